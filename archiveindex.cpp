@@ -0,0 +1,182 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "archiveindex.h"
+#include <algorithm>
+#include <sstream>
+
+const char ArchiveIndex::INDEX_NAME[] = ".rbackup-index";
+const char ArchiveIndex::FOOTER_NAME[] = ".rbackup-footer";
+
+namespace
+{
+        const char INDEX_MAGIC[] = "rbackup-index 1";
+        const char FOOTER_MAGIC[] = "rbackup-footer 1";
+
+        // Names are the last field of a line, so only newlines and backslashes are escaped.
+        std::string escape(const std::string &name)
+        {
+                std::string out;
+                for (char c : name) {
+                        if (c == '\\')
+                                out += "\\\\";
+                        else if (c == '\n')
+                                out += "\\n";
+                        else
+                                out += c;
+                }
+                return out;
+        }
+
+        std::string unescape(const std::string &name)
+        {
+                std::string out;
+                for (size_t i = 0; i < name.size(); i++) {
+                        if (name[i] == '\\' && i + 1 < name.size())
+                                out += name[++i] == 'n' ? '\n' : name[i];
+                        else
+                                out += name[i];
+                }
+                return out;
+        }
+
+        std::string strip_slash(const std::string &name)
+        {
+                size_t end = name.find_last_not_of('/');
+                return end == std::string::npos ? name : name.substr(0, end + 1);
+        }
+}
+
+void ArchiveIndex::add_member(const ArchiveMember &member)
+{
+        members.push_back(member);
+}
+
+void ArchiveIndex::set_frames(const std::vector<ArchiveFrame> &frames)
+{
+        this->frames = frames;
+}
+
+const std::vector<ArchiveMember> &ArchiveIndex::get_members() const
+{
+        return members;
+}
+
+const std::vector<ArchiveFrame> &ArchiveIndex::get_frames() const
+{
+        return frames;
+}
+
+std::pair<size_t, size_t> ArchiveIndex::frames_for(uint64_t offset, uint64_t len) const
+{
+        auto first = std::upper_bound(frames.begin(), frames.end(), offset,
+                                      [](uint64_t value, const ArchiveFrame &frame) {
+                                              return value < frame.rawOffset + frame.rawSize;
+                                      });
+        auto last = std::lower_bound(first, frames.end(), offset + len,
+                                     [](const ArchiveFrame &frame, uint64_t value) {
+                                             return frame.rawOffset < value;
+                                     });
+        return {first - frames.begin(), last - frames.begin()};
+}
+
+std::vector<size_t> ArchiveIndex::find(const std::string &path) const
+{
+        std::string wanted = strip_slash(path);
+        std::vector<size_t> found;
+        for (size_t i = 0; i < members.size(); i++) {
+                std::string name = strip_slash(members[i].name);
+                if (wanted.empty() || wanted == "." || name == wanted
+                    || (name.size() > wanted.size() && name[wanted.size()] == '/'
+                        && name.compare(0, wanted.size(), wanted) == 0))
+                        found.push_back(i);
+        }
+        return found;
+}
+
+std::string ArchiveIndex::to_text() const
+{
+        std::ostringstream out;
+        out << INDEX_MAGIC << "\n";
+        for (const auto &frame : frames)
+                out << "frame " << frame.offset << " " << frame.size << " " << frame.rawOffset
+                    << " " << frame.rawSize << "\n";
+        for (const auto &member : members) {
+                out << "member " << member.type << " " << member.offset << " "
+                    << member.dataOffset << " " << member.size << " " << escape(member.name)
+                    << "\n";
+                if (!member.link.empty())
+                        out << "link " << escape(member.link) << "\n";
+        }
+        return out.str();
+}
+
+int ArchiveIndex::from_text(const std::string &text)
+{
+        std::istringstream in(text);
+        std::string line;
+        if (!std::getline(in, line) || line != INDEX_MAGIC)
+                return -1;
+        members.clear();
+        frames.clear();
+        while (std::getline(in, line)) {
+                std::istringstream fields(line);
+                std::string kind;
+                fields >> kind;
+                if (kind == "frame") {
+                        ArchiveFrame frame;
+                        if (!(fields >> frame.offset >> frame.size >> frame.rawOffset
+                              >> frame.rawSize))
+                                return -1;
+                        frames.push_back(frame);
+                } else if (kind == "member") {
+                        ArchiveMember member;
+                        if (!(fields >> member.type >> member.offset >> member.dataOffset
+                              >> member.size))
+                                return -1;
+                        fields.get();
+                        std::string name;
+                        std::getline(fields, name);
+                        member.name = unescape(name);
+                        members.push_back(member);
+                } else if (kind == "link" && !members.empty()) {
+                        fields.get();
+                        std::string link;
+                        std::getline(fields, link);
+                        members.back().link = unescape(link);
+                } else if (!kind.empty()) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+std::string ArchiveIndex::footer(uint64_t offset)
+{
+        return std::string(FOOTER_MAGIC) + " " + std::to_string(offset) + "\n";
+}
+
+int ArchiveIndex::parse_footer(const std::string &text, uint64_t &offset)
+{
+        std::istringstream in(text);
+        std::string name, version;
+        if (!(in >> name >> version >> offset) || name + " " + version != FOOTER_MAGIC)
+                return -1;
+        return 0;
+}
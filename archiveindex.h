@@ -0,0 +1,116 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVEINDEX_H
+#define ARCHIVEINDEX_H
+
+#include "blockcompressor.h"
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*!
+ * \brief A member of a tar stream and where it is in the uncompressed stream.
+ */
+struct ArchiveMember {
+        std::string name;
+        uint64_t offset;     // start of its headers, including a pax header
+        uint64_t dataOffset; // start of its data
+        uint64_t size;
+        char type;
+        std::string link; // member a hard link links to
+};
+
+/*!
+ * \brief The ArchiveIndex class
+ * Maps the members of a seekable archive to the blocks they are compressed in.
+ *
+ * The index is stored at the end of the archive as a tar member of its own, starting
+ * a block, followed by a small footer member in the last block that gives the file
+ * offset of the index. Both are plain members, so "tar -x" still reads the archive
+ * and merely extracts them as two extra files.
+ */
+class ArchiveIndex
+{
+    public:
+        // Member names of the index and the footer.
+        static const char INDEX_NAME[];
+        static const char FOOTER_NAME[];
+
+        ArchiveIndex() = default;
+        ~ArchiveIndex() = default;
+
+        void add_member(const ArchiveMember &member);
+
+        void set_frames(const std::vector<ArchiveFrame> &frames);
+
+        const std::vector<ArchiveMember> &get_members() const;
+
+        const std::vector<ArchiveFrame> &get_frames() const;
+
+        /*!
+         * \brief Finds the blocks a part of the uncompressed stream is in.
+         * \param Offset in the uncompressed stream.
+         * \param Length of the part.
+         * \return First and one past the last block.
+         */
+        std::pair<size_t, size_t> frames_for(uint64_t offset, uint64_t len) const;
+
+        /*!
+         * \brief Finds the members named by a path or below it.
+         * \param Member name, with or without a trailing slash.
+         * \return Indexes into get_members() in stream order.
+         */
+        std::vector<size_t> find(const std::string &path) const;
+
+        /*!
+         * \brief Gets the contents of the index member.
+         * \return One line per block and per member.
+         */
+        std::string to_text() const;
+
+        /*!
+         * \brief Reads the contents of an index member.
+         * \param Text written by to_text().
+         * \return 0 for success, -1 if the text is not an index.
+         */
+        int from_text(const std::string &text);
+
+        /*!
+         * \brief Gets the contents of the footer member.
+         * \param Offset of the index's block in the archive file.
+         * \return Footer text.
+         */
+        static std::string footer(uint64_t offset);
+
+        /*!
+         * \brief Reads the contents of a footer member.
+         * \param Footer text.
+         * \param Set to the offset of the index's block.
+         * \return 0 for success, -1 if the text is not a footer.
+         */
+        static int parse_footer(const std::string &text, uint64_t &offset);
+
+    private:
+        std::vector<ArchiveMember> members;
+        std::vector<ArchiveFrame> frames;
+};
+
+#endif // ARCHIVEINDEX_H
@@ -0,0 +1,695 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "archivereader.h"
+#include "tarwriter.h"
+#include <algorithm>
+#include <bzlib.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <lzma.h>
+#include <map>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+constexpr size_t TAR_BLOCK_SIZE = 512;
+// The last block holds only the footer and the end of archive marker.
+constexpr uint64_t FOOTER_SEARCH = 1 << 20;
+constexpr size_t DECODE_BUFFER = 1 << 16;
+constexpr size_t SPARSE_BLOCK = 4096;
+
+namespace
+{
+        /*
+         * A member of the tar stream as its headers describe it.
+         */
+        struct Entry {
+                std::string link;
+                mode_t mode = 0;
+                uid_t uid = 0;
+                gid_t gid = 0;
+                time_t mtime = 0;
+                dev_t rdev = 0;
+                char type = '0';
+        };
+
+        /*
+         * A member being restored, fed the stream a block at a time.
+         */
+        struct Restore {
+                std::string headers;
+                std::string path;
+                Entry entry;
+                int fd = -1;
+                bool failed = false;
+        };
+
+        uint64_t parse_octal(const char *field, size_t width)
+        {
+                uint64_t value = 0;
+                for (size_t i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+                        value = value * 8 + (field[i] - '0');
+                return value;
+        }
+
+        std::string parse_string(const char *field, size_t width)
+        {
+                return std::string(field, strnlen(field, width));
+        }
+
+        /*
+         * Reads the headers of a member: pax headers followed by its ustar header.
+         * Returns false when they are not valid tar headers.
+         */
+        bool parse_headers(const std::string &headers, Entry &entry)
+        {
+                std::map<std::string, std::string> pax;
+                size_t pos = 0;
+                while (pos + TAR_BLOCK_SIZE <= headers.size()) {
+                        const char *header = headers.data() + pos;
+                        uint64_t size = parse_octal(header + 124, 12);
+                        char type = header[156];
+                        pos += TAR_BLOCK_SIZE;
+                        if (type == 'x' || type == 'g') {
+                                if (pos + size > headers.size())
+                                        return false;
+                                std::string records = headers.substr(pos, size);
+                                pos += (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE
+                                       * TAR_BLOCK_SIZE;
+                                // "length key=value\n", the length counting itself.
+                                size_t at = 0;
+                                while (type == 'x' && at < records.size()) {
+                                        size_t space = records.find(' ', at);
+                                        size_t len = std::strtoull(records.c_str() + at,
+                                                                   nullptr, 10);
+                                        if (space == std::string::npos || len == 0
+                                            || at + len > records.size())
+                                                return false;
+                                        std::string record =
+                                                records.substr(space + 1, at + len - space - 2);
+                                        size_t equals = record.find('=');
+                                        if (equals != std::string::npos)
+                                                pax[record.substr(0, equals)] =
+                                                        record.substr(equals + 1);
+                                        at += len;
+                                }
+                                continue;
+                        }
+                        if (memcmp(header + 257, "ustar", 5) != 0)
+                                return false;
+                        entry.type = type == '\0' ? '0' : type;
+                        entry.mode = parse_octal(header + 100, 8);
+                        entry.uid = parse_octal(header + 108, 8);
+                        entry.gid = parse_octal(header + 116, 8);
+                        entry.mtime = parse_octal(header + 136, 12);
+                        entry.link = parse_string(header + 157, 100);
+                        entry.rdev = makedev(parse_octal(header + 329, 8),
+                                             parse_octal(header + 337, 8));
+                        if (pax.count("linkpath"))
+                                entry.link = pax["linkpath"];
+                        if (pax.count("uid"))
+                                entry.uid = std::stoul(pax["uid"]);
+                        if (pax.count("gid"))
+                                entry.gid = std::stoul(pax["gid"]);
+                        if (pax.count("mtime"))
+                                entry.mtime = std::stoll(pax["mtime"]);
+                        return true;
+                }
+                return false;
+        }
+
+        /*
+         * Reads a single member at the start of a stream, as the index and footer are
+         * written. Returns false if the stream does not start with the named member.
+         */
+        bool read_member(const std::string &stream, const std::string &name,
+                         std::string &contents)
+        {
+                if (stream.size() < TAR_BLOCK_SIZE
+                    || parse_string(stream.data(), 100) != name)
+                        return false;
+                uint64_t size = parse_octal(stream.data() + 124, 12);
+                if (stream.size() < TAR_BLOCK_SIZE + size)
+                        return false;
+                contents = stream.substr(TAR_BLOCK_SIZE, size);
+                return true;
+        }
+
+        /*
+         * Creates the directories above a member, refusing to go through anything that
+         * is not a directory so that a restore stays inside the target.
+         */
+        bool make_parents(const std::string &target, const std::string &name)
+        {
+                std::string path = target;
+                size_t start = 0;
+                size_t slash;
+                while ((slash = name.find('/', start)) != std::string::npos) {
+                        path += "/" + name.substr(start, slash - start);
+                        start = slash + 1;
+                        struct stat st;
+                        if (lstat(path.c_str(), &st) == 0) {
+                                if (!S_ISDIR(st.st_mode)) {
+                                        errno = ENOTDIR;
+                                        return false;
+                                }
+                        } else if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+                                return false;
+                        }
+                }
+                return true;
+        }
+
+        bool safe_name(const std::string &name)
+        {
+                if (name.empty() || name[0] == '/')
+                        return false;
+                size_t start = 0;
+                while (start <= name.size()) {
+                        size_t end = name.find('/', start);
+                        if (end == std::string::npos)
+                                end = name.size();
+                        if (name.compare(start, end - start, "..") == 0 && end - start == 2)
+                                return false;
+                        start = end + 1;
+                }
+                return true;
+        }
+
+        /*
+         * Writes file data at an offset, leaving blocks of zeros as holes so that
+         * sparse files stay sparse.
+         */
+        int write_sparse(int fd, const char *data, uint64_t len, uint64_t offset)
+        {
+                static const char zeros[SPARSE_BLOCK] = {};
+                while (len > 0) {
+                        uint64_t n = std::min<uint64_t>(len, SPARSE_BLOCK - offset % SPARSE_BLOCK);
+                        if (n < SPARSE_BLOCK || memcmp(data, zeros, n) != 0) {
+                                ssize_t written = pwrite(fd, data, n, offset);
+                                if (written < 0 && errno == EINTR)
+                                        continue;
+                                if (written < 0)
+                                        return -1;
+                                n = written;
+                        }
+                        data += n;
+                        offset += n;
+                        len -= n;
+                }
+                return 0;
+        }
+
+        void set_times(const std::string &path, const Entry &entry)
+        {
+                struct timespec times[2];
+                times[0].tv_sec = entry.mtime;
+                times[0].tv_nsec = 0;
+                times[1] = times[0];
+                utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+
+        /*
+         * Owners are only restored for root, like "tar -x" does.
+         */
+        void set_attributes(const std::string &path, const Entry &entry)
+        {
+                if (geteuid() == 0)
+                        lchown(path.c_str(), entry.uid, entry.gid);
+                if (entry.type != '2')
+                        chmod(path.c_str(), entry.mode & 07777);
+                set_times(path, entry);
+        }
+}
+
+ArchiveReader::ArchiveReader(const std::string &path)
+        : path(path), fd(-1), fileSize(0), type(NONE), stats()
+{
+}
+
+ArchiveReader::~ArchiveReader()
+{
+        if (fd >= 0)
+                close(fd);
+}
+
+int ArchiveReader::open()
+{
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+                std::cerr << path << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        fileSize = st.st_size;
+
+        std::string magic;
+        if (read_at(0, std::min<uint64_t>(6, fileSize), magic) != 0)
+                return -1;
+        if (magic.compare(0, 3, "\x1f\x8b\x08") == 0)
+                type = GZ;
+        else if (magic.compare(0, 3, "BZh") == 0)
+                type = BZ2;
+        else if (magic.compare(0, 6, std::string("\xfd" "7zXZ\0", 6)) == 0)
+                type = XZ;
+        else if (magic.compare(0, 4, "\x28\xb5\x2f\xfd") == 0)
+                type = ZSTD;
+        else {
+                std::cerr << path << ": not a compressed archive\n";
+                return -1;
+        }
+
+        uint64_t offset, end;
+        std::string compressed, stream, text;
+        if (read_footer(offset, end) != 0 || offset >= end
+            || read_at(offset, end - offset, compressed) != 0
+            || decompress(type, compressed.data(), compressed.size(), stream) != 0
+            || !read_member(stream, ArchiveIndex::INDEX_NAME, text)
+            || index.from_text(text) != 0) {
+                std::cerr << path << ": not a seekable archive\n";
+                return -1;
+        }
+        return 0;
+}
+
+const ArchiveIndex &ArchiveReader::get_index() const
+{
+        return index;
+}
+
+CompressionType ArchiveReader::get_type() const
+{
+        return type;
+}
+
+int ArchiveReader::extract(const std::vector<std::string> &paths, const std::string &target,
+                           int threads)
+{
+        const auto &members = index.get_members();
+        const auto &frames = index.get_frames();
+        if (threads <= 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+
+        std::vector<bool> wanted(members.size(), paths.empty());
+        for (const auto &path : paths) {
+                for (size_t i : index.find(TarWriter::member_name(path)))
+                        wanted[i] = true;
+        }
+        // A hard link is restored as a link to the member it links to.
+        std::map<std::string, size_t> byName;
+        for (size_t i = 0; i < members.size(); i++) {
+                if (members[i].type != '1')
+                        byName.emplace(members[i].name, i);
+        }
+        for (size_t i = 0; i < members.size(); i++) {
+                auto it = byName.find(members[i].link);
+                if (wanted[i] && members[i].type == '1' && it != byName.end())
+                        wanted[it->second] = true;
+        }
+        std::vector<size_t> selected;
+        for (size_t i = 0; i < members.size(); i++) {
+                if (wanted[i])
+                        selected.push_back(i);
+        }
+
+        std::vector<bool> needed(frames.size(), false);
+        for (size_t i : selected) {
+                auto range = index.frames_for(members[i].offset, members[i].dataOffset
+                                                                         + members[i].size
+                                                                         - members[i].offset);
+                for (size_t f = range.first; f < range.second; f++)
+                        needed[f] = true;
+        }
+        std::vector<size_t> order;
+        for (size_t f = 0; f < frames.size(); f++) {
+                if (needed[f])
+                        order.push_back(f);
+        }
+
+        if (mkdir(target.c_str(), 0755) != 0 && errno != EEXIST) {
+                std::cerr << target << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+
+        // Directories get their times and modes last, once nothing is added to them.
+        std::vector<std::pair<std::string, Entry>> directories;
+
+        auto start = [&](const ArchiveMember &member, Restore &restore) {
+                std::string name = member.name;
+                while (name.size() > 1 && name.back() == '/')
+                        name.pop_back();
+                restore.path = target + "/" + name;
+                if (!safe_name(name) || !parse_headers(restore.headers, restore.entry)) {
+                        std::cerr << member.name << ": invalid member\n";
+                        restore.failed = true;
+                        return;
+                }
+                Entry &entry = restore.entry;
+                if (!make_parents(target, name)) {
+                        std::cerr << restore.path << ": " << strerror(errno) << "\n";
+                        restore.failed = true;
+                        return;
+                }
+                if (entry.type != '5' && unlink(restore.path.c_str()) != 0 && errno != ENOENT) {
+                        std::cerr << restore.path << ": " << strerror(errno) << "\n";
+                        restore.failed = true;
+                        return;
+                }
+                int status = 0;
+                switch (entry.type) {
+                case '0':
+                case '7':
+                        restore.fd = ::open(restore.path.c_str(),
+                                            O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                                            0600);
+                        status = restore.fd < 0 ? -1 : 0;
+                        break;
+                case '1':
+                        status = link((target + "/" + entry.link).c_str(), restore.path.c_str());
+                        break;
+                case '2':
+                        status = symlink(entry.link.c_str(), restore.path.c_str());
+                        break;
+                case '3':
+                case '4':
+                        status = mknod(restore.path.c_str(),
+                                       (entry.type == '3' ? S_IFCHR : S_IFBLK) | 0600,
+                                       entry.rdev);
+                        break;
+                case '5':
+                        status = mkdir(restore.path.c_str(), 0700) != 0 && errno != EEXIST ? -1
+                                                                                          : 0;
+                        break;
+                case '6':
+                        status = mkfifo(restore.path.c_str(), 0600);
+                        break;
+                default:
+                        errno = EINVAL;
+                        status = -1;
+                }
+                if (status != 0) {
+                        std::cerr << restore.path << ": " << strerror(errno) << "\n";
+                        restore.failed = true;
+                }
+        };
+
+        auto feed = [&](const ArchiveMember &member, Restore &restore, const char *data,
+                        uint64_t pos, uint64_t len) {
+                if (pos < member.dataOffset) {
+                        uint64_t n = std::min(len, member.dataOffset - pos);
+                        restore.headers.append(data, n);
+                        data += n;
+                        pos += n;
+                        len -= n;
+                        if (pos == member.dataOffset)
+                                start(member, restore);
+                }
+                if (len == 0 || restore.fd < 0 || restore.failed)
+                        return;
+                if (write_sparse(restore.fd, data, len, pos - member.dataOffset) != 0) {
+                        std::cerr << restore.path << ": " << strerror(errno) << "\n";
+                        restore.failed = true;
+                        return;
+                }
+                stats.bytesWritten += len;
+        };
+
+        auto finish = [&](const ArchiveMember &member, Restore &restore) {
+                if (restore.fd >= 0) {
+                        // Sets the size when the file ends in a hole.
+                        if (!restore.failed && ftruncate(restore.fd, member.size) != 0)
+                                restore.failed = true;
+                        if (close(restore.fd) != 0)
+                                restore.failed = true;
+                        restore.fd = -1;
+                }
+                if (restore.failed) {
+                        stats.errors++;
+                        return;
+                }
+                stats.members++;
+                if (restore.entry.type == '5')
+                        directories.emplace_back(restore.path, restore.entry);
+                else if (restore.entry.type != '1')
+                        set_attributes(restore.path, restore.entry);
+        };
+
+        // Blocks are decompressed a batch at a time and fed to the members in stream order.
+        size_t next = 0;
+        Restore restore;
+        int status = 0;
+        for (size_t batch = 0; batch < order.size() && status == 0; batch += threads) {
+                std::vector<size_t> list(order.begin() + batch,
+                                         order.begin() + std::min(order.size(), batch + threads));
+                std::vector<std::string> data;
+                if (decode(list, data, threads) != 0) {
+                        status = -1;
+                        break;
+                }
+                for (size_t k = 0; k < list.size(); k++) {
+                        const ArchiveFrame &frame = frames[list[k]];
+                        uint64_t frameEnd = frame.rawOffset + frame.rawSize;
+                        while (next < selected.size()) {
+                                const ArchiveMember &member = members[selected[next]];
+                                if (member.offset >= frameEnd)
+                                        break;
+                                uint64_t memberEnd = member.dataOffset + member.size;
+                                uint64_t from = std::max(frame.rawOffset, member.offset);
+                                uint64_t to = std::min(frameEnd, memberEnd);
+                                if (from < to)
+                                        feed(member, restore,
+                                             data[k].data() + (from - frame.rawOffset), from,
+                                             to - from);
+                                if (memberEnd > frameEnd)
+                                        break;
+                                finish(member, restore);
+                                restore = Restore();
+                                next++;
+                        }
+                }
+        }
+        if (restore.fd >= 0)
+                close(restore.fd);
+
+        // Deepest first, so a directory's time is set after its children are.
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it)
+                set_attributes(it->first, it->second);
+        return status;
+}
+
+const ExtractStats &ArchiveReader::get_stats() const
+{
+        return stats;
+}
+
+int ArchiveReader::decompress(CompressionType type, const char *data, size_t len,
+                              std::string &out)
+{
+        std::string buffer(DECODE_BUFFER, '\0');
+        switch (type) {
+        case GZ: {
+                z_stream zs;
+                memset(&zs, 0, sizeof(zs));
+                if (inflateInit2(&zs, 16 + 15) != Z_OK)
+                        return -1;
+                zs.next_in = (Bytef *)data;
+                zs.avail_in = len;
+                int status = Z_OK;
+                for (;;) {
+                        zs.next_out = (Bytef *)&buffer[0];
+                        zs.avail_out = buffer.size();
+                        status = inflate(&zs, Z_NO_FLUSH);
+                        out.append(buffer.data(), buffer.size() - zs.avail_out);
+                        if (status == Z_STREAM_END) {
+                                // Concatenated members follow each other.
+                                if (zs.avail_in == 0)
+                                        break;
+                                status = inflateReset(&zs);
+                        }
+                        if (status != Z_OK)
+                                break;
+                }
+                inflateEnd(&zs);
+                return status == Z_STREAM_END ? 0 : -1;
+        }
+        case BZ2: {
+                bz_stream bz;
+                memset(&bz, 0, sizeof(bz));
+                if (BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK)
+                        return -1;
+                bz.next_in = (char *)data;
+                bz.avail_in = len;
+                int status = BZ_OK;
+                for (;;) {
+                        bz.next_out = &buffer[0];
+                        bz.avail_out = buffer.size();
+                        status = BZ2_bzDecompress(&bz);
+                        out.append(buffer.data(), buffer.size() - bz.avail_out);
+                        if (status == BZ_STREAM_END) {
+                                if (bz.avail_in == 0)
+                                        break;
+                                char *next = bz.next_in;
+                                unsigned int left = bz.avail_in;
+                                BZ2_bzDecompressEnd(&bz);
+                                memset(&bz, 0, sizeof(bz));
+                                status = BZ2_bzDecompressInit(&bz, 0, 0);
+                                bz.next_in = next;
+                                bz.avail_in = left;
+                        }
+                        // Out of input before the end of the stream means it was cut short.
+                        if (status != BZ_OK || (bz.avail_in == 0 && bz.avail_out > 0))
+                                break;
+                }
+                BZ2_bzDecompressEnd(&bz);
+                return status == BZ_STREAM_END ? 0 : -1;
+        }
+        case XZ: {
+                lzma_stream xz = LZMA_STREAM_INIT;
+                if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+                        return -1;
+                xz.next_in = (const uint8_t *)data;
+                xz.avail_in = len;
+                lzma_ret status = LZMA_OK;
+                while (status == LZMA_OK) {
+                        xz.next_out = (uint8_t *)&buffer[0];
+                        xz.avail_out = buffer.size();
+                        status = lzma_code(&xz, xz.avail_in == 0 ? LZMA_FINISH : LZMA_RUN);
+                        out.append(buffer.data(), buffer.size() - xz.avail_out);
+                }
+                lzma_end(&xz);
+                return status == LZMA_STREAM_END ? 0 : -1;
+        }
+        case ZSTD: {
+                ZSTD_DCtx *dctx = ZSTD_createDCtx();
+                if (dctx == nullptr)
+                        return -1;
+                ZSTD_inBuffer input = {data, len, 0};
+                size_t left = 1;
+                while (input.pos < input.size || left != 0) {
+                        ZSTD_outBuffer output = {&buffer[0], buffer.size(), 0};
+                        size_t before = input.pos;
+                        left = ZSTD_decompressStream(dctx, &output, &input);
+                        if (ZSTD_isError(left))
+                                break;
+                        out.append(buffer.data(), output.pos);
+                        // No progress with input left over means the frame is incomplete.
+                        if (input.pos == before && output.pos == 0) {
+                                left = (size_t)-1;
+                                break;
+                        }
+                }
+                ZSTD_freeDCtx(dctx);
+                return left == 0 ? 0 : -1;
+        }
+        default:
+                return -1;
+        }
+}
+
+int ArchiveReader::read_at(uint64_t offset, uint64_t len, std::string &out) const
+{
+        out.resize(len);
+        uint64_t done = 0;
+        while (done < len) {
+                ssize_t n = pread(fd, &out[done], len - done, offset + done);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        std::cerr << path << ": " << (n < 0 ? strerror(errno) : "short read")
+                                  << "\n";
+                        return -1;
+                }
+                done += n;
+        }
+        return 0;
+}
+
+int ArchiveReader::read_footer(uint64_t &offset, uint64_t &end) const
+{
+        static const std::map<CompressionType, std::string> magics = {
+                {GZ, "\x1f\x8b\x08"},
+                {BZ2, "BZh"},
+                {XZ, std::string("\xfd" "7zXZ\0", 6)},
+                {ZSTD, "\x28\xb5\x2f\xfd"},
+        };
+        const std::string &magic = magics.at(type);
+        uint64_t start = fileSize - std::min(fileSize, FOOTER_SEARCH);
+        std::string tail;
+        if (read_at(start, fileSize - start, tail) != 0)
+                return -1;
+
+        // The last block is the one starting closest to the end that decodes to the footer.
+        for (size_t pos = tail.rfind(magic); pos != std::string::npos;
+             pos = pos == 0 ? std::string::npos : tail.rfind(magic, pos - 1)) {
+                std::string stream, text;
+                if (decompress(type, tail.data() + pos, tail.size() - pos, stream) == 0
+                    && read_member(stream, ArchiveIndex::FOOTER_NAME, text)
+                    && ArchiveIndex::parse_footer(text, offset) == 0) {
+                        end = start + pos;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+int ArchiveReader::decode(const std::vector<size_t> &frames, std::vector<std::string> &out,
+                          int threads)
+{
+        const auto &all = index.get_frames();
+        out.assign(frames.size(), std::string());
+        std::vector<int> results(frames.size(), 0);
+        std::vector<uint64_t> read(frames.size(), 0);
+        auto work = [&](size_t first) {
+                for (size_t i = first; i < frames.size(); i += threads) {
+                        const ArchiveFrame &frame = all[frames[i]];
+                        std::string compressed;
+                        results[i] = read_at(frame.offset, frame.size, compressed);
+                        if (results[i] == 0)
+                                results[i] = decompress(type, compressed.data(),
+                                                        compressed.size(), out[i]);
+                        if (results[i] == 0 && out[i].size() != frame.rawSize)
+                                results[i] = -1;
+                        read[i] = frame.size;
+                }
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < std::min<size_t>(threads, frames.size()); t++)
+                workers.emplace_back(work, t);
+        work(0);
+        for (auto &worker : workers)
+                worker.join();
+
+        for (size_t i = 0; i < frames.size(); i++) {
+                if (results[i] != 0) {
+                        std::cerr << path << ": block at " << all[frames[i]].offset
+                                  << " is damaged\n";
+                        return -1;
+                }
+                stats.frames++;
+                stats.bytesRead += read[i];
+                stats.bytesDecoded += out[i].size();
+        }
+        return 0;
+}
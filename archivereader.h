@@ -0,0 +1,133 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARCHIVEREADER_H
+#define ARCHIVEREADER_H
+
+#include "archiveindex.h"
+#include "backupjob.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief Counters of an extraction.
+ */
+struct ExtractStats {
+        uint64_t members;      // members restored
+        uint64_t frames;       // blocks decompressed
+        uint64_t bytesRead;    // compressed bytes read from the archive
+        uint64_t bytesDecoded; // bytes the blocks decompressed to
+        uint64_t bytesWritten; // file data written
+        uint64_t errors;       // members that could not be restored
+};
+
+/*!
+ * \brief The ArchiveReader class
+ * Restores members of a seekable archive without reading the rest of it.
+ *
+ * Opening an archive reads the footer from its last block and the index it points
+ * to. Extracting decompresses only the blocks the requested members are in, several
+ * at once, so the time to restore a file depends on its size and not on where it is
+ * in the archive. Hard links bring the member they link to along, and blocks of
+ * zeros are left as holes.
+ */
+class ArchiveReader
+{
+    public:
+        /*!
+         * \param Path of the archive.
+         */
+        explicit ArchiveReader(const std::string &path);
+        ~ArchiveReader();
+        ArchiveReader(const ArchiveReader &) = delete;
+        ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+        /*!
+         * \brief Opens the archive and reads its index.
+         * \return 0 for success, -1 if the archive can not be read or is not seekable.
+         */
+        int open();
+
+        const ArchiveIndex &get_index() const;
+
+        /*!
+         * \brief Retrieves the format of the archive, known once it is open.
+         * \return Compression type.
+         */
+        CompressionType get_type() const;
+
+        /*!
+         * \brief Restores members into a directory, laid out as "tar -x" would.
+         * \param Member names to restore with everything below them, empty for all.
+         * \param Directory to restore into.
+         * \param Number of blocks to decompress at once, 0 for one per core.
+         * \return 0 for success, -1 if the archive could not be read. Members that
+         * could not be restored are counted in get_stats().
+         */
+        int extract(const std::vector<std::string> &paths, const std::string &target,
+                    int threads = 0);
+
+        const ExtractStats &get_stats() const;
+
+        /*!
+         * \brief Decompresses a buffer holding one or more complete streams.
+         * \param Format of the buffer.
+         * \param Start of the buffer.
+         * \param Length of the buffer.
+         * \param Receives the uncompressed data.
+         * \return 0 for success, -1 if the buffer is not complete, valid data.
+         */
+        static int decompress(CompressionType type, const char *data, size_t len,
+                              std::string &out);
+
+    private:
+        std::string path;
+        int fd;
+        uint64_t fileSize;
+        CompressionType type;
+        ArchiveIndex index;
+        ExtractStats stats;
+
+        /*!
+         * \brief Reads part of the archive file.
+         * \return 0 for success, -1 for failure.
+         */
+        int read_at(uint64_t offset, uint64_t len, std::string &out) const;
+
+        /*!
+         * \brief Finds the footer in the last block of the archive.
+         * \param Set to the offset of the index's block.
+         * \param Set to the offset of the footer's block, where the index ends.
+         * \return 0 for success, -1 if there is no footer.
+         */
+        int read_footer(uint64_t &offset, uint64_t &end) const;
+
+        /*!
+         * \brief Decompresses blocks in parallel.
+         * \param Indexes of the blocks.
+         * \param Receives each block's data, in the same order.
+         * \param Number of threads.
+         * \return 0 for success, -1 if a block could not be read.
+         */
+        int decode(const std::vector<size_t> &frames, std::vector<std::string> &out,
+                   int threads);
+};
+
+#endif // ARCHIVEREADER_H
@@ -18,15 +18,43 @@
 */
 
 #include "backupjob.h"
+#include "utility.h"
 #include <QFile>
+#include <QTime>
+#include <algorithm>
+#include <stdexcept>
+
+// Most of a minute, so a randomized delay never undoes the spread of the offsets.
+constexpr int MAX_JITTER = 50;
 
 const static std::string shortDays[] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
 
+// Indexed by CompressionType.
+const static QString archiveFormats[] = {"", "tar", "gz", "bz2", "xz", "zstd"};
+// Indexed by IOSchedulingClass.
+const static QString ioClassNames[] = {"", "realtime", "best-effort", "idle"};
+
+const static QString archiveExtensions[] = {"",        ".tar",    ".tar.gz",
+                                           ".tar.bz2", ".tar.xz", ".tar.zst"};
+
 BackupJob::BackupJob(QString name, QString dest, QString src, QString command, Days days,
                      JobFlags flags, QString time, bool enabled)
         : name(name), dest(dest), src(src), command(command), flags(flags), days(days), time(time),
           enabled(enabled)
 {
+        if (src != "")
+                sources.append({src, QStringList()});
+        if (dest != "")
+                dests.append(dest);
+}
+
+BackupJob::BackupJob(QString name, QStringList dests, JobSources sources, QString command,
+                     Days days, JobFlags flags, QString time, bool enabled)
+        : name(name), dests(dests), sources(sources), command(command), flags(flags), days(days),
+          time(time), enabled(enabled)
+{
+        src = sources.isEmpty() ? "" : sources.first().path;
+        dest = dests.isEmpty() ? "" : dests.first();
 }
 
 BackupJob::BackupJob()
@@ -41,7 +69,7 @@ BackupJob::BackupJob()
         enabled = false;
 }
 
-QString BackupJob::get_service() const
+QString BackupJob::get_service(const QString &configDirectory) const
 {
         if (command == "" || dest == "" || src == "")
                 return "";
@@ -49,39 +77,164 @@ QString BackupJob::get_service() const
         out += "Description=Runs an rsync command " + name + "\n\n";
         out += "[Service]\n";
         out += "Type=simple\n";
-        out += "ExecStart=sh /etc/rbackup/" + name + ".sh\n";
-        out += "User=root";
-        out += "\n\n";
+        out += "ExecStart=" + QString(EXEC) + "--job " + name + " --history " + configDirectory
+               + name + ".history " + configDirectory + name + ".sh\n";
+        out += "User=root\n";
+        out += select_resource_controls();
+        out += "\n";
         out += "[Install]\n";
         out += "WantedBy=multi-user.target\n";
         return out;
 }
 
-QString BackupJob::get_timer() const
+QString BackupJob::get_timer(int expectedSeconds) const
 {
         if (command == "" || dest == "" || src == "")
                 return "";
+        int offset = get_stagger_offset(expectedSeconds);
         QString out = "[Unit]\nDescription=Runs the given service at specified time.\n";
         out += "[Timer]\n";
         out += "Unit=" + name + ".service\n";
-        out += "OnCalendar=" + make_systemd_calendar();
+        out += "OnCalendar=" + make_systemd_calendar(offset);
         out += "\nPersistent=true\n";
+        if (flags.staggerWindow > 0) {
+                // systemd's default accuracy of a minute would start the spread jobs together.
+                out += "AccuracySec=1s\n";
+                int slack = flags.staggerWindow * 60 - std::max(expectedSeconds, 0) - offset;
+                if (slack > 0)
+                        out += "RandomizedDelaySec=" + QString::number(std::min(slack, MAX_JITTER))
+                               + "\n";
+        }
         out += "[Install]\n";
         out += "WantedBy=multi-user.target";
         return out;
 }
 
+int BackupJob::get_stagger_offset(int expectedSeconds) const
+{
+        if (flags.staggerWindow <= 0)
+                return 0;
+        int window = flags.staggerWindow * 60;
+        // Jobs known to fit start early enough to end inside the window.
+        int span = expectedSeconds > 0 && expectedSeconds < window ? window - expectedSeconds
+                                                                   : window;
+        uint32_t hash = 2166136261u; // FNV-1a
+        for (char c : name.toUtf8()) {
+                hash ^= (uint8_t)c;
+                hash *= 16777619u;
+        }
+        return hash % span;
+}
+
+QString BackupJob::generate_command() const
+{
+        QString out = "";
+
+        // The repository keeps its own history, so there is nothing to archive afterwards.
+        if (flags.backupType == REPOSITORY) {
+                out += select_backup_type();
+                if (flags.keep > 0)
+                        out += "--keep " + QString::number(flags.keep) + " ";
+                return out + dest + " " + name + " " + src;
+        }
+
+        // Every run is a new directory, so there is nothing to delete or archive.
+        if (flags.backupType == SNAPSHOT) {
+                out += select_backup_type();
+                if (flags.keep > 0)
+                        out += "--keep " + QString::number(flags.keep) + " ";
+                out += "--job " + name + " -- " + INCREMENTAL_OPTIONS;
+                if (flags.transferCompression)
+                        out += TRANSFER_COMPRESSION;
+                out += select_bandwidth_limit();
+                if (!sources.isEmpty())
+                        out += select_excludes(sources.first());
+                return out + src + " " + dest;
+        }
+
+        // Every destination is written from one read of the sources, then archived from
+        // the first.
+        if (dests.size() > 1 && flags.backupType != NATIVE) {
+                out += select_fanout();
+                if (flags.compType != NONE)
+                        out += " && " + select_compression_type();
+                return out;
+        }
+
+        // More sources are copied by rsync first and archived from the destination.
+        bool multi = sources.size() > 1;
+
+        // Single pass: the source is read once, straight into the archive (and the mirror).
+        if (flags.streamArchive && flags.compType != NONE && !multi) {
+                out += ARCHIVE + select_archive_options(archiveFormats[flags.compType]);
+                if (flags.archiveMirror)
+                        out += "--mirror " + dest + " ";
+                return out + dest + archiveExtensions[flags.compType] + " " + src;
+        }
+
+        if (flags.backupType == NATIVE) {
+                out += select_backup_type();
+                if (flags.workers > 1)
+                        out += "--threads " + QString::number(flags.workers) + " ";
+        } else {
+                if (multi)
+                        out += select_sources();
+                else if (flags.shards > 1)
+                        out += SHARDED + QString("--shards %1 --workers %2 -- ")
+                                                 .arg(flags.shards)
+                                                 .arg(std::max(flags.workers, 1));
+                else if (flags.fileIndex)
+                        out += INDEXED + QString("--index ") + CONFIG_DIRECTORY + name
+                               + ".idx --journal " + CONFIG_DIRECTORY + name + ".journal -- ";
+                out += select_backup_type();
+                // The executors collect rsync's output themselves, so only a plain rsync
+                // can report its progress.
+                if (!multi && flags.shards <= 1 && !flags.fileIndex)
+                        out += QString(PROGRESS) + STATS;
+
+                if (flags.transferCompression)
+                        out += TRANSFER_COMPRESSION;
+                out += select_bandwidth_limit();
+
+                out += select_delete_type();
+                // "rbackup sources" adds each source and its excludes itself.
+                if (!multi && !sources.isEmpty())
+                        out += select_excludes(sources.first());
+        }
+        if (!multi || flags.backupType == NATIVE)
+                out += src + " ";
+        out += dest + " ";
+        if (flags.compType != NONE)
+                out += " && ";
+        out += select_compression_type();
+
+        return out;
+}
+
 QString BackupJob::to_string() const
 {
         QString out = "";
         out += "Job Name: " + name + "\n";
-        out += "Destination: " + dest + "\n";
-        out += "Source: " + src + "\n";
+        for (const auto &path : dests)
+                out += "Destination: " + path + "\n";
+        if (dests.isEmpty())
+                out += "Destination: " + dest + "\n";
+        for (const auto &source : sources) {
+                out += "Source: " + source.path;
+                if (!source.excludes.isEmpty())
+                        out += " (excluding " + source.excludes.join(", ") + ")";
+                out += "\n";
+        }
+        if (sources.isEmpty())
+                out += "Source: " + src + "\n";
         out += "Enabled: " + bool_to_string(enabled) + "\n";
         out += jobflags_to_string();
         out += days_to_string();
         out += "Time: " + time + "\n";
         out += "Command: " + command + "\n";
+        if (!snapshots.isEmpty())
+                out += "Snapshots: " + QString::number(snapshots.size()) + " (latest "
+                       + snapshots.last() + ")\n";
         return out;
 }
 
@@ -100,11 +253,35 @@ QString BackupJob::get_dest() const
         return dest;
 }
 
+QStringList BackupJob::get_dests() const
+{
+        return dests;
+}
+
 QString BackupJob::get_src() const
 {
         return src;
 }
 
+JobSources BackupJob::get_sources() const
+{
+        return sources;
+}
+
+void BackupJob::add_source(JobSources &sources, const QString &path, const QStringList &excludes)
+{
+        for (auto &source : sources) {
+                if (source.path != path)
+                        continue;
+                for (const auto &exclude : excludes) {
+                        if (!source.excludes.contains(exclude))
+                                source.excludes.append(exclude);
+                }
+                return;
+        }
+        sources.append({path, excludes});
+}
+
 JobFlags BackupJob::get_flags() const
 {
         return flags;
@@ -125,6 +302,16 @@ QString BackupJob::get_command() const
         return command;
 }
 
+bool BackupJob::is_enabled() const
+{
+        return enabled;
+}
+
+QStringList BackupJob::get_snapshots() const
+{
+        return snapshots;
+}
+
 QString BackupJob::jobflags_to_string() const
 {
         QString out = "";
@@ -132,6 +319,48 @@ QString BackupJob::jobflags_to_string() const
         out += "\tRecurring: " + bool_to_string(flags.recurring) + "\n";
         out += "\tTransfer Compression: " + bool_to_string(flags.transferCompression) + "\n";
         out += "\tBackup Compression: " + bool_to_string(flags.backupCompression) + "\n";
+        if (flags.compType > TARBALL)
+                out += "\tCompression Threads: "
+                       + (flags.compressionThreads > 0 ? QString::number(flags.compressionThreads)
+                                                       : QString("all cores"))
+                       + (flags.compressionMemory > 0
+                                  ? " (" + QString::number(flags.compressionMemory) + " MiB)"
+                                  : QString())
+                       + "\n";
+        if (flags.compType == ZSTD)
+                out += "\tZstd Level: "
+                       + (flags.zstdLevel != 0 ? QString::number(flags.zstdLevel)
+                                               : QString("default"))
+                       + (flags.zstdLongWindow ? " (long window)" : "") + "\n";
+        if (flags.streamArchive && flags.compType != NONE)
+                out += QString("\tSingle Pass Archive: ")
+                       + (flags.archiveMirror ? "with mirror" : "archive only") + "\n";
+        if (flags.seekableArchive && flags.compType > TARBALL)
+                out += "\tSeekable Archive: true\n";
+        if (flags.fileIndex && flags.shards <= 1 && sources.size() <= 1
+            && flags.backupType < NATIVE)
+                out += "\tMetadata Index: true\n";
+        if (flags.staggerWindow > 0)
+                out += "\tStagger Window: " + QString::number(flags.staggerWindow) + " min\n";
+        if (flags.bwLimit > 0)
+                out += "\tRsync Bandwidth Limit: " + QString::number(flags.bwLimit) + " KiB/s\n";
+        if (flags.pressureTarget > 0 || flags.latencyTarget > 0)
+                out += QString("\tThrottled Above: %1% pressure, %2 ms latency\n")
+                               .arg(flags.pressureTarget > 0 ? QString::number(flags.pressureTarget)
+                                                             : "any")
+                               .arg(flags.latencyTarget > 0 ? QString::number(flags.latencyTarget)
+                                                            : "any");
+        QString controls = select_resource_controls();
+        if (!controls.isEmpty())
+                out += "\tResource Controls:\n\t\t" + controls.trimmed().replace("\n", "\n\t\t")
+                       + "\n";
+        if (flags.keep > 0)
+                out += "\tSnapshots Kept: " + QString::number(flags.keep) + "\n";
+        if (sources.size() > 1 && flags.backupType < NATIVE)
+                out += "\tSources At Once: " + QString::number(std::max(flags.workers, 1)) + "\n";
+        else if (flags.backupType != NATIVE && flags.shards > 1)
+                out += "\tShards: " + QString::number(flags.shards) + " ("
+                       + QString::number(flags.workers) + " at once)\n";
         return out;
 }
 
@@ -154,16 +383,25 @@ QString BackupJob::bool_to_string(bool val) const
         return (val ? "true" : "false");
 }
 
-QString BackupJob::make_systemd_calendar() const
+QString BackupJob::make_systemd_calendar(int offsetSeconds) const
 {
         std::string out = "";
-        for (size_t i = 0; i < days.size(); i++) {
-                if (days[i]) {
+        Days start = days;
+        std::string at = time.toStdString();
+        QTime set = QTime::fromString(time);
+        if (offsetSeconds != 0 && set.isValid()) {
+                at = set.addSecs(offsetSeconds).toString("HH:mm:ss").toStdString();
+                // Past midnight the job runs on the day after each chosen day.
+                if (set.msecsSinceStartOfDay() / 1000 + offsetSeconds >= 24 * 60 * 60)
+                        std::rotate(start.rbegin(), start.rbegin() + 1, start.rend());
+        }
+        for (size_t i = 0; i < start.size(); i++) {
+                if (start[i]) {
                         out += shortDays[i] + ",";
                 }
         }
         out += "*-*-* ";
-        out += time.toStdString();
+        out += at;
         return QString::fromStdString(out);
 }
 
@@ -171,3 +409,164 @@ QString BackupJob::make_shell_script() const
 {
         return "#!/bin/bash\n\n" + command;
 }
+
+QString BackupJob::select_backup_type() const
+{
+        QString out = "";
+
+        switch (flags.backupType) {
+        case INCREMENTAL:
+                out += INCREMENTAL_OPTIONS;
+                break;
+        case INCREMENTAL_NO_D:
+                out += INCREMENTAL_OPTIONS;
+                out += NO_DELTA;
+                break;
+        case FULL:
+                out += FULL_OPTIONS;
+                break;
+        case FULL_NO_D:
+                out += INCREMENTAL_OPTIONS;
+                out += NO_DELTA;
+                break;
+        case NATIVE:
+                out += NATIVE_COPY;
+                break;
+        case REPOSITORY:
+                out += REPOSITORY_BACKUP;
+                break;
+        case SNAPSHOT:
+                out += SNAPSHOT_BACKUP;
+                break;
+        default:
+                throw std::out_of_range("Invalid Backup Type Index");
+        }
+
+        return out;
+}
+
+QString BackupJob::select_delete_type() const
+{
+        switch (flags.deleteType) {
+        case DURING:
+                return DELETE_DURING;
+        case AFTER:
+                return DELETE_AFTER;
+        case BEFORE:
+                return DELETE_BEFORE;
+        default:
+                throw std::out_of_range("Invalid Delete Type Index");
+        }
+}
+
+QString BackupJob::select_compression_type() const
+{
+        QString out = "";
+        switch (flags.compType) {
+        case NONE:
+                break;
+        case TARBALL:
+                out += TAR;
+                out += dest + ".tar " + dest;
+                break;
+        case GZ:
+        case BZ2:
+        case XZ:
+        case ZSTD:
+                out += ARCHIVE + select_archive_options(archiveFormats[flags.compType]);
+                out += dest + archiveExtensions[flags.compType] + " " + dest;
+                break;
+        default:
+                throw std::out_of_range("Invalid Compression Type Index");
+        }
+        return out;
+}
+
+QString BackupJob::select_excludes(const JobSource &source) const
+{
+        QString out = "";
+        for (QString exclude : source.excludes)
+                out += "--exclude='" + exclude.replace("'", "'\\''") + "' ";
+        return out;
+}
+
+QString BackupJob::select_source_options() const
+{
+        QString out = "";
+        for (const auto &source : sources) {
+                out += "--source " + source.path + " ";
+                for (QString exclude : source.excludes)
+                        out += "--exclude '" + exclude.replace("'", "'\\''") + "' ";
+        }
+        return out;
+}
+
+QString BackupJob::select_sources() const
+{
+        return SOURCES + QString("--workers %1 ").arg(std::max(flags.workers, 1))
+               + select_source_options() + "-- ";
+}
+
+QString BackupJob::select_fanout() const
+{
+        // rsync's options are not passed on, so the deletion and -u they imply are.
+        QString out = FANOUT + QString("--delete yes ");
+        if (flags.backupType != FULL)
+                out += "--update yes ";
+        return out + select_source_options() + "-- " + dests.join(' ') + " ";
+}
+
+QString BackupJob::select_bandwidth_limit() const
+{
+        if (flags.bwLimit <= 0)
+                return "";
+        // Shards or sources running at once share the limit.
+        int limit = flags.bwLimit;
+        if ((flags.shards > 1 || sources.size() > 1) && flags.backupType != SNAPSHOT)
+                limit = std::max(limit / std::max(flags.workers, 1), 1);
+        return "--bwlimit=" + QString::number(limit) + " ";
+}
+
+QString BackupJob::select_resource_controls() const
+{
+        QString out = "";
+        if (flags.ioWeight > 0)
+                out += "IOWeight=" + QString::number(flags.ioWeight) + "\n";
+        if (flags.readBandwidth > 0) {
+                for (const auto &source : sources)
+                        out += "IOReadBandwidthMax=" + source.path + " "
+                               + QString::number(flags.readBandwidth) + "M\n";
+        }
+        if (flags.writeBandwidth > 0) {
+                for (const auto &path : dests)
+                        out += "IOWriteBandwidthMax=" + path + " "
+                               + QString::number(flags.writeBandwidth) + "M\n";
+        }
+        if (flags.cpuWeight > 0)
+                out += "CPUWeight=" + QString::number(flags.cpuWeight) + "\n";
+        if (flags.cpuQuota > 0)
+                out += "CPUQuota=" + QString::number(flags.cpuQuota) + "%\n";
+        if (flags.nice != 0)
+                out += "Nice=" + QString::number(flags.nice) + "\n";
+        if (flags.ioClass > DEFAULT_IO && flags.ioClass <= IDLE_IO)
+                out += "IOSchedulingClass=" + ioClassNames[flags.ioClass] + "\n";
+        return out;
+}
+
+QString BackupJob::select_archive_options(const QString &format) const
+{
+        QString out = "--format " + format + " ";
+        if (flags.compressionThreads > 0)
+                out += "--threads " + QString::number(flags.compressionThreads) + " ";
+        if (flags.compressionMemory > 0)
+                out += "--memory " + QString::number(flags.compressionMemory) + " ";
+        if (flags.compType == ZSTD) {
+                if (flags.zstdLevel != 0)
+                        out += "--level " + QString::number(flags.zstdLevel) + " ";
+                if (flags.zstdLongWindow)
+                        out += "--long ";
+        }
+        if (flags.seekableArchive)
+                out += "--seekable ";
+        return out;
+}
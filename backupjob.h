@@ -21,6 +21,7 @@
 #define BACKUPJOB_H
 
 #include <QString>
+#include <QStringList>
 #include <array>
 
 // Forward declaration used to make Manager a friend.
@@ -28,8 +29,10 @@ class Manager;
 
 // Enums corresponding to the index on the combo box in the ui.
 enum DeleteType { DURING, AFTER, BEFORE };
-enum CompressionType { NONE, TARBALL, GZ, BZ2, XZ };
-enum BackupType { INCREMENTAL, INCREMENTAL_NO_D, FULL, FULL_NO_D };
+enum CompressionType { NONE, TARBALL, GZ, BZ2, XZ, ZSTD };
+enum IOSchedulingClass { DEFAULT_IO, REALTIME_IO, BEST_EFFORT_IO, IDLE_IO };
+
+enum BackupType { INCREMENTAL, INCREMENTAL_NO_D, FULL, FULL_NO_D, NATIVE, REPOSITORY, SNAPSHOT };
 
 struct JobFlags {
         bool transferCompression;
@@ -39,10 +42,44 @@ struct JobFlags {
         DeleteType deleteType;
         CompressionType compType;
         BackupType backupType;
+        int shards;
+        int workers;
+        int keep;
+        int compressionThreads;
+        int compressionMemory;
+        bool streamArchive;
+        bool archiveMirror;
+        bool seekableArchive; // indexed for restoring single files
+        int zstdLevel;
+        bool zstdLongWindow;
+        bool fileIndex;
+        int staggerWindow; // minutes the start is spread over, 0 starts at the set time
+        // Resource controls of the service; 0 leaves systemd's default.
+        int ioWeight;
+        int readBandwidth;  // MiB/s read from the source's disk
+        int writeBandwidth; // MiB/s written to the destination's disk
+        int cpuWeight;
+        int cpuQuota; // percent of one core
+        int nice;
+        IOSchedulingClass ioClass;
+        int bwLimit; // KiB/s per rsync
+        // Throttled by the daemon while running; 0 turns a target off.
+        int pressureTarget; // percent of time stalled, from /proc/pressure
+        int latencyTarget;  // ms per request on the destination's disk
 };
 
 typedef std::array<bool, 7> Days;
 
+/*!
+ * \brief A directory backed up by a job, and the rsync patterns left out of it.
+ */
+struct JobSource {
+        QString path;
+        QStringList excludes;
+};
+
+typedef QList<JobSource> JobSources;
+
 class BackupJob
 {
     public:
@@ -50,6 +87,12 @@ class BackupJob
 
         BackupJob(QString name, QString dest, QString src, QString command, Days days,
                   JobFlags flags, QString time, bool enabled = false);
+        /*!
+         * \brief Creates a job backing up several sources to several destinations; the
+         * first of each are its source and destination.
+         */
+        BackupJob(QString name, QStringList dests, JobSources sources, QString command,
+                  Days days, JobFlags flags, QString time, bool enabled = false);
         BackupJob();
         ~BackupJob() = default;
         BackupJob(const BackupJob &) = default;
@@ -59,15 +102,33 @@ class BackupJob
 
         /*!
          * \brief Gets the text that will go into the .service file.
+         * \param Directory holding the job's script and run history, ending with a slash.
          * \return std::string of data for the .service file.
          */
-        QString get_service() const;
+        QString get_service(const QString &configDirectory) const;
 
         /*!
          * \brief Gets the text that will go into the .timer file.
+         * \param Expected length of a run in seconds, 0 if unknown; keeps a staggered
+         * start early enough for the run to end inside the window.
          * \return std::string of data for the .timer file.
          */
-        QString get_timer() const;
+        QString get_timer(int expectedSeconds = 0) const;
+
+        /*!
+         * \brief Gets how far into its stagger window the job starts.
+         * The offset only depends on the job's name and expected length, so it stays
+         * the same every time the timer is written.
+         * \param Expected length of a run in seconds, 0 if unknown.
+         * \return Seconds after the set time, 0 without a stagger window.
+         */
+        int get_stagger_offset(int expectedSeconds = 0) const;
+
+        /*!
+         * \brief Generates the rsync command from the job's source, destination and flags.
+         * \return QString containing the backup commands.
+         */
+        QString generate_command() const;
 
         /*!
          * \brief Converts the job to an easily displayed QString.
@@ -93,12 +154,33 @@ class BackupJob
          */
         QString get_dest() const;
 
+        /*!
+         * \brief Retrieves every destination of the job.
+         * \return Destinations of the job, the one get_dest() returns first.
+         */
+        QStringList get_dests() const;
+
         /*!
          * \brief Retrieves the source of the job.
          * \return Source of the job.
          */
         QString get_src() const;
 
+        /*!
+         * \brief Retrieves every source of the job, with their excludes.
+         * \return Sources of the job, the one get_src() returns first.
+         */
+        JobSources get_sources() const;
+
+        /*!
+         * \brief Adds a source to a list, or excludes to a source already in it.
+         * \param List of sources.
+         * \param Path of the source.
+         * \param Patterns to leave out of it.
+         */
+        static void add_source(JobSources &sources, const QString &path,
+                               const QStringList &excludes = QStringList());
+
         /*!
          * \brief Retrieves the flags of the job.
          * \return Flags of the job.
@@ -123,10 +205,31 @@ class BackupJob
          */
         QString get_command() const;
 
+        /*!
+         * \brief Retrieves whether the job's timer is enabled.
+         * \return True if enabled.
+         */
+        bool is_enabled() const;
+
+        /*!
+         * \brief Creates the string for "OnCalendar" of the systemd timer.
+         * \param Seconds to start after the set time; the days move when it passes midnight.
+         * \return Calendar formatted for the timer.
+         */
+        QString make_systemd_calendar(int offsetSeconds = 0) const;
+
+        /*!
+         * \brief Retrieves the snapshots the last snapshot run left in the destination.
+         * \return Snapshot names, oldest first.
+         */
+        QStringList get_snapshots() const;
+
     private:
         QString name;
         QString dest;
+        QStringList dests; // dest first
         QString src;
+        JobSources sources; // src and its excludes first
         QString command;
         JobFlags flags;
         Days days;
@@ -134,19 +237,79 @@ class BackupJob
 
         bool enabled;
 
+        // Written by snapshot runs, not by editing the job.
+        QStringList snapshots;
+
         QString jobflags_to_string() const;
 
         QString days_to_string() const;
 
         QString bool_to_string(bool val) const;
 
+        QString make_shell_script() const;
+
         /*!
-         * \brief Creates the string for "OnCalendar" of the systemd timer.
-         * \return Calendar formatted for the timer.
+         * \brief Selects the rsync options for the backup type.
+         * \return QString containing the flags for the backup type selected.
          */
-        QString make_systemd_calendar() const;
+        QString select_backup_type() const;
 
-        QString make_shell_script() const;
+        /*!
+         * \brief Selects when to delete files.
+         * \return QString containing proper delete flag.
+         */
+        QString select_delete_type() const;
+
+        /*!
+         * \brief Selects the type of compression to use for the backup.
+         * \return QString containing the compression command.
+         */
+        QString select_compression_type() const;
+
+        /*!
+         * \brief Selects the exclude options of a source.
+         * \param The source.
+         * \return Quoted --exclude options, so the shell leaves the patterns alone.
+         */
+        QString select_excludes(const JobSource &source) const;
+
+        /*!
+         * \brief Lists the sources for "rbackup sources" and "rbackup fanout".
+         * \return A --source option per source, each followed by its quoted excludes.
+         */
+        QString select_source_options() const;
+
+        /*!
+         * \brief Builds the "rbackup sources" command that runs an rsync per source.
+         * \return The command up to the rsync options.
+         */
+        QString select_sources() const;
+
+        /*!
+         * \brief Builds the "rbackup fanout" command that reads the sources once for
+         * every destination.
+         * \return The command.
+         */
+        QString select_fanout() const;
+
+        /*!
+         * \brief Selects rsync's bandwidth limit, split between the rsyncs that run at once.
+         * \return The --bwlimit option, or an empty string without a limit.
+         */
+        QString select_bandwidth_limit() const;
+
+        /*!
+         * \brief Selects the cgroup and scheduling settings of the service.
+         * \return Lines for the [Service] section, empty when every setting is the default.
+         */
+        QString select_resource_controls() const;
+
+        /*!
+         * \brief Builds the options of "rbackup archive" for the job.
+         * \param Name of the archive format.
+         * \return QString containing the format, thread and memory options.
+         */
+        QString select_archive_options(const QString &format) const;
 };
 
 #endif // BACKUPJOB_H
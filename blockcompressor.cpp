@@ -0,0 +1,418 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "blockcompressor.h"
+#include <algorithm>
+#include <bzlib.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <lzma.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+// Same levels as "tar -z", "tar -j" and "tar -J".
+constexpr int GZ_LEVEL = 6;
+constexpr int BZ2_LEVEL = 9;
+constexpr uint32_t XZ_PRESET = 6;
+
+// A gzip window is 32K, so restarting every MiB costs next to nothing in ratio.
+constexpr size_t GZ_BLOCK = 1 << 20;
+// One full bzip2 block per stream.
+constexpr size_t BZ2_BLOCK = 900000;
+// Three times the dictionary of preset 6, the block size xz itself uses with threads.
+constexpr size_t XZ_BLOCK = 24 << 20;
+// Large enough for a good ratio, small enough that one file costs little to reach.
+constexpr size_t ZSTD_FRAME = 4 << 20;
+constexpr size_t TAR_BLOCK = 1 << 20;
+constexpr size_t TAR_IN_FLIGHT = 8;
+// 128 MiB, the window of "zstd --long".
+constexpr int ZSTD_LONG_WINDOW_LOG = 27;
+
+BlockCompressor::BlockCompressor(int fd, CompressionType type, int threads, int memory,
+                                 int level, bool longWindow, bool seekable)
+        : fd(fd), type(type), threads(0), level(level != 0 ? level : ZSTD_CLEVEL_DEFAULT),
+          seekable(seekable), bytesIn(0), bytesOut(0), rawOut(0), finished(false),
+          started(false), zstd(nullptr), current(std::make_shared<Block>()), failed(false),
+          closing(false), stopping(false)
+{
+        size_t encoder = 0;
+        switch (type) {
+        case GZ:
+                blockSize = GZ_BLOCK;
+                encoder = 256 << 10;
+                break;
+        case BZ2:
+                blockSize = BZ2_BLOCK;
+                encoder = 7600 << 10;
+                break;
+        case XZ:
+                blockSize = XZ_BLOCK;
+                encoder = lzma_easy_encoder_memusage(XZ_PRESET);
+                break;
+        case ZSTD:
+                if (seekable) {
+                        blockSize = ZSTD_FRAME;
+                        // Rough size of one encoder at the usual levels.
+                        encoder = 8 << 20;
+                        break;
+                }
+                blockSize = TAR_BLOCK;
+                // Rough size of one zstd worker: its window plus the jobs it buffers.
+                encoder = (size_t)4 << (longWindow ? ZSTD_LONG_WINDOW_LOG : 23);
+                break;
+        default:
+                // Written through, the queue only decouples reading from writing.
+                blockSize = TAR_BLOCK;
+                maxInFlight = TAR_IN_FLIGHT;
+                writer = std::thread(&BlockCompressor::write_blocks, this);
+                return;
+        }
+
+        if (threads <= 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+        // Every thread holds an encoder and keeps two blocks, input and output, in flight.
+        if (memory > 0) {
+                size_t perThread = encoder + 4 * blockSize;
+                size_t fits = ((size_t)memory << 20) / perThread;
+                threads = (int)std::max<size_t>(1, std::min<size_t>(threads, fits));
+        }
+        this->threads = threads;
+
+        if (type == ZSTD && !seekable) {
+                // zstd runs its own workers on one stream, so blocks go straight to the writer.
+                zstd = ZSTD_createCCtx();
+                ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, this->level);
+                ZSTD_CCtx_setParameter(zstd, ZSTD_c_checksumFlag, 1);
+                if (longWindow) {
+                        ZSTD_CCtx_setParameter(zstd, ZSTD_c_enableLongDistanceMatching, 1);
+                        ZSTD_CCtx_setParameter(zstd, ZSTD_c_windowLog, ZSTD_LONG_WINDOW_LOG);
+                }
+                // A library built without threads rejects workers and compresses inline.
+                if (threads > 1
+                    && ZSTD_isError(ZSTD_CCtx_setParameter(zstd, ZSTD_c_nbWorkers, threads)))
+                        this->threads = 1;
+                maxInFlight = TAR_IN_FLIGHT;
+                writer = std::thread(&BlockCompressor::write_blocks, this);
+                return;
+        }
+
+        maxInFlight = 2 * threads;
+        for (int i = 0; i < threads; i++)
+                workers.emplace_back(&BlockCompressor::work, this);
+        writer = std::thread(&BlockCompressor::write_blocks, this);
+}
+
+BlockCompressor::~BlockCompressor()
+{
+        stop();
+        ZSTD_freeCCtx(zstd);
+}
+
+int BlockCompressor::write(const char *data, size_t len)
+{
+        if (finished)
+                return -1;
+        bytesIn += len;
+        while (len > 0) {
+                size_t n = std::min(len, blockSize - current->in.size());
+                if (current->in.capacity() < blockSize)
+                        current->in.reserve(blockSize);
+                current->in.append(data, n);
+                data += n;
+                len -= n;
+                if (current->in.size() == blockSize && submit() != 0)
+                        return -1;
+        }
+        return 0;
+}
+
+int BlockCompressor::finish()
+{
+        if (finished)
+                return failed ? -1 : 0;
+        // An empty stream still needs one member to be a valid file.
+        if (!current->in.empty() || !started)
+                submit();
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
+        }
+        compressed.notify_all();
+        if (writer.joinable())
+                writer.join();
+        finished = true;
+        stop();
+        return failed ? -1 : 0;
+}
+
+int BlockCompressor::flush()
+{
+        if (finished)
+                return -1;
+        if (!current->in.empty() && submit() != 0)
+                return -1;
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this] { return failed || inFlight.empty(); });
+        return failed ? -1 : 0;
+}
+
+uint64_t BlockCompressor::get_bytes_in() const
+{
+        return bytesIn;
+}
+
+uint64_t BlockCompressor::get_bytes_out() const
+{
+        return bytesOut;
+}
+
+int BlockCompressor::get_threads() const
+{
+        return threads;
+}
+
+std::vector<ArchiveFrame> BlockCompressor::get_frames()
+{
+        std::lock_guard<std::mutex> lock(mutex);
+        return frames;
+}
+
+std::string BlockCompressor::extension(CompressionType type)
+{
+        switch (type) {
+        case TARBALL:
+                return ".tar";
+        case GZ:
+                return ".tar.gz";
+        case BZ2:
+                return ".tar.bz2";
+        case XZ:
+                return ".tar.xz";
+        case ZSTD:
+                return ".tar.zst";
+        default:
+                return "";
+        }
+}
+
+int BlockCompressor::submit()
+{
+        std::shared_ptr<Block> block = std::move(current);
+        current = std::make_shared<Block>();
+        started = true;
+        block->rawSize = block->in.size();
+        if (workers.empty()) {
+                block->out.swap(block->in);
+                block->done = true;
+        }
+
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                space.wait(lock, [this] { return failed || inFlight.size() < maxInFlight; });
+                if (failed)
+                        return -1;
+                inFlight.push_back(block);
+                if (!block->done)
+                        todo.push_back(block);
+        }
+        if (block->done)
+                compressed.notify_all();
+        else
+                ready.notify_one();
+        return 0;
+}
+
+void BlockCompressor::work()
+{
+        for (;;) {
+                std::shared_ptr<Block> block;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this] { return stopping || !todo.empty(); });
+                        if (todo.empty())
+                                return;
+                        block = todo.front();
+                        todo.pop_front();
+                }
+                bool error = compress(*block) != 0;
+                std::string().swap(block->in);
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        block->failed = error;
+                        block->done = true;
+                }
+                compressed.notify_all();
+        }
+}
+
+void BlockCompressor::write_blocks()
+{
+        for (;;) {
+                std::shared_ptr<Block> front;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        compressed.wait(lock, [this] {
+                                return stopping || (closing && inFlight.empty())
+                                       || (!inFlight.empty() && inFlight.front()->done);
+                        });
+                        if (stopping)
+                                return;
+                        if (inFlight.empty())
+                                break;
+                        front = inFlight.front();
+                }
+                uint64_t offset = bytesOut;
+                bool error = front->failed
+                             || (zstd != nullptr ? write_zstd(front->out, false)
+                                                 : write_out(front->out.data(), front->out.size()))
+                                        != 0;
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (seekable && !error)
+                                frames.push_back(
+                                        {offset, bytesOut - offset, rawOut, front->rawSize});
+                        rawOut += front->rawSize;
+                        inFlight.pop_front();
+                        failed = failed || error;
+                }
+                space.notify_all();
+                if (error)
+                        return;
+        }
+
+        if (zstd != nullptr && write_zstd(std::string(), true) != 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                failed = true;
+        }
+}
+
+int BlockCompressor::write_zstd(const std::string &data, bool last)
+{
+        ZSTD_inBuffer input = {data.data(), data.size(), 0};
+        std::string buffer(ZSTD_CStreamOutSize(), '\0');
+        for (;;) {
+                ZSTD_outBuffer output = {&buffer[0], buffer.size(), 0};
+                size_t left = ZSTD_compressStream2(zstd, &output, &input,
+                                                   last ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(left)) {
+                        std::cerr << "zstd: " << ZSTD_getErrorName(left) << "\n";
+                        return -1;
+                }
+                if (write_out(buffer.data(), output.pos) != 0)
+                        return -1;
+                if (last ? left == 0 : input.pos == input.size)
+                        return 0;
+        }
+}
+
+int BlockCompressor::compress(Block &block) const
+{
+        switch (type) {
+        case GZ: {
+                z_stream zs;
+                memset(&zs, 0, sizeof(zs));
+                // 16 + 15 window bits selects the gzip wrapper.
+                if (deflateInit2(&zs, GZ_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                        return -1;
+                block.out.resize(deflateBound(&zs, block.in.size()));
+                zs.next_in = (Bytef *)block.in.data();
+                zs.avail_in = block.in.size();
+                zs.next_out = (Bytef *)&block.out[0];
+                zs.avail_out = block.out.size();
+                int status = deflate(&zs, Z_FINISH);
+                block.out.resize(zs.total_out);
+                deflateEnd(&zs);
+                return status == Z_STREAM_END ? 0 : -1;
+        }
+        case BZ2: {
+                unsigned int len = block.in.size() + block.in.size() / 100 + 600;
+                block.out.resize(len);
+                int status = BZ2_bzBuffToBuffCompress(&block.out[0], &len, (char *)block.in.data(),
+                                                      block.in.size(), BZ2_LEVEL, 0, 0);
+                block.out.resize(len);
+                return status == BZ_OK ? 0 : -1;
+        }
+        case XZ: {
+                size_t len = 0;
+                block.out.resize(lzma_stream_buffer_bound(block.in.size()));
+                lzma_ret status = lzma_easy_buffer_encode(
+                        XZ_PRESET, LZMA_CHECK_CRC64, nullptr, (const uint8_t *)block.in.data(),
+                        block.in.size(), (uint8_t *)&block.out[0], &len, block.out.size());
+                block.out.resize(len);
+                return status == LZMA_OK ? 0 : -1;
+        }
+        case ZSTD: {
+                // Only seekable streams compress zstd here, one complete frame per block.
+                ZSTD_CCtx *cctx = ZSTD_createCCtx();
+                if (cctx == nullptr)
+                        return -1;
+                ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+                ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+                block.out.resize(ZSTD_compressBound(block.in.size()));
+                size_t len = ZSTD_compress2(cctx, &block.out[0], block.out.size(),
+                                            block.in.data(), block.in.size());
+                ZSTD_freeCCtx(cctx);
+                if (ZSTD_isError(len))
+                        return -1;
+                block.out.resize(len);
+                return 0;
+        }
+        default:
+                block.out = block.in;
+                return 0;
+        }
+}
+
+int BlockCompressor::write_out(const char *data, size_t len)
+{
+        const char *p = data;
+        size_t left = len;
+        while (left > 0) {
+                ssize_t n = ::write(fd, p, left);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        std::cerr << "write: " << strerror(errno) << "\n";
+                        return -1;
+                }
+                p += n;
+                left -= n;
+        }
+        bytesOut += len;
+        return 0;
+}
+
+void BlockCompressor::stop()
+{
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                // Blocks nobody will write out any more.
+                todo.clear();
+        }
+        ready.notify_all();
+        compressed.notify_all();
+        if (writer.joinable())
+                writer.join();
+        for (auto &worker : workers)
+                worker.join();
+        workers.clear();
+}
@@ -0,0 +1,219 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCKCOMPRESSOR_H
+#define BLOCKCOMPRESSOR_H
+
+#include "backupjob.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+
+/*!
+ * \brief An independently decodable block of a seekable archive.
+ */
+struct ArchiveFrame {
+        uint64_t offset;    // in the compressed file
+        uint64_t size;      // compressed
+        uint64_t rawOffset; // in the uncompressed stream
+        uint64_t rawSize;
+};
+
+/*!
+ * \brief The BlockCompressor class
+ * Compresses a stream on every core by cutting it into blocks that are compressed
+ * independently and written out in order.
+ *
+ * Each block becomes a complete gzip member, bzip2 stream or xz stream. Concatenated
+ * members are part of all three formats, so the output is read by the standard
+ * tools (and "tar -x") like any other .gz, .bz2 or .xz file. ZSTD is one stream
+ * compressed by the library's own workers, which keeps its long range matches
+ * across blocks. TARBALL is written through unchanged.
+ *
+ * A seekable stream compresses zstd in independent frames as well and records where
+ * every block starts in the file and in the stream, so a reader can decode any part
+ * of it without what comes before.
+ *
+ * Finished blocks are written by a thread of their own, so reading the input
+ * overlaps with writing the output. The number of blocks in flight is bounded by
+ * the thread count and the memory budget, so a slow disk stalls the caller instead
+ * of growing the queue.
+ */
+class BlockCompressor
+{
+    public:
+        /*!
+         * \param File descriptor the compressed stream is written to.
+         * \param Format of the output.
+         * \param Number of blocks to compress at once, 0 for one per core.
+         * \param Memory budget in MiB for encoders and queued blocks, 0 for no limit.
+         * \param zstd compression level, 0 for the library default.
+         * \param Whether zstd uses a 128 MiB window with long distance matching.
+         * \param Whether every block is decodable on its own and recorded in get_frames().
+         * The long window does not apply to seekable streams.
+         */
+        BlockCompressor(int fd, CompressionType type, int threads = 0, int memory = 0,
+                        int level = 0, bool longWindow = false, bool seekable = false);
+        ~BlockCompressor();
+        BlockCompressor(const BlockCompressor &) = delete;
+        BlockCompressor &operator=(const BlockCompressor &) = delete;
+
+        /*!
+         * \brief Appends data to the stream.
+         * \param Start of the data.
+         * \param Length of the data.
+         * \return 0 for success, -1 if compressing or writing failed.
+         */
+        int write(const char *data, size_t len);
+
+        /*!
+         * \brief Ends the current block and waits for everything so far to be written,
+         * so that the next write starts a new block at get_bytes_out().
+         * \return 0 for success, -1 if compressing or writing failed.
+         */
+        int flush();
+
+        /*!
+         * \brief Compresses the rest of the stream and waits for it to be written.
+         * \return 0 for success, -1 if compressing or writing failed.
+         */
+        int finish();
+
+        /*!
+         * \brief Retrieves the number of bytes given to write().
+         * \return Uncompressed size.
+         */
+        uint64_t get_bytes_in() const;
+
+        /*!
+         * \brief Retrieves the number of bytes written to the file descriptor.
+         * \return Compressed size.
+         */
+        uint64_t get_bytes_out() const;
+
+        /*!
+         * \brief Retrieves the number of worker threads in use after the memory budget.
+         * \return Number of threads, 0 when the stream is written through.
+         */
+        int get_threads() const;
+
+        /*!
+         * \brief Retrieves the blocks of a seekable stream written so far.
+         * \return Blocks in stream order, empty when the stream is not seekable.
+         */
+        std::vector<ArchiveFrame> get_frames();
+
+        /*!
+         * \brief Gets the archive file extension of a compression type.
+         * \param Compression type.
+         * \return Extension including the leading dot, e.g. ".tar.gz".
+         */
+        static std::string extension(CompressionType type);
+
+    private:
+        struct Block {
+                std::string in;
+                std::string out;
+                uint64_t rawSize = 0;
+                bool done = false;
+                bool failed = false;
+        };
+
+        int fd;
+        CompressionType type;
+        int threads;
+        int level;
+        bool seekable;
+        size_t blockSize;
+        size_t maxInFlight;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        // Uncompressed bytes written out, counted by the writer thread.
+        uint64_t rawOut;
+        bool finished;
+        bool started;
+        ZSTD_CCtx_s *zstd;
+
+        std::shared_ptr<Block> current;
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable compressed;
+        std::condition_variable space;
+        // Blocks in stream order, waiting to be compressed and written.
+        std::deque<std::shared_ptr<Block>> inFlight;
+        std::deque<std::shared_ptr<Block>> todo;
+        std::vector<ArchiveFrame> frames;
+        bool failed;
+        bool closing;
+        bool stopping;
+        std::vector<std::thread> workers;
+        std::thread writer;
+
+        /*!
+         * \brief Queues the current block, waiting while too many are in flight.
+         * \return 0 for success, -1 for failure.
+         */
+        int submit();
+
+        /*!
+         * \brief Compresses queued blocks until stopped.
+         */
+        void work();
+
+        /*!
+         * \brief Writes finished blocks in stream order until closed.
+         */
+        void write_blocks();
+
+        /*!
+         * \brief Compresses one block into its output buffer.
+         * \param Block to compress.
+         * \return 0 for success, -1 for failure.
+         */
+        int compress(Block &block) const;
+
+        /*!
+         * \brief Writes a buffer to the file descriptor, retrying short writes.
+         * \return 0 for success, -1 for failure.
+         */
+        int write_out(const char *data, size_t len);
+
+        /*!
+         * \brief Feeds a block to the zstd stream and writes what it returns.
+         * \param Uncompressed block.
+         * \param True to end the frame after the block.
+         * \return 0 for success, -1 for failure.
+         */
+        int write_zstd(const std::string &data, bool last);
+
+        /*!
+         * \brief Drops queued blocks and joins the workers.
+         */
+        void stop();
+};
+
+#endif // BLOCKCOMPRESSOR_H
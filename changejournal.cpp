@@ -0,0 +1,219 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "changejournal.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr char JOURNAL_MAGIC[4] = {'R', 'B', 'C', 'J'};
+constexpr uint32_t FLAG_OVERFLOW = 1;
+
+namespace
+{
+        struct Header {
+                char magic[4];
+                uint32_t flags;
+                int64_t pid;
+        };
+
+        int write_all(int fd, const char *data, size_t len)
+        {
+                while (len > 0) {
+                        ssize_t n = write(fd, data, len);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n < 0)
+                                return -1;
+                        data += n;
+                        len -= n;
+                }
+                return 0;
+        }
+}
+
+ChangeJournal::ChangeJournal(const std::string &path) : path(path), pendingPath(path + ".pending")
+{
+}
+
+int ChangeJournal::reset(pid_t owner)
+{
+        return write_file(path, owner, true, {});
+}
+
+int ChangeJournal::append(const std::vector<std::string> &paths)
+{
+        int fd = open_locked();
+        if (fd < 0)
+                return -1;
+        std::string records;
+        for (const auto &name : paths)
+                records.append(name.c_str(), name.size() + 1);
+        int status = lseek(fd, 0, SEEK_END) < 0 ? -1
+                                                : write_all(fd, records.data(), records.size());
+        close(fd);
+        return status;
+}
+
+int ChangeJournal::mark_overflow()
+{
+        int fd = open_locked();
+        if (fd < 0)
+                return -1;
+        uint32_t flags = FLAG_OVERFLOW;
+        int status = pwrite(fd, &flags, sizeof(flags), offsetof(Header, flags)) == sizeof(flags)
+                             ? 0
+                             : -1;
+        close(fd);
+        return status;
+}
+
+int ChangeJournal::take(std::vector<std::string> &paths)
+{
+        pid_t owner = 0;
+        bool overflow = false;
+        paths.clear();
+
+        // Left over from a run that failed.
+        int pending = open(pendingPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (pending >= 0) {
+                if (read_file(pending, owner, overflow, paths) != 0)
+                        overflow = true;
+                close(pending);
+        }
+
+        int fd = open_locked();
+        if (fd < 0) {
+                // Nobody is watching.
+                write_file(pendingPath, 0, true, {});
+                return -1;
+        }
+
+        bool current = false;
+        if (read_file(fd, owner, current, paths) != 0)
+                current = true;
+        overflow = overflow || current;
+        bool alive = owner > 0 && (kill(owner, 0) == 0 || errno == EPERM);
+
+        std::sort(paths.begin(), paths.end());
+        paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+        if (!alive)
+                overflow = true;
+        if (overflow)
+                paths.clear();
+
+        int status = write_file(pendingPath, owner, overflow, paths);
+        // An empty journal for the watcher, unless it is gone and will reset its own.
+        if (status == 0) {
+                if (alive)
+                        status = write_file(path, owner, false, {});
+                else
+                        unlink(path.c_str());
+        }
+        close(fd);
+        if (status != 0)
+                return -1;
+        return overflow ? -1 : 0;
+}
+
+void ChangeJournal::done()
+{
+        unlink(pendingPath.c_str());
+}
+
+int ChangeJournal::open_locked() const
+{
+        for (;;) {
+                int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+                if (fd < 0)
+                        return -1;
+                if (flock(fd, LOCK_EX) != 0) {
+                        close(fd);
+                        return -1;
+                }
+                // take() may have replaced the file while we waited for the lock.
+                struct stat locked;
+                struct stat named;
+                if (fstat(fd, &locked) == 0 && stat(path.c_str(), &named) == 0
+                    && locked.st_ino == named.st_ino && locked.st_dev == named.st_dev)
+                        return fd;
+                close(fd);
+        }
+}
+
+int ChangeJournal::write_file(const std::string &file, pid_t owner, bool overflow,
+                              const std::vector<std::string> &paths)
+{
+        Header header;
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.flags = overflow ? FLAG_OVERFLOW : 0;
+        header.pid = owner;
+        std::string data((const char *)&header, sizeof(header));
+        for (const auto &name : paths)
+                data.append(name.c_str(), name.size() + 1);
+
+        std::string temp = file + ".new";
+        int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                std::cerr << temp << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        bool ok = write_all(fd, data.data(), data.size()) == 0 && fsync(fd) == 0;
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(temp.c_str(), file.c_str()) != 0) {
+                std::cerr << file << ": " << strerror(errno) << "\n";
+                unlink(temp.c_str());
+                return -1;
+        }
+        return 0;
+}
+
+int ChangeJournal::read_file(int fd, pid_t &owner, bool &overflow, std::vector<std::string> &paths)
+{
+        std::string data;
+        char buffer[1 << 16];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n < 0 && errno == EINTR)) {
+                if (n > 0)
+                        data.append(buffer, n);
+        }
+        if (n < 0 || data.size() < sizeof(Header))
+                return -1;
+
+        Header header;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0)
+                return -1;
+        owner = header.pid;
+        overflow = overflow || (header.flags & FLAG_OVERFLOW) != 0;
+
+        // A record cut short by a crash is dropped.
+        size_t start = sizeof(Header);
+        for (size_t end; (end = data.find('\0', start)) != std::string::npos; start = end + 1)
+                paths.push_back(data.substr(start, end - start));
+        return 0;
+}
@@ -0,0 +1,117 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHANGEJOURNAL_H
+#define CHANGEJOURNAL_H
+
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/*!
+ * \brief The ChangeJournal class
+ * On disk list of the paths that changed under a job's source, written by the
+ * watcher in the daemon and handed to the next run of the job.
+ *
+ * The file starts with a header holding the watcher's pid and an overflow flag,
+ * followed by NUL terminated paths in the form FileIndex uses. A path ending with
+ * a slash means the whole directory has to be read again. Writers and the reader
+ * lock the file; the reader moves what it took to "<journal>.pending" and puts an
+ * empty journal in place before unlocking, so no change is lost between the two.
+ * The pending file stays until the run succeeded, so a failed run is retried.
+ *
+ * The journal can not be trusted, and the run has to read the whole source, when
+ * it is missing, overflowed, or its watcher is no longer running.
+ */
+class ChangeJournal
+{
+    public:
+        /*!
+         * \param Path of the journal file.
+         */
+        explicit ChangeJournal(const std::string &path);
+        ~ChangeJournal() = default;
+
+        /*!
+         * \brief Starts a new journal owned by a watcher, marked overflowed because
+         * nothing was watched before.
+         * \param Pid of the watcher.
+         * \return 0 for success, -1 for failure.
+         */
+        int reset(pid_t owner);
+
+        /*!
+         * \brief Appends changed paths.
+         * \param Paths to append.
+         * \return 0 for success, -1 for failure.
+         */
+        int append(const std::vector<std::string> &paths);
+
+        /*!
+         * \brief Marks the journal as incomplete, so the next run reads everything.
+         * \return 0 for success, -1 for failure.
+         */
+        int mark_overflow();
+
+        /*!
+         * \brief Takes the changes recorded since the last successful run.
+         * \param Receives the sorted, unique paths.
+         * \return 0 if the paths are complete, -1 if the whole source must be read.
+         */
+        int take(std::vector<std::string> &paths);
+
+        /*!
+         * \brief Drops the taken changes once the run that used them succeeded.
+         */
+        void done();
+
+    private:
+        std::string path;
+        std::string pendingPath;
+
+        /*!
+         * \brief Opens and locks the current journal file, following a rename by take().
+         * \return Locked file descriptor, or -1 if there is no journal.
+         */
+        int open_locked() const;
+
+        /*!
+         * \brief Atomically writes a journal file.
+         * \param Path of the file.
+         * \param Pid of the watcher.
+         * \param Whether the file is marked overflowed.
+         * \param Paths to write.
+         * \return 0 for success, -1 for failure.
+         */
+        static int write_file(const std::string &file, pid_t owner, bool overflow,
+                              const std::vector<std::string> &paths);
+
+        /*!
+         * \brief Reads a journal file.
+         * \param Open file descriptor.
+         * \param Receives the pid of the watcher.
+         * \param Receives the overflow flag.
+         * \param Receives the paths.
+         * \return 0 for success, -1 if the file is not a journal.
+         */
+        static int read_file(int fd, pid_t &owner, bool &overflow,
+                             std::vector<std::string> &paths);
+};
+
+#endif // CHANGEJOURNAL_H
@@ -0,0 +1,245 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "changewatcher.h"
+#include "changejournal.h"
+#include "fileindex.h"
+#include "utility.h"
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+constexpr uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+                                | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW
+                                | IN_EXCL_UNLINK;
+
+// Beyond this many paths a full read is cheaper than stat'ing them one by one.
+constexpr size_t MAX_PENDING = 1 << 20;
+
+constexpr int FLUSH_INTERVAL = 1000;
+
+ChangeWatcher::ChangeWatcher(Manager &manager, QObject *parent)
+        : QObject(parent), manager(manager), fd(-1), notifier(nullptr)
+{
+        connect(&timer, &QTimer::timeout, this, &ChangeWatcher::flush);
+}
+
+ChangeWatcher::~ChangeWatcher()
+{
+        flush();
+        if (fd >= 0)
+                close(fd);
+}
+
+int ChangeWatcher::start()
+{
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+                std::cerr << "inotify: " << strerror(errno) << "\n";
+                return -1;
+        }
+        notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+        // activated() is overloaded from Qt 5.15 on, so the pointer form would be ambiguous.
+        connect(notifier, SIGNAL(activated(int)), this, SLOT(on_events()));
+        timer.start(FLUSH_INTERVAL);
+        reload();
+        return 0;
+}
+
+void ChangeWatcher::reload()
+{
+        if (fd < 0)
+                return;
+        flush();
+
+        std::map<std::string, std::string> wanted;
+        for (const auto &name : manager.get_job_names()) {
+                if (!manager.is_job_enabled(QString::fromStdString(name)))
+                        continue;
+                const BackupJob &job = manager.get_job(name);
+                // Jobs with more sources do not use the index.
+                if (job.get_flags().fileIndex && job.get_sources().size() <= 1)
+                        wanted[name] = job.get_src().toStdString();
+        }
+
+        for (auto it = jobs.begin(); it != jobs.end();) {
+                auto found = wanted.find(it->first);
+                if (found != wanted.end() && found->second == it->second.src) {
+                        wanted.erase(found);
+                        ++it;
+                        continue;
+                }
+                std::string root;
+                FileIndex::split_source(it->second.src, it->second.base, root);
+                remove_tree(it->first, root);
+                it = jobs.erase(it);
+        }
+
+        for (const auto &entry : wanted) {
+                Job &job = jobs[entry.first];
+                std::string root;
+                job.src = entry.second;
+                job.journal = CONFIG_DIRECTORY + entry.first + ".journal";
+                FileIndex::split_source(job.src, job.base, root);
+                // Whatever happened before now was not seen.
+                ChangeJournal(job.journal).reset(getpid());
+                add_tree(entry.first, root);
+        }
+}
+
+void ChangeWatcher::on_events()
+{
+        alignas(struct inotify_event) char buffer[1 << 16];
+        for (;;) {
+                ssize_t len = read(fd, buffer, sizeof(buffer));
+                if (len <= 0)
+                        break;
+                for (char *p = buffer; p < buffer + len;) {
+                        const struct inotify_event *event = (const struct inotify_event *)p;
+                        p += sizeof(struct inotify_event) + event->len;
+
+                        if (event->mask & IN_Q_OVERFLOW) {
+                                for (auto &job : jobs)
+                                        overflow(job.second);
+                                continue;
+                        }
+
+                        auto range = watches.equal_range(event->wd);
+                        std::vector<std::pair<std::string, std::string>> targets;
+                        for (auto it = range.first; it != range.second; ++it)
+                                targets.push_back(it->second);
+                        if (event->mask & IN_IGNORED) {
+                                watches.erase(event->wd);
+                                continue;
+                        }
+
+                        for (const auto &target : targets) {
+                                auto job = jobs.find(target.first);
+                                if (job == jobs.end())
+                                        continue;
+                                const std::string &dir = target.second;
+                                std::string path = event->len == 0 ? dir
+                                                   : dir.empty()   ? std::string(event->name)
+                                                                   : dir + "/" + event->name;
+                                bool isDir = event->mask & IN_ISDIR;
+                                if (isDir && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                                        // Files may appear before the new watch is in place.
+                                        add_tree(target.first, path);
+                                        record(job->second, path + "/");
+                                } else {
+                                        record(job->second, path);
+                                }
+                                if (isDir && (event->mask & IN_MOVED_FROM))
+                                        remove_tree(target.first, path);
+                                // Adding or removing an entry changes the directory too.
+                                if (event->len != 0
+                                    && (event->mask
+                                        & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)))
+                                        record(job->second, dir);
+                        }
+                }
+        }
+}
+
+void ChangeWatcher::flush()
+{
+        for (auto &entry : jobs) {
+                Job &job = entry.second;
+                ChangeJournal journal(job.journal);
+                if (job.incomplete) {
+                        job.pending.clear();
+                        journal.mark_overflow();
+                } else if (!job.pending.empty()) {
+                        journal.append(std::vector<std::string>(job.pending.begin(),
+                                                                job.pending.end()));
+                        job.pending.clear();
+                }
+        }
+}
+
+void ChangeWatcher::add_tree(const std::string &name, const std::string &dir)
+{
+        Job &job = jobs[name];
+        std::vector<std::string> stack = {dir};
+        while (!stack.empty()) {
+                std::string current = stack.back();
+                stack.pop_back();
+                std::string full = job.base + current;
+                int wd = inotify_add_watch(fd, full.c_str(), WATCH_MASK);
+                if (wd < 0) {
+                        // Gone again, or not a directory: the event for it is enough.
+                        if (errno == ENOENT || errno == ENOTDIR)
+                                continue;
+                        std::cerr << full << ": " << strerror(errno) << "\n";
+                        job.incomplete = true;
+                        continue;
+                }
+                watches.emplace(wd, std::make_pair(name, current));
+
+                DIR *handle = opendir(full.c_str());
+                if (handle == nullptr)
+                        continue;
+                while (struct dirent *item = readdir(handle)) {
+                        if (item->d_type != DT_DIR && item->d_type != DT_UNKNOWN)
+                                continue;
+                        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+                                continue;
+                        stack.push_back(current.empty() ? std::string(item->d_name)
+                                                        : current + "/" + item->d_name);
+                }
+                closedir(handle);
+        }
+}
+
+void ChangeWatcher::remove_tree(const std::string &name, const std::string &dir)
+{
+        for (auto it = watches.begin(); it != watches.end();) {
+                const std::string &path = it->second.second;
+                bool inside = dir.empty() || path == dir
+                              || path.compare(0, dir.size() + 1, dir + "/") == 0;
+                if (it->second.first != name || !inside) {
+                        ++it;
+                        continue;
+                }
+                int wd = it->first;
+                it = watches.erase(it);
+                if (watches.count(wd) == 0)
+                        inotify_rm_watch(fd, wd);
+        }
+}
+
+void ChangeWatcher::record(Job &job, const std::string &path)
+{
+        // The root of a "src/" job is not an entry of its index.
+        if (path.empty() || path == "/" || job.incomplete)
+                return;
+        job.pending.insert(path);
+        if (job.pending.size() > MAX_PENDING)
+                overflow(job);
+}
+
+void ChangeWatcher::overflow(Job &job)
+{
+        job.pending.clear();
+        ChangeJournal(job.journal).mark_overflow();
+}
@@ -0,0 +1,116 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHANGEWATCHER_H
+#define CHANGEWATCHER_H
+
+#include "manager.h"
+#include <QObject>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <map>
+#include <set>
+#include <string>
+
+/*!
+ * \brief The ChangeWatcher class
+ * Watches the sources of enabled jobs that keep a metadata index with inotify and
+ * records what changed in each job's ChangeJournal, so the next run only stats
+ * those paths.
+ *
+ * Events are collected per job and appended to the journal once a second. A full
+ * kernel queue, too many pending paths or a directory that can not be watched
+ * marks the journal overflowed, and the next run reads the whole source.
+ */
+class ChangeWatcher : public QObject
+{
+        Q_OBJECT
+
+    public:
+        ChangeWatcher(Manager &manager, QObject *parent = nullptr);
+        ~ChangeWatcher();
+        ChangeWatcher(const ChangeWatcher &) = delete;
+        ChangeWatcher &operator=(const ChangeWatcher &) = delete;
+
+        /*!
+         * \brief Starts watching.
+         * \return 0 for success, -1 if inotify is not available.
+         */
+        int start();
+
+        /*!
+         * \brief Brings the watched jobs in line with the manager's jobs.
+         */
+        void reload();
+
+    private slots:
+        void on_events();
+
+        /*!
+         * \brief Appends the collected paths to the journals.
+         */
+        void flush();
+
+    private:
+        struct Job {
+                std::string src;
+                std::string base;
+                std::string journal;
+                std::set<std::string> pending;
+                // Some directory could not be watched, so every run has to read everything.
+                bool incomplete = false;
+        };
+
+        Manager &manager;
+        int fd;
+        QSocketNotifier *notifier;
+        QTimer timer;
+        std::map<std::string, Job> jobs;
+        // Watch descriptor to job name and directory, as the index names it.
+        std::multimap<int, std::pair<std::string, std::string>> watches;
+
+        /*!
+         * \brief Watches a directory and every directory below it.
+         * \param Name of the job.
+         * \param Directory relative to the job's base.
+         */
+        void add_tree(const std::string &name, const std::string &dir);
+
+        /*!
+         * \brief Stops watching a directory and everything below it for one job.
+         * \param Name of the job.
+         * \param Directory relative to the job's base.
+         */
+        void remove_tree(const std::string &name, const std::string &dir);
+
+        /*!
+         * \brief Collects a changed path for a job.
+         * \param Job.
+         * \param Changed path, ending with a slash to read the whole directory again.
+         */
+        void record(Job &job, const std::string &path);
+
+        /*!
+         * \brief Drops a job's collected paths and marks its journal overflowed.
+         * \param Job.
+         */
+        void overflow(Job &job);
+};
+
+#endif // CHANGEWATCHER_H
@@ -0,0 +1,668 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "chunkstore.h"
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QSaveFile>
+#include <array>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// FastCDC chunk sizes. The average is 2^16 bytes.
+constexpr size_t MIN_CHUNK = 16 * 1024;
+constexpr size_t AVG_CHUNK = 64 * 1024;
+constexpr size_t MAX_CHUNK = 256 * 1024;
+
+// Normalized chunking: a stricter mask before the average size and a looser one
+// after it keeps most chunks close to the average.
+constexpr quint64 MASK_S = ~0ULL << (64 - 18);
+constexpr quint64 MASK_L = ~0ULL << (64 - 14);
+
+constexpr qint64 READ_SIZE = 4 * 1024 * 1024;
+
+constexpr quint32 INDEX_MAGIC = 0x52424958; // RBIX
+constexpr quint32 LOG_MAGIC = 0x5242494c; // RBIL
+constexpr quint32 MANIFEST_MAGIC = 0x52424d46; // RBMF
+constexpr quint32 FORMAT_VERSION = 1;
+constexpr quint32 INDEX_VERSION = 2; // version 1 had no generation
+constexpr int HASH_SIZE = 32;
+
+// Log header: magic, generation. Record: hash, reference change, size.
+constexpr qint64 LOG_HEADER = 4 + 8;
+constexpr qint64 LOG_RECORD = HASH_SIZE + 4 + 4;
+// The index is rewritten once the log holds more records than it has chunks, and
+// at least this many.
+constexpr qint64 LOG_MINIMUM = 64 * 1024;
+
+// Random values for the gear hash. Fixed, since changing them moves every chunk boundary.
+static const std::array<quint64, 256> gear = [] {
+        std::array<quint64, 256> table{};
+        quint64 state = 0x2545f4914f6cdd1dULL;
+        for (auto &value : table) {
+                state += 0x9e3779b97f4a7c15ULL;
+                quint64 z = state;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                value = z ^ (z >> 31);
+        }
+        return table;
+}();
+
+static int set_attributes(const QString &file, const ManifestEntry &entry)
+{
+        QByteArray name = QFile::encodeName(file);
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = entry.mtime / 1000000000;
+        times[0].tv_nsec = times[1].tv_nsec = entry.mtime % 1000000000;
+        if (geteuid() == 0 && lchown(name.constData(), entry.uid, entry.gid) != 0)
+                return -1;
+        if (entry.type != ManifestEntry::SYMLINK && chmod(name.constData(), entry.mode & 07777) != 0)
+                return -1;
+        return utimensat(AT_FDCWD, name.constData(), times, AT_SYMLINK_NOFOLLOW);
+}
+
+ChunkStore::ChunkStore(const QString &path) : path(path), generation(0), logRecords(0)
+{
+}
+
+bool ChunkStore::exists() const
+{
+        return QFileInfo(path + "/snapshots").isDir();
+}
+
+QString ChunkStore::backup(const QString &job, const QString &src, int keep)
+{
+        if (create_layout() != 0) {
+                std::cerr << path.toStdString() << ": unable to create the repository\n";
+                return "";
+        }
+        QLockFile lock(path + "/lock");
+        lock.setStaleLockTime(std::numeric_limits<int>::max());
+        if (!lock.lock() || load_index() != 0)
+                return "";
+        stats = RepositoryStats();
+
+        // Unchanged files reuse the chunks of the job's previous snapshot.
+        std::vector<ManifestEntry> old;
+        QHash<QString, const ManifestEntry *> previous;
+        QStringList snapshots = list_snapshots(job);
+        if (!snapshots.isEmpty() && read_manifest(snapshots.last(), old) == 0) {
+                for (const auto &entry : old)
+                        previous.insert(entry.path, &entry);
+        }
+
+        std::vector<ManifestEntry> entries;
+        std::error_code ec;
+        fs::path root = fs::path(QFile::encodeName(src).toStdString()).lexically_normal();
+        if (!root.has_filename())
+                root = root.parent_path();
+        auto options = fs::directory_options::skip_permission_denied;
+        fs::recursive_directory_iterator it(root, options, ec), end;
+        if (ec) {
+                std::cerr << root.string() << ": " << ec.message() << "\n";
+                return "";
+        }
+
+        for (fs::path current = root; !current.empty();) {
+                struct stat st;
+                ManifestEntry entry;
+                QString file = QFile::decodeName(current.c_str());
+                if (lstat(current.c_str(), &st) == 0) {
+                        entry.path = current == root ? "." : QFile::decodeName(
+                                                                     current.lexically_relative(root)
+                                                                             .c_str());
+                        entry.mode = st.st_mode;
+                        entry.uid = st.st_uid;
+                        entry.gid = st.st_gid;
+                        entry.mtime = (qint64)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+                        entry.size = S_ISREG(st.st_mode) ? st.st_size : 0;
+                        stats.files++;
+                        stats.totalSize += entry.size;
+
+                        auto found = previous.find(entry.path);
+                        if (S_ISDIR(st.st_mode)) {
+                                entry.type = ManifestEntry::DIRECTORY;
+                                entries.push_back(entry);
+                        } else if (S_ISLNK(st.st_mode)) {
+                                entry.type = ManifestEntry::SYMLINK;
+                                entry.target = QFile::decodeName(
+                                        fs::read_symlink(current, ec).c_str());
+                                entries.push_back(entry);
+                        } else if (S_ISREG(st.st_mode)) {
+                                entry.type = ManifestEntry::FILE;
+                                if (found != previous.end()
+                                    && (*found)->type == ManifestEntry::FILE
+                                    && (*found)->size == entry.size
+                                    && (*found)->mtime == entry.mtime) {
+                                        entry.chunks = (*found)->chunks;
+                                        stats.chunks += entry.chunks.size();
+                                        entries.push_back(entry);
+                                } else if (store_file(file, entry) == 0) {
+                                        stats.filesChunked++;
+                                        entries.push_back(entry);
+                                } else {
+                                        std::cerr << file.toStdString() << ": unable to read\n";
+                                        stats.errors++;
+                                }
+                        }
+                } else {
+                        std::cerr << file.toStdString() << ": unable to stat\n";
+                        stats.errors++;
+                }
+
+                current.clear();
+                if (it != end) {
+                        current = it->path();
+                        it.increment(ec);
+                        if (ec) {
+                                std::cerr << ec.message() << "\n";
+                                stats.errors++;
+                                it = end;
+                        }
+                }
+        }
+
+        // References are saved before the manifest that holds them, so a crash can
+        // only leave chunks with too many references, never too few.
+        QHash<QByteArray, qint32> deltas;
+        for (const auto &entry : entries) {
+                for (const auto &hash : entry.chunks) {
+                        index[hash].refs++;
+                        deltas[hash]++;
+                }
+        }
+        QString base = job + "/" + QDateTime::currentDateTimeUtc().toString("yyyyMMdd'T'HHmmss'Z'");
+        QString name = base;
+        for (int i = 1; QFile::exists(path + "/snapshots/" + name); i++)
+                name = base + "." + QString::number(i);
+        if (append_index(deltas) != 0 || write_manifest(name, entries) != 0)
+                return "";
+
+        if (keep > 0) {
+                QList<QByteArray> garbage;
+                QHash<QByteArray, qint32> dropped;
+                snapshots = list_snapshots(job);
+                for (int i = 0; i < snapshots.size() - keep; i++)
+                        drop_snapshot(snapshots[i], garbage, dropped);
+                if (append_index(dropped) == 0) {
+                        for (const auto &hash : garbage)
+                                QFile::remove(chunk_path(hash));
+                }
+        }
+        return name;
+}
+
+int ChunkStore::restore(const QString &snapshot, const QString &target, const QStringList &paths)
+{
+        std::vector<ManifestEntry> entries;
+        if (read_manifest(snapshot, entries) != 0)
+                return -1;
+
+        int status = 0;
+        std::vector<const ManifestEntry *> dirs;
+        QDir().mkpath(target);
+        for (const auto &entry : entries) {
+                bool wanted = paths.isEmpty();
+                for (const auto &prefix : paths) {
+                        if (entry.path == prefix || entry.path.startsWith(prefix + "/")
+                            || prefix.startsWith(entry.path + "/") || entry.path == ".")
+                                wanted = true;
+                }
+                if (!wanted)
+                        continue;
+
+                QString file = entry.path == "." ? target : target + "/" + entry.path;
+                if (entry.type == ManifestEntry::DIRECTORY) {
+                        QDir().mkpath(file);
+                        dirs.push_back(&entry);
+                        continue;
+                }
+
+                QFile::remove(file);
+                if (entry.type == ManifestEntry::SYMLINK) {
+                        if (symlink(QFile::encodeName(entry.target).constData(),
+                                    QFile::encodeName(file).constData())
+                            != 0) {
+                                std::cerr << file.toStdString() << ": unable to create link\n";
+                                status = -1;
+                                continue;
+                        }
+                } else {
+                        QFile out(file);
+                        if (!out.open(QIODevice::WriteOnly)) {
+                                std::cerr << file.toStdString() << ": unable to write\n";
+                                status = -1;
+                                continue;
+                        }
+                        for (const auto &hash : entry.chunks) {
+                                QFile chunk(chunk_path(hash));
+                                if (!chunk.open(QIODevice::ReadOnly)
+                                    || out.write(chunk.readAll()) < 0) {
+                                        std::cerr << file.toStdString() << ": missing chunk "
+                                                  << hash.toHex().toStdString() << "\n";
+                                        status = -1;
+                                        break;
+                                }
+                        }
+                        out.close();
+                }
+                if (set_attributes(file, entry) != 0)
+                        status = -1;
+        }
+
+        // Directories last, deepest first, since restoring their contents changes their times.
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+                const ManifestEntry *entry = *it;
+                QString file = entry->path == "." ? target : target + "/" + entry->path;
+                if (set_attributes(file, *entry) != 0)
+                        status = -1;
+        }
+        return status;
+}
+
+int ChunkStore::forget(const QString &snapshot)
+{
+        QLockFile lock(path + "/lock");
+        lock.setStaleLockTime(std::numeric_limits<int>::max());
+        if (!lock.lock() || load_index() != 0)
+                return -1;
+
+        QList<QByteArray> garbage;
+        QHash<QByteArray, qint32> deltas;
+        if (drop_snapshot(snapshot, garbage, deltas) != 0)
+                return -1;
+        // The index must stop listing a chunk before its file goes away, otherwise a
+        // crash would leave later backups referencing a chunk that no longer exists.
+        if (append_index(deltas) != 0)
+                return -1;
+        for (const auto &hash : garbage)
+                QFile::remove(chunk_path(hash));
+        return 0;
+}
+
+int ChunkStore::collect_garbage()
+{
+        QLockFile lock(path + "/lock");
+        lock.setStaleLockTime(std::numeric_limits<int>::max());
+        if (!lock.lock() || load_index() != 0)
+                return -1;
+
+        // Recount every reference from the manifests, which also repairs counts left
+        // too high by an interrupted backup.
+        QHash<QByteArray, ChunkInfo> counted;
+        for (const auto &snapshot : list_snapshots()) {
+                std::vector<ManifestEntry> entries;
+                if (read_manifest(snapshot, entries) != 0)
+                        return -1;
+                for (const auto &entry : entries) {
+                        for (const auto &hash : entry.chunks) {
+                                ChunkInfo &info = counted[hash];
+                                info.refs++;
+                                info.size = index.value(hash).size;
+                        }
+                }
+        }
+        // Also the one place the index is always rewritten and the log emptied.
+        index = counted;
+        if (save_index() != 0)
+                return -1;
+
+        int deleted = 0;
+        QDirIterator it(path + "/chunks", QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+                QString file = it.next();
+                QByteArray hash = QByteArray::fromHex(it.fileName().toLatin1());
+                if (!index.contains(hash) && QFile::remove(file))
+                        deleted++;
+        }
+        return deleted;
+}
+
+QStringList ChunkStore::list_snapshots(const QString &job) const
+{
+        QStringList out;
+        QDir root(path + "/snapshots");
+        QStringList jobs = job.isEmpty() ? root.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name)
+                                         : QStringList{job};
+        for (const auto &name : jobs) {
+                for (const auto &time : QDir(root.filePath(name)).entryList(QDir::Files, QDir::Name))
+                        out.append(name + "/" + time);
+        }
+        return out;
+}
+
+RepositoryStats ChunkStore::get_stats() const
+{
+        return stats;
+}
+
+size_t ChunkStore::cut_point(const unsigned char *data, size_t len)
+{
+        if (len <= MIN_CHUNK)
+                return len;
+        size_t limit = std::min(len, MAX_CHUNK);
+        size_t normal = std::min(AVG_CHUNK, limit);
+        quint64 hash = 0;
+        size_t i = MIN_CHUNK;
+
+        for (; i < normal; i++) {
+                hash = (hash << 1) + gear[data[i]];
+                if (!(hash & MASK_S))
+                        return i + 1;
+        }
+        for (; i < limit; i++) {
+                hash = (hash << 1) + gear[data[i]];
+                if (!(hash & MASK_L))
+                        return i + 1;
+        }
+        return limit;
+}
+
+QString ChunkStore::chunk_path(const QByteArray &hash) const
+{
+        QString hex = QString::fromLatin1(hash.toHex());
+        return path + "/chunks/" + hex.left(2) + "/" + hex;
+}
+
+int ChunkStore::create_layout() const
+{
+        QDir dir;
+        if (!dir.mkpath(path + "/snapshots"))
+                return -1;
+        for (int i = 0; i < 256; i++) {
+                if (!dir.mkpath(path + "/chunks/" + QString("%1").arg(i, 2, 16, QChar('0'))))
+                        return -1;
+        }
+        return 0;
+}
+
+int ChunkStore::load_index()
+{
+        index.clear();
+        generation = 0;
+        logRecords = 0;
+        QFile file(path + "/index");
+        if (file.exists()) {
+                if (!file.open(QIODevice::ReadOnly))
+                        return -1;
+                QDataStream in(&file);
+                in.setVersion(QDataStream::Qt_5_6);
+                quint32 magic = 0, version = 0;
+                qint64 count = 0;
+                in >> magic >> version;
+                if (version == INDEX_VERSION)
+                        in >> generation;
+                in >> count;
+                if (magic != INDEX_MAGIC || (version != INDEX_VERSION && version != 1)) {
+                        std::cerr << "Unrecognized repository index.\n";
+                        return -1;
+                }
+                index.reserve(count);
+                QByteArray hash(HASH_SIZE, 0);
+                for (qint64 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+                        ChunkInfo info;
+                        in.readRawData(hash.data(), HASH_SIZE);
+                        in >> info.refs >> info.size;
+                        index.insert(QByteArray(hash.constData(), HASH_SIZE), info);
+                }
+                if (in.status() != QDataStream::Ok)
+                        return -1;
+        }
+
+        QFile log(path + "/index.log");
+        if (!log.exists())
+                return 0;
+        if (!log.open(QIODevice::ReadOnly))
+                return -1;
+        QDataStream in(&log);
+        in.setVersion(QDataStream::Qt_5_6);
+        quint32 magic = 0;
+        quint64 logGeneration = 0;
+        in >> magic >> logGeneration;
+        if (in.status() == QDataStream::Ok && magic != LOG_MAGIC) {
+                std::cerr << "Unrecognized repository index log.\n";
+                return -1;
+        }
+        // An older log was left by a crash after the index was rewritten, so the index
+        // already holds it; an incomplete header means no record was written yet.
+        if (in.status() != QDataStream::Ok || logGeneration != generation) {
+                log.close();
+                return reset_log();
+        }
+        QByteArray hash(HASH_SIZE, 0);
+        while (log.bytesAvailable() >= LOG_RECORD) {
+                qint32 delta = 0;
+                quint32 size = 0;
+                in.readRawData(hash.data(), HASH_SIZE);
+                in >> delta >> size;
+                QByteArray key(hash.constData(), HASH_SIZE);
+                auto it = index.find(key);
+                if (it == index.end()) {
+                        if (delta > 0)
+                                index.insert(key, {(quint32)delta, size});
+                } else if ((qint64)it->refs + delta > 0) {
+                        it->refs += delta;
+                        it->size = size != 0 ? size : it->size;
+                } else {
+                        index.erase(it);
+                }
+                logRecords++;
+        }
+        // A record cut short by a crash goes, so the next one is appended in place of it.
+        bool partial = log.bytesAvailable() > 0;
+        log.close();
+        if (partial && !log.resize(LOG_HEADER + logRecords * LOG_RECORD))
+                return -1;
+        return 0;
+}
+
+int ChunkStore::save_index()
+{
+        QSaveFile file(path + "/index");
+        if (!file.open(QIODevice::WriteOnly))
+                return -1;
+
+        QDataStream out(&file);
+        out.setVersion(QDataStream::Qt_5_6);
+        out << INDEX_MAGIC << INDEX_VERSION << generation + 1 << (qint64)index.size();
+        for (auto it = index.constBegin(); it != index.constEnd(); ++it) {
+                out.writeRawData(it.key().constData(), HASH_SIZE);
+                out << it.value().refs << it.value().size;
+        }
+        if (!file.commit())
+                return -1;
+        // From here the old log no longer matches the index, so it is ignored if the
+        // new one is never written.
+        generation++;
+        return reset_log();
+}
+
+int ChunkStore::append_index(const QHash<QByteArray, qint32> &deltas)
+{
+        if (deltas.isEmpty())
+                return 0;
+        if (logRecords + deltas.size() > std::max<qint64>(index.size(), LOG_MINIMUM))
+                return save_index();
+
+        QFile log(path + "/index.log");
+        if (!log.exists() && reset_log() != 0)
+                return -1;
+        if (!log.open(QIODevice::WriteOnly | QIODevice::Append))
+                return -1;
+        QByteArray data;
+        QDataStream out(&data, QIODevice::WriteOnly);
+        out.setVersion(QDataStream::Qt_5_6);
+        for (auto it = deltas.constBegin(); it != deltas.constEnd(); ++it) {
+                out.writeRawData(it.key().constData(), HASH_SIZE);
+                out << it.value() << index.value(it.key()).size;
+        }
+        bool ok = log.write(data) == data.size() && log.flush() && fsync(log.handle()) == 0;
+        logRecords += deltas.size();
+        return ok ? 0 : -1;
+}
+
+int ChunkStore::reset_log()
+{
+        QSaveFile log(path + "/index.log");
+        if (!log.open(QIODevice::WriteOnly))
+                return -1;
+        QDataStream out(&log);
+        out.setVersion(QDataStream::Qt_5_6);
+        out << LOG_MAGIC << generation;
+        logRecords = 0;
+        return log.commit() ? 0 : -1;
+}
+
+int ChunkStore::store_file(const QString &file, ManifestEntry &entry)
+{
+        QFile in(file);
+        if (!in.open(QIODevice::ReadOnly))
+                return -1;
+
+        QByteArray buffer;
+        int pos = 0;
+        bool eof = false;
+        entry.chunks.clear();
+        for (;;) {
+                // Refill once less than a maximum sized chunk is buffered, moving the
+                // remainder to the front rather than shifting after every chunk.
+                if (!eof && buffer.size() - pos < (int)MAX_CHUNK) {
+                        buffer.remove(0, pos);
+                        pos = 0;
+                        QByteArray more = in.read(READ_SIZE);
+                        if (in.error() != QFileDevice::NoError)
+                                return -1;
+                        eof = more.isEmpty();
+                        buffer.append(more);
+                        continue;
+                }
+                if (pos >= buffer.size())
+                        break;
+
+                const char *data = buffer.constData() + pos;
+                size_t len = cut_point((const unsigned char *)data, buffer.size() - pos);
+                QByteArray chunk = QByteArray::fromRawData(data, len);
+                QByteArray hash = QCryptographicHash::hash(chunk, QCryptographicHash::Sha256);
+                pos += len;
+                stats.chunks++;
+                entry.chunks.push_back(hash);
+                if (index.contains(hash))
+                        continue;
+
+                QSaveFile out(chunk_path(hash));
+                if (!out.open(QIODevice::WriteOnly) || out.write(data, len) != (qint64)len
+                    || !out.commit())
+                        return -1;
+                index.insert(hash, {0, (quint32)len});
+                stats.newChunks++;
+                stats.newBytes += len;
+        }
+        return 0;
+}
+
+int ChunkStore::read_manifest(const QString &snapshot, std::vector<ManifestEntry> &entries) const
+{
+        QFile file(path + "/snapshots/" + snapshot);
+        if (!file.open(QIODevice::ReadOnly))
+                return -1;
+
+        QDataStream in(&file);
+        in.setVersion(QDataStream::Qt_5_6);
+        quint32 magic = 0, version = 0;
+        qint64 count = 0;
+        in >> magic >> version >> count;
+        if (magic != MANIFEST_MAGIC || version != FORMAT_VERSION)
+                return -1;
+
+        entries.clear();
+        entries.reserve(count);
+        for (qint64 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+                ManifestEntry entry;
+                quint8 type;
+                quint32 chunks;
+                in >> entry.path >> type >> entry.mode >> entry.uid >> entry.gid >> entry.mtime
+                        >> entry.size >> entry.target >> chunks;
+                entry.type = (ManifestEntry::Type)type;
+                entry.chunks.resize(chunks);
+                for (auto &hash : entry.chunks) {
+                        hash.resize(HASH_SIZE);
+                        in.readRawData(hash.data(), HASH_SIZE);
+                }
+                entries.push_back(std::move(entry));
+        }
+        return in.status() == QDataStream::Ok ? 0 : -1;
+}
+
+int ChunkStore::write_manifest(const QString &snapshot,
+                               const std::vector<ManifestEntry> &entries) const
+{
+        QDir().mkpath(QFileInfo(path + "/snapshots/" + snapshot).path());
+        QSaveFile file(path + "/snapshots/" + snapshot);
+        if (!file.open(QIODevice::WriteOnly))
+                return -1;
+
+        QDataStream out(&file);
+        out.setVersion(QDataStream::Qt_5_6);
+        out << MANIFEST_MAGIC << FORMAT_VERSION << (qint64)entries.size();
+        for (const auto &entry : entries) {
+                out << entry.path << (quint8)entry.type << entry.mode << entry.uid << entry.gid
+                    << entry.mtime << entry.size << entry.target << (quint32)entry.chunks.size();
+                for (const auto &hash : entry.chunks)
+                        out.writeRawData(hash.constData(), HASH_SIZE);
+        }
+        return file.commit() ? 0 : -1;
+}
+
+int ChunkStore::drop_snapshot(const QString &snapshot, QList<QByteArray> &garbage,
+                              QHash<QByteArray, qint32> &deltas)
+{
+        std::vector<ManifestEntry> entries;
+        if (read_manifest(snapshot, entries) != 0)
+                return -1;
+        // The manifest goes first: a crash after this point leaks references but never
+        // leaves a snapshot pointing at deleted chunks.
+        if (!QFile::remove(path + "/snapshots/" + snapshot))
+                return -1;
+
+        for (const auto &entry : entries) {
+                for (const auto &hash : entry.chunks) {
+                        auto it = index.find(hash);
+                        if (it == index.end() || it->refs == 0)
+                                continue;
+                        deltas[hash]--;
+                        if (--it->refs == 0) {
+                                garbage.append(hash);
+                                index.erase(it);
+                        }
+                }
+        }
+        return 0;
+}
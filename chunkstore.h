@@ -0,0 +1,230 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <vector>
+
+/*!
+ * \brief One file, directory or link recorded in a snapshot.
+ */
+struct ManifestEntry {
+        enum Type : quint8 { FILE, DIRECTORY, SYMLINK };
+
+        QString path;
+        Type type;
+        quint32 mode;
+        quint32 uid;
+        quint32 gid;
+        qint64 mtime; // nanoseconds
+        qint64 size;
+        QString target;
+        std::vector<QByteArray> chunks;
+};
+
+/*!
+ * \brief Counters reported by a repository backup.
+ */
+struct RepositoryStats {
+        qint64 files = 0;
+        qint64 filesChunked = 0;
+        qint64 totalSize = 0;
+        qint64 chunks = 0;
+        qint64 newChunks = 0;
+        qint64 newBytes = 0;
+        qint64 errors = 0;
+};
+
+/*!
+ * \brief The ChunkStore class
+ * A deduplicating, content addressed backup repository.
+ *
+ * Files are cut into variable sized chunks with FastCDC, so an edit only changes
+ * the chunks around it, and each chunk is stored once under its SHA-256. Every
+ * backup writes a manifest listing the files of the snapshot and their chunks.
+ * The index counts how many manifest references each chunk has; forgetting a
+ * snapshot drops its references and chunks that reach zero are deleted.
+ *
+ * Several jobs can use the same repository and share its chunks. Operations that
+ * change the repository hold its lock file, so they run one at a time.
+ *
+ * Changes to the reference counts are appended to the index log and synced, so a
+ * backup writes what it references rather than the whole index. The index itself is
+ * only rewritten by repo-gc or once the log outgrows it; both files carry a
+ * generation, and a log left behind by a crash during the rewrite is ignored.
+ *
+ * Only a backup creates the repository. Reading a path that holds none fails.
+ *
+ * Layout:
+ *      index                           chunk hash -> references, size
+ *      index.log                       chunk hash, reference change, size
+ *      chunks/ab/abcdef...             chunk data
+ *      snapshots/<job>/<time>          manifest
+ */
+class ChunkStore
+{
+    public:
+        /*!
+         * \param Root directory of the repository. It is created by the first backup.
+         */
+        ChunkStore(const QString &path);
+        ~ChunkStore() = default;
+        ChunkStore(const ChunkStore &) = delete;
+        ChunkStore &operator=(const ChunkStore &) = delete;
+
+        /*!
+         * \brief Checks whether the path holds a repository.
+         * \return True once a backup has created it.
+         */
+        bool exists() const;
+
+        /*!
+         * \brief Stores a new snapshot of a directory.
+         * Files whose size and modification time match the job's previous snapshot
+         * reuse its chunks without being read.
+         * \param Name of the job the snapshot belongs to.
+         * \param Directory to back up.
+         * \param Number of the job's snapshots to keep, 0 to keep all.
+         * \return Snapshot name, "<job>/<time>", or an empty string on failure.
+         */
+        QString backup(const QString &job, const QString &src, int keep = 0);
+
+        /*!
+         * \brief Restores a snapshot into a directory.
+         * \param Snapshot name.
+         * \param Directory to restore into.
+         * \param Paths inside the snapshot to restore, all of them when empty.
+         * \return 0 for success, -1 for failure.
+         */
+        int restore(const QString &snapshot, const QString &target,
+                    const QStringList &paths = QStringList());
+
+        /*!
+         * \brief Removes a snapshot and deletes the chunks no other snapshot uses.
+         * \param Snapshot name.
+         * \return 0 for success, -1 for failure.
+         */
+        int forget(const QString &snapshot);
+
+        /*!
+         * \brief Deletes chunk files the index does not reference, e.g. after a crash.
+         * \return Number of chunks deleted, or -1 on failure.
+         */
+        int collect_garbage();
+
+        /*!
+         * \brief Lists the snapshots in the repository.
+         * \param Only list this job's snapshots when not empty.
+         * \return Snapshot names, oldest first within each job.
+         */
+        QStringList list_snapshots(const QString &job = QString()) const;
+
+        /*!
+         * \brief Retrieves the counters of the last backup.
+         * \return Counters.
+         */
+        RepositoryStats get_stats() const;
+
+        /*!
+         * \brief Finds the length of the next chunk with FastCDC.
+         * \param Data to chunk.
+         * \param Length of the data.
+         * \return Length of the first chunk.
+         */
+        static size_t cut_point(const unsigned char *data, size_t len);
+
+    private:
+        struct ChunkInfo {
+                quint32 refs;
+                quint32 size;
+        };
+
+        QString path;
+        QHash<QByteArray, ChunkInfo> index;
+        RepositoryStats stats;
+        // Of the index file; the log only applies while its generation matches.
+        quint64 generation;
+        qint64 logRecords;
+
+        QString chunk_path(const QByteArray &hash) const;
+
+        /*!
+         * \brief Creates the directories of a new repository.
+         * \return 0 for success, -1 for failure.
+         */
+        int create_layout() const;
+
+        /*!
+         * \brief Reads the index and replays the log over it.
+         * \return 0 for success, -1 for failure.
+         */
+        int load_index();
+
+        /*!
+         * \brief Rewrites the whole index under a new generation and empties the log.
+         * \return 0 for success, -1 for failure.
+         */
+        int save_index();
+
+        /*!
+         * \brief Records reference changes in the log and syncs it. The index must already
+         * hold the changes; it is rewritten instead once the log outgrows it.
+         * \param Change in references by chunk.
+         * \return 0 for success, -1 for failure.
+         */
+        int append_index(const QHash<QByteArray, qint32> &deltas);
+
+        /*!
+         * \brief Starts an empty log for the current generation.
+         * \return 0 for success, -1 for failure.
+         */
+        int reset_log();
+
+        /*!
+         * \brief Cuts a file into chunks, storing the ones the index does not have yet.
+         * \param Path of the file.
+         * \param Entry that receives the chunk hashes.
+         * \return 0 for success, -1 for failure.
+         */
+        int store_file(const QString &file, ManifestEntry &entry);
+
+        int read_manifest(const QString &snapshot, std::vector<ManifestEntry> &entries) const;
+
+        int write_manifest(const QString &snapshot,
+                           const std::vector<ManifestEntry> &entries) const;
+
+        /*!
+         * \brief Removes a snapshot's manifest and drops its references from the index.
+         * The caller holds the lock, logs the changes and then deletes the garbage.
+         * \param Snapshot name.
+         * \param Receives the chunks that no longer have any references.
+         * \param Receives the change in references by chunk.
+         * \return 0 for success, -1 for failure.
+         */
+        int drop_snapshot(const QString &snapshot, QList<QByteArray> &garbage,
+                          QHash<QByteArray, qint32> &deltas);
+};
+
+#endif // CHUNKSTORE_H
@@ -0,0 +1,1528 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "cli.h"
+#include "archivereader.h"
+#include "blockcompressor.h"
+#include "changejournal.h"
+#include "chunkstore.h"
+#include "daemon.h"
+#include "deltacopy.h"
+#include "fanoutcopy.h"
+#include "fileindex.h"
+#include "runhistory.h"
+#include "runmonitor.h"
+#include "shardedrsync.h"
+#include "snapshotset.h"
+#include "tarwriter.h"
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QMap>
+#include <QProcess>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QTime>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <unistd.h>
+
+static const QStringList backupTypeNames = {"incremental", "incremental-no-delta", "full",
+                                            "full-no-delta", "native", "repository",
+                                            "snapshot"};
+static const QStringList deleteTypeNames = {"during", "after", "before"};
+static const QStringList compressionTypeNames = {"none", "tar", "gz", "bz2", "xz", "zstd"};
+static const QStringList ioClassNames = {"default", "realtime", "best-effort", "idle"};
+static const QStringList dayNames = {"mon", "tue", "wed", "thu", "fri", "sat", "sun"};
+
+/*!
+ * \brief Reads "--source path" options, each followed by its "--exclude pattern"s.
+ * QCommandLineParser would lose which source an exclude follows.
+ * \param Options before "--".
+ * \param Receives the sources.
+ * \param Receives the value of every other option, by name without the dashes.
+ * \return Reason the options are invalid, empty if they are not.
+ */
+static QString parse_sources(const QStringList &options, JobSources &sources,
+                             QMap<QString, QString> &values)
+{
+        for (int i = 0; i < options.size(); i += 2) {
+                if (i + 1 >= options.size() || !options[i].startsWith("--"))
+                        return "Missing value for " + options[i] + ".";
+                QString value = options[i + 1];
+                if (options[i] == "--source")
+                        sources.append({value, QStringList()});
+                else if (options[i] == "--exclude" && !sources.isEmpty())
+                        sources.last().excludes.append(value);
+                else if (options[i] == "--exclude")
+                        return "--exclude must follow a --source.";
+                else
+                        values[options[i].mid(2)] = value;
+        }
+        return sources.isEmpty() ? "At least one --source is needed." : "";
+}
+
+Cli::Cli(Manager &manager) : manager(manager)
+{
+}
+
+int Cli::execute(const QStringList &args, QTextStream &out)
+{
+        QJsonObject result;
+        int status = 2;
+        QString command = args.value(0);
+        QStringList rest = args.mid(1);
+
+        if (command == "list") {
+                status = list_jobs(result);
+        } else if (command == "status") {
+                status = 0;
+                if (rest.isEmpty()) {
+                        for (const auto &name : manager.get_job_names())
+                                rest.append(QString::fromStdString(name));
+                }
+                QJsonArray arr;
+                for (const auto &name : rest) {
+                        QJsonObject job;
+                        if (show_status(name, job) != 0)
+                                status = 1;
+                        arr.append(job);
+                }
+                result["Jobs"] = arr;
+        } else if (command == "add" || command == "update") {
+                status = save_job(command, rest, result);
+        } else if (command == "enable" || command == "disable" || command == "run"
+                   || command == "delete") {
+                if (rest.isEmpty())
+                        result["Error"] = command + " requires at least one job name.";
+                else
+                        status = run_named(command, rest, result);
+        } else if (command == "catalog" || command == "export" || command == "import") {
+                status = run_catalog(command, rest, result);
+        } else if (command == "queue") {
+                result["Error"] = "The daemon is not running, so runs are not queued.";
+                status = 1;
+        } else if (command == "history") {
+                status = show_history(rest, result);
+        } else if (command == "exec") {
+                status = run_exec(rest, out, result);
+        } else if (command == "shard") {
+                status = run_shards(rest, out, result);
+        } else if (command == "sources") {
+                status = run_sources(rest, out, result);
+        } else if (command == "fanout") {
+                status = run_fanout(rest, out, result);
+        } else if (command == "indexed") {
+                status = run_indexed(rest, out, result);
+        } else if (command == "snapshot") {
+                status = run_snapshot(rest, out, result);
+        } else if (command == "set-snapshots") {
+                if (rest.isEmpty() || manager.set_snapshots(rest[0], rest.mid(1)) != 0)
+                        result["Error"] = "Job not found.";
+                else
+                        status = manager.save_jobs() == 0 ? 0 : 1;
+        } else if (command == "copy" || command == "compare-copy") {
+                status = run_copy(command, rest, out, result);
+        } else if (command == "archive") {
+                status = run_archive(rest, result);
+        } else if (command == "extract") {
+                status = run_extract(rest, result);
+        } else if (command == "restore") {
+                status = run_restore(rest, out, result);
+        } else if (command.startsWith("repo-")) {
+                status = run_repository(command, rest, out, result);
+        } else {
+                result["Error"] = "Unknown command \"" + command + "\".\n" + usage();
+        }
+
+        result["Ok"] = status == 0;
+        out << QJsonDocument(result).toJson(QJsonDocument::Compact) << "\n";
+        out.flush();
+        return status;
+}
+
+QString Cli::usage()
+{
+        return "Usage: rbackup <command> [options]\n"
+               "  list                      List all jobs.\n"
+               "  status [name...]          Show the jobs and the state of their services.\n"
+               "  add <name> [options]      Add a job.\n"
+               "  update <name> [options]   Update a job.\n"
+               "  enable <name...>          Enable the jobs' timers.\n"
+               "  disable <name...>         Disable the jobs' timers.\n"
+               "  run <name...>             Start the jobs now.\n"
+               "  delete <name...>          Delete the jobs and their units.\n"
+               "  catalog --format json|binary\n"
+               "                            Rewrite the job catalog in the given format.\n"
+               "  export <file>             Write every job to a JSON file.\n"
+               "  import <file>             Add or update the jobs in a JSON file.\n"
+               "  daemon [--socket path] [--watch] [--rotational-slots N] [--slots N]\n"
+               "                            Serve commands on a local socket and queue runs\n"
+               "                            by disk, optionally journaling changes to\n"
+               "                            indexed jobs' sources.\n"
+               "  queue                     Show the runs holding and waiting for disks.\n"
+               "  history <name> [--last N] List a job's recorded runs and their trend.\n"
+               "  exec [--job name] [--history file] <script>\n"
+               "                            Run a job's script once the daemon's queue frees\n"
+               "                            its disks, passing rsync's progress on once a\n"
+               "                            second as whole lines, and record the run.\n"
+               "  shard --shards N --workers N -- <rsync command>\n"
+               "                            Run an rsync command as parallel shards.\n"
+               "  sources --workers N {--source <path> [--exclude pattern...]}...\n"
+               "          -- <rsync options> <dest>\n"
+               "                            Run one rsync per source, N at a time.\n"
+               "  fanout [--buffer MiB] [--delete yes] [--update yes]\n"
+               "         {--source <path> [--exclude pattern...]}... -- <dest...>\n"
+               "                            Copy the sources to every destination, reading\n"
+               "                            them once.\n"
+               "  indexed --index <file> [--threads N] [--journal file] -- <rsync command>\n"
+               "                            Run rsync on what changed since the last run.\n"
+               "  snapshot [--keep N] [--job name] -- <rsync command>\n"
+               "                            Copy into a new dated snapshot, hard linking\n"
+               "                            unchanged files to the previous one.\n"
+               "  copy [--threads N] <src> <dest>\n"
+               "                            Copy with the built in delta engine.\n"
+               "  compare-copy [--threads N] <src> <rsync dest> <native dest>\n"
+               "                            Time rsync -a against the built in engine.\n"
+               "  repo-backup [--keep N] <repo> <job> <src>\n"
+               "                            Store a snapshot in a deduplicating repository.\n"
+               "  repo-list <repo> [job]    List the snapshots in a repository.\n"
+               "  repo-restore <repo> <snapshot> <target> [path...]\n"
+               "                            Restore a snapshot, or only the given paths.\n"
+               "  repo-forget <repo> <snapshot>\n"
+               "                            Remove a snapshot and its unused chunks.\n"
+               "  repo-gc <repo>            Recount references and delete unused chunks.\n"
+               "  archive --format tar|gz|bz2|xz|zstd [--threads N] [--memory MiB]\n"
+               "          [--level N] [--long] [--seekable] [--mirror dir] <archive> <path...>\n"
+               "                            Write a tar archive, compressed on every core,\n"
+               "                            optionally updating a copy in the same pass.\n"
+               "  extract [--threads N] [--list] <archive> <target> [path...]\n"
+               "                            Restore a seekable archive, or only the given\n"
+               "                            paths, decompressing just the blocks they are in.\n"
+               "  restore [--snapshot name] [--archive file] [--workers N] <name> <target>\n"
+               "          [path...]         Restore a job's backup, or only the given paths,\n"
+               "                            with N rsync processes or blocks at once.\n"
+               "Job options: --src (repeat for more sources), --exclude [source:]pattern,\n"
+               "  --dest (repeat to fan out to more), --command, --time HH:mm:ss,\n"
+               "  --days Mon,Tue,..., --recurring yes|no,\n"
+               "  --backup-type " + backupTypeNames.join('|') + ",\n"
+               "  --delete " + deleteTypeNames.join('|') + ", --compression "
+               + compressionTypeNames.join('|') + ",\n"
+               "  --transfer-compression yes|no, --shards N, --workers N, --keep N,\n"
+               "  --compression-threads N, --compression-memory MiB, --stream-archive yes|no,\n"
+               "  --archive-mirror yes|no, --seekable-archive yes|no, --zstd-level N,\n"
+               "  --zstd-long yes|no, --file-index yes|no,\n"
+               "  --stagger-window minutes, --io-weight N, --read-bandwidth MiB/s,\n"
+               "  --write-bandwidth MiB/s, --cpu-weight N, --cpu-quota percent, --nice N,\n"
+               "  --io-class " + ioClassNames.join('|') + ", --bwlimit KiB/s,\n"
+               "  --pressure-target percent, --latency-target ms, --json <file|->\n";
+}
+
+int Cli::list_jobs(QJsonObject &result)
+{
+        std::list<std::string> names = manager.get_job_names();
+        names.sort();
+        QJsonArray arr;
+        for (const auto &name : names) {
+                const BackupJob &job = manager.get_job(name);
+                QJsonObject obj;
+                obj["Name"] = job.get_name();
+                obj["Src"] = job.get_src();
+                if (job.get_sources().size() > 1)
+                        obj["Sources"] = job.get_sources().size();
+                obj["Dst"] = job.get_dest();
+                obj["Enabled"] = job.is_enabled();
+                obj["Recurring"] = job.get_flags().recurring;
+                arr.append(obj);
+        }
+        result["Jobs"] = arr;
+        return 0;
+}
+
+int Cli::show_status(const QString &name, QJsonObject &result)
+{
+        result["Name"] = name;
+        if (!manager.has_job(name)) {
+                result["Error"] = "Job not found.";
+                return 1;
+        }
+        result["Job"] = manager.job_to_json(manager.get_job(name.toStdString()));
+        result["ActiveState"] = manager.get_job_status(name);
+        return 0;
+}
+
+int Cli::save_job(const QString &command, const QStringList &args, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addPositionalArgument("name", "Name of the job.");
+        parser.addOptions({
+                {"src", "Source directory, repeated for more sources.", "path"},
+                {"exclude", "rsync pattern left out of every source, or of one as source:pattern.",
+                 "pattern"},
+                {"dest", "Destination directory, repeated to write several at once.", "path"},
+                {"command", "Backup command, generated from the options when omitted.",
+                 "command"},
+                {"time", "Time to run, HH:mm:ss.", "time"},
+                {"days", "Comma separated days to run.", "days"},
+                {"recurring", "Whether a timer is created.", "yes|no"},
+                {"backup-type", "Type of backup.", "type"},
+                {"delete", "When to delete files.", "when"},
+                {"compression", "Compression of the backup.", "type"},
+                {"transfer-compression", "Compress during transfer.", "yes|no"},
+                {"shards", "Number of shards to split the source into.", "count"},
+                {"workers", "Number of shards or sources to run at once.", "count"},
+                {"keep", "Number of snapshots to keep, 0 for all.", "count"},
+                {"compression-threads", "Threads compressing the archive, 0 for all cores.",
+                 "count"},
+                {"compression-memory", "Memory budget of the compression in MiB, 0 for none.",
+                 "MiB"},
+                {"stream-archive", "Archive straight from the source in one pass.", "yes|no"},
+                {"archive-mirror", "Also keep a copy during a single pass archive.", "yes|no"},
+                {"seekable-archive", "Index the archive so single files restore quickly.",
+                 "yes|no"},
+                {"zstd-level", "zstd compression level, 0 for the default.", "level"},
+                {"zstd-long", "Use zstd's 128 MiB long distance window.", "yes|no"},
+                {"file-index", "Keep a metadata index and copy only what changed.", "yes|no"},
+                {"stagger-window", "Spread the start over this many minutes.", "minutes"},
+                {"io-weight", "systemd IOWeight, 1 to 10000, 0 for the default.", "weight"},
+                {"read-bandwidth", "Most read from the source's disk, 0 for no limit.", "MiB/s"},
+                {"write-bandwidth", "Most written to the destination's disk.", "MiB/s"},
+                {"cpu-weight", "systemd CPUWeight, 1 to 10000, 0 for the default.", "weight"},
+                {"cpu-quota", "Percent of one core, 0 for no limit.", "percent"},
+                {"nice", "Nice level, -20 to 19.", "level"},
+                {"io-class", "I/O scheduling class.", ioClassNames.join('|')},
+                {"bwlimit", "rsync --bwlimit, 0 for no limit.", "KiB/s"},
+                {"pressure-target", "Throttle above this percent of stalled time.", "percent"},
+                {"latency-target", "Throttle above this destination latency.", "ms"},
+                {"json-text", "Job as JSON, filled in from --json by the caller.", "json"},
+        });
+        if (!parser.parse(QStringList{"rbackup " + command} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+
+        BackupJob base;
+        QString name = parser.positionalArguments().value(0);
+        QByteArray text = parser.value("json-text").toUtf8();
+        if (!text.isEmpty()) {
+                QJsonParseError err;
+                QJsonDocument doc = QJsonDocument::fromJson(text, &err);
+                if (err.error != QJsonParseError::NoError || !doc.isObject()) {
+                        result["Error"] = "Invalid job JSON: " + err.errorString();
+                        return 1;
+                }
+                QJsonObject obj = doc.object();
+                if (name.isEmpty())
+                        name = obj["Name"].toString();
+                obj["Name"] = name;
+                base = manager.job_from_json(obj);
+        } else if (command == "update") {
+                if (!manager.has_job(name)) {
+                        result["Error"] = "Job not found.";
+                        return 1;
+                }
+                base = manager.get_job(name.toStdString());
+        } else {
+                JobFlags flags = JobFlags();
+                flags.recurring = true;
+                flags.shards = 1;
+                flags.workers = 1;
+                base = BackupJob(name, "", "", "", Days(), flags, "00:00:00");
+        }
+
+        if (name.isEmpty() || name.contains(' ') || name.contains('/')) {
+                result["Error"] = "Invalid job name. Cannot contain spaces or special characters";
+                return 2;
+        }
+
+        QString error;
+        BackupJob job = apply_options(parser, base, error);
+        if (!error.isEmpty()) {
+                result["Error"] = error;
+                return 2;
+        }
+        if (job.get_src().isEmpty() || job.get_dest().isEmpty()) {
+                result["Error"] = "A job needs both --src and --dest.";
+                return 2;
+        }
+
+        int status = command == "add" ? manager.add_new_job(job) : manager.update_job(job);
+        if (status != 0) {
+                result["Error"] = "Unable to " + command + " job.";
+                return 1;
+        }
+        manager.save_jobs();
+        result["Job"] = manager.job_to_json(job);
+        return 0;
+}
+
+BackupJob Cli::apply_options(const QCommandLineParser &parser, const BackupJob &job,
+                             QString &error) const
+{
+        JobSources sources = job.get_sources();
+        QStringList dests = job.get_dests();
+        if (parser.isSet("dest")) {
+                dests = parser.values("dest");
+                dests.removeDuplicates();
+        }
+        QString time = job.get_time();
+        Days days = job.get_days();
+        JobFlags flags = job.get_flags();
+        bool regenerate = parser.isSet("src") || parser.isSet("dest") || job.get_command() == "";
+
+        if (parser.isSet("time")) {
+                QTime parsed = QTime::fromString(parser.value("time"));
+                if (!parsed.isValid())
+                        error = "Invalid --time, expected HH:mm:ss.";
+                time = parsed.toString();
+        }
+        if (parser.isSet("days")) {
+                days = Days();
+                for (const auto &day : parser.value("days").split(',')) {
+                        int index = dayNames.indexOf(day.trimmed().left(3).toLower());
+                        if (day.trimmed().isEmpty())
+                                continue;
+                        if (index < 0)
+                                error = "Invalid day \"" + day + "\".";
+                        else
+                                days[index] = true;
+                }
+        }
+        if (parser.isSet("recurring"))
+                flags.recurring = parser.value("recurring") == "yes";
+        if (parser.isSet("transfer-compression")) {
+                flags.transferCompression = parser.value("transfer-compression") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("backup-type")) {
+                int index = backupTypeNames.indexOf(parser.value("backup-type"));
+                if (index < 0)
+                        error = "Invalid --backup-type.";
+                else
+                        flags.backupType = (BackupType)index;
+                flags.delta = index == INCREMENTAL_NO_D || index == FULL_NO_D;
+                regenerate = true;
+        }
+        if (parser.isSet("delete")) {
+                int index = deleteTypeNames.indexOf(parser.value("delete"));
+                if (index < 0)
+                        error = "Invalid --delete.";
+                else
+                        flags.deleteType = (DeleteType)index;
+                regenerate = true;
+        }
+        if (parser.isSet("compression")) {
+                int index = compressionTypeNames.indexOf(parser.value("compression"));
+                if (index < 0)
+                        error = "Invalid --compression.";
+                else
+                        flags.compType = (CompressionType)index;
+                flags.backupCompression = flags.compType != NONE;
+                regenerate = true;
+        }
+
+        if (parser.isSet("shards")) {
+                flags.shards = std::max(parser.value("shards").toInt(), 1);
+                regenerate = true;
+        }
+        if (parser.isSet("workers")) {
+                flags.workers = std::max(parser.value("workers").toInt(), 1);
+                regenerate = true;
+        }
+        if (parser.isSet("compression-threads")) {
+                flags.compressionThreads = std::max(parser.value("compression-threads").toInt(), 0);
+                regenerate = true;
+        }
+        if (parser.isSet("compression-memory")) {
+                flags.compressionMemory = std::max(parser.value("compression-memory").toInt(), 0);
+                regenerate = true;
+        }
+        if (parser.isSet("stream-archive")) {
+                flags.streamArchive = parser.value("stream-archive") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("archive-mirror")) {
+                flags.archiveMirror = parser.value("archive-mirror") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("seekable-archive")) {
+                flags.seekableArchive = parser.value("seekable-archive") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("zstd-level")) {
+                flags.zstdLevel = std::min(std::max(parser.value("zstd-level").toInt(), 0), 22);
+                regenerate = true;
+        }
+        if (parser.isSet("zstd-long")) {
+                flags.zstdLongWindow = parser.value("zstd-long") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("file-index")) {
+                flags.fileIndex = parser.value("file-index") == "yes";
+                regenerate = true;
+        }
+        if (parser.isSet("stagger-window")) {
+                flags.staggerWindow = std::min(std::max(parser.value("stagger-window").toInt(), 0),
+                                               24 * 60);
+        }
+        if (parser.isSet("io-weight")) {
+                flags.ioWeight = std::min(std::max(parser.value("io-weight").toInt(), 0), 10000);
+        }
+        if (parser.isSet("read-bandwidth")) {
+                flags.readBandwidth = std::max(parser.value("read-bandwidth").toInt(), 0);
+        }
+        if (parser.isSet("write-bandwidth")) {
+                flags.writeBandwidth = std::max(parser.value("write-bandwidth").toInt(), 0);
+        }
+        if (parser.isSet("cpu-weight")) {
+                flags.cpuWeight = std::min(std::max(parser.value("cpu-weight").toInt(), 0), 10000);
+        }
+        if (parser.isSet("cpu-quota")) {
+                flags.cpuQuota = std::max(parser.value("cpu-quota").toInt(), 0);
+        }
+        if (parser.isSet("nice")) {
+                flags.nice = std::min(std::max(parser.value("nice").toInt(), -20), 19);
+        }
+        if (parser.isSet("io-class")) {
+                int index = ioClassNames.indexOf(parser.value("io-class"));
+                if (index < 0)
+                        error = "Invalid --io-class.";
+                else
+                        flags.ioClass = (IOSchedulingClass)index;
+        }
+        if (parser.isSet("pressure-target")) {
+                flags.pressureTarget =
+                        std::min(std::max(parser.value("pressure-target").toInt(), 0), 100);
+        }
+        if (parser.isSet("latency-target")) {
+                flags.latencyTarget = std::max(parser.value("latency-target").toInt(), 0);
+        }
+        if (parser.isSet("src")) {
+                // Sources that stay keep their excludes.
+                JobSources old = sources;
+                sources.clear();
+                for (const auto &path : parser.values("src")) {
+                        QStringList excludes;
+                        for (const auto &source : old) {
+                                if (source.path == path)
+                                        excludes = source.excludes;
+                        }
+                        BackupJob::add_source(sources, path, excludes);
+                }
+        }
+        if (parser.isSet("exclude")) {
+                for (auto &source : sources)
+                        source.excludes.clear();
+                for (const auto &exclude : parser.values("exclude")) {
+                        // The longest source the pattern starts with, so /srv/a wins over /srv.
+                        JobSource *target = nullptr;
+                        for (auto &source : sources) {
+                                if (exclude.startsWith(source.path + ":")
+                                    && (target == nullptr
+                                        || source.path.size() > target->path.size()))
+                                        target = &source;
+                        }
+                        for (auto &source : sources) {
+                                if (target == nullptr)
+                                        source.excludes.append(exclude);
+                                else if (&source == target)
+                                        source.excludes.append(
+                                                exclude.mid(source.path.size() + 1));
+                        }
+                }
+                regenerate = true;
+        }
+        bool excluded = std::any_of(sources.begin(), sources.end(), [](const JobSource &source) {
+                return !source.excludes.isEmpty();
+        });
+        if (parser.isSet("bwlimit")) {
+                flags.bwLimit = std::max(parser.value("bwlimit").toInt(), 0);
+                regenerate = true;
+        }
+        if (dests.size() > 1 && flags.backupType >= NATIVE)
+                error = "More than one --dest needs an rsync backup type.";
+        else if (dests.size() > 1 && (flags.transferCompression || flags.bwLimit > 0))
+                error = "More than one --dest can not be combined with --transfer-compression "
+                        "or --bwlimit.";
+        else if (sources.size() > 1 && flags.backupType >= NATIVE)
+                error = "More than one --src needs an rsync backup type.";
+        else if (excluded && (flags.backupType == NATIVE || flags.backupType == REPOSITORY))
+                error = "--exclude needs an rsync or snapshot backup type.";
+        if (parser.isSet("keep")) {
+                flags.keep = std::max(parser.value("keep").toInt(), 0);
+                regenerate = true;
+        }
+
+        BackupJob out(job.get_name(), dests, sources, job.get_command(), days, flags, time,
+                      job.is_enabled());
+        QString command = job.get_command();
+        if (parser.isSet("command"))
+                command = parser.value("command");
+        else if (regenerate && error.isEmpty())
+                command = out.generate_command();
+        return BackupJob(job.get_name(), dests, sources, command, days, flags, time,
+                         job.is_enabled());
+}
+
+int Cli::run_named(const QString &command, const QStringList &names, QJsonObject &result)
+{
+        int status = 0;
+        QJsonArray arr;
+        // Enabling and disabling go to systemd in one call for all of the jobs.
+        std::map<QString, QString> errors;
+        if (command == "enable")
+                manager.enable_jobs(names, errors);
+        else if (command == "disable")
+                manager.disable_jobs(names, errors);
+        for (const auto &name : names) {
+                QJsonObject obj;
+                int jobStatus = -1;
+                obj["Name"] = name;
+                if (!manager.has_job(name))
+                        obj["Error"] = "Job not found.";
+                else if (command == "enable" || command == "disable")
+                        jobStatus = errors[name].isEmpty() ? 0 : -1;
+                else if (command == "run")
+                        jobStatus = manager.run_job(name);
+                else if (command == "delete")
+                        jobStatus = manager.delete_job(name);
+                obj["Ok"] = jobStatus == 0;
+                if (jobStatus != 0 && !errors[name].isEmpty())
+                        obj["Error"] = errors[name];
+                if (jobStatus != 0)
+                        status = 1;
+                arr.append(obj);
+        }
+        if (command == "enable" || command == "disable")
+                manager.save_jobs();
+        result["Results"] = arr;
+        return status;
+}
+
+int Cli::run_catalog(const QString &command, const QStringList &args, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOption({"format", "Catalog format.", "json|binary"});
+        if (!parser.parse(QStringList{"rbackup " + command} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        QStringList files = parser.positionalArguments();
+
+        if (command == "catalog") {
+                QString format = parser.value("format");
+                if (format != "json" && format != "binary") {
+                        result["Error"] = "--format must be json or binary.";
+                        return 2;
+                }
+                result["Jobs"] = (int)manager.get_job_names().size();
+                return manager.set_catalog_format(format == "binary") == 0 ? 0 : 1;
+        }
+        if (files.size() != 1) {
+                result["Error"] = command + " takes one file.";
+                return 2;
+        }
+
+        QFile file(files[0]);
+        if (command == "export") {
+                QJsonArray arr;
+                for (const auto &name : manager.get_job_names())
+                        arr.append(manager.job_to_json(manager.get_job(name)));
+                QJsonObject obj;
+                obj["jobs"] = arr;
+                if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)
+                    || file.write(QJsonDocument(obj).toJson()) < 0) {
+                        result["Error"] = "Unable to write " + files[0] + ".";
+                        return 1;
+                }
+                result["Jobs"] = arr.size();
+                return 0;
+        }
+
+        QJsonParseError err;
+        QJsonDocument doc;
+        if (file.open(QIODevice::ReadOnly))
+                doc = QJsonDocument::fromJson(file.readAll(), &err);
+        if (!file.isOpen() || err.error != QJsonParseError::NoError) {
+                result["Error"] = "Unable to read " + files[0] + ".";
+                return 1;
+        }
+        int count = 0;
+        for (const auto &value : doc.object()["jobs"].toArray()) {
+                BackupJob job = manager.job_from_json(value.toObject());
+                if (job.get_name().isEmpty())
+                        continue;
+                int status = manager.has_job(job.get_name()) ? manager.update_job(job)
+                                                             : manager.add_new_job(job);
+                if (status == 0)
+                        count++;
+        }
+        result["Jobs"] = count;
+        return manager.save_jobs() == 0 ? 0 : 1;
+}
+
+int Cli::run_exec(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"history", "History file the run is appended to.", "file"},
+                {"job", "Job whose disks are queued for in the daemon.", "name"},
+        });
+        if (!parser.parse(QStringList{"rbackup exec"} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        if (parser.positionalArguments().isEmpty()) {
+                result["Error"] = "exec needs a script.";
+                return 2;
+        }
+
+        // Held until the script is done; without a daemon the run starts right away.
+        std::unique_ptr<QLocalSocket> devices;
+        if (parser.isSet("job")) {
+                QJsonObject queued;
+                devices = Daemon::acquire(get_daemon_socket(), parser.value("job"), queued);
+                if (devices) {
+                        result["Devices"] = queued["Devices"];
+                        result["QueueSeconds"] = queued["WaitSeconds"];
+                }
+        }
+
+        RunRecord record;
+        record.queuedSeconds = (int32_t)result["QueueSeconds"].toDouble();
+        record.start = QDateTime::currentMSecsSinceEpoch();
+        QProcess script;
+        script.setProcessChannelMode(QProcess::MergedChannels);
+        script.start("sh", parser.positionalArguments());
+        if (!script.waitForStarted(-1)) {
+                result["Error"] = "Unable to start " + parser.positionalArguments()[0] + ".";
+                return 1;
+        }
+
+        // The executors print rsync style statistics and a line of JSON; plain rsync
+        // prints its own with --stats.
+        RsyncStats stats;
+        qint64 scanned = 0;
+        qint64 archived = 0;
+        qint64 compressed = 0;
+        auto write_line = [&](const QString &line) {
+                out << line << "\n";
+                out.flush();
+                ShardedRsync::parse_stats(line, stats);
+                if (!line.startsWith('{'))
+                        return;
+                QJsonObject json = QJsonDocument::fromJson(line.toUtf8()).object();
+                scanned += json["Scanned"].toVariant().toLongLong();
+                archived += json["Bytes"].toVariant().toLongLong();
+                compressed += json["CompressedBytes"].toVariant().toLongLong();
+        };
+
+        // rsync redraws its progress line with \r, which the journal would only see
+        // as one line at the end of the run.
+        QByteArray pending;
+        QString latest;
+        QElapsedTimer shown;
+        bool running = true;
+        while (running) {
+                running = script.waitForReadyRead(-1);
+                pending += script.readAll();
+                for (int end = 0; end < pending.size();) {
+                        if (pending[end] != '\r' && pending[end] != '\n') {
+                                end++;
+                                continue;
+                        }
+                        QString line = QString::fromLocal8Bit(pending.left(end)).trimmed();
+                        pending.remove(0, end + 1);
+                        end = 0;
+                        if (line.isEmpty())
+                                continue;
+                        RunProgress progress;
+                        if (RunMonitor::parse_progress(line, progress)) {
+                                latest = line;
+                                if (shown.isValid() && shown.elapsed() < 1000)
+                                        continue;
+                                shown.start();
+                                latest.clear();
+                        }
+                        write_line(line);
+                }
+        }
+        if (!latest.isEmpty())
+                write_line(latest);
+        if (!pending.trimmed().isEmpty())
+                write_line(QString::fromLocal8Bit(pending).trimmed());
+
+        script.waitForFinished(-1);
+        int code = script.exitStatus() == QProcess::NormalExit ? script.exitCode() : -1;
+        result["ExitCode"] = code;
+
+        record.end = QDateTime::currentMSecsSinceEpoch();
+        record.exitCode = code;
+        record.filesScanned = std::max(stats.files, scanned);
+        record.filesTransferred = stats.filesTransferred;
+        record.bytesRead = stats.transferredSize + archived;
+        record.bytesWritten = stats.transferredSize + compressed;
+        record.compressionRatio = compressed > 0 ? (double)archived / compressed : 0;
+        if (parser.isSet("history")
+            && RunHistory(parser.value("history").toStdString()).append(record) != 0)
+                result["HistoryError"] = "Unable to record the run.";
+        return code == 0 ? 0 : 1;
+}
+
+int Cli::show_history(const QStringList &args, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"last", "Number of most recent runs to show, 0 for all.", "count", "0"},
+        });
+        if (!parser.parse(QStringList{"rbackup history"} + args)
+            || parser.positionalArguments().size() != 1) {
+                result["Error"] = parser.errorText().isEmpty() ? "history needs a job name."
+                                                              : parser.errorText();
+                return 2;
+        }
+        QString name = parser.positionalArguments()[0];
+        if (!manager.has_job(name)) {
+                result["Error"] = "Job not found.";
+                return 1;
+        }
+
+        std::vector<RunRecord> records;
+        RunHistory(manager.get_history_path(name).toStdString())
+                .read(records, parser.value("last").toUInt());
+        QJsonArray runs;
+        for (const auto &record : records) {
+                QJsonObject run;
+                run["Start"] = QDateTime::fromMSecsSinceEpoch(record.start).toString(Qt::ISODate);
+                run["Seconds"] = (record.end - record.start) / 1000.0;
+                run["ExitCode"] = record.exitCode;
+                run["QueuedSeconds"] = record.queuedSeconds;
+                run["FilesScanned"] = (qint64)record.filesScanned;
+                run["FilesTransferred"] = (qint64)record.filesTransferred;
+                run["BytesRead"] = (qint64)record.bytesRead;
+                run["BytesWritten"] = (qint64)record.bytesWritten;
+                if (record.compressionRatio > 0)
+                        run["CompressionRatio"] = record.compressionRatio;
+                runs.append(run);
+        }
+        result["Runs"] = runs;
+
+        RunTrend trend = RunHistory::trend(records);
+        QJsonObject summary;
+        summary["Failures"] = (qint64)trend.failures;
+        summary["MeanSeconds"] = trend.meanDuration;
+        summary["MeanBytesPerSecond"] = trend.meanThroughput;
+        summary["RecentBytesPerSecond"] = trend.recentThroughput;
+        summary["ThroughputChange"] = trend.change;
+        result["Trend"] = summary;
+        return 0;
+}
+
+int Cli::run_shards(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        int separator = args.indexOf("--");
+        QStringList command = args.mid(separator + 1);
+        if (separator < 0 || command.size() < 3) {
+                result["Error"] = "shard needs an rsync command after --.";
+                return 2;
+        }
+
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"shards", "Number of shards to split the source into.", "count"},
+                {"workers", "Number of shards to run at once.", "count"},
+        });
+        if (!parser.parse(QStringList{"rbackup shard"} + args.mid(0, separator))) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+
+        ShardedRsync sharded(command, parser.value("shards").toInt(),
+                             parser.value("workers").toInt());
+        int status = sharded.run();
+        out << ShardedRsync::format_stats(sharded.get_stats());
+
+        QJsonArray codes;
+        for (int code : sharded.get_exit_codes())
+                codes.append(code);
+        result["ExitCodes"] = codes;
+        result["ExitCode"] = status;
+        return status == 0 ? 0 : 1;
+}
+
+int Cli::run_sources(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        int separator = args.indexOf("--");
+        QStringList command = args.mid(separator + 1);
+        if (separator < 0 || command.size() < 2) {
+                result["Error"] = "sources needs rsync options and a destination after --.";
+                return 2;
+        }
+
+        JobSources sources;
+        QMap<QString, QString> values;
+        QString error = parse_sources(args.mid(0, separator), sources, values);
+        for (const auto &name : values.keys()) {
+                if (name != "workers")
+                        error = "Unexpected option --" + name + ".";
+        }
+        if (!error.isEmpty()) {
+                result["Error"] = error;
+                return 2;
+        }
+        int workers = values.value("workers", "1").toInt();
+
+        // --relative keeps each source's full path, so sources with the same name do not
+        // overwrite each other and each rsync only deletes inside its own source.
+        QStringList rsyncOptions = command.mid(1, command.size() - 2);
+        std::vector<QStringList> lists;
+        for (const auto &source : sources) {
+                QStringList list = rsyncOptions + QStringList{"--relative", "--stats"};
+                for (const auto &exclude : source.excludes)
+                        list.append("--exclude=" + exclude);
+                lists.push_back(list + QStringList{source.path, command.last()});
+        }
+        RsyncStats stats;
+        std::vector<int> codes = ShardedRsync::run_all(command.first(), lists, workers, stats);
+        out << ShardedRsync::format_stats(stats);
+
+        QJsonArray exitCodes;
+        int status = 0;
+        for (int code : codes) {
+                exitCodes.append(code);
+                if (status == 0)
+                        status = code;
+        }
+        result["ExitCodes"] = exitCodes;
+        result["ExitCode"] = status;
+        return status == 0 ? 0 : 1;
+}
+
+int Cli::run_fanout(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        int separator = args.indexOf("--");
+        QStringList dests = args.mid(separator + 1);
+        if (separator < 0 || dests.isEmpty()) {
+                result["Error"] = "fanout needs the destinations after --.";
+                return 2;
+        }
+        JobSources sources;
+        QMap<QString, QString> values;
+        QString error = parse_sources(args.mid(0, separator), sources, values);
+        for (const auto &name : values.keys()) {
+                if (name != "buffer" && name != "delete" && name != "update")
+                        error = "Unexpected option --" + name + ".";
+        }
+        if (!error.isEmpty()) {
+                result["Error"] = error;
+                return 2;
+        }
+
+        std::vector<std::string> paths;
+        for (const auto &dest : dests)
+                paths.push_back(dest.toStdString());
+        size_t buffer = (size_t)std::max(values.value("buffer", "64").toInt(), 1) << 20;
+        FanoutCopy copy(paths, buffer);
+        // Like "rbackup sources", more than one source keeps the full paths apart.
+        copy.set_relative(sources.size() > 1);
+        copy.set_delete(values.value("delete") == "yes");
+        copy.set_update(values.value("update") == "yes");
+        for (const auto &source : sources) {
+                std::vector<std::string> excludes;
+                for (const auto &exclude : source.excludes)
+                        excludes.push_back(exclude.toStdString());
+                copy.add(source.path.toStdString(), excludes);
+        }
+        int status = copy.finish();
+
+        FanoutStats stats = copy.get_stats();
+        RsyncStats summary;
+        summary.files = stats.filesScanned;
+        summary.filesTransferred = stats.filesRead;
+        summary.totalSize = stats.totalSize;
+        summary.transferredSize = stats.bytesRead;
+        out << ShardedRsync::format_stats(summary);
+
+        QJsonArray written;
+        for (int i = 0; i < dests.size(); i++) {
+                const MirrorWriter &writer = *copy.get_writers()[i];
+                QJsonObject dest;
+                dest["Path"] = dests[i];
+                dest["FilesWritten"] = (qint64)writer.get_files_written();
+                dest["FilesDeleted"] = (qint64)writer.get_files_deleted();
+                dest["Errors"] = (qint64)writer.get_errors();
+                // Time reading waited on this destination's full queue.
+                dest["WaitSeconds"] = writer.get_wait_seconds();
+                written.append(dest);
+        }
+        result["Destinations"] = written;
+        result["BytesRead"] = (qint64)stats.bytesRead;
+        result["Errors"] = (qint64)stats.errors;
+        return status == 0 ? 0 : 1;
+}
+
+int Cli::run_indexed(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        int separator = args.indexOf("--");
+        QStringList command = args.mid(separator + 1);
+        if (separator < 0 || command.size() < 3) {
+                result["Error"] = "indexed needs an rsync command after --.";
+                return 2;
+        }
+
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"index", "Index file of the job.", "file"},
+                {"threads", "Number of directories to read at once.", "count", "0"},
+                {"journal", "Change journal kept by the daemon.", "file"},
+        });
+        if (!parser.parse(QStringList{"rbackup indexed"} + args.mid(0, separator))
+            || !parser.isSet("index")) {
+                result["Error"] =
+                        parser.isSet("index") ? parser.errorText() : "--index is required.";
+                return 2;
+        }
+
+        FileIndex index(parser.value("index").toStdString());
+        QString src = command[command.size() - 2];
+        int threads = parser.value("threads").toInt();
+        std::unique_ptr<ChangeJournal> journal;
+        std::vector<std::string> journaled;
+        bool complete = false;
+        if (parser.isSet("journal")) {
+                journal = std::make_unique<ChangeJournal>(parser.value("journal").toStdString());
+                complete = journal->take(journaled) == 0;
+        }
+        // Without a complete journal since the last run the whole source is read.
+        int status = complete && index.get_indexed() > 0
+                             ? index.update(src.toStdString(), journaled, threads)
+                             : index.scan(src.toStdString(), threads);
+        if (status != 0) {
+                result["Error"] = "Unable to scan " + src + ".";
+                return 1;
+        }
+        result["Journaled"] = complete ? (qint64)journaled.size() : -1;
+        result["Scanned"] = (qint64)index.get_scanned();
+        result["Changed"] = (qint64)index.get_changed().size();
+        result["Deleted"] = (qint64)index.get_deleted().size();
+
+        RsyncStats stats;
+        int code = 0;
+        if (!index.get_changed().empty() || !index.get_deleted().empty()) {
+                QTemporaryFile list;
+                if (!list.open()) {
+                        result["Error"] = "Unable to create the file list.";
+                        return 1;
+                }
+                for (const auto &path : index.get_changed())
+                        list.write(path.c_str(), path.size() + 1);
+                for (const auto &path : index.get_deleted())
+                        list.write(path.c_str(), path.size() + 1);
+                list.flush();
+
+                // Listed paths that no longer exist are deleted from the destination.
+                QProcess rsync;
+                rsync.setProcessChannelMode(QProcess::MergedChannels);
+                rsync.start(command[0],
+                            command.mid(1, command.size() - 3)
+                                    + QStringList{"--from0", "--files-from=" + list.fileName(),
+                                                  "--delete-missing-args", "--stats",
+                                                  QString::fromStdString(index.get_base()),
+                                                  command.last()});
+                rsync.waitForFinished(-1);
+                QString output = QString::fromLocal8Bit(rsync.readAll());
+                ShardedRsync::parse_stats(output, stats);
+                code = rsync.exitStatus() == QProcess::NormalExit ? rsync.exitCode() : -1;
+                if (code != 0)
+                        out << output;
+        }
+        stats.files = index.get_scanned();
+        out << ShardedRsync::format_stats(stats);
+        result["ExitCode"] = code;
+
+        // Only a successful copy may move the index forward, or changes would be lost.
+        if (code == 0 && index.commit() != 0) {
+                result["Error"] = "Unable to write the index.";
+                return 1;
+        }
+        if (code == 0 && journal)
+                journal->done();
+        return code == 0 ? 0 : 1;
+}
+
+int Cli::run_snapshot(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        int separator = args.indexOf("--");
+        QStringList command = args.mid(separator + 1);
+        if (separator < 0 || command.size() < 3) {
+                result["Error"] = "snapshot needs an rsync command after --.";
+                return 2;
+        }
+
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"keep", "Number of snapshots to keep, 0 for all.", "count", "0"},
+                {"job", "Job whose snapshot list is updated.", "name"},
+        });
+        if (!parser.parse(QStringList{"rbackup snapshot"} + args.mid(0, separator))) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+
+        QString dest = command.last();
+        while (dest.size() > 1 && dest.endsWith('/'))
+                dest.chop(1);
+        SnapshotSet snapshots(dest);
+        QString previous = snapshots.latest();
+        QString target = snapshots.begin();
+        if (target.isEmpty()) {
+                result["Error"] = "Unable to create a snapshot in " + dest + ".";
+                return 1;
+        }
+
+        QStringList options = command.mid(1, command.size() - 3) << "--stats";
+        // rsync resolves a relative --link-dest against the new snapshot, not the cwd.
+        if (!previous.isEmpty())
+                options << "--link-dest=" + QFileInfo(dest).absoluteFilePath() + "/" + previous;
+        QProcess rsync;
+        rsync.setProcessChannelMode(QProcess::MergedChannels);
+        rsync.start(command[0], options << command[command.size() - 2] << target + "/");
+        rsync.waitForFinished(-1);
+        QString output = QString::fromLocal8Bit(rsync.readAll());
+        RsyncStats stats;
+        ShardedRsync::parse_stats(output, stats);
+        int code = rsync.exitStatus() == QProcess::NormalExit ? rsync.exitCode() : -1;
+        out << (code == 0 ? ShardedRsync::format_stats(stats) : output);
+        result["ExitCode"] = code;
+        result["Previous"] = previous;
+        // A failed run stays partial and is continued by the next one.
+        if (code != 0)
+                return 1;
+
+        if (snapshots.commit() != 0) {
+                result["Error"] = "Unable to complete the snapshot.";
+                return 1;
+        }
+        result["Snapshot"] = snapshots.get_name();
+        QStringList pruned = snapshots.prune(parser.value("keep").toInt());
+        result["Pruned"] = QJsonArray::fromStringList(pruned);
+        QStringList list = snapshots.list();
+        result["Snapshots"] = list.size();
+
+        // The daemon owns the job list while it runs, so the update goes through it.
+        if (parser.isSet("job")) {
+                QString none;
+                QTextStream discard(&none);
+                QStringList update = QStringList{"set-snapshots", parser.value("job")} + list;
+                if (Daemon::forward(get_daemon_socket(), update, discard) < 0
+                    && manager.set_snapshots(parser.value("job"), list) == 0)
+                        manager.save_jobs();
+        }
+        return 0;
+}
+
+int Cli::run_copy(const QString &command, const QStringList &args, QTextStream &out,
+                  QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOption({"threads", "Number of files to copy at once.", "count", "0"});
+        parser.addPositionalArgument("src", "Source directory.");
+        parser.addPositionalArgument("dest", "Destination directory.");
+        if (!parser.parse(QStringList{"rbackup " + command} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        QStringList paths = parser.positionalArguments();
+        int needed = command == "copy" ? 2 : 3;
+        if (paths.size() != needed) {
+                result["Error"] = command + " takes " + QString::number(needed) + " paths.";
+                return 2;
+        }
+
+        QElapsedTimer timer;
+        QJsonObject rsync;
+        if (command == "compare-copy") {
+                timer.start();
+                int code = QProcess::execute("rsync", {"-a", paths[0], paths[1]});
+                rsync["Seconds"] = timer.elapsed() / 1000.0;
+                rsync["ExitCode"] = code;
+                result["Rsync"] = rsync;
+        }
+
+        DeltaCopy copy(paths[0].toStdString(), paths.last().toStdString(),
+                       parser.value("threads").toInt());
+        timer.start();
+        int status = copy.run();
+        double seconds = timer.elapsed() / 1000.0;
+        CopyStats stats = copy.get_stats();
+
+        RsyncStats summary;
+        summary.files = stats.filesScanned;
+        summary.filesTransferred = stats.filesCopied;
+        summary.totalSize = stats.totalSize;
+        summary.transferredSize = stats.bytesWritten;
+        out << ShardedRsync::format_stats(summary);
+
+        QJsonObject native;
+        native["Seconds"] = seconds;
+        native["FilesScanned"] = (qint64)stats.filesScanned;
+        native["FilesCopied"] = (qint64)stats.filesCopied;
+        native["BytesRead"] = (qint64)stats.bytesRead;
+        native["BytesMatched"] = (qint64)stats.bytesMatched;
+        native["BytesWritten"] = (qint64)stats.bytesWritten;
+        native["Errors"] = (qint64)stats.errors;
+        result["Native"] = native;
+        if (command == "compare-copy")
+                result["Faster"] = seconds < rsync["Seconds"].toDouble() ? "native" : "rsync";
+        return status == 0 ? 0 : 1;
+}
+
+int Cli::run_repository(const QString &command, const QStringList &args, QTextStream &out,
+                        QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOption({"keep", "Number of the job's snapshots to keep, 0 for all.", "count", "0"});
+        if (!parser.parse(QStringList{"rbackup " + command} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        QStringList paths = parser.positionalArguments();
+        int needed = command == "repo-backup" || command == "repo-restore" ? 3
+                     : command == "repo-forget"                            ? 2
+                                                                           : 1;
+        if (paths.size() < needed) {
+                result["Error"] = command + " takes " + QString::number(needed) + " arguments.";
+                return 2;
+        }
+
+        ChunkStore store(paths[0]);
+        if (command != "repo-backup" && !store.exists()) {
+                result["Error"] = paths[0] + " is not a repository.";
+                return 1;
+        }
+        if (command == "repo-backup") {
+                QString snapshot = store.backup(paths[1], paths[2], parser.value("keep").toInt());
+                RepositoryStats stats = store.get_stats();
+                RsyncStats summary;
+                summary.files = stats.files;
+                summary.filesTransferred = stats.filesChunked;
+                summary.totalSize = stats.totalSize;
+                summary.transferredSize = stats.newBytes;
+                out << ShardedRsync::format_stats(summary);
+                result["Snapshot"] = snapshot;
+                result["Chunks"] = stats.chunks;
+                result["NewChunks"] = stats.newChunks;
+                result["NewBytes"] = stats.newBytes;
+                result["Errors"] = stats.errors;
+                return snapshot.isEmpty() || stats.errors > 0 ? 1 : 0;
+        } else if (command == "repo-list") {
+                result["Snapshots"] = QJsonArray::fromStringList(store.list_snapshots(paths.value(1)));
+                return 0;
+        } else if (command == "repo-restore") {
+                return store.restore(paths[1], paths[2], paths.mid(3)) == 0 ? 0 : 1;
+        } else if (command == "repo-forget") {
+                return store.forget(paths[1]) == 0 ? 0 : 1;
+        } else if (command == "repo-gc") {
+                int deleted = store.collect_garbage();
+                result["Deleted"] = deleted;
+                return deleted < 0 ? 1 : 0;
+        }
+        result["Error"] = "Unknown command \"" + command + "\".";
+        return 2;
+}
+
+int Cli::run_archive(const QStringList &args, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"format", "Archive format.", "tar|gz|bz2|xz|zstd", "gz"},
+                {"threads", "Number of blocks to compress at once, 0 for all cores.", "count",
+                 "0"},
+                {"memory", "Memory budget in MiB, 0 for no limit.", "MiB", "0"},
+                {"mirror", "Directory to keep a copy in while archiving.", "dir"},
+                {"level", "zstd compression level, 0 for the default.", "level", "0"},
+                {"long", "Use zstd's 128 MiB long distance window."},
+                {"seekable", "Compress in independent blocks and index the members."},
+        });
+        if (!parser.parse(QStringList{"rbackup archive"} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        int format = compressionTypeNames.indexOf(parser.value("format"));
+        QStringList paths = parser.positionalArguments();
+        if (format <= NONE) {
+                result["Error"] = "Invalid --format.";
+                return 2;
+        }
+        if (paths.size() < 2) {
+                result["Error"] = "archive takes an archive and at least one path.";
+                return 2;
+        }
+        if (parser.isSet("seekable") && format == TARBALL) {
+                result["Error"] = "--seekable needs a compressed --format.";
+                return 2;
+        }
+
+        // Written next to the archive and renamed, so a failed run never replaces a good one.
+        QString archive = paths.takeFirst();
+        QByteArray partial = (archive + ".part").toLocal8Bit();
+        int fd = open(partial.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                result["Error"] = archive + ": " + strerror(errno);
+                return 1;
+        }
+
+        BlockCompressor compressor(fd, (CompressionType)format, parser.value("threads").toInt(),
+                                   parser.value("memory").toInt(), parser.value("level").toInt(),
+                                   parser.isSet("long"), parser.isSet("seekable"));
+        TarWriter tar(compressor);
+        ArchiveIndex index;
+        if (parser.isSet("seekable"))
+                tar.set_index(&index);
+        std::unique_ptr<MirrorWriter> mirror;
+        if (parser.isSet("mirror")) {
+                mirror.reset(new MirrorWriter(parser.value("mirror").toStdString()));
+                tar.set_mirror(mirror.get());
+        }
+        int status = 0;
+        for (const auto &path : paths) {
+                if ((status = tar.add(path.toStdString())) != 0)
+                        break;
+        }
+        if (status == 0)
+                status = tar.finish();
+        if (compressor.finish() != 0)
+                status = -1;
+        qint64 mirrorErrors = 0;
+        if (mirror) {
+                mirrorErrors = mirror->finish() != 0 ? (qint64)mirror->get_errors() : 0;
+                result["MirroredFiles"] = (qint64)mirror->get_files_written();
+        }
+        if (fsync(fd) != 0 || close(fd) != 0)
+                status = -1;
+        if (status == 0 && rename(partial.constData(), archive.toLocal8Bit().constData()) != 0)
+                status = -1;
+        if (status != 0) {
+                unlink(partial.constData());
+                result["Error"] = "Unable to write " + archive + ".";
+        }
+
+        result["Archive"] = archive;
+        result["Files"] = (qint64)tar.get_files();
+        result["Bytes"] = (qint64)compressor.get_bytes_in();
+        result["CompressedBytes"] = (qint64)compressor.get_bytes_out();
+        result["Threads"] = compressor.get_threads();
+        if (parser.isSet("seekable"))
+                result["Blocks"] = (qint64)index.get_frames().size();
+        result["Errors"] = (qint64)tar.get_errors() + mirrorErrors;
+        return status == 0 && tar.get_errors() == 0 && mirrorErrors == 0 ? 0 : 1;
+}
+
+int Cli::run_extract(const QStringList &args, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"threads", "Number of blocks to decompress at once, 0 for all cores.", "count",
+                 "0"},
+                {"list", "List the members instead of restoring them."},
+        });
+        if (!parser.parse(QStringList{"rbackup extract"} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        QStringList paths = parser.positionalArguments();
+        int needed = parser.isSet("list") ? 1 : 2;
+        if (paths.size() < needed) {
+                result["Error"] = "extract takes " + QString::number(needed) + " arguments.";
+                return 2;
+        }
+
+        ArchiveReader reader(paths[0].toStdString());
+        if (reader.open() != 0) {
+                result["Error"] = paths[0] + " is not a seekable archive.";
+                return 1;
+        }
+        result["Archive"] = paths[0];
+        result["Blocks"] = (qint64)reader.get_index().get_frames().size();
+        if (parser.isSet("list")) {
+                QJsonArray members;
+                for (const auto &member : reader.get_index().get_members())
+                        members.append(QString::fromStdString(member.name));
+                result["Members"] = members;
+                return 0;
+        }
+
+        std::vector<std::string> wanted;
+        for (const auto &path : paths.mid(2))
+                wanted.push_back(path.toStdString());
+        QElapsedTimer timer;
+        timer.start();
+        int status = reader.extract(wanted, paths[1].toStdString(),
+                                    parser.value("threads").toInt());
+        double seconds = timer.elapsed() / 1000.0;
+        const ExtractStats &stats = reader.get_stats();
+        result["Target"] = paths[1];
+        result["Members"] = (qint64)stats.members;
+        result["BlocksDecoded"] = (qint64)stats.frames;
+        result["CompressedBytesRead"] = (qint64)stats.bytesRead;
+        result["BytesWritten"] = (qint64)stats.bytesWritten;
+        result["Seconds"] = seconds;
+        result["Errors"] = (qint64)stats.errors;
+        if (status != 0)
+                result["Error"] = "Unable to read " + paths[0] + ".";
+        return status == 0 && stats.errors == 0 ? 0 : 1;
+}
+
+int Cli::run_restore(const QStringList &args, QTextStream &out, QJsonObject &result)
+{
+        QCommandLineParser parser;
+        parser.addOptions({
+                {"snapshot", "Snapshot to restore, the latest when omitted.", "name"},
+                {"archive", "Archive to restore from instead of the destination.", "file"},
+                {"workers", "rsync processes or blocks at once, 0 for one per core.", "count",
+                 "0"},
+        });
+        if (!parser.parse(QStringList{"rbackup restore"} + args)) {
+                result["Error"] = parser.errorText();
+                return 2;
+        }
+        QStringList paths = parser.positionalArguments();
+        if (paths.size() < 2) {
+                result["Error"] = "restore takes a job and a target.";
+                return 2;
+        }
+        QString name = paths.takeFirst();
+        QString target = paths.takeFirst();
+        result["Name"] = name;
+        if (!manager.has_job(name)) {
+                result["Error"] = "Job not found.";
+                return 1;
+        }
+        const BackupJob &job = manager.get_job(name.toStdString());
+        const JobFlags &flags = job.get_flags();
+        int workers = parser.value("workers").toInt();
+        if (workers <= 0)
+                workers = std::max(QThread::idealThreadCount(), 1);
+        QString snapshot = parser.value("snapshot");
+        QString archive = parser.value("archive");
+        // A single pass archive without a mirror is the only copy there is.
+        bool archiveOnly = flags.streamArchive && !flags.archiveMirror && flags.compType != NONE
+                           && flags.backupType < NATIVE && job.get_sources().size() <= 1
+                           && job.get_dests().size() <= 1;
+        if (archive.isEmpty() && archiveOnly)
+                archive = job.get_dest()
+                          + QString::fromStdString(BlockCompressor::extension(flags.compType));
+        if (!QDir().mkpath(target)) {
+                result["Error"] = "Unable to create " + target + ".";
+                return 1;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        int status = 0;
+        qint64 bytes = 0;
+        if (!archive.isEmpty()) {
+                result["Archive"] = archive;
+                ArchiveReader reader(archive.toStdString());
+                if (reader.open() == 0) {
+                        result["Method"] = "seekable archive";
+                        std::vector<std::string> wanted;
+                        for (const auto &path : paths)
+                                wanted.push_back(path.toStdString());
+                        status = reader.extract(wanted, target.toStdString(), workers);
+                        const ExtractStats &stats = reader.get_stats();
+                        bytes = stats.bytesWritten;
+                        result["Files"] = (qint64)stats.members;
+                        result["Errors"] = (qint64)stats.errors;
+                        status = status == 0 && stats.errors == 0 ? 0 : 1;
+                } else {
+                        // Anything else is read by tar in one stream.
+                        result["Method"] = "tar";
+                        workers = 1;
+                        status = QProcess::execute("tar", QStringList{"--extract", "--file",
+                                                                      archive, "--directory",
+                                                                      target,
+                                                                      "--preserve-permissions",
+                                                                      "--numeric-owner"}
+                                                                  + paths);
+                        result["ExitCode"] = status;
+                        status = status == 0 ? 0 : 1;
+                }
+        } else if (flags.backupType == REPOSITORY) {
+                result["Method"] = "repository";
+                workers = 1;
+                ChunkStore store(job.get_dest());
+                if (!store.exists()) {
+                        result["Error"] = job.get_dest() + " is not a repository.";
+                        return 1;
+                }
+                if (snapshot.isEmpty()) {
+                        // Oldest first, so the last one is the latest.
+                        QStringList snapshots = store.list_snapshots(name);
+                        snapshot = snapshots.isEmpty() ? QString() : snapshots.last();
+                }
+                if (snapshot.isEmpty()) {
+                        result["Error"] = "The job has no snapshots.";
+                        return 1;
+                }
+                result["Snapshot"] = snapshot;
+                status = store.restore(snapshot, target, paths) == 0 ? 0 : 1;
+        } else {
+                QString source = job.get_dest();
+                if (flags.backupType == SNAPSHOT) {
+                        SnapshotSet snapshots(source);
+                        if (snapshot.isEmpty())
+                                snapshot = snapshots.latest();
+                        if (snapshot.isEmpty()) {
+                                result["Error"] = "The job has no snapshots.";
+                                return 1;
+                        }
+                        result["Snapshot"] = snapshot;
+                        source = snapshots.path_of(snapshot);
+                }
+                // One shard per worker; -H, -A, -X and -S keep hard links, ACLs, extended
+                // attributes and holes, --numeric-ids the owners even without their names.
+                result["Method"] = "rsync";
+                ShardedRsync rsync({"rsync", "-aHAXS", "--numeric-ids", source + "/", target},
+                                   workers, workers);
+                rsync.set_paths(paths);
+                status = rsync.run() == 0 ? 0 : 1;
+                RsyncStats stats = rsync.get_stats();
+                out << ShardedRsync::format_stats(stats);
+                bytes = stats.transferredSize;
+                result["Files"] = stats.files;
+        }
+
+        double seconds = timer.elapsed() / 1000.0;
+        result["Target"] = target;
+        result["Workers"] = workers;
+        result["Bytes"] = bytes;
+        result["Seconds"] = seconds;
+        result["BytesPerSecond"] = seconds > 0 ? (qint64)(bytes / seconds) : bytes;
+        if (status != 0 && !result.contains("Error"))
+                result["Error"] = "Unable to restore everything.";
+        return status;
+}
@@ -0,0 +1,218 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CLI_H
+#define CLI_H
+
+#include "manager.h"
+#include <QCommandLineParser>
+#include <QJsonObject>
+#include <QStringList>
+#include <QTextStream>
+
+/*!
+ * \brief The Cli class
+ * Drives a Manager from command line arguments without any widgets.
+ * Every command writes a single line of JSON to the output stream.
+ */
+class Cli
+{
+    public:
+        Cli(Manager &manager);
+        ~Cli() = default;
+        Cli(const Cli &) = delete;
+        Cli &operator=(const Cli &) = delete;
+
+        /*!
+         * \brief Runs a single command.
+         * \param Arguments starting with the command name, e.g. {"enable", "home"}.
+         * \param Stream the JSON result is written to.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int execute(const QStringList &args, QTextStream &out);
+
+        /*!
+         * \brief Gets the usage text listing every command.
+         * \return Usage text.
+         */
+        static QString usage();
+
+    private:
+        Manager &manager;
+
+        int list_jobs(QJsonObject &result);
+
+        int show_status(const QString &name, QJsonObject &result);
+
+        /*!
+         * \brief Adds or updates a job from the command line options.
+         * \param Command name, "add" or "update".
+         * \param Remaining arguments.
+         * \param Object that receives the resulting job or error.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int save_job(const QString &command, const QStringList &args, QJsonObject &result);
+
+        /*!
+         * \brief Applies the job options given on the command line on top of a job.
+         * \param Parser holding the options.
+         * \param Job to start from.
+         * \param Set to the reason when the options are invalid.
+         * \return The updated job.
+         */
+        BackupJob apply_options(const QCommandLineParser &parser, const BackupJob &job,
+                                QString &error) const;
+
+        /*!
+         * \brief Runs one of the commands that take a list of job names.
+         * \param Command name.
+         * \param Names of the jobs.
+         * \param Object that receives the per job results.
+         * \return 0 if every job succeeded, 1 otherwise.
+         */
+        int run_named(const QString &command, const QStringList &names, QJsonObject &result);
+
+        /*!
+         * \brief Converts, exports or imports the job catalog.
+         * \param Command name, "catalog", "export" or "import".
+         * \param Options and the file to export to or import from.
+         * \param Object that receives the number of jobs.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_catalog(const QString &command, const QStringList &args, QJsonObject &result);
+
+        /*!
+         * \brief Lists the runs recorded in a job's history with a summary of the trend.
+         * \param Options and the name of the job.
+         * \param Object that receives the runs and the trend.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int show_history(const QStringList &args, QJsonObject &result);
+
+        /*!
+         * \brief Runs a job's script for its service once the daemon's queue frees its
+         * disks, writing rsync's progress to the journal as whole lines at most once a
+         * second, and records the run.
+         * \param Options and the path of the script.
+         * \param Stream the script's output is written to.
+         * \param Object that receives the script's exit code.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_exec(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Runs an rsync command split into parallel shards.
+         * \param Options followed by "--" and the rsync command.
+         * \param Stream the aggregated rsync statistics are written to.
+         * \param Object that receives the exit codes of the shards.
+         * \return 0 if every shard succeeded, 1 otherwise.
+         */
+        int run_shards(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Runs one rsync per source of a job, a bounded number at a time.
+         * \param "--workers N", each "--source path" followed by its "--exclude pattern"s,
+         * then "--" and the rsync options ending with the destination.
+         * \param Stream the aggregated rsync statistics are written to.
+         * \param Object that receives the exit codes of the sources.
+         * \return 0 if every source succeeded, 1 otherwise.
+         */
+        int run_sources(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Copies sources to several destinations, reading each file once.
+         * \param "--buffer MiB" per destination, the sources as for run_sources, then
+         * "--" and the destinations.
+         * \param Stream the rsync style statistics are written to.
+         * \param Object that receives each destination's files, errors and waits.
+         * \return 0 for success, 1 if anything could not be copied.
+         */
+        int run_fanout(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Runs an rsync command on the paths a job's index says have changed,
+         * then updates the index if rsync succeeded.
+         * \param Options followed by "--" and the rsync command.
+         * \param Stream the rsync statistics are written to.
+         * \param Object that receives the scan counts and rsync's exit code.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_indexed(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Runs an rsync command into a new dated snapshot of the destination,
+         * hard linking files that did not change to the previous snapshot.
+         * \param Options followed by "--" and the rsync command.
+         * \param Stream the rsync statistics are written to.
+         * \param Object that receives the snapshot names and rsync's exit code.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_snapshot(const QStringList &args, QTextStream &out, QJsonObject &result);
+
+        /*!
+         * \brief Copies a tree with the built in delta engine, or times it against rsync.
+         * \param Command name, "copy" or "compare-copy".
+         * \param Options and paths.
+         * \param Stream the rsync style statistics are written to.
+         * \param Object that receives the engine's counters and timings.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_copy(const QString &command, const QStringList &args, QTextStream &out,
+                     QJsonObject &result);
+
+        /*!
+         * \brief Runs one of the repo-* commands against a deduplicating repository.
+         * \param Command name.
+         * \param Options, the repository path and the command's arguments.
+         * \param Stream the rsync style statistics of a backup are written to.
+         * \param Object that receives the command's result.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_repository(const QString &command, const QStringList &args, QTextStream &out,
+                           QJsonObject &result);
+
+        /*!
+         * \brief Writes a tar archive of the given paths with the parallel compressor,
+         * updating a mirror from the same reads when one is given.
+         * \param Options, the archive path and the paths to add.
+         * \param Object that receives the sizes and thread count.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_archive(const QStringList &args, QJsonObject &result);
+
+        /*!
+         * \brief Restores members of a seekable archive, or lists them.
+         * \param Options, the archive, the target directory and the paths to restore.
+         * \param Object that receives the counts of members, blocks and bytes.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_extract(const QStringList &args, QJsonObject &result);
+
+        /*!
+         * \brief Restores a job's backup from its destination, snapshot, repository or
+         * archive, split over parallel rsync processes or decompressing threads.
+         * \param Options, the job, the target directory and the paths to restore.
+         * \param Stream the rsync statistics are written to.
+         * \param Object that receives the method, the bytes restored and the throughput.
+         * \return 0 for success, 1 for failure, 2 for invalid usage.
+         */
+        int run_restore(const QStringList &args, QTextStream &out, QJsonObject &result);
+};
+
+#endif // CLI_H
@@ -0,0 +1,244 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "daemon.h"
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <iostream>
+
+Daemon::Daemon(Manager &manager, int rotationalSlots, int otherSlots, QObject *parent)
+        : QObject(parent), manager(manager), cli(manager), watcher(nullptr),
+          queue(rotationalSlots, otherSlots), nextRun(1)
+{
+        connect(&server, &QLocalServer::newConnection, this, &Daemon::on_new_connection);
+}
+
+int Daemon::listen(const QString &path)
+{
+        QLocalServer::removeServer(path);
+        server.setSocketOptions(QLocalServer::UserAccessOption);
+        if (!server.listen(path)) {
+                std::cerr << server.errorString().toStdString() << "\n";
+                return -1;
+        }
+        return 0;
+}
+
+void Daemon::set_watcher(ChangeWatcher *watcher)
+{
+        this->watcher = watcher;
+}
+
+int Daemon::forward(const QString &path, const QStringList &args, QTextStream &out)
+{
+        if (!QFile::exists(path))
+                return -1;
+        QLocalSocket socket;
+        socket.connectToServer(path);
+        if (!socket.waitForConnected(100))
+                return -1;
+
+        socket.write(QJsonDocument(QJsonArray::fromStringList(args)).toJson(QJsonDocument::Compact)
+                     + "\n");
+        while (!socket.canReadLine()) {
+                if (!socket.waitForReadyRead(-1)) {
+                        std::cerr << "Lost connection to the daemon.\n";
+                        return 1;
+                }
+        }
+        QJsonObject reply = QJsonDocument::fromJson(socket.readLine()).object();
+        out << QJsonDocument(reply["Output"].toObject()).toJson(QJsonDocument::Compact) << "\n";
+        out.flush();
+        return reply["Status"].toInt(1);
+}
+
+std::unique_ptr<QLocalSocket> Daemon::acquire(const QString &path, const QString &job,
+                                              QJsonObject &result)
+{
+        if (!QFile::exists(path))
+                return nullptr;
+        auto socket = std::make_unique<QLocalSocket>();
+        socket->connectToServer(path);
+        if (!socket->waitForConnected(100))
+                return nullptr;
+
+        socket->write(QJsonDocument(QJsonArray{"acquire", job}).toJson(QJsonDocument::Compact)
+                      + "\n");
+        while (!socket->canReadLine()) {
+                if (!socket->waitForReadyRead(-1)) {
+                        std::cerr << "Lost connection to the daemon, running without the queue.\n";
+                        return nullptr;
+                }
+        }
+        QJsonObject reply = QJsonDocument::fromJson(socket->readLine()).object();
+        result = reply["Output"].toObject();
+        return socket;
+}
+
+void Daemon::on_new_connection()
+{
+        while (QLocalSocket *socket = server.nextPendingConnection()) {
+                connect(socket, &QLocalSocket::disconnected, socket, &QObject::deleteLater);
+                connect(socket, &QLocalSocket::readyRead, this,
+                        [this, socket]() { handle_request(socket); });
+        }
+}
+
+void Daemon::handle_request(QLocalSocket *socket)
+{
+        if (!socket->canReadLine())
+                return;
+
+        QStringList args;
+        for (const auto &value : QJsonDocument::fromJson(socket->readLine()).array())
+                args.append(value.toString());
+        // The GUI and the command line save the catalog without going through the daemon.
+        bool reloaded = manager.reload_jobs();
+        if (reloaded && watcher != nullptr)
+                watcher->reload();
+
+        // The socket stays open while the run holds its devices.
+        if (args.value(0) == "acquire") {
+                queue_run(socket, args.value(1));
+                return;
+        }
+
+        QString output;
+        QTextStream stream(&output);
+        QJsonObject reply;
+        if (args.value(0) == "queue") {
+                QJsonObject result = queue_to_json();
+                result["Ok"] = true;
+                reply["Status"] = 0;
+                reply["Output"] = result;
+                socket->write(QJsonDocument(reply).toJson(QJsonDocument::Compact) + "\n");
+                socket->disconnectFromServer();
+                return;
+        }
+        reply["Status"] = cli.execute(args, stream);
+        static const QStringList changesJobs = {"add", "update", "enable", "disable", "delete"};
+        if (watcher != nullptr && !args.isEmpty() && changesJobs.contains(args[0]))
+                watcher->reload();
+        reply["Output"] = QJsonDocument::fromJson(output.toUtf8()).object();
+        socket->write(QJsonDocument(reply).toJson(QJsonDocument::Compact) + "\n");
+        socket->disconnectFromServer();
+}
+
+void Daemon::queue_run(QLocalSocket *socket, const QString &job)
+{
+        std::vector<std::string> paths;
+        if (manager.has_job(job)) {
+                const BackupJob &found = manager.get_job(job.toStdString());
+                for (const auto &source : found.get_sources())
+                        paths.push_back(source.path.toStdString());
+                for (const auto &dest : found.get_dests())
+                        paths.push_back(dest.toStdString());
+        }
+        uint64_t id = nextRun++;
+        runs[id] = socket;
+        queue.add(id, job.toStdString(), DeviceQueue::devices_of(paths));
+        // Also the end of a run: the client exits or closes the connection when it is done.
+        connect(socket, &QLocalSocket::disconnected, this, [this, id]() {
+                const DeviceQueue::Entry *entry = queue.get_entry(id);
+                if (entry != nullptr && entry->running)
+                        supervisor.stop(QString::fromStdString(entry->job));
+                runs.erase(id);
+                queue.remove(id);
+                start_runs();
+        });
+        start_runs();
+}
+
+void Daemon::start_runs()
+{
+        for (uint64_t id : queue.schedule()) {
+                const DeviceQueue::Entry *entry = queue.get_entry(id);
+                QJsonArray devices;
+                for (const auto &device : entry->devices)
+                        devices.append(QString::fromStdString(device));
+                QJsonObject output;
+                output["Devices"] = devices;
+                output["WaitSeconds"] = std::chrono::duration<double>(entry->started
+                                                                      - entry->queued)
+                                                .count();
+                QJsonObject reply;
+                reply["Status"] = 0;
+                reply["Output"] = output;
+                runs[id]->write(QJsonDocument(reply).toJson(QJsonDocument::Compact) + "\n");
+                if (manager.has_job(QString::fromStdString(entry->job)))
+                        supervisor.start(manager.get_job(entry->job));
+        }
+}
+
+QJsonObject Daemon::queue_to_json()
+{
+        DeviceQueue::Clock::time_point now = DeviceQueue::Clock::now();
+        QJsonArray running;
+        QJsonArray waiting;
+        std::map<std::string, std::pair<int, int>> devices; // running, waiting
+        for (const auto &entry : queue.get_entries()) {
+                QJsonObject run;
+                run["Job"] = QString::fromStdString(entry.job);
+                QJsonArray names;
+                for (const auto &device : entry.devices) {
+                        names.append(QString::fromStdString(device));
+                        if (entry.running)
+                                devices[device].first++;
+                        else
+                                devices[device].second++;
+                }
+                run["Devices"] = names;
+                run["WaitSeconds"] = std::chrono::duration<double>(
+                                             (entry.running ? entry.started : now) - entry.queued)
+                                             .count();
+                if (entry.running) {
+                        run["RunSeconds"] =
+                                std::chrono::duration<double>(now - entry.started).count();
+                        int level = supervisor.get_level(QString::fromStdString(entry.job));
+                        if (level >= 0) {
+                                run["ThrottleLevel"] = level;
+                                run["Frozen"] = supervisor.is_frozen(
+                                        QString::fromStdString(entry.job));
+                        }
+                }
+                (entry.running ? running : waiting).append(run);
+        }
+
+        QJsonArray depths;
+        for (const auto &device : devices) {
+                QJsonObject depth;
+                depth["Device"] = QString::fromStdString(device.first);
+                depth["Slots"] = queue.get_slots(device.first);
+                depth["Running"] = device.second.first;
+                depth["Waiting"] = device.second.second;
+                depths.append(depth);
+        }
+
+        QJsonObject result;
+        result["Running"] = running;
+        result["Waiting"] = waiting;
+        result["Devices"] = depths;
+        result["Started"] = (qint64)queue.get_started();
+        result["MeanWaitSeconds"] =
+                queue.get_started() > 0 ? queue.get_total_wait() / 1000.0 / queue.get_started()
+                                        : 0;
+        result["MaxWaitSeconds"] = queue.get_max_wait() / 1000.0;
+        return result;
+}
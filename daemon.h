@@ -0,0 +1,136 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "changewatcher.h"
+#include "cli.h"
+#include "devicequeue.h"
+#include "manager.h"
+#include "runsupervisor.h"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QObject>
+#include <map>
+#include <memory>
+
+/*!
+ * \brief The Daemon class
+ * Keeps a Manager loaded and serves Cli commands on a local socket so that
+ * repeated invocations of rbackup do not reload the job catalog. The catalog is
+ * only read again when another process has saved it since.
+ *
+ * A request is a single line holding a JSON array of arguments. The reply is a
+ * single line holding {"Status": exit code, "Output": command result}.
+ *
+ * Runs of jobs also queue here for the disks they use: "acquire" answers once the
+ * run may start and holds its devices until the client disconnects, and "queue"
+ * shows what is running and waiting. Runs of jobs with a pressure or latency target
+ * are throttled by a RunSupervisor while they hold their devices.
+ */
+class Daemon : public QObject
+{
+        Q_OBJECT
+
+    public:
+        /*!
+         * \param Manager of the jobs.
+         * \param Runs at once on a spinning disk.
+         * \param Runs at once on any other device.
+         * \param Parent object.
+         */
+        Daemon(Manager &manager, int rotationalSlots = 1, int otherSlots = 4,
+               QObject *parent = nullptr);
+        ~Daemon() = default;
+        Daemon(const Daemon &) = delete;
+        Daemon &operator=(const Daemon &) = delete;
+
+        /*!
+         * \brief Starts listening on the given socket path.
+         * \param Path of the socket.
+         * \return 0 for success, -1 for failure.
+         */
+        int listen(const QString &path);
+
+        /*!
+         * \brief Sets the watcher to reload whenever a command changes the jobs.
+         * \param Watcher of the jobs' sources, or nullptr.
+         */
+        void set_watcher(ChangeWatcher *watcher);
+
+        /*!
+         * \brief Sends a command to a running daemon.
+         * \param Path of the daemon's socket.
+         * \param Arguments starting with the command name.
+         * \param Stream the command result is written to.
+         * \return Exit code of the command, or -1 if no daemon is listening.
+         */
+        static int forward(const QString &path, const QStringList &args, QTextStream &out);
+
+        /*!
+         * \brief Waits in a running daemon's queue until a job's devices are free.
+         * \param Path of the daemon's socket.
+         * \param Name of the job.
+         * \param Object that receives the devices and the time spent waiting.
+         * \return Connection holding the devices until it is closed, or nullptr if no
+         * daemon is listening.
+         */
+        static std::unique_ptr<QLocalSocket> acquire(const QString &path, const QString &job,
+                                                     QJsonObject &result);
+
+    private slots:
+        void on_new_connection();
+
+    private:
+        QLocalServer server;
+        Manager &manager;
+        Cli cli;
+        ChangeWatcher *watcher;
+        DeviceQueue queue;
+        uint64_t nextRun;
+        std::map<uint64_t, QLocalSocket *> runs;
+        RunSupervisor supervisor;
+
+        /*!
+         * \brief Runs the request waiting on the socket once a full line has arrived.
+         * \param Socket of the client.
+         */
+        void handle_request(QLocalSocket *socket);
+
+        /*!
+         * \brief Queues a run for the devices under its job's source and destination.
+         * \param Socket of the client, answered once the run may start.
+         * \param Name of the job.
+         */
+        void queue_run(QLocalSocket *socket, const QString &job);
+
+        /*!
+         * \brief Tells the clients whose runs can start now.
+         */
+        void start_runs();
+
+        /*!
+         * \brief Describes the queue.
+         * \return Running and waiting runs, per device counts and wait times.
+         */
+        QJsonObject queue_to_json();
+};
+
+#endif // DAEMON_H
@@ -0,0 +1,608 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "deltacopy.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace fs = std::filesystem;
+
+constexpr size_t MIN_BLOCK = 700;
+constexpr size_t MAX_BLOCK = 128 * 1024;
+constexpr size_t MAX_WRITE = 1 << 20;
+
+// Files waiting for a worker. Bounds memory on trees with millions of files.
+constexpr size_t MAX_QUEUE = 4096;
+
+namespace
+{
+        /*
+         * Read only mapping of a whole file.
+         */
+        class MappedFile
+        {
+            public:
+                MappedFile() = default;
+                ~MappedFile()
+                {
+                        if (data != nullptr)
+                                munmap((void *)data, size);
+                        if (fd >= 0)
+                                close(fd);
+                }
+                MappedFile(const MappedFile &) = delete;
+                MappedFile &operator=(const MappedFile &) = delete;
+
+                int open(const fs::path &path)
+                {
+                        struct stat st;
+                        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                        if (fd < 0 || fstat(fd, &st) != 0)
+                                return -1;
+                        size = st.st_size;
+                        if (size == 0)
+                                return 0;
+                        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (addr == MAP_FAILED)
+                                return -1;
+                        data = (const unsigned char *)addr;
+                        madvise(addr, size, MADV_SEQUENTIAL);
+                        return 0;
+                }
+
+                const unsigned char *data = nullptr;
+                size_t size = 0;
+                int fd = -1;
+        };
+
+        struct Block {
+                uint32_t weak;
+                uint64_t strong;
+                uint64_t offset;
+        };
+
+        /*
+         * A run of the new file, copied either from the source (literal) or from
+         * the old destination file starting at basis.
+         */
+        struct Op {
+                bool literal;
+                uint64_t offset;
+                uint64_t length;
+                uint64_t basis;
+        };
+
+        void add_stats(CopyStats &to, const CopyStats &from)
+        {
+                to.filesScanned += from.filesScanned;
+                to.filesCopied += from.filesCopied;
+                to.totalSize += from.totalSize;
+                to.bytesRead += from.bytesRead;
+                to.bytesMatched += from.bytesMatched;
+                to.bytesWritten += from.bytesWritten;
+                to.errors += from.errors;
+        }
+
+        size_t block_size(uint64_t len)
+        {
+                size_t size = ((size_t)std::sqrt((double)len) + 7) & ~(size_t)7;
+                return std::clamp(size, MIN_BLOCK, MAX_BLOCK);
+        }
+
+        uint32_t pack(uint32_t a, uint32_t b)
+        {
+                return (a & 0xffff) | (b << 16);
+        }
+
+        uint32_t filter_index(uint32_t weak)
+        {
+                return (weak ^ (weak >> 16)) & 0xffff;
+        }
+
+        int write_all(int fd, const unsigned char *data, uint64_t len, off_t offset)
+        {
+                while (len > 0) {
+                        ssize_t n = pwrite(fd, data, std::min<uint64_t>(len, MAX_WRITE), offset);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n <= 0)
+                                return -1;
+                        data += n;
+                        len -= n;
+                        offset += n;
+                }
+                return 0;
+        }
+
+        int copy_attributes(int fd, const struct stat &st)
+        {
+                struct timespec times[2] = {st.st_atim, st.st_mtim};
+                if (geteuid() == 0 && fchown(fd, st.st_uid, st.st_gid) != 0)
+                        return -1;
+                if (fchmod(fd, st.st_mode & 07777) != 0)
+                        return -1;
+                return futimens(fd, times);
+        }
+
+        int copy_path_attributes(const fs::path &path, const struct stat &st)
+        {
+                struct timespec times[2] = {st.st_atim, st.st_mtim};
+                if (geteuid() == 0 && lchown(path.c_str(), st.st_uid, st.st_gid) != 0)
+                        return -1;
+                if (!S_ISLNK(st.st_mode) && chmod(path.c_str(), st.st_mode & 07777) != 0)
+                        return -1;
+                return utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+
+        /*
+         * Finds the blocks of basis that also occur in source, and describes source as
+         * a list of runs taken from either file.
+         */
+        std::vector<Op> match_blocks(const MappedFile &basis, const MappedFile &source,
+                                     CopyStats &local)
+        {
+                size_t blockSize = block_size(basis.size);
+                std::vector<Block> blocks;
+                std::vector<bool> filter(1 << 16, false);
+                uint32_t a = 0, b = 0;
+
+                blocks.reserve(basis.size / blockSize);
+                for (uint64_t off = 0; off + blockSize <= basis.size; off += blockSize) {
+                        DeltaCopy::block_sums(basis.data + off, blockSize, a, b);
+                        blocks.push_back({pack(a, b),
+                                          DeltaCopy::strong_hash(basis.data + off, blockSize),
+                                          off});
+                        filter[filter_index(pack(a, b))] = true;
+                }
+                local.bytesRead += blocks.size() * blockSize;
+                std::sort(blocks.begin(), blocks.end(),
+                          [](const Block &x, const Block &y) { return x.weak < y.weak; });
+
+                std::vector<Op> ops;
+                auto emit = [&ops](bool literal, uint64_t offset, uint64_t length,
+                                   uint64_t basisOffset) {
+                        if (!ops.empty()) {
+                                Op &last = ops.back();
+                                bool follows = last.offset + last.length == offset;
+                                if (follows && literal && last.literal) {
+                                        last.length += length;
+                                        return;
+                                }
+                                if (follows && !literal && !last.literal
+                                    && last.basis + last.length == basisOffset) {
+                                        last.length += length;
+                                        return;
+                                }
+                        }
+                        ops.push_back({literal, offset, length, basisOffset});
+                };
+
+                const unsigned char *data = source.data;
+                uint64_t len = source.size;
+                uint64_t pos = 0;
+                uint64_t literal = 0;
+                bool fresh = true;
+                while (!blocks.empty() && pos + blockSize <= len) {
+                        if (fresh) {
+                                DeltaCopy::block_sums(data + pos, blockSize, a, b);
+                                fresh = false;
+                        }
+
+                        uint32_t weak = pack(a, b);
+                        const Block *found = nullptr;
+                        if (filter[filter_index(weak)]) {
+                                auto range = std::equal_range(
+                                        blocks.begin(), blocks.end(), Block{weak, 0, 0},
+                                        [](const Block &x, const Block &y) {
+                                                return x.weak < y.weak;
+                                        });
+                                uint64_t strong = 0;
+                                if (range.first != range.second)
+                                        strong = DeltaCopy::strong_hash(data + pos, blockSize);
+                                // Prefer the block at the same offset so the file can be
+                                // patched in place.
+                                for (auto it = range.first; it != range.second; ++it) {
+                                        if (it->strong != strong)
+                                                continue;
+                                        if (found == nullptr || it->offset == pos)
+                                                found = &*it;
+                                        if (it->offset == pos)
+                                                break;
+                                }
+                        }
+
+                        if (found != nullptr) {
+                                if (pos > literal)
+                                        emit(true, literal, pos - literal, 0);
+                                emit(false, pos, blockSize, found->offset);
+                                local.bytesMatched += blockSize;
+                                pos += blockSize;
+                                literal = pos;
+                                fresh = true;
+                                continue;
+                        }
+
+                        if (pos + blockSize < len) {
+                                uint32_t out = data[pos];
+                                uint32_t in = data[pos + blockSize];
+                                a += in - out;
+                                b += a - (uint32_t)blockSize * out;
+                        }
+                        pos++;
+                }
+                if (len > literal)
+                        emit(true, literal, len - literal, 0);
+                local.bytesRead += len;
+                return ops;
+        }
+} // namespace
+
+DeltaCopy::DeltaCopy(const std::string &src, const std::string &dest, int threads)
+        : threads(threads), done(false)
+{
+        fs::path from(src);
+        // Like rsync, "src/" copies the contents and "src" copies the directory itself.
+        if (from.has_filename()) {
+                this->src = from;
+                this->dest = fs::path(dest) / from.filename();
+        } else {
+                this->src = from.parent_path();
+                this->dest = fs::path(dest);
+        }
+        if (this->threads <= 0)
+                this->threads = std::max(1u, std::thread::hardware_concurrency());
+}
+
+int DeltaCopy::run()
+{
+        stats = CopyStats();
+        done = false;
+
+        std::vector<std::thread> pool;
+        for (int i = 0; i < threads; i++)
+                pool.emplace_back(&DeltaCopy::work, this);
+
+        CopyStats local;
+        std::vector<std::pair<fs::path, fs::path>> dirs = walk(local);
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+        }
+        ready.notify_all();
+        for (auto &thread : pool)
+                thread.join();
+
+        // Directory times change as files are written, so they are set last,
+        // deepest first.
+        for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+                struct stat st;
+                if (lstat(it->first.c_str(), &st) != 0
+                    || copy_path_attributes(it->second, st) != 0) {
+                        std::cerr << it->second.string() << ": " << strerror(errno) << "\n";
+                        local.errors++;
+                }
+        }
+
+        add_stats(stats, local);
+        return stats.errors == 0 ? 0 : -1;
+}
+
+CopyStats DeltaCopy::get_stats() const
+{
+        return stats;
+}
+
+void DeltaCopy::block_sums(const unsigned char *data, size_t len, uint32_t &a, uint32_t &b)
+{
+        uint32_t sum = 0, weighted = 0;
+        size_t i = 0;
+        a = 0;
+        b = 0;
+
+#ifdef __SSE2__
+        // For each 16 byte chunk starting at i, b gains (len - i) * sum(x_k) - sum(k * x_k).
+        // The first term needs the chunk's plain sum; the second is accumulated in
+        // vector lanes and reduced once at the end.
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lowWeights = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i highWeights = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i weightedSums = zero;
+        for (; i + 16 <= len; i += 16) {
+                __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+                __m128i sad = _mm_sad_epu8(bytes, zero);
+                uint32_t chunk = _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+                __m128i low = _mm_unpacklo_epi8(bytes, zero);
+                __m128i high = _mm_unpackhi_epi8(bytes, zero);
+                weightedSums = _mm_add_epi32(weightedSums, _mm_madd_epi16(low, lowWeights));
+                weightedSums = _mm_add_epi32(weightedSums, _mm_madd_epi16(high, highWeights));
+                b += (uint32_t)(len - i) * chunk;
+                sum += chunk;
+        }
+        weightedSums = _mm_add_epi32(weightedSums,
+                                     _mm_shuffle_epi32(weightedSums, _MM_SHUFFLE(1, 0, 3, 2)));
+        weightedSums = _mm_add_epi32(weightedSums,
+                                     _mm_shuffle_epi32(weightedSums, _MM_SHUFFLE(2, 3, 0, 1)));
+        weighted = _mm_cvtsi128_si32(weightedSums);
+#endif
+
+        for (; i < len; i++) {
+                sum += data[i];
+                b += (uint32_t)(len - i) * data[i];
+        }
+        a = sum;
+        b -= weighted;
+}
+
+uint64_t DeltaCopy::strong_hash(const unsigned char *data, size_t len)
+{
+        constexpr uint64_t P1 = 11400714785074694791ULL;
+        constexpr uint64_t P2 = 14029467366897019727ULL;
+        constexpr uint64_t P3 = 1609587929392839161ULL;
+        constexpr uint64_t P4 = 9650029242287828579ULL;
+        constexpr uint64_t P5 = 2870177450012600261ULL;
+
+        auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+        auto read64 = [](const unsigned char *p) {
+                uint64_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+        };
+        auto read32 = [](const unsigned char *p) {
+                uint32_t v;
+                memcpy(&v, p, sizeof(v));
+                return v;
+        };
+        auto mix = [&](uint64_t acc, uint64_t input) {
+                return rotl(acc + input * P2, 31) * P1;
+        };
+        auto merge = [&](uint64_t acc, uint64_t val) { return (acc ^ mix(0, val)) * P1 + P4; };
+
+        const unsigned char *end = data + len;
+        uint64_t h;
+        if (len >= 32) {
+                uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+                do {
+                        v1 = mix(v1, read64(data));
+                        v2 = mix(v2, read64(data + 8));
+                        v3 = mix(v3, read64(data + 16));
+                        v4 = mix(v4, read64(data + 24));
+                        data += 32;
+                } while (data + 32 <= end);
+                h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+                h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+        } else {
+                h = P5;
+        }
+        h += len;
+
+        for (; data + 8 <= end; data += 8)
+                h = rotl(h ^ mix(0, read64(data)), 27) * P1 + P4;
+        if (data + 4 <= end) {
+                h = rotl(h ^ (read32(data) * P1), 23) * P2 + P3;
+                data += 4;
+        }
+        for (; data < end; data++)
+                h = rotl(h ^ (*data * P5), 11) * P1;
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+}
+
+std::vector<std::pair<fs::path, fs::path>> DeltaCopy::walk(CopyStats &local)
+{
+        std::vector<std::pair<fs::path, fs::path>> dirs;
+        std::error_code ec;
+
+        fs::create_directories(dest, ec);
+        if (ec || !fs::is_directory(src, ec)) {
+                std::cerr << src.string() << ": not a directory\n";
+                local.errors++;
+                return dirs;
+        }
+        dirs.emplace_back(src, dest);
+
+        auto options = fs::directory_options::skip_permission_denied;
+        for (fs::recursive_directory_iterator it(src, options, ec), end; !ec && it != end;
+             it.increment(ec)) {
+                fs::path to = dest / it->path().lexically_relative(src);
+                fs::file_status status = it->symlink_status(ec);
+
+                if (fs::is_symlink(status)) {
+                        if (copy_symlink(it->path(), to) != 0)
+                                local.errors++;
+                } else if (fs::is_directory(status)) {
+                        if (!fs::is_directory(fs::symlink_status(to, ec)))
+                                fs::remove(to, ec);
+                        fs::create_directory(to, ec);
+                        if (ec) {
+                                std::cerr << to.string() << ": " << ec.message() << "\n";
+                                local.errors++;
+                                it.disable_recursion_pending();
+                                ec.clear();
+                                continue;
+                        }
+                        dirs.emplace_back(it->path(), to);
+                } else if (fs::is_regular_file(status)) {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        space.wait(lock, [this] { return tasks.size() < MAX_QUEUE; });
+                        tasks.push_back({it->path(), to});
+                        lock.unlock();
+                        ready.notify_one();
+                }
+                ec.clear();
+        }
+        if (ec) {
+                std::cerr << src.string() << ": " << ec.message() << "\n";
+                local.errors++;
+        }
+        return dirs;
+}
+
+void DeltaCopy::work()
+{
+        CopyStats local;
+        for (;;) {
+                Task task;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this] { return done || !tasks.empty(); });
+                        if (tasks.empty())
+                                break;
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                }
+                space.notify_one();
+                if (copy_file(task.src, task.dest, local) != 0)
+                        local.errors++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        add_stats(stats, local);
+}
+
+int DeltaCopy::copy_file(const fs::path &from, const fs::path &to, CopyStats &local)
+{
+        struct stat srcStat, destStat;
+        if (lstat(from.c_str(), &srcStat) != 0) {
+                std::cerr << from.string() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        local.filesScanned++;
+        local.totalSize += srcStat.st_size;
+
+        bool exists = lstat(to.c_str(), &destStat) == 0;
+        if (exists && !S_ISREG(destStat.st_mode)) {
+                std::error_code ec;
+                fs::remove_all(to, ec);
+                exists = false;
+        }
+        if (exists && destStat.st_size == srcStat.st_size
+            && destStat.st_mtim.tv_sec == srcStat.st_mtim.tv_sec
+            && destStat.st_mtim.tv_nsec == srcStat.st_mtim.tv_nsec) {
+                bool owned = geteuid() != 0 || (destStat.st_uid == srcStat.st_uid
+                                                && destStat.st_gid == srcStat.st_gid);
+                if (owned && (destStat.st_mode & 07777) == (srcStat.st_mode & 07777))
+                        return 0;
+                if (copy_path_attributes(to, srcStat) != 0) {
+                        std::cerr << to.string() << ": " << strerror(errno) << "\n";
+                        return -1;
+                }
+                return 0;
+        }
+
+        MappedFile source;
+        if (source.open(from) != 0) {
+                std::cerr << from.string() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        local.filesCopied++;
+
+        MappedFile basis;
+        std::vector<Op> ops;
+        if (exists && destStat.st_size > 0 && basis.open(to) == 0) {
+                ops = match_blocks(basis, source, local);
+        } else if (source.size > 0) {
+                ops.push_back({true, 0, source.size, 0});
+                local.bytesRead += source.size;
+        }
+
+        bool matched = std::any_of(ops.begin(), ops.end(), [](const Op &op) { return !op.literal; });
+        // Patching writes through every hard link, e.g. into older --link-dest snapshots.
+        bool inPlace = matched && destStat.st_nlink == 1
+                       && std::all_of(ops.begin(), ops.end(), [](const Op &op) {
+                                  return op.literal || op.basis == op.offset;
+                          });
+
+        int fd = -1;
+        std::string temp;
+        if (inPlace) {
+                fd = ::open(to.c_str(), O_WRONLY | O_CLOEXEC);
+        } else {
+                temp = (to.parent_path() / ("." + to.filename().string() + ".XXXXXX")).string();
+                fd = mkstemp(&temp[0]);
+        }
+        if (fd < 0) {
+                std::cerr << to.string() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+
+        int status = 0;
+        for (const auto &op : ops) {
+                if (op.literal) {
+                        status = write_all(fd, source.data + op.offset, op.length, op.offset);
+                        local.bytesWritten += op.length;
+                } else if (!inPlace) {
+                        status = write_all(fd, basis.data + op.basis, op.length, op.offset);
+                        local.bytesWritten += op.length;
+                }
+                if (status != 0)
+                        break;
+        }
+        if (status == 0 && inPlace)
+                status = ftruncate(fd, source.size);
+        if (status == 0)
+                status = copy_attributes(fd, srcStat);
+        if (status != 0)
+                std::cerr << to.string() << ": " << strerror(errno) << "\n";
+        close(fd);
+
+        if (!inPlace) {
+                if (status == 0 && rename(temp.c_str(), to.c_str()) != 0) {
+                        std::cerr << to.string() << ": " << strerror(errno) << "\n";
+                        status = -1;
+                }
+                if (status != 0)
+                        unlink(temp.c_str());
+        }
+        return status;
+}
+
+int DeltaCopy::copy_symlink(const fs::path &from, const fs::path &to)
+{
+        std::error_code ec;
+        struct stat st;
+        fs::path target = fs::read_symlink(from, ec);
+        if (ec || lstat(from.c_str(), &st) != 0) {
+                std::cerr << from.string() << ": " << ec.message() << "\n";
+                return -1;
+        }
+        if (fs::is_symlink(fs::symlink_status(to, ec)) && fs::read_symlink(to, ec) == target)
+                return 0;
+        fs::remove_all(to, ec);
+        fs::create_symlink(target, to, ec);
+        if (ec || copy_path_attributes(to, st) != 0) {
+                std::cerr << to.string() << ": " << (ec ? ec.message() : strerror(errno)) << "\n";
+                return -1;
+        }
+        return 0;
+}
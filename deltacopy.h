@@ -0,0 +1,148 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DELTACOPY_H
+#define DELTACOPY_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief Counters reported by DeltaCopy.
+ */
+struct CopyStats {
+        uint64_t filesScanned = 0;
+        uint64_t filesCopied = 0;
+        uint64_t totalSize = 0;
+        uint64_t bytesRead = 0;
+        uint64_t bytesMatched = 0;
+        uint64_t bytesWritten = 0;
+        uint64_t errors = 0;
+};
+
+/*!
+ * \brief The DeltaCopy class
+ * Copies a directory tree in process using rsync style block matching.
+ *
+ * Files whose size and modification time match the destination are skipped, only
+ * getting their mode and owner fixed. Changed files are split into blocks on the
+ * destination side, each with a weak rolling checksum and a strong hash, and the
+ * source is scanned for those blocks. When every matched block is still at its old
+ * offset and the destination has no other hard links, it is patched in place, so
+ * only the changed bytes are written; otherwise the file is rebuilt next to the
+ * destination and renamed over it, which leaves other links to the old file alone.
+ *
+ * Like "rsync -a src dest", the copy goes to dest/<name of src> unless src ends with
+ * a slash. Files missing from the source are not deleted.
+ */
+class DeltaCopy
+{
+    public:
+        /*!
+         * \param Source directory.
+         * \param Destination directory.
+         * \param Number of files to copy at once, 0 for one per core.
+         */
+        DeltaCopy(const std::string &src, const std::string &dest, int threads = 0);
+        ~DeltaCopy() = default;
+        DeltaCopy(const DeltaCopy &) = delete;
+        DeltaCopy &operator=(const DeltaCopy &) = delete;
+
+        /*!
+         * \brief Copies the tree.
+         * \return 0 for success, -1 if any file could not be copied.
+         */
+        int run();
+
+        /*!
+         * \brief Retrieves the counters of the last run.
+         * \return Counters summed over all threads.
+         */
+        CopyStats get_stats() const;
+
+        /*!
+         * \brief Computes the weak checksum of a block, vectorized where SSE2 is available.
+         * \param Start of the block.
+         * \param Length of the block.
+         * \param Receives the plain byte sum.
+         * \param Receives the position weighted byte sum.
+         */
+        static void block_sums(const unsigned char *data, size_t len, uint32_t &a, uint32_t &b);
+
+        /*!
+         * \brief Computes the strong hash of a block (XXH64).
+         * \param Start of the block.
+         * \param Length of the block.
+         * \return Hash of the block.
+         */
+        static uint64_t strong_hash(const unsigned char *data, size_t len);
+
+    private:
+        struct Task {
+                std::filesystem::path src;
+                std::filesystem::path dest;
+        };
+
+        std::filesystem::path src;
+        std::filesystem::path dest;
+        int threads;
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable space;
+        std::deque<Task> tasks;
+        bool done;
+        CopyStats stats;
+
+        /*!
+         * \brief Walks the source, creating directories and queueing files.
+         * \param Counters of the walking thread.
+         * \return Source and destination of every directory, parents first.
+         */
+        std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+        walk(CopyStats &local);
+
+        /*!
+         * \brief Takes files off the queue until the walk is finished.
+         */
+        void work();
+
+        /*!
+         * \brief Brings one destination file up to date with its source.
+         * \param Source file.
+         * \param Destination file.
+         * \param Counters of the calling thread.
+         * \return 0 for success, -1 for failure.
+         */
+        int copy_file(const std::filesystem::path &from, const std::filesystem::path &to,
+                      CopyStats &local);
+
+        /*!
+         * \brief Recreates a symbolic link.
+         * \return 0 for success, -1 for failure.
+         */
+        int copy_symlink(const std::filesystem::path &from, const std::filesystem::path &to);
+};
+
+#endif // DELTACOPY_H
@@ -0,0 +1,185 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "devicequeue.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+        std::string read_line(const fs::path &file)
+        {
+                std::ifstream in(file);
+                std::string line;
+                std::getline(in, line);
+                return line;
+        }
+
+        /*!
+         * \brief Adds the disks under a block device.
+         * \param Device as "major:minor".
+         * \param Receives the disks.
+         * \param Levels of stacked devices left to follow.
+         */
+        void add_disks(const std::string &device, std::set<std::string> &disks, int depth)
+        {
+                std::error_code ec;
+                fs::path block = fs::canonical("/sys/dev/block/" + device, ec);
+                if (ec || depth == 0) {
+                        disks.insert(device);
+                        return;
+                }
+
+                // Device mapper and md devices list what they are built on.
+                bool stacked = false;
+                for (const auto &slave : fs::directory_iterator(block / "slaves", ec)) {
+                        std::string dev = read_line(slave.path() / "dev");
+                        if (!dev.empty()) {
+                                add_disks(dev, disks, depth - 1);
+                                stacked = true;
+                        }
+                }
+                if (stacked)
+                        return;
+                if (fs::exists(block / "partition", ec))
+                        block = block.parent_path();
+                std::string dev = read_line(block / "dev");
+                disks.insert(dev.empty() ? device : dev);
+        }
+}
+
+DeviceQueue::DeviceQueue(int rotationalSlots, int otherSlots)
+        : rotationalSlots(std::max(rotationalSlots, 1)), otherSlots(std::max(otherSlots, 1)),
+          started(0), totalWait(0), maxWait(0)
+{
+}
+
+std::vector<std::string> DeviceQueue::devices_of(const std::vector<std::string> &paths)
+{
+        std::set<std::string> disks;
+        for (const auto &name : paths) {
+                fs::path path(name);
+                struct stat st;
+                while (stat(path.c_str(), &st) != 0 && path.has_relative_path())
+                        path = path.parent_path();
+                if (stat(path.c_str(), &st) != 0)
+                        continue;
+                add_disks(std::to_string(major(st.st_dev)) + ":" + std::to_string(minor(st.st_dev)),
+                          disks, 8);
+        }
+        return std::vector<std::string>(disks.begin(), disks.end());
+}
+
+void DeviceQueue::add(uint64_t id, const std::string &job, const std::vector<std::string> &devices)
+{
+        Entry entry;
+        entry.id = id;
+        entry.job = job;
+        entry.devices = devices;
+        entry.queued = Clock::now();
+        entries.push_back(entry);
+}
+
+std::vector<uint64_t> DeviceQueue::schedule()
+{
+        std::map<std::string, int> used;
+        for (const auto &entry : entries) {
+                if (entry.running) {
+                        for (const auto &device : entry.devices)
+                                used[device]++;
+                }
+        }
+
+        std::vector<uint64_t> ids;
+        std::set<std::string> reserved;
+        for (auto &entry : entries) {
+                if (entry.running)
+                        continue;
+                bool free = std::all_of(entry.devices.begin(), entry.devices.end(),
+                                        [&](const std::string &device) {
+                                                return reserved.count(device) == 0
+                                                       && used[device] < get_slots(device);
+                                        });
+                if (!free) {
+                        reserved.insert(entry.devices.begin(), entry.devices.end());
+                        continue;
+                }
+                for (const auto &device : entry.devices)
+                        used[device]++;
+                entry.running = true;
+                entry.started = Clock::now();
+                int64_t wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                       entry.started - entry.queued)
+                                       .count();
+                started++;
+                totalWait += wait;
+                maxWait = std::max(maxWait, wait);
+                ids.push_back(entry.id);
+        }
+        return ids;
+}
+
+void DeviceQueue::remove(uint64_t id)
+{
+        entries.remove_if([id](const Entry &entry) { return entry.id == id; });
+}
+
+const DeviceQueue::Entry *DeviceQueue::get_entry(uint64_t id) const
+{
+        for (const auto &entry : entries) {
+                if (entry.id == id)
+                        return &entry;
+        }
+        return nullptr;
+}
+
+const std::list<DeviceQueue::Entry> &DeviceQueue::get_entries() const
+{
+        return entries;
+}
+
+int DeviceQueue::get_slots(const std::string &device)
+{
+        auto found = slots.find(device);
+        if (found != slots.end())
+                return found->second;
+        std::string rotational = read_line("/sys/dev/block/" + device + "/queue/rotational");
+        return slots[device] = rotational == "1" ? rotationalSlots : otherSlots;
+}
+
+uint64_t DeviceQueue::get_started() const
+{
+        return started;
+}
+
+int64_t DeviceQueue::get_total_wait() const
+{
+        return totalWait;
+}
+
+int64_t DeviceQueue::get_max_wait() const
+{
+        return maxWait;
+}
@@ -0,0 +1,142 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEVICEQUEUE_H
+#define DEVICEQUEUE_H
+
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief The DeviceQueue class
+ * Decides which of the runs waiting in the daemon may start, so that runs on
+ * different disks go at the same time and runs on the same disk take turns.
+ *
+ * Every run names the block devices under its source and destination. A device
+ * has a number of slots, one for spinning disks and more for solid state ones,
+ * and a run starts once each of its devices has a free slot. Runs are looked at
+ * in the order they arrived; a run that can not start yet reserves its devices,
+ * so later runs do not overtake it there forever, but later runs on other
+ * devices still start.
+ */
+class DeviceQueue
+{
+    public:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry {
+                uint64_t id;
+                std::string job;
+                std::vector<std::string> devices;
+                Clock::time_point queued;
+                Clock::time_point started;
+                bool running = false;
+        };
+
+        /*!
+         * \param Runs at once on a spinning disk.
+         * \param Runs at once on any other device.
+         */
+        DeviceQueue(int rotationalSlots = 1, int otherSlots = 4);
+        ~DeviceQueue() = default;
+
+        /*!
+         * \brief Finds the disks the given paths are stored on.
+         * Partitions map to their disk, and device mapper and md devices to the
+         * disks they are built on. Paths that do not exist yet use their nearest
+         * existing parent. File systems without a block device, like tmpfs or
+         * network mounts, are their own device.
+         * \param Paths of a run.
+         * \return Devices as "major:minor", sorted and unique.
+         */
+        static std::vector<std::string> devices_of(const std::vector<std::string> &paths);
+
+        /*!
+         * \brief Queues a run.
+         * \param Id of the run, unique among the queued runs.
+         * \param Name of the job.
+         * \param Devices the run uses.
+         */
+        void add(uint64_t id, const std::string &job, const std::vector<std::string> &devices);
+
+        /*!
+         * \brief Starts every waiting run that can start now.
+         * \return Ids of the runs that were started.
+         */
+        std::vector<uint64_t> schedule();
+
+        /*!
+         * \brief Removes a run that ended, or stopped waiting.
+         * \param Id of the run.
+         */
+        void remove(uint64_t id);
+
+        /*!
+         * \brief Retrieves a queued or running run.
+         * \param Id of the run.
+         * \return The run, or nullptr if it is not in the queue.
+         */
+        const Entry *get_entry(uint64_t id) const;
+
+        /*!
+         * \brief Retrieves every queued and running run, in the order they arrived.
+         * \return The runs.
+         */
+        const std::list<Entry> &get_entries() const;
+
+        /*!
+         * \brief Gets how many runs may use a device at once.
+         * \param The device.
+         * \return Number of slots.
+         */
+        int get_slots(const std::string &device);
+
+        /*!
+         * \brief Counts the runs that were started.
+         * \return Number of runs.
+         */
+        uint64_t get_started() const;
+
+        /*!
+         * \brief Retrieves the total time started runs waited.
+         * \return Wait time in milliseconds.
+         */
+        int64_t get_total_wait() const;
+
+        /*!
+         * \brief Retrieves the longest time a started run waited.
+         * \return Wait time in milliseconds.
+         */
+        int64_t get_max_wait() const;
+
+    private:
+        int rotationalSlots;
+        int otherSlots;
+        std::list<Entry> entries;
+        std::map<std::string, int> slots;
+        uint64_t started;
+        int64_t totalWait;
+        int64_t maxWait;
+};
+
+#endif // DEVICEQUEUE_H
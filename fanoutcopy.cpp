@@ -0,0 +1,309 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "fanoutcopy.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <iostream>
+#include <unistd.h>
+
+constexpr size_t READ_SIZE = 1 << 20;
+
+FanoutCopy::FanoutCopy(const std::vector<std::string> &dests, size_t maxQueued)
+        : relative(false), deleting(false), strip(0), sourceLength(0)
+{
+        for (const auto &dest : dests)
+                writers.push_back(std::make_unique<MirrorWriter>(dest, maxQueued));
+}
+
+void FanoutCopy::set_relative(bool relative)
+{
+        this->relative = relative;
+}
+
+void FanoutCopy::set_delete(bool deleting)
+{
+        this->deleting = deleting;
+}
+
+void FanoutCopy::set_update(bool update)
+{
+        for (auto &writer : writers)
+                writer->set_update(update);
+}
+
+int FanoutCopy::add(const std::string &path, const std::vector<std::string> &excludes)
+{
+        struct stat st;
+        if (path.empty() || lstat(path.c_str(), &st) != 0) {
+                report(path);
+                return -1;
+        }
+        this->excludes = excludes;
+        sourceLength = path.back() == '/' ? path.size() : path.size() + 1;
+
+        if (!relative) {
+                size_t slash = path.find_last_of('/');
+                if (path.back() == '/')
+                        strip = path.size();
+                else
+                        strip = slash == std::string::npos ? 0 : slash + 1;
+                add_entry(path, st);
+                return 0;
+        }
+
+        std::string trimmed = path;
+        while (trimmed.size() > 1 && trimmed.back() == '/')
+                trimmed.pop_back();
+        strip = std::min(trimmed.find_first_not_of('/'), trimmed.size());
+        // The writers create one level at a time, so the parents come first.
+        for (size_t slash = trimmed.find('/', strip); slash != std::string::npos;
+             slash = trimmed.find('/', slash + 1)) {
+                std::string parent = trimmed.substr(0, slash);
+                struct stat pst;
+                if (lstat(parent.c_str(), &pst) != 0) {
+                        report(parent);
+                        return -1;
+                }
+                for (auto &writer : writers)
+                        writer->directory(parent.substr(strip), pst);
+        }
+        add_entry(trimmed, st);
+        return 0;
+}
+
+int FanoutCopy::finish()
+{
+        int status = 0;
+        for (auto &writer : writers) {
+                if (writer->finish() != 0)
+                        status = -1;
+        }
+        return status == 0 && stats.errors == 0 ? 0 : -1;
+}
+
+FanoutStats FanoutCopy::get_stats() const
+{
+        return stats;
+}
+
+const std::vector<std::unique_ptr<MirrorWriter>> &FanoutCopy::get_writers() const
+{
+        return writers;
+}
+
+bool FanoutCopy::is_excluded(const std::string &inside, bool directory,
+                             const std::vector<std::string> &patterns)
+{
+        std::string name = inside.substr(inside.find_last_of('/') + 1);
+        for (std::string pattern : patterns) {
+                if (!pattern.empty() && pattern.back() == '/') {
+                        if (!directory)
+                                continue;
+                        pattern.pop_back();
+                }
+                if (pattern.empty())
+                        continue;
+                if (pattern.find('/') == std::string::npos) {
+                        if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+                                return true;
+                        continue;
+                }
+                if (pattern[0] == '/') {
+                        if (fnmatch(pattern.c_str() + 1, inside.c_str(), FNM_PATHNAME) == 0)
+                                return true;
+                        continue;
+                }
+                // Unanchored, so it may match the end of the path at any directory.
+                for (size_t at = 0; at != std::string::npos; at = inside.find('/', at)) {
+                        if (at > 0)
+                                at++;
+                        if (fnmatch(pattern.c_str(), inside.c_str() + at, FNM_PATHNAME) == 0)
+                                return true;
+                }
+        }
+        return false;
+}
+
+void FanoutCopy::add_entry(const std::string &path, const struct stat &st)
+{
+        std::string destPath = path.substr(std::min(strip, path.size()));
+        if (path.size() > sourceLength
+            && is_excluded(path.substr(sourceLength), S_ISDIR(st.st_mode), excludes))
+                return;
+        stats.filesScanned++;
+
+        if (S_ISDIR(st.st_mode)) {
+                for (auto &writer : writers) {
+                        writer->prefetch(destPath);
+                        writer->directory(destPath, st);
+                }
+                DIR *dir = opendir(path.c_str());
+                if (dir == nullptr) {
+                        report(path);
+                        for (auto &writer : writers)
+                                writer->forget(destPath);
+                        return;
+                }
+                std::vector<std::string> children;
+                while (struct dirent *entry = readdir(dir)) {
+                        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                                children.push_back(entry->d_name);
+                }
+                closedir(dir);
+                std::sort(children.begin(), children.end());
+
+                std::string prefix = path.back() == '/' ? path : path + "/";
+                if (deleting)
+                        prune(prefix, destPath, children);
+                std::vector<std::pair<std::string, struct stat>> entries;
+                for (const auto &child : children) {
+                        struct stat cst;
+                        std::string childPath = prefix + child;
+                        if (lstat(childPath.c_str(), &cst) != 0)
+                                report(childPath);
+                        else
+                                entries.emplace_back(childPath, cst);
+                }
+                // Asked for last first, so the writers list the next directory entered first.
+                for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+                        if (!S_ISDIR(it->second.st_mode)
+                            || is_excluded(it->first.substr(sourceLength), true, excludes))
+                                continue;
+                        std::string childDest = it->first.substr(std::min(strip, it->first.size()));
+                        for (auto &writer : writers)
+                                writer->prefetch(childDest);
+                }
+                for (const auto &entry : entries)
+                        add_entry(entry.first, entry.second);
+                for (auto &writer : writers)
+                        writer->forget(destPath);
+                return;
+        }
+
+        // Each writer checks again before writing, so the destinations whose listing is
+        // not ready yet get everything and the reader never waits on their metadata.
+        std::vector<MirrorWriter *> targets;
+        for (auto &writer : writers) {
+                if (writer->check(destPath, st) != MirrorWriter::CURRENT)
+                        targets.push_back(writer.get());
+        }
+
+        if (S_ISREG(st.st_mode))
+                stats.totalSize += st.st_size;
+        if (st.st_nlink > 1) {
+                auto key = std::make_pair(st.st_dev, st.st_ino);
+                auto it = links.find(key);
+                if (it != links.end()) {
+                        for (auto *writer : targets)
+                                writer->hard_link(destPath, it->second);
+                        return;
+                }
+                links[key] = destPath;
+        }
+        if (targets.empty())
+                return;
+
+        if (S_ISREG(st.st_mode)) {
+                int fd = open(path.c_str(), O_RDONLY | O_NOATIME | O_CLOEXEC);
+                if (fd < 0 && errno == EPERM)
+                        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        report(path);
+                        return;
+                }
+                for (auto *writer : targets)
+                        writer->begin_file(destPath, st);
+                copy_data(fd, path, targets);
+                close(fd);
+                return;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+                std::string target(st.st_size > 0 ? st.st_size : PATH_MAX, '\0');
+                ssize_t len = readlink(path.c_str(), &target[0], target.size());
+                if (len < 0) {
+                        report(path);
+                        return;
+                }
+                target.resize(len);
+                for (auto *writer : targets)
+                        writer->special(destPath, target, st);
+                return;
+        }
+
+        // Sockets are skipped, like rsync without --specials.
+        if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) || S_ISFIFO(st.st_mode)) {
+                for (auto *writer : targets)
+                        writer->special(destPath, "", st);
+        }
+}
+
+void FanoutCopy::copy_data(int fd, const std::string &path,
+                           const std::vector<MirrorWriter *> &targets)
+{
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<char> buffer(READ_SIZE);
+        bool complete = true;
+        for (;;) {
+                ssize_t n = read(fd, buffer.data(), buffer.size());
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n < 0) {
+                        report(path);
+                        complete = false;
+                        break;
+                }
+                if (n == 0)
+                        break;
+                stats.bytesRead += n;
+                for (auto *writer : targets)
+                        writer->file_data(buffer.data(), n);
+        }
+        // Every destination already has its copy, so caching the file only evicts others.
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        for (auto *writer : targets)
+                writer->end_file(complete);
+        if (complete)
+                stats.filesRead++;
+}
+
+void FanoutCopy::prune(const std::string &prefix, const std::string &destPath,
+                       const std::vector<std::string> &children)
+{
+        // Like rsync, excluded entries are protected from deletion.
+        std::string inside = prefix.substr(std::min(sourceLength, prefix.size()));
+        auto keep = [inside, excludes = excludes](const std::string &name, bool directory) {
+                return is_excluded(inside + name, directory, excludes);
+        };
+        // Listed and deleted on each writer's thread, in order with what it writes.
+        for (auto &writer : writers)
+                writer->prune(destPath, children, keep);
+}
+
+void FanoutCopy::report(const std::string &path)
+{
+        std::cerr << path << ": " << strerror(errno) << "\n";
+        stats.errors++;
+}
@@ -0,0 +1,169 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FANOUTCOPY_H
+#define FANOUTCOPY_H
+
+#include "mirrorwriter.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/*!
+ * \brief Counters reported by FanoutCopy.
+ */
+struct FanoutStats {
+        uint64_t filesScanned = 0;
+        uint64_t filesRead = 0;
+        uint64_t totalSize = 0;
+        uint64_t bytesRead = 0;
+        uint64_t errors = 0;
+};
+
+/*!
+ * \brief The FanoutCopy class
+ * Copies trees to several destinations at once while reading the source only once.
+ *
+ * Every writer lists the destination's directories on its own thread as the walk
+ * reaches them, and a file is read only if some destination lacks it or has not
+ * been listed that far yet; its data then goes to a MirrorWriter for each such
+ * destination, which checks it like rsync's quick check before writing. Every writer
+ * has its own threads and a bounded queue, so a fast destination keeps writing while
+ * a slow one catches up, and reading only waits once a slow destination's queue is
+ * full, never on a destination's metadata.
+ *
+ * Like "rsync -a path dest", a path goes under its name in each destination, or
+ * directly into it when the path ends with a slash; with relative paths set it goes
+ * under its full path like rsync --relative. With deletion set, each directory that
+ * is copied loses the entries the source no longer has, like rsync --delete-during;
+ * entries matching an exclude pattern are kept.
+ */
+class FanoutCopy
+{
+    public:
+        /*!
+         * \param Destination directories, created if missing.
+         * \param Bytes of file data that may be queued per destination before reading waits.
+         */
+        explicit FanoutCopy(const std::vector<std::string> &dests, size_t maxQueued = 64 << 20);
+        ~FanoutCopy() = default;
+        FanoutCopy(const FanoutCopy &) = delete;
+        FanoutCopy &operator=(const FanoutCopy &) = delete;
+
+        /*!
+         * \brief Keeps the full path of every added path in the destinations.
+         * \param True for rsync --relative layout.
+         */
+        void set_relative(bool relative);
+
+        /*!
+         * \brief Deletes what the source no longer has from the copied directories.
+         * \param True for rsync --delete.
+         */
+        void set_delete(bool deleting);
+
+        /*!
+         * \brief Keeps files that are newer in a destination than in the source.
+         * \param True for rsync --update.
+         */
+        void set_update(bool update);
+
+        /*!
+         * \brief Copies a file or directory tree to every destination.
+         * \param Path to copy.
+         * \param rsync style patterns left out of it.
+         * \return 0 for success, -1 if the path could not be read.
+         */
+        int add(const std::string &path, const std::vector<std::string> &excludes = {});
+
+        /*!
+         * \brief Waits for every destination to be written.
+         * \return 0 for success, -1 if anything could not be read or written.
+         */
+        int finish();
+
+        /*!
+         * \brief Retrieves the counters of the source side.
+         * \return Counters.
+         */
+        FanoutStats get_stats() const;
+
+        /*!
+         * \brief Retrieves the destinations' writers, for their own counters.
+         * \return Writers in the order of the destinations.
+         */
+        const std::vector<std::unique_ptr<MirrorWriter>> &get_writers() const;
+
+        /*!
+         * \brief Checks a path against rsync style exclude patterns.
+         * A pattern without a slash matches names, one starting with a slash is anchored
+         * at the source, and one ending with a slash only matches directories.
+         * \param Path inside the source.
+         * \param Whether the path is a directory.
+         * \param Patterns to check.
+         * \return True if some pattern matches.
+         */
+        static bool is_excluded(const std::string &inside, bool directory,
+                                const std::vector<std::string> &patterns);
+
+    private:
+        std::vector<std::unique_ptr<MirrorWriter>> writers;
+        bool relative;
+        bool deleting;
+
+        // Of the path being added.
+        size_t strip;
+        size_t sourceLength;
+        std::vector<std::string> excludes;
+
+        // Destination path of the first link to each inode.
+        std::map<std::pair<dev_t, ino_t>, std::string> links;
+        FanoutStats stats;
+
+        /*!
+         * \brief Copies one entry, and what is below it for a directory.
+         * \param Path of the entry.
+         * \param Status of the entry.
+         */
+        void add_entry(const std::string &path, const struct stat &st);
+
+        /*!
+         * \brief Reads a file once and hands its data to the given writers.
+         * \param Open file.
+         * \param Path of the file, for errors.
+         * \param Writers whose current file receives the data.
+         */
+        void copy_data(int fd, const std::string &path, const std::vector<MirrorWriter *> &targets);
+
+        /*!
+         * \brief Deletes the entries of a copied directory that the source does not have.
+         * \param Path of the source directory, ending with a slash.
+         * \param Path of the directory in the destinations.
+         * \param Names of the entries in the source directory.
+         */
+        void prune(const std::string &prefix, const std::string &destPath,
+                   const std::vector<std::string> &children);
+
+        void report(const std::string &path);
+};
+
+#endif // FANOUTCOPY_H
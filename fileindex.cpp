@@ -0,0 +1,444 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "fileindex.h"
+#include "deltacopy.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <unordered_set>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+constexpr char INDEX_MAGIC[4] = {'R', 'B', 'F', 'I'};
+constexpr uint32_t INDEX_VERSION = 1;
+
+namespace
+{
+        struct Header {
+                char magic[4];
+                uint32_t version;
+                uint64_t count;
+                uint64_t pathBytes;
+        };
+
+        int64_t nanoseconds(const struct timespec &ts)
+        {
+                return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        }
+}
+
+FileIndex::FileIndex(const std::string &path)
+        : path(path), map(nullptr), mapSize(0), entries(nullptr), count(0), paths(nullptr),
+          errors(0), pending(0)
+{
+        load();
+}
+
+FileIndex::~FileIndex()
+{
+        if (map != nullptr)
+                munmap((void *)map, mapSize);
+}
+
+int FileIndex::scan(const std::string &src, int threads)
+{
+        struct stat st;
+        if (lstat(src.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                std::cerr << src << ": not a directory\n";
+                return -1;
+        }
+
+        std::string root;
+        split_source(src, base, root);
+        records.clear();
+        changed.clear();
+        deleted.clear();
+        unreadable.clear();
+        errors = 0;
+        if (!root.empty())
+                records.push_back(make_record(root, st));
+
+        directories.assign(1, root);
+        pending = 1;
+        walk_all(threads);
+
+        std::vector<bool> seen(count, false);
+        for (const auto &record : records) {
+                int64_t old = find(record.entry.hash, record.path);
+                if (old < 0) {
+                        changed.push_back(record.path);
+                        continue;
+                }
+                seen[old] = true;
+                if (differs(entries[old], record.entry))
+                        changed.push_back(record.path);
+        }
+
+        for (uint64_t i = 0; i < count; i++) {
+                if (seen[i])
+                        continue;
+                std::string name = path_of(i);
+                bool kept = std::any_of(unreadable.begin(), unreadable.end(),
+                                        [&](const std::string &dir) {
+                                                return name.compare(0, dir.size() + 1, dir + "/")
+                                                       == 0;
+                                        });
+                // What could not be read is kept as it was instead of deleted.
+                if (kept)
+                        records.push_back({entries[i], name});
+                else
+                        deleted.push_back(name);
+        }
+        std::sort(deleted.rbegin(), deleted.rend());
+        return 0;
+}
+
+int FileIndex::update(const std::string &src, const std::vector<std::string> &journal,
+                      int threads)
+{
+        struct stat st;
+        if (lstat(src.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+                std::cerr << src << ": not a directory\n";
+                return -1;
+        }
+
+        std::string root;
+        split_source(src, base, root);
+        records.clear();
+        changed.clear();
+        deleted.clear();
+        unreadable.clear();
+        errors = 0;
+
+        std::set<std::string> exact;
+        std::set<std::string> subtrees;
+        for (const auto &name : journal) {
+                if (!name.empty() && name.back() == '/')
+                        subtrees.insert(name.substr(0, name.size() - 1));
+                else if (!name.empty())
+                        exact.insert(name);
+        }
+
+        // Stat what the journal names; subtrees are read again completely.
+        std::set<std::string> gone;
+        directories.clear();
+        pending = 0;
+        auto visit = [&](const std::string &name, bool recurse) {
+                struct stat pst;
+                if (lstat((base + name).c_str(), &pst) != 0) {
+                        gone.insert(name);
+                        return;
+                }
+                records.push_back(make_record(name, pst));
+                if (recurse && S_ISDIR(pst.st_mode)) {
+                        directories.push_back(name);
+                        pending++;
+                }
+        };
+        for (const auto &name : subtrees) {
+                if (!below(name, subtrees))
+                        visit(name, true);
+        }
+        for (const auto &name : exact) {
+                if (!below(name, subtrees) && subtrees.count(name) == 0)
+                        visit(name, false);
+        }
+        if (pending > 0)
+                walk_all(threads);
+
+        std::unordered_set<std::string> fresh;
+        for (const auto &record : records) {
+                fresh.insert(record.path);
+                int64_t old = find(record.entry.hash, record.path);
+                if (old < 0 || differs(entries[old], record.entry))
+                        changed.push_back(record.path);
+        }
+
+        // Everything else is carried over without touching the disk.
+        std::set<std::string> unread(unreadable.begin(), unreadable.end());
+        for (uint64_t i = 0; i < count; i++) {
+                std::string name = path_of(i);
+                if (fresh.count(name) != 0)
+                        continue;
+                bool readAgain = subtrees.count(name) != 0 || below(name, subtrees);
+                bool removed = gone.count(name) != 0 || below(name, gone);
+                if ((readAgain || removed) && !below(name, unread))
+                        deleted.push_back(name);
+                else
+                        records.push_back({entries[i], name});
+        }
+        std::sort(deleted.rbegin(), deleted.rend());
+        return 0;
+}
+
+int FileIndex::commit()
+{
+        std::sort(records.begin(), records.end(), [](const Record &a, const Record &b) {
+                return a.entry.hash != b.entry.hash ? a.entry.hash < b.entry.hash
+                                                    : a.path < b.path;
+        });
+
+        Header header;
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.version = INDEX_VERSION;
+        header.count = records.size();
+        header.pathBytes = 0;
+        std::vector<Entry> table;
+        table.reserve(records.size());
+        for (auto &record : records) {
+                Entry entry = record.entry;
+                entry.pathOffset = header.pathBytes;
+                entry.pathLength = record.path.size();
+                header.pathBytes += record.path.size();
+                table.push_back(entry);
+        }
+
+        std::string temp = path + ".new";
+        FILE *file = fopen(temp.c_str(), "wb");
+        if (file == nullptr) {
+                std::cerr << temp << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+                  && fwrite(table.data(), sizeof(Entry), table.size(), file) == table.size();
+        for (size_t i = 0; ok && i < records.size(); i++)
+                ok = fwrite(records[i].path.data(), 1, records[i].path.size(), file)
+                     == records[i].path.size();
+        ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+                std::cerr << path << ": " << strerror(errno) << "\n";
+                unlink(temp.c_str());
+                return -1;
+        }
+
+        if (map != nullptr)
+                munmap((void *)map, mapSize);
+        map = nullptr;
+        load();
+        return 0;
+}
+
+const std::vector<std::string> &FileIndex::get_changed() const
+{
+        return changed;
+}
+
+const std::vector<std::string> &FileIndex::get_deleted() const
+{
+        return deleted;
+}
+
+std::string FileIndex::get_base() const
+{
+        return base;
+}
+
+uint64_t FileIndex::get_indexed() const
+{
+        return count;
+}
+
+uint64_t FileIndex::get_scanned() const
+{
+        return records.size();
+}
+
+uint64_t FileIndex::get_errors() const
+{
+        return errors;
+}
+
+void FileIndex::load()
+{
+        entries = nullptr;
+        paths = nullptr;
+        count = 0;
+        mapSize = 0;
+
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)) {
+                close(fd);
+                return;
+        }
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+                return;
+
+        const Header *header = (const Header *)data;
+        uint64_t size = st.st_size;
+        bool valid = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0
+                     && header->version == INDEX_VERSION
+                     && header->count <= (size - sizeof(Header)) / sizeof(Entry)
+                     && sizeof(Header) + header->count * sizeof(Entry) + header->pathBytes == size;
+        if (!valid) {
+                std::cerr << path << ": invalid index, scanning everything\n";
+                munmap(data, st.st_size);
+                return;
+        }
+        map = (const char *)data;
+        mapSize = st.st_size;
+        count = header->count;
+        entries = (const Entry *)(map + sizeof(Header));
+        paths = (const char *)(entries + count);
+        madvise(data, st.st_size, MADV_RANDOM);
+}
+
+void FileIndex::walk(std::vector<Record> &found)
+{
+        for (;;) {
+                std::string dir;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this] { return pending == 0 || !directories.empty(); });
+                        if (directories.empty())
+                                return;
+                        dir = std::move(directories.front());
+                        directories.pop_front();
+                }
+
+                std::vector<std::string> subdirs;
+                DIR *handle = opendir((base + dir).c_str());
+                if (handle == nullptr) {
+                        std::cerr << base + dir << ": " << strerror(errno) << "\n";
+                        std::lock_guard<std::mutex> lock(mutex);
+                        unreadable.push_back(dir);
+                        errors++;
+                } else {
+                        while (struct dirent *item = readdir(handle)) {
+                                if (strcmp(item->d_name, ".") == 0
+                                    || strcmp(item->d_name, "..") == 0)
+                                        continue;
+                                struct stat st;
+                                if (fstatat(dirfd(handle), item->d_name, &st, AT_SYMLINK_NOFOLLOW)
+                                    != 0)
+                                        continue; // Removed since it was listed.
+                                Record record = make_record(
+                                        dir.empty() ? std::string(item->d_name)
+                                                    : dir + "/" + item->d_name,
+                                        st);
+                                if (S_ISDIR(st.st_mode))
+                                        subdirs.push_back(record.path);
+                                found.push_back(std::move(record));
+                        }
+                        closedir(handle);
+                }
+
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        pending += subdirs.size();
+                        for (auto &sub : subdirs)
+                                directories.push_back(std::move(sub));
+                        pending--;
+                }
+                ready.notify_all();
+        }
+}
+
+int64_t FileIndex::find(uint64_t hash, const std::string &name) const
+{
+        const Entry *end = entries + count;
+        const Entry *it = std::lower_bound(
+                entries, end, hash, [](const Entry &entry, uint64_t h) { return entry.hash < h; });
+        for (; it != end && it->hash == hash; ++it) {
+                if (it->pathLength == name.size()
+                    && memcmp(paths + it->pathOffset, name.data(), name.size()) == 0)
+                        return it - entries;
+        }
+        return -1;
+}
+
+std::string FileIndex::path_of(uint64_t index) const
+{
+        return std::string(paths + entries[index].pathOffset, entries[index].pathLength);
+}
+
+void FileIndex::split_source(const std::string &src, std::string &base, std::string &root)
+{
+        // Same rule as rsync: "src/" copies the contents, "src" the directory itself.
+        root.clear();
+        if (src.back() == '/') {
+                base = src;
+        } else {
+                size_t slash = src.find_last_of('/');
+                base = slash == std::string::npos ? "./" : src.substr(0, slash + 1);
+                root = src.substr(slash == std::string::npos ? 0 : slash + 1);
+        }
+}
+
+void FileIndex::walk_all(int threads)
+{
+        if (threads <= 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::vector<Record>> found(threads);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++)
+                workers.emplace_back(&FileIndex::walk, this, std::ref(found[i]));
+        for (auto &worker : workers)
+                worker.join();
+        for (auto &list : found) {
+                records.insert(records.end(), std::make_move_iterator(list.begin()),
+                               std::make_move_iterator(list.end()));
+                std::vector<Record>().swap(list);
+        }
+}
+
+FileIndex::Record FileIndex::make_record(const std::string &name, const struct stat &st)
+{
+        Record record;
+        record.path = name;
+        // Directory sizes say nothing, and rsync only needs them for new entries.
+        record.entry = {DeltaCopy::strong_hash((const unsigned char *)name.data(), name.size()),
+                        S_ISDIR(st.st_mode) ? 0 : (uint64_t)st.st_size,
+                        nanoseconds(st.st_mtim),
+                        nanoseconds(st.st_ctim),
+                        (uint64_t)st.st_ino,
+                        0,
+                        0,
+                        (uint32_t)st.st_mode};
+        return record;
+}
+
+bool FileIndex::differs(const Entry &a, const Entry &b)
+{
+        return a.size != b.size || a.mtime != b.mtime || a.ctime != b.ctime || a.inode != b.inode
+               || a.mode != b.mode;
+}
+
+bool FileIndex::below(const std::string &name, const std::set<std::string> &dirs)
+{
+        if (dirs.empty())
+                return false;
+        for (size_t slash = name.find('/'); slash != std::string::npos;
+             slash = name.find('/', slash + 1)) {
+                if (dirs.count(name.substr(0, slash)) != 0)
+                        return true;
+        }
+        return false;
+}
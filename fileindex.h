@@ -0,0 +1,206 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/*!
+ * \brief The FileIndex class
+ * Remembers the metadata of every path under a job's source, so an incremental run
+ * can hand rsync only the entries that changed instead of letting it compare the
+ * whole tree against the destination.
+ *
+ * The index file holds entries sorted by a hash of their path (XXH64) followed by the
+ * paths themselves, and is memory mapped for lookups. A scan stats the source with
+ * several threads, and an entry counts as changed when its size, modification time,
+ * inode or change time differ. Paths in the index but no longer in the source are
+ * reported as deleted, except below directories that could not be read.
+ *
+ * Paths are relative to the directory rsync is given as its source: under the
+ * source's name, or directly when the source ends with a slash, like "rsync -a".
+ */
+class FileIndex
+{
+    public:
+        /*!
+         * \param Path of the index file. A missing file is an empty index.
+         */
+        explicit FileIndex(const std::string &path);
+        ~FileIndex();
+        FileIndex(const FileIndex &) = delete;
+        FileIndex &operator=(const FileIndex &) = delete;
+
+        /*!
+         * \brief Stats the source and compares it against the index.
+         * \param Source directory, as given to rsync.
+         * \param Number of directories to read at once, 0 for one per core.
+         * \return 0 for success, -1 if the source could not be read.
+         */
+        int scan(const std::string &src, int threads = 0);
+
+        /*!
+         * \brief Updates the index from a change journal instead of reading the whole source.
+         * Only the journaled paths are stat'ed; a path ending with a slash stands for a
+         * directory whose whole subtree is read again. Every other entry is carried over.
+         * \param Source directory, as given to rsync.
+         * \param Changed paths, in the same form as the index.
+         * \param Number of directories to read at once, 0 for one per core.
+         * \return 0 for success, -1 if the source could not be read.
+         */
+        int update(const std::string &src, const std::vector<std::string> &journal,
+                   int threads = 0);
+
+        /*!
+         * \brief Writes the result of the last scan as the new index.
+         * Only call this once the changes have been copied.
+         * \return 0 for success, -1 for failure.
+         */
+        int commit();
+
+        /*!
+         * \brief Retrieves the paths that are new or changed since the index was written.
+         * \return Paths relative to get_base().
+         */
+        const std::vector<std::string> &get_changed() const;
+
+        /*!
+         * \brief Retrieves the paths that were removed from the source.
+         * \return Paths relative to get_base(), children before their parents.
+         */
+        const std::vector<std::string> &get_deleted() const;
+
+        /*!
+         * \brief Retrieves the directory the paths are relative to.
+         * \return The source if it ends with a slash, otherwise its parent, ending with a slash.
+         */
+        std::string get_base() const;
+
+        /*!
+         * \brief Retrieves the number of entries in the index file.
+         * \return Number of entries, 0 when there is no index yet.
+         */
+        uint64_t get_indexed() const;
+
+        /*!
+         * \brief Retrieves the number of entries the last scan found.
+         * \return Number of entries.
+         */
+        uint64_t get_scanned() const;
+
+        /*!
+         * \brief Retrieves the number of directories the last scan could not read.
+         * \return Number of errors.
+         */
+        uint64_t get_errors() const;
+
+        /*!
+         * \brief Splits a source the way rsync does.
+         * \param Source directory.
+         * \param Receives the directory paths are relative to, ending with a slash.
+         * \param Receives the source's name when it does not end with a slash, else "".
+         */
+        static void split_source(const std::string &src, std::string &base, std::string &root);
+
+    private:
+        // On disk layout of an entry; paths follow the entry table.
+        struct Entry {
+                uint64_t hash;
+                uint64_t size;
+                int64_t mtime;
+                int64_t ctime;
+                uint64_t inode;
+                uint64_t pathOffset;
+                uint32_t pathLength;
+                uint32_t mode;
+        };
+
+        struct Record {
+                Entry entry;
+                std::string path;
+        };
+
+        std::string path;
+        std::string base;
+        const char *map;
+        size_t mapSize;
+        const Entry *entries;
+        uint64_t count;
+        const char *paths;
+
+        std::vector<Record> records;
+        std::vector<std::string> changed;
+        std::vector<std::string> deleted;
+        std::vector<std::string> unreadable;
+        uint64_t errors;
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::string> directories;
+        size_t pending;
+
+        /*!
+         * \brief Maps the index file, leaving the index empty if it is missing or invalid.
+         */
+        void load();
+
+        /*!
+         * \brief Reads the queued directories and everything below them on several threads.
+         * \param Number of threads, 0 for one per core.
+         */
+        void walk_all(int threads);
+
+        /*!
+         * \brief Reads queued directories until the whole tree has been read.
+         * \param Receives the entries found by this thread.
+         */
+        void walk(std::vector<Record> &found);
+
+        /*!
+         * \brief Finds the entry of a path in the mapped index.
+         * \param Hash of the path.
+         * \param The path.
+         * \return Index of the entry, or -1 if it is not in the index.
+         */
+        int64_t find(uint64_t hash, const std::string &name) const;
+
+        std::string path_of(uint64_t index) const;
+
+        static Record make_record(const std::string &name, const struct stat &st);
+
+        static bool differs(const Entry &a, const Entry &b);
+
+        /*!
+         * \brief Checks whether a path lies inside one of the given directories.
+         * \param Path to check.
+         * \param Directories.
+         * \return True if a parent of the path is in the set.
+         */
+        static bool below(const std::string &name, const std::set<std::string> &dirs);
+};
+
+#endif // FILEINDEX_H
@@ -0,0 +1,164 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jobcatalog.h"
+#include <QCborValue>
+#include <QJsonValue>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+constexpr char CATALOG_MAGIC[4] = {'R', 'B', 'J', 'C'};
+constexpr uint32_t CATALOG_VERSION = 1;
+
+JobCatalog::JobCatalog(const QString &path)
+        : map(nullptr), mapSize(0), slots(nullptr), names(nullptr), count(0)
+{
+        int fd = open(path.toLocal8Bit(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+                void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                        map = (const char *)p;
+                        mapSize = st.st_size;
+                }
+        }
+        close(fd);
+        if (map == nullptr)
+                return;
+
+        const Header *header = (const Header *)map;
+        uint64_t slotEnd = header->slotOffset + header->count * sizeof(Slot);
+        if (memcmp(header->magic, CATALOG_MAGIC, 4) != 0 || header->version != CATALOG_VERSION
+            || header->slotOffset % alignof(Slot) != 0 || header->count > mapSize / sizeof(Slot)
+            || slotEnd > header->nameOffset || header->nameOffset > mapSize) {
+                std::cerr << path.toStdString() << ": invalid catalog\n";
+                return;
+        }
+        slots = (const Slot *)(map + header->slotOffset);
+        names = map + header->nameOffset;
+        count = header->count;
+}
+
+JobCatalog::~JobCatalog()
+{
+        if (map != nullptr)
+                munmap((void *)map, mapSize);
+}
+
+bool JobCatalog::is_valid() const
+{
+        return slots != nullptr;
+}
+
+uint64_t JobCatalog::size() const
+{
+        return count;
+}
+
+QString JobCatalog::name(uint64_t index) const
+{
+        const Slot &slot = slots[index];
+        if (names + slot.nameOffset + slot.nameLength > map + mapSize)
+                return QString();
+        return QString::fromUtf8(names + slot.nameOffset, slot.nameLength);
+}
+
+bool JobCatalog::is_enabled(uint64_t index) const
+{
+        return slots[index].flags & FLAG_ENABLED;
+}
+
+QJsonObject JobCatalog::read(uint64_t index) const
+{
+        const Slot &slot = slots[index];
+        if (slot.offset + slot.length > mapSize)
+                return QJsonObject();
+        QByteArray record = QByteArray::fromRawData(map + slot.offset, slot.length);
+        return QCborValue::fromCbor(record).toJsonValue().toObject();
+}
+
+int JobCatalog::write(const QString &path, const std::map<QString, QJsonObject> &jobs)
+{
+        QByteArray records;
+        QByteArray nameData;
+        std::vector<Slot> table;
+        table.reserve(jobs.size());
+        // std::map iterates in name order, which is the order of the table.
+        for (const auto &job : jobs) {
+                QByteArray record = QCborValue::fromJsonValue(job.second).toCbor();
+                QByteArray name = job.first.toUtf8();
+                Slot slot;
+                slot.offset = sizeof(Header) + records.size();
+                slot.length = record.size();
+                slot.nameOffset = nameData.size();
+                slot.nameLength = name.size();
+                slot.flags = job.second["Enabled"].toBool() ? FLAG_ENABLED : 0;
+                table.push_back(slot);
+                records += record;
+                nameData += name;
+        }
+
+        Header header;
+        memcpy(header.magic, CATALOG_MAGIC, 4);
+        header.version = CATALOG_VERSION;
+        header.count = table.size();
+        size_t padding = (alignof(Slot) - records.size() % alignof(Slot)) % alignof(Slot);
+        header.slotOffset = sizeof(Header) + records.size() + padding;
+        header.nameOffset = header.slotOffset + table.size() * sizeof(Slot);
+
+        QByteArray data((const char *)&header, sizeof(header));
+        data += records;
+        data += QByteArray(padding, '\0');
+        data += QByteArray((const char *)table.data(), table.size() * sizeof(Slot));
+        data += nameData;
+
+        QString temp = path + ".new";
+        int fd = open(temp.toLocal8Bit(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                std::cerr << temp.toStdString() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        const char *p = data.constData();
+        qint64 left = data.size();
+        while (left > 0) {
+                ssize_t n = ::write(fd, p, left);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+                p += n;
+                left -= n;
+        }
+        bool ok = left == 0 && fsync(fd) == 0;
+        close(fd);
+        if (!ok || rename(temp.toLocal8Bit(), path.toLocal8Bit()) != 0) {
+                std::cerr << path.toStdString() << ": " << strerror(errno) << "\n";
+                unlink(temp.toLocal8Bit());
+                return -1;
+        }
+        return 0;
+}
@@ -0,0 +1,121 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef JOBCATALOG_H
+#define JOBCATALOG_H
+
+#include <QJsonObject>
+#include <QString>
+#include <cstdint>
+#include <map>
+
+/*!
+ * \brief The JobCatalog class
+ * A binary job catalog that is mapped into memory and decoded one job at a time.
+ *
+ * Each job is stored as a CBOR record. A table sorted by name follows the records
+ * and holds every job's name, enabled state and record position, so the names and
+ * states are available as soon as the file is mapped and a job's record is only
+ * decoded when the job is used.
+ *
+ * Layout:
+ *      Header                  magic, version, count, table and name offsets
+ *      CBOR records            one per job
+ *      Slot[count]             sorted by name
+ *      names                   UTF-8, not terminated
+ */
+class JobCatalog
+{
+    public:
+        /*!
+         * \param Path of the catalog. A missing or invalid file is an empty catalog.
+         */
+        explicit JobCatalog(const QString &path);
+        ~JobCatalog();
+        JobCatalog(const JobCatalog &) = delete;
+        JobCatalog &operator=(const JobCatalog &) = delete;
+
+        /*!
+         * \brief Checks whether the file was mapped and its header is valid.
+         * \return True if the catalog could be read.
+         */
+        bool is_valid() const;
+
+        /*!
+         * \brief Retrieves the number of jobs.
+         * \return Number of jobs.
+         */
+        uint64_t size() const;
+
+        /*!
+         * \brief Retrieves the name of a job without decoding its record.
+         * \param Position of the job, 0 to size() - 1, in name order.
+         * \return Name of the job.
+         */
+        QString name(uint64_t index) const;
+
+        /*!
+         * \brief Retrieves whether a job is enabled without decoding its record.
+         * \param Position of the job.
+         * \return True if the job's timer is enabled.
+         */
+        bool is_enabled(uint64_t index) const;
+
+        /*!
+         * \brief Decodes a job's record.
+         * \param Position of the job.
+         * \return The job in the same form as in backups.json, or an empty object.
+         */
+        QJsonObject read(uint64_t index) const;
+
+        /*!
+         * \brief Writes a catalog to a new file and renames it over the old one.
+         * \param Path of the catalog.
+         * \param Every job, by name.
+         * \return 0 for success, -1 for failure.
+         */
+        static int write(const QString &path, const std::map<QString, QJsonObject> &jobs);
+
+    private:
+        struct Header {
+                char magic[4];
+                uint32_t version;
+                uint64_t count;
+                uint64_t slotOffset;
+                uint64_t nameOffset;
+        };
+
+        struct Slot {
+                uint64_t offset;
+                uint32_t length;
+                uint32_t nameOffset;
+                uint32_t nameLength;
+                uint32_t flags;
+        };
+
+        static constexpr uint32_t FLAG_ENABLED = 1;
+
+        const char *map;
+        size_t mapSize;
+        const Slot *slots;
+        const char *names;
+        uint64_t count;
+};
+
+#endif // JOBCATALOG_H
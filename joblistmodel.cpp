@@ -0,0 +1,340 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "joblistmodel.h"
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <QtDBus/QDBusPendingReply>
+#include <algorithm>
+#include <memory>
+
+JobListModel::JobListModel(Manager &manager, QObject *parent)
+        : QAbstractListModel(parent), manager(manager), sortKey(NAME)
+{
+        reload();
+}
+
+int JobListModel::rowCount(const QModelIndex &parent) const
+{
+        return parent.isValid() ? 0 : visible.size();
+}
+
+QVariant JobListModel::data(const QModelIndex &index, int role) const
+{
+        if (!index.isValid() || index.row() >= (int)visible.size())
+                return QVariant();
+        const Row &row = *visible[index.row()];
+        switch (role) {
+        case Qt::DisplayRole:
+        case NameRole:
+                return row.name;
+        case StatusRole:
+                return row.status;
+        case NextRunRole:
+                return row.nextRun;
+        case LastDurationRole:
+                return row.lastDuration;
+        case Qt::ToolTipRole: {
+                QString tip = "Status: " + row.status;
+                if (row.nextRun.isValid())
+                        tip += "\nNext run: " + row.nextRun.toString(Qt::ISODate);
+                if (row.lastDuration >= 0)
+                        tip += "\nLast run: " + QString::number(row.lastDuration / 1000.0, 'f', 1)
+                               + " s";
+                return tip;
+        }
+        default:
+                return QVariant();
+        }
+}
+
+void JobListModel::reload()
+{
+        beginResetModel();
+        rows.clear();
+        visible.clear();
+        for (const auto &name : manager.get_job_names()) {
+                Row &row = rows[name];
+                row.name = QString::fromStdString(name);
+                fill_row(row);
+                if (matches(row))
+                        visible.push_back(&row);
+        }
+        std::sort(visible.begin(), visible.end(),
+                  [this](const Row *a, const Row *b) { return less(a, b); });
+        endResetModel();
+}
+
+void JobListModel::refresh_states()
+{
+        std::unordered_map<std::string, ServiceState> states = manager.get_service_states();
+        for (auto &entry : rows) {
+                auto state = states.find(entry.first);
+                entry.second.status = state != states.end() ? state->second.activeState
+                                                            : QString("not loaded");
+        }
+        if (sortKey == STATUS)
+                set_sort(STATUS);
+        else if (!visible.empty())
+                emit dataChanged(index(0), index(visible.size() - 1), {StatusRole});
+
+        // Collected first when sorting by duration, so the order never goes stale mid-update.
+        auto durations = std::make_shared<std::unordered_map<std::string, qint64>>();
+        auto pending = std::make_shared<size_t>(states.size());
+        for (const auto &state : states) {
+                QDBusMessage call = QDBusMessage::createMethodCall(
+                        "org.freedesktop.systemd1", state.second.path,
+                        "org.freedesktop.DBus.Properties", "GetAll");
+                call << QString("org.freedesktop.systemd1.Service");
+                auto *watcher = new QDBusPendingCallWatcher(
+                        QDBusConnection::systemBus().asyncCall(call), this);
+                std::string name = state.first;
+                connect(watcher, &QDBusPendingCallWatcher::finished, this,
+                        [this, watcher, name, durations, pending]() {
+                                QDBusPendingReply<QVariantMap> reply = *watcher;
+                                watcher->deleteLater();
+                                if (reply.isValid()) {
+                                        QVariantMap props = reply.value();
+                                        quint64 start = props["ExecMainStartTimestampMonotonic"]
+                                                                .toULongLong();
+                                        quint64 exit = props["ExecMainExitTimestampMonotonic"]
+                                                               .toULongLong();
+                                        if (start > 0 && exit >= start)
+                                                (*durations)[name] = (exit - start) / 1000;
+                                }
+                                auto row = rows.find(name);
+                                if (sortKey != LAST_DURATION && row != rows.end()
+                                    && durations->count(name) != 0) {
+                                        row->second.lastDuration = (*durations)[name];
+                                        int at = row_of(row->second.name);
+                                        if (at >= 0)
+                                                emit dataChanged(index(at), index(at),
+                                                                 {LastDurationRole});
+                                }
+                                if (--*pending > 0)
+                                        return;
+                                for (const auto &duration : *durations) {
+                                        auto found = rows.find(duration.first);
+                                        if (found != rows.end())
+                                                found->second.lastDuration = duration.second;
+                                }
+                                if (sortKey == LAST_DURATION)
+                                        set_sort(LAST_DURATION);
+                        });
+        }
+}
+
+void JobListModel::add_job(const QString &name)
+{
+        std::string key = name.toStdString();
+        if (rows.count(key) != 0) {
+                update_job(name);
+                return;
+        }
+        Row &row = rows[key];
+        row.name = name;
+        fill_row(row);
+        if (!matches(row))
+                return;
+        int at = position_of(&row);
+        beginInsertRows(QModelIndex(), at, at);
+        visible.insert(visible.begin() + at, &row);
+        endInsertRows();
+}
+
+void JobListModel::update_job(const QString &name)
+{
+        auto it = rows.find(name.toStdString());
+        if (it == rows.end()) {
+                add_job(name);
+                return;
+        }
+        Row &row = it->second;
+        int at = row_of(name);
+        if (at >= 0) {
+                beginRemoveRows(QModelIndex(), at, at);
+                visible.erase(visible.begin() + at);
+                endRemoveRows();
+        }
+        qint64 lastDuration = row.lastDuration;
+        fill_row(row);
+        row.lastDuration = lastDuration;
+        if (!matches(row))
+                return;
+        at = position_of(&row);
+        beginInsertRows(QModelIndex(), at, at);
+        visible.insert(visible.begin() + at, &row);
+        endInsertRows();
+}
+
+void JobListModel::remove_job(const QString &name)
+{
+        auto it = rows.find(name.toStdString());
+        if (it == rows.end())
+                return;
+        int at = row_of(name);
+        if (at >= 0) {
+                beginRemoveRows(QModelIndex(), at, at);
+                visible.erase(visible.begin() + at);
+                endRemoveRows();
+        }
+        rows.erase(it);
+}
+
+void JobListModel::set_filter(const QString &text)
+{
+        QString previous = filter;
+        filter = text.toLower();
+        beginResetModel();
+        if (filter.contains(previous)) {
+                // Narrowing: everything that matches now was already shown, still in order.
+                visible.erase(std::remove_if(visible.begin(), visible.end(),
+                                             [this](const Row *row) { return !matches(*row); }),
+                              visible.end());
+        } else {
+                visible.clear();
+                for (const auto &entry : rows) {
+                        if (matches(entry.second))
+                                visible.push_back(&entry.second);
+                }
+                std::sort(visible.begin(), visible.end(),
+                          [this](const Row *a, const Row *b) { return less(a, b); });
+        }
+        endResetModel();
+}
+
+void JobListModel::set_sort(SortKey key)
+{
+        sortKey = key;
+        if (key == NEXT_RUN) {
+                for (auto &entry : rows) {
+                        if (!entry.second.scheduled)
+                                schedule_row(entry.second);
+                }
+        }
+        emit layoutAboutToBeChanged();
+        QModelIndexList before = persistentIndexList();
+        std::vector<const Row *> moved;
+        for (const auto &index : before)
+                moved.push_back(index.row() < (int)visible.size() ? visible[index.row()]
+                                                                    : nullptr);
+        std::sort(visible.begin(), visible.end(),
+                  [this](const Row *a, const Row *b) { return less(a, b); });
+        QModelIndexList after;
+        for (const auto *row : moved)
+                after.append(row != nullptr ? index(position_of(row)) : QModelIndex());
+        changePersistentIndexList(before, after);
+        emit layoutChanged();
+}
+
+QString JobListModel::name_at(int row) const
+{
+        if (row < 0 || row >= (int)visible.size())
+                return QString();
+        return visible[row]->name;
+}
+
+int JobListModel::row_of(const QString &name) const
+{
+        auto it = rows.find(name.toStdString());
+        if (it == rows.end())
+                return -1;
+        int at = position_of(&it->second);
+        return at < (int)visible.size() && visible[at] == &it->second ? at : -1;
+}
+
+void JobListModel::fill_row(Row &row)
+{
+        row.enabled = manager.is_job_enabled(row.name);
+        row.status = row.enabled ? "enabled" : "disabled";
+        row.scheduled = false;
+        row.nextRun = QDateTime();
+        row.lastDuration = -1;
+        if (sortKey == NEXT_RUN)
+                schedule_row(row);
+}
+
+void JobListModel::schedule_row(Row &row)
+{
+        row.nextRun = next_run(manager.get_job(row.name.toStdString()),
+                               manager.get_expected_duration(row.name));
+        row.scheduled = true;
+}
+
+bool JobListModel::matches(const Row &row) const
+{
+        return filter.isEmpty() || row.name.contains(filter, Qt::CaseInsensitive);
+}
+
+bool JobListModel::less(const Row *a, const Row *b) const
+{
+        switch (sortKey) {
+        case NEXT_RUN:
+                // Jobs that never run go last.
+                if (a->nextRun != b->nextRun) {
+                        if (!a->nextRun.isValid() || !b->nextRun.isValid())
+                                return a->nextRun.isValid();
+                        return a->nextRun < b->nextRun;
+                }
+                break;
+        case LAST_DURATION:
+                // Longest first, so the slow jobs are on top.
+                if (a->lastDuration != b->lastDuration)
+                        return a->lastDuration > b->lastDuration;
+                break;
+        case STATUS:
+                if (a->status != b->status)
+                        return a->status < b->status;
+                break;
+        case NAME:
+                break;
+        }
+        return a->name < b->name;
+}
+
+int JobListModel::position_of(const Row *row) const
+{
+        return std::lower_bound(visible.begin(), visible.end(), row,
+                                [this](const Row *a, const Row *b) { return less(a, b); })
+               - visible.begin();
+}
+
+QDateTime JobListModel::next_run(const BackupJob &job, int expectedSeconds)
+{
+        if (!job.is_enabled() || !job.get_flags().recurring)
+                return QDateTime();
+        QTime time = QTime::fromString(job.get_time());
+        if (!time.isValid())
+                return QDateTime();
+        Days days = job.get_days();
+        // A timer without days runs every day.
+        bool any = std::find(days.begin(), days.end(), true) != days.end();
+        QDateTime now = QDateTime::currentDateTime();
+        for (int i = 0; i <= 7; i++) {
+                QDate date = now.date().addDays(i);
+                if (any && !days[date.dayOfWeek() - 1])
+                        continue;
+                QDateTime run =
+                        QDateTime(date, time).addSecs(job.get_stagger_offset(expectedSeconds));
+                if (run > now)
+                        return run;
+        }
+        return QDateTime();
+}
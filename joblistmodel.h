@@ -0,0 +1,153 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef JOBLISTMODEL_H
+#define JOBLISTMODEL_H
+
+#include "manager.h"
+#include <QAbstractListModel>
+#include <QDateTime>
+#include <unordered_map>
+#include <vector>
+
+/*!
+ * \brief The JobListModel class
+ * Lists the manager's jobs for the job view, filtered by a substring of their name
+ * and sorted by name, next run, last duration or status.
+ *
+ * Changes to single jobs insert, remove or update single rows, so editing one job
+ * in a large catalog does not rebuild the list. A filter that extends the previous
+ * one only looks at the rows already shown. Jobs are only decoded when sorting by
+ * next run needs their schedule.
+ */
+class JobListModel : public QAbstractListModel
+{
+        Q_OBJECT
+
+    public:
+        enum SortKey { NAME, NEXT_RUN, LAST_DURATION, STATUS };
+
+        enum Role { NameRole = Qt::UserRole, StatusRole, NextRunRole, LastDurationRole };
+
+        JobListModel(Manager &manager, QObject *parent = nullptr);
+        ~JobListModel() = default;
+        JobListModel(const JobListModel &) = delete;
+        JobListModel &operator=(const JobListModel &) = delete;
+
+        int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+
+        QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+
+        /*!
+         * \brief Reads every job from the manager again.
+         */
+        void reload();
+
+        /*!
+         * \brief Asks systemd for the state and last run time of every job's service.
+         * Durations arrive asynchronously and update their rows as they come in.
+         */
+        void refresh_states();
+
+        /*!
+         * \brief Adds the row of a job that was added to the manager.
+         * \param Name of the job.
+         */
+        void add_job(const QString &name);
+
+        /*!
+         * \brief Updates the row of a job that was changed in the manager.
+         * \param Name of the job.
+         */
+        void update_job(const QString &name);
+
+        /*!
+         * \brief Removes the row of a job that was deleted from the manager.
+         * \param Name of the job.
+         */
+        void remove_job(const QString &name);
+
+        /*!
+         * \brief Shows only the jobs whose name contains the text.
+         * \param Text to look for, case insensitive; empty shows every job.
+         */
+        void set_filter(const QString &text);
+
+        /*!
+         * \brief Changes the order of the rows.
+         * \param Key to sort by.
+         */
+        void set_sort(SortKey key);
+
+        /*!
+         * \brief Retrieves the name of the job in a row.
+         * \param Row of the job.
+         * \return Name of the job, or an empty string if the row does not exist.
+         */
+        QString name_at(int row) const;
+
+        /*!
+         * \brief Finds the row of a job.
+         * \param Name of the job.
+         * \return Row of the job, or -1 if it is not shown.
+         */
+        int row_of(const QString &name) const;
+
+    private:
+        struct Row {
+                QString name;
+                QString status;
+                bool enabled = false;
+                // Only computed once sorting by next run needs it.
+                bool scheduled = false;
+                QDateTime nextRun;
+                qint64 lastDuration = -1; // milliseconds, -1 when unknown
+        };
+
+        Manager &manager;
+        std::unordered_map<std::string, Row> rows;
+        std::vector<const Row *> visible;
+        QString filter;
+        SortKey sortKey;
+
+        void fill_row(Row &row);
+
+        void schedule_row(Row &row);
+
+        bool matches(const Row &row) const;
+
+        bool less(const Row *a, const Row *b) const;
+
+        /*!
+         * \brief Finds where a row belongs in the sorted rows.
+         * \param The row.
+         * \return Position of the row, or of the first row after it.
+         */
+        int position_of(const Row *row) const;
+
+        /*!
+         * \brief Computes when a job's timer fires next.
+         * \param The job.
+         * \param Expected length of a run in seconds, which moves a staggered start.
+         * \return Time of the next run, invalid if the job has no enabled timer.
+         */
+        static QDateTime next_run(const BackupJob &job, int expectedSeconds);
+};
+
+#endif // JOBLISTMODEL_H
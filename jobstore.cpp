@@ -0,0 +1,283 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "jobstore.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The journal is compacted once it holds this many records per job, and at least this many.
+constexpr size_t COMPACT_RATIO = 2;
+constexpr size_t COMPACT_MINIMUM = 1000;
+
+namespace
+{
+        int write_all(int fd, const QByteArray &data)
+        {
+                const char *p = data.constData();
+                qint64 left = data.size();
+                while (left > 0) {
+                        ssize_t n = write(fd, p, left);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n <= 0)
+                                return -1;
+                        p += n;
+                        left -= n;
+                }
+                return 0;
+        }
+}
+
+JobStore::JobStore(const QString &path, const QString &catalogPath)
+        : path(path), catalogPath(catalogPath), journalPath(path + ".journal"), records(0),
+          binary(QFile::exists(catalogPath))
+{
+}
+
+int JobStore::load(std::map<QString, QJsonObject> &jobs, std::set<QString> &deleted)
+{
+        jobs.clear();
+        deleted.clear();
+        records = 0;
+        bool found = false;
+
+        binary = QFile::exists(catalogPath);
+        catalog.reset();
+        if (binary) {
+                catalog = std::make_unique<JobCatalog>(catalogPath);
+                if (!catalog->is_valid())
+                        return -1;
+                found = true;
+        } else if (QFile::exists(path)) {
+                found = true;
+                if (read_snapshot(jobs) != 0)
+                        return -1;
+        }
+
+        found = found || QFile::exists(journalPath);
+        stamp = get_stamp();
+        records = replay(jobs, &deleted);
+        return found ? 0 : -1;
+}
+
+int JobStore::append(const std::map<QString, QJsonObject> &changes)
+{
+        if (changes.empty())
+                return 0;
+        QByteArray data;
+        for (const auto &change : changes) {
+                QJsonObject record;
+                record["Name"] = change.first;
+                if (!change.second.isEmpty())
+                        record["Job"] = change.second;
+                data += QJsonDocument(record).toJson(QJsonDocument::Compact) + "\n";
+        }
+
+        int fd = open_locked();
+        if (fd < 0)
+                return -1;
+        int status = write_all(fd, data) == 0 && fdatasync(fd) == 0 ? 0 : -1;
+        if (status != 0)
+                std::cerr << journalPath.toStdString() << ": " << strerror(errno) << "\n";
+        close(fd);
+        records += changes.size();
+        return status;
+}
+
+const JobCatalog *JobStore::get_catalog() const
+{
+        return catalog.get();
+}
+
+void JobStore::set_binary(bool binary)
+{
+        this->binary = binary;
+}
+
+int JobStore::compact(const std::map<QString, QJsonObject> &changes)
+{
+        // Held until the journal is emptied, so no append lands between the two.
+        int lock = open_locked();
+        if (lock < 0)
+                return -1;
+        std::map<QString, QJsonObject> jobs;
+        if (read_snapshot(jobs) != 0) {
+                close(lock);
+                return -1;
+        }
+        replay(jobs, nullptr);
+        for (const auto &change : changes) {
+                if (change.second.isEmpty())
+                        jobs.erase(change.first);
+                else
+                        jobs[change.first] = change.second;
+        }
+
+        if (binary) {
+                int status = JobCatalog::write(catalogPath, jobs);
+                if (status == 0) {
+                        unlink(path.toLocal8Bit());
+                        sync_directory();
+                        status = ftruncate(lock, 0) == 0 && fsync(lock) == 0 ? 0 : -1;
+                        records = 0;
+                }
+                close(lock);
+                return status;
+        }
+
+        QJsonArray arr;
+        for (const auto &job : jobs)
+                arr.append(job.second);
+        QJsonObject obj;
+        obj["jobs"] = arr;
+
+        QString temp = path + ".new";
+        int fd = open(temp.toLocal8Bit(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int status = -1;
+        if (fd >= 0) {
+                status = write_all(fd, QJsonDocument(obj).toJson()) == 0 && fsync(fd) == 0 ? 0 : -1;
+                close(fd);
+        }
+        if (status == 0)
+                status = rename(temp.toLocal8Bit(), path.toLocal8Bit());
+        if (status == 0) {
+                unlink(catalogPath.toLocal8Bit());
+                sync_directory();
+                status = ftruncate(lock, 0) == 0 && fsync(lock) == 0 ? 0 : -1;
+                records = 0;
+        } else {
+                std::cerr << path.toStdString() << ": " << strerror(errno) << "\n";
+                unlink(temp.toLocal8Bit());
+        }
+        close(lock);
+        return status;
+}
+
+bool JobStore::needs_compaction(size_t jobs) const
+{
+        return records > std::max(jobs * COMPACT_RATIO, COMPACT_MINIMUM);
+}
+
+bool JobStore::is_stale() const
+{
+        return get_stamp() != stamp;
+}
+
+std::string JobStore::get_stamp() const
+{
+        std::string result;
+        for (const QString &file : {path, catalogPath, journalPath}) {
+                struct stat st;
+                if (stat(file.toLocal8Bit().constData(), &st) != 0) {
+                        result += "-;";
+                        continue;
+                }
+                result += std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":"
+                          + std::to_string(st.st_mtim.tv_sec) + "."
+                          + std::to_string(st.st_mtim.tv_nsec) + ";";
+        }
+        return result;
+}
+
+size_t JobStore::replay(std::map<QString, QJsonObject> &jobs, std::set<QString> *deleted) const
+{
+        size_t count = 0;
+        QFile journal(journalPath);
+        if (!journal.open(QIODevice::ReadOnly))
+                return 0;
+        while (!journal.atEnd()) {
+                QByteArray line = journal.readLine();
+                // Only the last line can be incomplete, from a crash during append().
+                if (!line.endsWith('\n'))
+                        break;
+                QJsonObject record = QJsonDocument::fromJson(line).object();
+                QString name = record["Name"].toString();
+                if (name.isEmpty())
+                        continue;
+                if (record.contains("Job")) {
+                        jobs[name] = record["Job"].toObject();
+                } else {
+                        jobs.erase(name);
+                        if (deleted != nullptr)
+                                deleted->insert(name);
+                }
+                count++;
+        }
+        return count;
+}
+
+int JobStore::read_snapshot(std::map<QString, QJsonObject> &jobs) const
+{
+        if (QFile::exists(catalogPath)) {
+                JobCatalog current(catalogPath);
+                if (!current.is_valid())
+                        return -1;
+                for (uint64_t i = 0; i < current.size(); i++)
+                        jobs[current.name(i)] = current.read(i);
+                return 0;
+        }
+        QFile snapshot(path);
+        if (!snapshot.open(QIODevice::ReadOnly))
+                return 0;
+        QJsonParseError err;
+        QJsonDocument doc = QJsonDocument::fromJson(snapshot.readAll(), &err);
+        if (err.error != QJsonParseError::NoError) {
+                std::cerr << "Error: " + err.errorString().toStdString() << "\n";
+                return -1;
+        }
+        for (const auto &value : doc.object()["jobs"].toArray()) {
+                QJsonObject job = value.toObject();
+                jobs[job["Name"].toString()] = job;
+        }
+        return 0;
+}
+
+int JobStore::open_locked() const
+{
+        int fd = open(journalPath.toLocal8Bit(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                std::cerr << journalPath.toStdString() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+void JobStore::sync_directory() const
+{
+        int fd = open(QFileInfo(path).absolutePath().toLocal8Bit(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+                fsync(fd);
+                close(fd);
+        }
+}
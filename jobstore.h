@@ -0,0 +1,157 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef JOBSTORE_H
+#define JOBSTORE_H
+
+#include "jobcatalog.h"
+#include <QJsonObject>
+#include <QString>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+/*!
+ * \brief The JobStore class
+ * Persists the job catalog as a snapshot plus an append-only journal, so saving a
+ * change costs as much as the change and not the whole catalog.
+ *
+ * Every added, changed or deleted job is appended to the journal as one line of
+ * JSON and flushed to disk. Loading reads the snapshot and replays the journal over
+ * it; a line cut short by a crash is ignored. Once the journal outgrows the catalog
+ * it is compacted: the snapshot is written to a new file, synced and renamed over
+ * the old one, then the journal is emptied. Records hold whole jobs, so replaying a
+ * journal that a crash kept after compaction changes nothing.
+ *
+ * The snapshot is either JSON in the format of backups.json, {"jobs": [...]}, or a
+ * binary JobCatalog whose records are decoded on first use. The binary catalog is
+ * used whenever its file exists. Writers hold an exclusive lock on the journal, so
+ * the GUI and the command line tools can share it.
+ */
+class JobStore
+{
+    public:
+        /*!
+         * \param Path of the JSON snapshot; the journal is the same path with ".journal".
+         * \param Path of the binary catalog.
+         */
+        JobStore(const QString &path, const QString &catalogPath);
+        ~JobStore() = default;
+        JobStore(const JobStore &) = delete;
+        JobStore &operator=(const JobStore &) = delete;
+
+        /*!
+         * \brief Reads the snapshot and replays the journal.
+         * With a binary catalog only the journaled jobs are decoded; the rest stay in
+         * get_catalog() until they are used.
+         * \param Receives the decoded jobs by name.
+         * \param Receives the names the journal deletes.
+         * \return 0 for success, -1 if there is no catalog yet or it could not be read.
+         */
+        int load(std::map<QString, QJsonObject> &jobs, std::set<QString> &deleted);
+
+        /*!
+         * \brief Retrieves the binary catalog loaded by load().
+         * \return The catalog, or nullptr when the snapshot is JSON.
+         */
+        const JobCatalog *get_catalog() const;
+
+        /*!
+         * \brief Selects the snapshot format written by the next compact().
+         * The snapshot of the other format is removed once the new one is written.
+         * \param True for the binary catalog, false for JSON.
+         */
+        void set_binary(bool binary);
+
+        /*!
+         * \brief Records changed and deleted jobs in the journal.
+         * \param Jobs that were added or changed, by name.
+         * \param Names of deleted jobs, mapped to empty objects.
+         * \return 0 for success, -1 for failure.
+         */
+        int append(const std::map<QString, QJsonObject> &changes);
+
+        /*!
+         * \brief Writes the whole catalog as the new snapshot and empties the journal.
+         * The catalog is read again under the journal's lock, so records other processes
+         * appended are kept, and the given changes are applied on top of it.
+         * \param Changes not appended yet, deleted jobs mapped to empty objects.
+         * \return 0 for success, -1 for failure.
+         */
+        int compact(const std::map<QString, QJsonObject> &changes);
+
+        /*!
+         * \brief Checks whether the journal has grown enough to be worth compacting.
+         * \param Number of jobs in the catalog.
+         * \return True if compact() should be called.
+         */
+        bool needs_compaction(size_t jobs) const;
+
+        /*!
+         * \brief Checks whether the files changed since the last load(), for example
+         * because another process saved or compacted the catalog.
+         * \return True if load() would read something different.
+         */
+        bool is_stale() const;
+
+    private:
+        QString path;
+        QString catalogPath;
+        QString journalPath;
+        size_t records;
+        bool binary;
+        std::unique_ptr<JobCatalog> catalog;
+        // Inode, size and modification time of the files as of the last load().
+        std::string stamp;
+
+        /*!
+         * \brief Describes the snapshot, catalog and journal files as they are on disk.
+         * \return A string that changes whenever one of the files does.
+         */
+        std::string get_stamp() const;
+
+        /*!
+         * \brief Opens the journal and takes its lock.
+         * \return File descriptor, or -1 for failure.
+         */
+        int open_locked() const;
+
+        /*!
+         * \brief Replays the journal over a set of jobs.
+         * \param Jobs by name, updated in place.
+         * \param Receives the names the journal deletes, if not nullptr.
+         * \return Number of records replayed.
+         */
+        size_t replay(std::map<QString, QJsonObject> &jobs, std::set<QString> *deleted) const;
+
+        /*!
+         * \brief Reads every job in the snapshot on disk, decoding the whole catalog.
+         * \param Receives the jobs by name.
+         * \return 0 for success, -1 if the snapshot could not be read.
+         */
+        int read_snapshot(std::map<QString, QJsonObject> &jobs) const;
+
+        /*!
+         * \brief Flushes the directory of the catalog so a rename in it survives a crash.
+         */
+        void sync_directory() const;
+};
+
+#endif // JOBSTORE_H
@@ -24,6 +24,11 @@
 int main(int argc, char *argv[])
 {
         QApplication a(argc, argv);
+        set_error_handler([](const QString &text) {
+                QMessageBox box;
+                box.setText(text);
+                box.exec();
+        });
         MainWindow w;
         w.show();
         return a.exec();
@@ -21,12 +21,15 @@
 #include "./ui_mainwindow.h"
 
 MainWindow::MainWindow(QWidget *parent)
-        : QMainWindow(parent), ui(new Ui::MainWindow), manager(new Manager()),
-          commandGenerated(false), isUpdating(false)
+        : QMainWindow(parent), ui(new Ui::MainWindow), manager(new Manager()), jobs(nullptr),
+          monitor(new RunMonitor(this)), commandGenerated(false), isUpdating(false)
 {
         ui->setupUi(this);
         add_jobs_to_list();
         create_checkbox_array();
+        connect(monitor, &RunMonitor::progress, this, &MainWindow::show_run_progress);
+        connect(monitor, &RunMonitor::finished, this, &MainWindow::show_run_finished);
+        watch_running_jobs();
 }
 
 MainWindow::~MainWindow()
@@ -37,89 +40,9 @@ MainWindow::~MainWindow()
 
 QString MainWindow::generate() const
 {
-        QString tmp = "", out = selectBackupType();
-
-        if (ui->transferCompression->isChecked())
-                out += TRANSFER_COMPRESSION;
-
-        out += selectDeleteType();
-        out += ui->source->text() + " ";
-        out += ui->destination->text() + " ";
-        if (ui->backupCompression->currentIndex() != 0)
-                out += " && ";
-        out += selectCompressionType();
-
-        return out;
-}
-
-QString MainWindow::selectBackupType() const
-{
-        QString out = "";
-
-        switch (ui->backupType->currentIndex()) {
-                void on_actionServicePath_triggered();
-        case 0:
-                out += INCREMENTAL_OPTIONS;
-                break;
-        case 1:
-                out += INCREMENTAL_OPTIONS;
-                out += NO_DELTA;
-                break;
-        case 2:
-                out += FULL_OPTIONS;
-                break;
-        case 3:
-                out += INCREMENTAL_OPTIONS;
-                out += NO_DELTA;
-                break;
-        default:
-                throw std::out_of_range("Invalid Backup Type Index");
-        }
-
-        return out;
-}
-
-QString MainWindow::selectDeleteType() const
-{
-        switch (ui->deleteWhen->currentIndex()) {
-        case 0:
-                return DELETE_DURING;
-        case 1:
-                return DELETE_AFTER;
-        case 2:
-                return DELETE_BEFORE;
-        default:
-                throw std::out_of_range("Invalid Delete Type Index");
-        }
-}
-
-QString MainWindow::selectCompressionType() const
-{
-        QString out = "";
-        QString dest = ui->destination->text();
-        switch (ui->backupCompression->currentIndex()) {
-        case 0:
-                break;
-        case 1:
-                out += TAR;
-                out += dest + ".tar " + dest;
-                break;
-        case 2:
-                out += TAR_GZ;
-                out += dest + ".tar.gz " + dest;
-                break;
-        case 3:
-                out += TAR_BZ;
-                out += dest + ".tar.bz2 " + dest;
-                break;
-        case 4:
-                out += TAR_XZ;
-                out += dest + ".tar.xz " + dest;
-                break;
-        default:
-                throw std::out_of_range("Invalid Compression Type Index");
-        }
-        return out;
+        BackupJob job(ui->jobName->text(), create_dests(), create_sources(), "",
+                      create_days(), create_flags(), create_time());
+        return job.generate_command();
 }
 
 BackupJob MainWindow::create_job() const
@@ -129,7 +52,7 @@ BackupJob MainWindow::create_job() const
                 command = ui->command->toPlainText();
         else
                 command = generate();
-        return BackupJob(ui->jobName->text(), ui->destination->text(), ui->source->text(), command,
+        return BackupJob(ui->jobName->text(), create_dests(), create_sources(), command,
                          create_days(), create_flags(), create_time());
 }
 
@@ -145,6 +68,28 @@ JobFlags MainWindow::create_flags() const
         flags.backupCompression = flags.compType != 0;
         flags.transferCompression = ui->transferCompression->isChecked();
         flags.backupType = (BackupType)ui->backupType->currentIndex();
+        flags.shards = ui->shards->value();
+        flags.workers = ui->workers->value();
+        flags.keep = ui->keep->value();
+        flags.compressionThreads = ui->compressionThreads->value();
+        flags.compressionMemory = ui->compressionMemory->value();
+        flags.streamArchive = ui->streamArchive->isChecked();
+        flags.archiveMirror = ui->archiveMirror->isChecked();
+        flags.seekableArchive = ui->seekableArchive->isChecked();
+        flags.zstdLevel = ui->zstdLevel->value();
+        flags.zstdLongWindow = ui->zstdLongWindow->isChecked();
+        flags.fileIndex = ui->fileIndex->isChecked();
+        flags.staggerWindow = ui->staggerWindow->value();
+        flags.ioWeight = ui->ioWeight->value();
+        flags.readBandwidth = ui->readBandwidth->value();
+        flags.writeBandwidth = ui->writeBandwidth->value();
+        flags.cpuWeight = ui->cpuWeight->value();
+        flags.cpuQuota = ui->cpuQuota->value();
+        flags.nice = ui->niceLevel->value();
+        flags.ioClass = (IOSchedulingClass)ui->ioClass->currentIndex();
+        flags.bwLimit = ui->bwLimit->value();
+        flags.pressureTarget = ui->pressureTarget->value();
+        flags.latencyTarget = ui->latencyTarget->value();
 
         return flags;
 }
@@ -158,6 +103,37 @@ Days MainWindow::create_days() const
         return days;
 }
 
+JobSources MainWindow::create_sources() const
+{
+        JobSources sources;
+        if (!ui->source->text().isEmpty())
+                sources.append({ui->source->text(), QStringList()});
+        // One "path: pattern pattern" per line, the patterns being optional.
+        for (const auto &line : ui->moreSources->toPlainText().split('\n')) {
+                int colon = line.indexOf(':');
+                QString path = line.left(colon).trimmed();
+                if (path.isEmpty())
+                        continue;
+                QStringList excludes;
+                if (colon >= 0)
+                        excludes = line.mid(colon + 1).split(' ', QString::SkipEmptyParts);
+                BackupJob::add_source(sources, path, excludes);
+        }
+        return sources;
+}
+
+QStringList MainWindow::create_dests() const
+{
+        QStringList dests;
+        if (!ui->destination->text().isEmpty())
+                dests.append(ui->destination->text());
+        for (const auto &line : ui->moreDests->toPlainText().split('\n')) {
+                if (!line.trimmed().isEmpty() && !dests.contains(line.trimmed()))
+                        dests.append(line.trimmed());
+        }
+        return dests;
+}
+
 QString MainWindow::create_time() const
 {
         return ui->timeEdit->time().toString();
@@ -165,11 +141,88 @@ QString MainWindow::create_time() const
 
 void MainWindow::add_jobs_to_list()
 {
-        std::list<std::string> list = manager->get_job_names();
-        for (const auto &name : list) {
-                ui->jobNamesList->addItem(QString::fromStdString(name));
+        jobs = new JobListModel(*manager, this);
+        ui->jobNamesList->setModel(jobs);
+        connect(ui->jobNamesList->selectionModel(), &QItemSelectionModel::currentChanged, this,
+                &MainWindow::on_job_selected);
+        jobs->refresh_states();
+        ui->jobNamesList->setCurrentIndex(jobs->index(0));
+}
+
+QString MainWindow::selected_job() const
+{
+        return jobs->name_at(ui->jobNamesList->currentIndex().row());
+}
+
+void MainWindow::watch_running_jobs()
+{
+        for (const auto &state : manager->get_service_states()) {
+                if (state.second.activeState == "active"
+                    || state.second.activeState == "activating")
+                        monitor->watch(QString::fromStdString(state.first));
+        }
+}
+
+QString MainWindow::format_progress(const RunProgress &progress)
+{
+        QString text = QString("%1% - %2 copied at %3/s, %4 files/s")
+                               .arg(progress.percent)
+                               .arg(QLocale().formattedDataSize(progress.bytes))
+                               .arg(QLocale().formattedDataSize((qint64)progress.rate))
+                               .arg(progress.filesPerSec, 0, 'f', 1);
+        if (progress.eta >= 0)
+                text += ", " + QTime(0, 0).addSecs(progress.eta).toString("H:mm:ss")
+                        + " left";
+        return text;
+}
+
+QString MainWindow::format_history(const QString &name) const
+{
+        static const QString bars = QString::fromUtf8("▁▂▃▄▅▆▇█");
+        std::vector<RunRecord> records;
+        if (RunHistory(manager->get_history_path(name).toStdString()).read(records, 30) != 0
+            || records.empty())
+                return "";
+
+        RunTrend trend = RunHistory::trend(records);
+        QString out = QString("\nLast %1 Runs: %2 failed\n").arg(trend.runs).arg(trend.failures);
+        out += "Mean Duration: " + QTime(0, 0).addSecs((int)trend.meanDuration).toString("H:mm:ss")
+               + "\n";
+        out += "Mean Throughput: " + QLocale().formattedDataSize((qint64)trend.meanThroughput)
+               + "/s";
+        if (trend.change != 0)
+                out += QString(" (%1%2% recently)")
+                               .arg(trend.change > 0 ? "+" : "")
+                               .arg(trend.change * 100, 0, 'f', 0);
+
+        // One bar per run, scaled to the fastest; failed runs are a gap.
+        double fastest = 0;
+        for (const auto &record : records) {
+                double seconds = (record.end - record.start) / 1000.0;
+                if (record.exitCode == 0 && seconds > 0)
+                        fastest = std::max(fastest, record.bytesRead / seconds);
         }
-        ui->jobNamesList->setCurrentRow(0);
+        QString chart;
+        for (const auto &record : records) {
+                double seconds = (record.end - record.start) / 1000.0;
+                if (record.exitCode != 0 || seconds <= 0 || fastest <= 0) {
+                        chart += ' ';
+                        continue;
+                }
+                int level = (int)(record.bytesRead / seconds / fastest * (bars.size() - 1));
+                chart += bars[level];
+        }
+        return out + "\nThroughput: " + chart + "\n";
+}
+
+QStringList MainWindow::selected_jobs() const
+{
+        QStringList names;
+        for (const auto &index : ui->jobNamesList->selectionModel()->selectedRows())
+                names.append(jobs->name_at(index.row()));
+        if (names.isEmpty() && !selected_job().isEmpty())
+                names.append(selected_job());
+        return names;
 }
 
 void MainWindow::edit_job(const BackupJob &job)
@@ -180,7 +233,18 @@ void MainWindow::edit_job(const BackupJob &job)
         ui->jobName->setEnabled(false); // prevent change of jobname.
         set_days_from_array(job.get_days());
         ui->source->setText(job.get_src());
+        QStringList more;
+        JobSources sources = job.get_sources();
+        for (int i = 0; i < sources.size(); i++) {
+                if (i == 0 && sources[i].excludes.isEmpty())
+                        continue;
+                more.append(sources[i].path);
+                if (!sources[i].excludes.isEmpty())
+                        more.last() += ": " + sources[i].excludes.join(' ');
+        }
+        ui->moreSources->setPlainText(more.join('\n'));
         ui->destination->setText(job.get_dest());
+        ui->moreDests->setPlainText(job.get_dests().mid(1).join('\n'));
         ui->recurring->setChecked(tmp.recurring);
         ui->timeEdit->setTime(QTime::fromString(job.get_time()));
         ui->command->setPlainText(job.get_command());
@@ -188,6 +252,28 @@ void MainWindow::edit_job(const BackupJob &job)
         ui->backupCompression->setCurrentIndex(tmp.compType);
         ui->transferCompression->setChecked(tmp.transferCompression);
         ui->backupType->setCurrentIndex(tmp.backupType);
+        ui->shards->setValue(tmp.shards);
+        ui->workers->setValue(tmp.workers);
+        ui->keep->setValue(tmp.keep);
+        ui->compressionThreads->setValue(tmp.compressionThreads);
+        ui->compressionMemory->setValue(tmp.compressionMemory);
+        ui->streamArchive->setChecked(tmp.streamArchive);
+        ui->archiveMirror->setChecked(tmp.archiveMirror);
+        ui->seekableArchive->setChecked(tmp.seekableArchive);
+        ui->zstdLevel->setValue(tmp.zstdLevel);
+        ui->zstdLongWindow->setChecked(tmp.zstdLongWindow);
+        ui->fileIndex->setChecked(tmp.fileIndex);
+        ui->staggerWindow->setValue(tmp.staggerWindow);
+        ui->ioWeight->setValue(tmp.ioWeight);
+        ui->readBandwidth->setValue(tmp.readBandwidth);
+        ui->writeBandwidth->setValue(tmp.writeBandwidth);
+        ui->cpuWeight->setValue(tmp.cpuWeight);
+        ui->cpuQuota->setValue(tmp.cpuQuota);
+        ui->niceLevel->setValue(tmp.nice);
+        ui->ioClass->setCurrentIndex(tmp.ioClass);
+        ui->bwLimit->setValue(tmp.bwLimit);
+        ui->pressureTarget->setValue(tmp.pressureTarget);
+        ui->latencyTarget->setValue(tmp.latencyTarget);
 }
 
 void MainWindow::set_days_from_array(const Days &days)
@@ -201,7 +287,9 @@ void MainWindow::clear_form()
 {
         ui->jobName->setText("");
         ui->source->setText("");
+        ui->moreSources->setPlainText("");
         ui->destination->setText("");
+        ui->moreDests->setPlainText("");
         ui->recurring->setChecked(true);
         ui->timeEdit->setTime(QTime::currentTime());
         ui->command->setPlainText("");
@@ -209,6 +297,28 @@ void MainWindow::clear_form()
         ui->backupCompression->setCurrentIndex(0);
         ui->backupType->setCurrentIndex(0);
         ui->transferCompression->setChecked(0);
+        ui->shards->setValue(1);
+        ui->workers->setValue(1);
+        ui->keep->setValue(0);
+        ui->compressionThreads->setValue(0);
+        ui->compressionMemory->setValue(0);
+        ui->streamArchive->setChecked(false);
+        ui->archiveMirror->setChecked(false);
+        ui->seekableArchive->setChecked(false);
+        ui->zstdLevel->setValue(0);
+        ui->zstdLongWindow->setChecked(false);
+        ui->fileIndex->setChecked(false);
+        ui->staggerWindow->setValue(0);
+        ui->ioWeight->setValue(0);
+        ui->readBandwidth->setValue(0);
+        ui->writeBandwidth->setValue(0);
+        ui->cpuWeight->setValue(0);
+        ui->cpuQuota->setValue(0);
+        ui->niceLevel->setValue(0);
+        ui->ioClass->setCurrentIndex(DEFAULT_IO);
+        ui->bwLimit->setValue(0);
+        ui->pressureTarget->setValue(0);
+        ui->latencyTarget->setValue(0);
 
         for (size_t i = 0; i < checkboxes.size(); i++) {
                 checkboxes[i]->setChecked(false);
@@ -269,18 +379,32 @@ void MainWindow::on_finish_clicked()
                 show_error_dialog("Invalid job name. Cannot contain spaces or special characters");
                 return;
         }
+        if ((create_sources().size() > 1 || create_dests().size() > 1)
+            && ui->backupType->currentIndex() >= NATIVE) {
+                show_error_dialog(
+                        "More than one source or destination needs an rsync backup type.");
+                return;
+        }
+        if (create_dests().size() > 1
+            && (ui->transferCompression->isChecked() || ui->bwLimit->value() > 0)) {
+                show_error_dialog("More than one destination can not be combined with transfer "
+                                  "compression or a bandwidth limit.");
+                return;
+        }
         ui->tabs->setCurrentIndex(JOBS);
         if (!isUpdating) {
                 status = manager->add_new_job(create_job());
                 if (!status) {
-                        ui->jobNamesList->addItem(ui->jobName->text());
+                        jobs->add_job(ui->jobName->text());
                         clear_form();
                 }
 
         } else {
                 status = manager->update_job(create_job());
-                if (!status)
+                if (!status) {
+                        jobs->update_job(ui->jobName->text());
                         clear_form();
+                }
                 ui->jobName->setEnabled(true);
                 isUpdating = false;
         }
@@ -292,22 +416,37 @@ void MainWindow::on_newButton_clicked()
         ui->tabs->setCurrentIndex(SETTINGS);
 }
 
-void MainWindow::on_jobNamesList_itemSelectionChanged()
+void MainWindow::on_job_selected()
 {
-        QString jobname = ui->jobNamesList->selectedItems().first()->text();
+        QString jobname = selected_job();
+        if (jobname.isEmpty())
+                return;
         QString jobText = manager->get_job_text(jobname);
         if (jobText == "") {
                 show_error_dialog("Job not found!");
                 return;
         }
-        ui->jobInfo->setPlainText(jobText);
+        ui->jobInfo->setPlainText(jobText + format_history(jobname));
+        ui->runProgress->setText(monitor->is_watching(jobname)
+                                         ? format_progress(monitor->get_progress(jobname))
+                                         : "");
+}
+
+void MainWindow::on_jobFilter_textChanged(const QString &text)
+{
+        jobs->set_filter(text);
+}
+
+void MainWindow::on_jobSort_currentIndexChanged(int index)
+{
+        jobs->set_sort((JobListModel::SortKey)index);
 }
 
 void MainWindow::on_editButton_clicked()
 {
         ui->tabs->setCurrentIndex(SETTINGS);
         try {
-                edit_job(manager->get_job(ui->jobNamesList->currentItem()->text().toStdString()));
+                edit_job(manager->get_job(selected_job().toStdString()));
         } catch (std::exception &e) {
                 show_error_dialog(e.what());
         }
@@ -326,12 +465,7 @@ void MainWindow::create_checkbox_array()
 
 void MainWindow::on_enableButton_clicked()
 {
-        int status = manager->enable_job(ui->jobNamesList->currentItem()->text());
-        if (status)
-                show_error_dialog("Unable to enable job.");
-        else
-                ui->jobInfo->setPlainText(
-                        manager->get_job_text(ui->jobNamesList->currentItem()->text()));
+        set_selected_enabled(true);
 }
 
 void MainWindow::on_actionExit_triggered()
@@ -349,17 +483,92 @@ void MainWindow::closeEvent([[maybe_unused]] QCloseEvent *event)
 
 void MainWindow::on_runButton_clicked()
 {
-        manager->run_job(ui->jobNamesList->currentItem()->text());
+        QString name = selected_job();
+        if (name.isEmpty())
+                return;
+        // Followed before starting, so the first progress lines are not missed.
+        monitor->watch(name);
+        if (manager->run_job(name) != 0)
+                monitor->unwatch(name);
+        else if (name == selected_job())
+                ui->runProgress->setText("Starting...");
+}
+
+void MainWindow::on_restoreButton_clicked()
+{
+        QString name = selected_job();
+        if (name.isEmpty())
+                return;
+        QString target = QFileDialog::getExistingDirectory(
+                this, tr("Restore %1 Into").arg(name), "/",
+                QFileDialog::ShowDirsOnly | QFileDialog::DontResolveSymlinks);
+        if (target.isEmpty())
+                return;
+        bool ok = false;
+        QString paths = QInputDialog::getText(
+                this, tr("Restore %1").arg(name),
+                tr("Paths in the backup to restore, separated by spaces. Leave empty for all."),
+                QLineEdit::Normal, "", &ok);
+        if (!ok)
+                return;
+
+        ui->restoreButton->setEnabled(false);
+        ui->runProgress->setText("Restoring " + name + "...");
+        manager->restore_job_async(
+                name, target, paths.split(' ', QString::SkipEmptyParts),
+                [this, name](const QJsonObject &result) {
+                        ui->restoreButton->setEnabled(true);
+                        ui->runProgress->clear();
+                        if (!result["Ok"].toBool()) {
+                                show_error_dialog("Unable to restore " + name + ": "
+                                                  + result["Error"].toString());
+                                return;
+                        }
+                        double mib = result["Bytes"].toDouble() / (1 << 20);
+                        QMessageBox::information(
+                                this, tr("Restore"),
+                                tr("Restored %1 MiB of %2 in %3 s (%4 MiB/s) with %5 %6.")
+                                        .arg(mib, 0, 'f', 1)
+                                        .arg(name)
+                                        .arg(result["Seconds"].toDouble(), 0, 'f', 1)
+                                        .arg(result["BytesPerSecond"].toDouble() / (1 << 20), 0,
+                                             'f', 1)
+                                        .arg(result["Workers"].toInt())
+                                        .arg(result["Method"].toString() == "rsync"
+                                                     ? tr("rsync processes")
+                                                     : tr("workers")));
+                });
 }
 
 void MainWindow::on_disableButton_clicked()
 {
-        int status = manager->disable_job(ui->jobNamesList->currentItem()->text());
-        if (status)
-                show_error_dialog("Unable to disable job.");
-        else
-                ui->jobInfo->setPlainText(
-                        manager->get_job_text(ui->jobNamesList->currentItem()->text()));
+        set_selected_enabled(false);
+}
+
+void MainWindow::set_selected_enabled(bool enable)
+{
+        QStringList names = selected_jobs();
+        if (names.isEmpty())
+                return;
+        ui->enableButton->setEnabled(false);
+        ui->disableButton->setEnabled(false);
+        manager->set_jobs_enabled_async(
+                enable, names, [this, enable](const std::map<QString, QString> &errors) {
+                        QStringList failed;
+                        for (const auto &result : errors) {
+                                jobs->update_job(result.first);
+                                if (!result.second.isEmpty())
+                                        failed.append(result.first + ": " + result.second);
+                        }
+                        manager->save_jobs();
+                        ui->enableButton->setEnabled(true);
+                        ui->disableButton->setEnabled(true);
+                        on_job_selected();
+                        if (!failed.isEmpty())
+                                show_error_dialog(QString("Unable to %1 jobs:\n")
+                                                          .arg(enable ? "enable" : "disable")
+                                                  + failed.join('\n'));
+                });
 }
 
 void MainWindow::on_recurring_stateChanged(int state)
@@ -370,14 +579,59 @@ void MainWindow::on_recurring_stateChanged(int state)
                 disable_recurring_elements();
 }
 
+void MainWindow::on_staggerWindow_valueChanged([[maybe_unused]] int minutes)
+{
+        update_stagger_preview();
+}
+
+void MainWindow::on_timeEdit_timeChanged([[maybe_unused]] const QTime &time)
+{
+        update_stagger_preview();
+}
+
+void MainWindow::update_stagger_preview()
+{
+        static const QString bars = QString::fromUtf8("▁▂▃▄▅▆▇█");
+        BackupJob job(ui->jobName->text(), "", "", "", create_days(), create_flags(),
+                      create_time());
+        std::vector<int> counts = manager->get_concurrency(job, 48);
+        int peak = *std::max_element(counts.begin(), counts.end());
+        QString chart;
+        for (int count : counts) {
+                if (count == 0)
+                        chart += ' ';
+                else
+                        chart += bars[peak > 1 ? (count - 1) * (bars.size() - 1) / (peak - 1) : 0];
+        }
+        ui->staggerPreview->setText(QString("Running at once: %1 (peak %2)").arg(chart).arg(peak));
+}
+
 void MainWindow::on_deleteButton_clicked()
 {
-        int status = manager->delete_job(ui->jobNamesList->currentItem()->text());
+        QString name = selected_job();
+        int status = manager->delete_job(name);
         if(status)
                 show_error_dialog("Unable to delete job.");
-        else {
-                ui->jobNamesList->clear();
-                add_jobs_to_list();
-        }
+        else
+                jobs->remove_job(name);
 
 }
+
+void MainWindow::show_run_progress(const QString &name, const RunProgress &progress)
+{
+        if (name == selected_job())
+                ui->runProgress->setText(format_progress(progress));
+}
+
+void MainWindow::show_run_finished(const QString &name, const QString &result)
+{
+        manager->forget_duration(name);
+        jobs->update_job(name);
+        QString text = result == "success" ? name + " finished."
+                                           : name + " failed (" + result + ").";
+        ui->statusbar->showMessage(text);
+        if (name == selected_job()) {
+                on_job_selected(); // shows the run that was just recorded
+                ui->runProgress->setText(text);
+        }
+}
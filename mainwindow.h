@@ -20,10 +20,15 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include "joblistmodel.h"
 #include "manager.h"
+#include "runhistory.h"
+#include "runmonitor.h"
 #include <QCloseEvent>
 #include <QFileDialog>
+#include <QInputDialog>
 #include <QMainWindow>
+#include <QMessageBox>
 #include <stdexcept>
 
 QT_BEGIN_NAMESPACE
@@ -91,7 +96,19 @@ class MainWindow : public QMainWindow
          * \brief Handles when the job selection is changed.
          * This changes the preview pane in the jobs tab.
          */
-        void on_jobNamesList_itemSelectionChanged();
+        void on_job_selected();
+
+        /*!
+         * \brief Shows only the jobs whose name contains the filter text.
+         * \param Filter text.
+         */
+        void on_jobFilter_textChanged(const QString &text);
+
+        /*!
+         * \brief Sorts the job list by the selected key.
+         * \param Index of the sort key.
+         */
+        void on_jobSort_currentIndexChanged(int index);
 
         /*!
          * \brief Handles when the edit button is clicked. Loads all of the information
@@ -114,6 +131,11 @@ class MainWindow : public QMainWindow
          */
         void on_runButton_clicked();
 
+        /*!
+         * \brief Asks for a target directory and paths, then restores the selected job.
+         */
+        void on_restoreButton_clicked();
+
         /*!
          * \brief Tells systemd to disable the job.
          */
@@ -121,16 +143,40 @@ class MainWindow : public QMainWindow
 
         void on_recurring_stateChanged(int state);
 
+        /*!
+         * \brief Updates the concurrency preview for the new stagger window.
+         */
+        void on_staggerWindow_valueChanged(int minutes);
+
+        /*!
+         * \brief Updates the concurrency preview for the new start time.
+         */
+        void on_timeEdit_timeChanged(const QTime &time);
+
         /*!
          * \brief Deletes the specified job.
          */ 
         void on_deleteButton_clicked();
 
+        /*!
+         * \brief Shows the progress of a running job if it is selected.
+         */
+        void show_run_progress(const QString &name, const RunProgress &progress);
+
+        /*!
+         * \brief Shows how a job's run ended and updates its row.
+         */
+        void show_run_finished(const QString &name, const QString &result);
+
 private:
         Ui::MainWindow *ui;
 
         Manager *manager;
 
+        JobListModel *jobs;
+
+        RunMonitor *monitor;
+
         std::array<QCheckBox *, 7> checkboxes;
 
         bool commandGenerated;
@@ -147,39 +193,6 @@ private:
          */
         QString generate() const;
 
-        /*!
-         * \brief Selects the backup type.
-         * Options: \n
-         * 1. Incremental \n
-         * 2. Incremental W/O Delta Copy \n
-         * 3. Full Backup \n
-         * 4. Full Backup W/O Delta Copy \n
-         * \return QString containing the flags for the backup type selected.
-         */
-        QString selectBackupType() const;
-
-        /*!
-         * \brief Selects when to delete files.
-         * Options: \n
-         * 1. During copy \n
-         * 2. After Copy \n
-         * 3. Before Copy \n
-         * \return QString containing proper delete flag.
-         */
-        QString selectDeleteType() const;
-
-        /*!
-         * \brief Selects the type of compression to use for the backup.
-         * Options: \n
-         * 1. None \n
-         * 2. Tarball \n
-         * 3. Tar w/ gzip \n
-         * 4. Tar w/ bzip2 \n
-         * 5. Tar w/ xz \n
-         * \return QString containing the compression command.
-         */
-        QString selectCompressionType() const;
-
         /*!
          * \brief Creates a BackupJob object based on the fields of the UI.
          * \return BackupJob object with user data.
@@ -192,6 +205,19 @@ private:
          */
         JobFlags create_flags() const;
 
+        /*!
+         * \brief Creates the job's sources from the source field and the extra sources.
+         * \return Sources with their excludes, the source field first.
+         */
+        JobSources create_sources() const;
+
+        /*!
+         * \brief Creates the job's destinations from the destination field and the extra
+         * destinations.
+         * \return Destinations, the destination field first.
+         */
+        QStringList create_dests() const;
+
         /*!
          * \brief Creates the days array based on the checkboxes.
          * \return Days array with correct values set;
@@ -205,10 +231,54 @@ private:
         QString create_time() const;
 
         /*!
-         * \brief Take jobs from manager's jobs map and list them in the QListWidget.
+         * \brief Lists the manager's jobs in the job view.
          */
         void add_jobs_to_list();
 
+        /*!
+         * \brief Retrieves the name of the job selected in the job view.
+         * \return Name of the job, or an empty string if none is selected.
+         */
+        QString selected_job() const;
+
+        /*!
+         * \brief Follows the jobs that were already running when the window opened.
+         */
+        void watch_running_jobs();
+
+        /*!
+         * \brief Formats a job's progress for the progress label.
+         * \param The progress.
+         * \return Text with the throughput, files per second, bytes and ETA.
+         */
+        static QString format_progress(const RunProgress &progress);
+
+        /*!
+         * \brief Summarizes a job's recent runs for the info pane.
+         * \param Name of the job.
+         * \return Text with the run counts, means and a throughput chart, or an empty
+         * string if the job has not run yet.
+         */
+        QString format_history(const QString &name) const;
+
+        /*!
+         * \brief Shows how many jobs are expected to run at once with the job in the form.
+         */
+        void update_stagger_preview();
+
+        /*!
+         * \brief Retrieves the names of every job selected in the job view.
+         * \return Names of the jobs.
+         */
+        QStringList selected_jobs() const;
+
+        /*!
+         * \brief Enables or disables the selected jobs in one request to systemd.
+         * The window stays responsive while systemd answers.
+         * \param True to enable, false to disable.
+         */
+        void set_selected_enabled(bool enable);
+
         /*!
          * \brief Loads a job's information into the Settings form.
          * \param BackupJob to load.
@@ -18,22 +18,33 @@
 */
 
 #include "manager.h"
+#include "runhistory.h"
 #include <QFile>
+#include <QProcess>
+#include <QTime>
+#include <QtDBus/QDBusArgument>
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <pwd.h>
 #include <unistd.h>
 
-Manager::Manager()
+Manager::Manager() : Manager(CONFIG_DIRECTORY, "/usr/lib/systemd/system/")
+{
+}
+
+Manager::Manager(const QString &configPath, const QString &servicePath)
+        : servicePath(servicePath), configPath(configPath)
 {
-        servicePath = "/usr/lib/systemd/system/";
-        configPath = "/etc/rbackup/";
         backupPath = configPath + "backups.json";
+        store = std::make_unique<JobStore>(backupPath, configPath + "backups.cat");
+        systemd = std::make_unique<SystemdClient>();
+        receiver = std::make_unique<QObject>();
         if (!std::filesystem::exists(configPath.toStdString())) {
-                bool status = std::filesystem::create_directory(configPath.toStdString());
+                bool status = std::filesystem::create_directories(configPath.toStdString());
                 if (!status) {
                         throw std::system_error();
                 }
@@ -41,49 +52,107 @@ Manager::Manager()
         load_jobs();
 }
 
-int Manager::save_jobs()
+Manager::~Manager()
 {
-        QJsonArray arr;
-        QJsonObject obj;
-        for (const auto &job : jobs) {
-                arr.append(job_to_json(job.second));
-        }
+        if (unitWriter.joinable())
+                unitWriter.join();
+}
 
-        QFile backups(backupPath);
+std::map<QString, QJsonObject> Manager::get_changes() const
+{
+        // Deleted jobs are recorded as empty objects.
+        std::map<QString, QJsonObject> changes;
+        for (const auto &name : changed) {
+                auto it = jobs.find(name);
+                changes[QString::fromStdString(name)] =
+                        it != jobs.end() ? job_to_json(it->second) : QJsonObject();
+        }
+        return changes;
+}
 
-        if (!backups.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+int Manager::save_jobs()
+{
+        if (store->append(get_changes()) != 0) {
                 show_error_dialog("Unable to save backups!");
                 return -1;
         }
-        obj["jobs"] = arr;
-        QJsonDocument doc(obj);
-        backups.write(doc.toJson());
+        changed.clear();
+        if (store->needs_compaction(jobs.size()))
+                return compact_jobs();
         return 0;
 }
 
+int Manager::compact_jobs()
+{
+        // The store merges these into what is on disk, then the merged catalog is loaded back.
+        if (store->compact(get_changes()) != 0) {
+                show_error_dialog("Unable to save backups!");
+                return -1;
+        }
+        changed.clear();
+        return load_jobs();
+}
+
+int Manager::set_catalog_format(bool binary)
+{
+        store->set_binary(binary);
+        return compact_jobs();
+}
+
 int Manager::load_jobs()
 {
-        QJsonObject obj = load_json_document(backupPath);
-        if (obj.isEmpty())
+        std::map<QString, QJsonObject> saved;
+        std::set<QString> deleted;
+        jobs.clear();
+        lazy.clear();
+        schedules.clear();
+        if (store->load(saved, deleted) != 0)
                 return -1;
-        QJsonArray arr = obj["jobs"].toArray();
 
         BackupJob job;
-        for (int i = 0; i < arr.size(); i++) {
-                job = job_from_json(arr[i].toObject());
+        for (const auto &entry : saved) {
+                job = job_from_json(entry.second);
                 jobs[job.name.toStdString()] = job;
         }
+        // Only the names are read now; the rest of a job is decoded when it is used.
+        const JobCatalog *catalog = store->get_catalog();
+        for (uint64_t i = 0; catalog != nullptr && i < catalog->size(); i++) {
+                QString name = catalog->name(i);
+                if (saved.count(name) == 0 && deleted.count(name) == 0)
+                        lazy[name.toStdString()] = i;
+        }
         return 0;
 }
 
+bool Manager::reload_jobs()
+{
+        if (!changed.empty() || !store->is_stale())
+                return false;
+        load_jobs();
+        return true;
+}
+
+bool Manager::resolve(const std::string &name)
+{
+        if (jobs.count(name) != 0)
+                return true;
+        auto it = lazy.find(name);
+        if (it == lazy.end())
+                return false;
+        jobs[name] = job_from_json(store->get_catalog()->read(it->second));
+        lazy.erase(it);
+        return true;
+}
+
 int Manager::add_new_job(BackupJob job)
 {
         std::string tmp = job.name.toStdString();
-        if (jobs.count(tmp) != 0) {
+        if (resolve(tmp)) {
                 show_error_dialog("A job with that name already exists!");
                 return -1;
         }
         jobs[tmp] = job;
+        changed.insert(tmp);
         return 0;
 }
 
@@ -93,12 +162,14 @@ std::list<std::string> Manager::get_job_names() const
         for (const auto &key : jobs) {
                 list.push_back(key.first);
         }
+        for (const auto &key : lazy)
+                list.push_back(key.first);
         return list;
 }
 
 QString Manager::get_job_text(QString name)
 {
-        if (jobs.count(name.toStdString()) != 0)
+        if (resolve(name.toStdString()))
                 return jobs[name.toStdString()].to_string();
         else
                 return "";
@@ -107,80 +178,187 @@ QString Manager::get_job_text(QString name)
 int Manager::update_job(BackupJob job)
 {
         std::string jobname = job.name.toStdString();
-        if (jobs.count(jobname) != 0) {
+        if (resolve(jobname)) {
+                // Editing a job does not change what is already in its destination.
+                job.snapshots = jobs[jobname].snapshots;
                 jobs[jobname] = job;
+                changed.insert(jobname);
                 return 0;
         }
         show_error_dialog("Unable to update job.");
         return -1;
 }
 
+int Manager::set_snapshots(const QString &name, const QStringList &snapshots)
+{
+        if (!resolve(name.toStdString()))
+                return -1;
+        jobs[name.toStdString()].snapshots = snapshots;
+        changed.insert(name.toStdString());
+        return 0;
+}
+
 const BackupJob &Manager::get_job(const std::string &name)
 {
+        resolve(name);
         return jobs[name];
 }
 
 int Manager::enable_job(const QString &name)
 {
-        int status = -1;
-        if (jobs.count(name.toStdString()) != 0) {
-                jobs[name.toStdString()].enabled = true;
-                status = create_systemd_objects(name);
-                if(status == -1) {
-                        std::cerr << "Failed to create systemd objects.\n";
+        std::map<QString, QString> errors;
+        int status = enable_jobs({name}, errors);
+        if (status != 0)
+                std::cerr << errors[name].toStdString() << "\n";
+        return status;
+}
+
+int Manager::disable_job(const QString &name)
+{
+        std::map<QString, QString> errors;
+        int status = disable_jobs({name}, errors);
+        if (status != 0)
+                std::cerr << errors[name].toStdString() << "\n";
+        return status;
+}
+
+int Manager::enable_jobs(const QStringList &names, std::map<QString, QString> &errors)
+{
+        return set_jobs_enabled(true, names, errors);
+}
+
+int Manager::disable_jobs(const QStringList &names, std::map<QString, QString> &errors)
+{
+        return set_jobs_enabled(false, names, errors);
+}
+
+void Manager::set_jobs_enabled_async(bool enable, const QStringList &names,
+                                     std::function<void(const std::map<QString, QString> &)> done)
+{
+        auto errors = std::make_shared<std::map<QString, QString>>();
+        std::vector<BackupJob> ready = mark_enabled(enable, names, *errors);
+        // Writing the units waits on the disk, so it is kept off the event loop. Each
+        // writer waits for the one before it, so joining the last joins them all.
+        std::thread previous = std::move(unitWriter);
+        unitWriter = std::thread([this, enable, ready, errors, done,
+                                  previous = std::move(previous)]() mutable {
+                if (previous.joinable())
+                        previous.join();
+                QStringList units = write_units(ready, *errors);
+                // Dropped unanswered if the receiver is destroyed first.
+                QMetaObject::invokeMethod(
+                        receiver.get(),
+                        [this, enable, units, errors, done]() {
+                                set_unit_files_async(enable, units, errors, done);
+                        },
+                        Qt::QueuedConnection);
+        });
+}
+
+void Manager::set_unit_files_async(bool enable, const QStringList &units,
+                                   std::shared_ptr<std::map<QString, QString>> errors,
+                                   std::function<void(const std::map<QString, QString> &)> done)
+{
+        systemd->set_unit_files_async(enable, units, [this, enable, units, errors, done](
+                                                             const QString &error,
+                                                             const QStringList &) {
+                if (error.isEmpty()) {
+                        assign_unit_errors(enable, units, error, {}, *errors);
+                        done(*errors);
+                        return;
                 }
-                QDBusInterface interface("org.freedesktop.systemd1", "/org/freedesktop/systemd1",
-                                         "org.freedesktop.systemd1.Manager",
-                                         QDBusConnection::systemBus());
-                QDBusReply<QDBusVariant> reply;
-                QDBusMessage msg;
-                QStringList arg = {name + ".timer"};
-                if (!interface.isValid()) {
-                        show_error_dialog("Unable to connect to systemd.");
+                systemd->get_unit_file_states_async(
+                        units, [enable, units, error, errors,
+                                done](const std::map<QString, QString> &states) {
+                                assign_unit_errors(enable, units, error, states, *errors);
+                                done(*errors);
+                        });
+        });
+}
+
+int Manager::set_jobs_enabled(bool enable, const QStringList &names,
+                              std::map<QString, QString> &errors)
+{
+        errors.clear();
+        QStringList units = write_units(mark_enabled(enable, names, errors), errors);
+        QStringList changes;
+        QString error = systemd->set_unit_files(enable, units, changes);
+        std::map<QString, QString> states;
+        for (const auto &unit : error.isEmpty() ? QStringList() : units)
+                states[unit] = systemd->get_unit_file_state(unit);
+        assign_unit_errors(enable, units, error, states, errors);
+        for (const auto &entry : errors) {
+                if (!entry.second.isEmpty())
                         return -1;
+        }
+        return 0;
+}
+
+std::vector<BackupJob> Manager::mark_enabled(bool enable, const QStringList &names,
+                                             std::map<QString, QString> &errors)
+{
+        std::vector<BackupJob> ready;
+        for (const auto &name : names) {
+                if (!resolve(name.toStdString())) {
+                        errors[name] = "Job not found.";
+                        continue;
                 }
-                msg = interface.call("EnableUnitFiles", arg, false, true);
-                std::cerr << msg.errorMessage().toStdString() << "\n";
-                interface.call("Reload");
+                jobs[name.toStdString()].enabled = enable;
+                changed.insert(name.toStdString());
+                ready.push_back(jobs[name.toStdString()]);
         }
-        return status;
+        return ready;
 }
 
-int Manager::disable_job(const QString &name)
+QStringList Manager::write_units(const std::vector<BackupJob> &ready,
+                                 std::map<QString, QString> &errors) const
 {
-        int status = -1;
-        if (jobs.count(name.toStdString()) != 0) {
-                jobs[name.toStdString()].enabled = false;
-                status = create_systemd_objects(name);
-                QDBusInterface interface("org.freedesktop.systemd1", "/org/freedesktop/systemd1",
-                                         "org.freedesktop.systemd1.Manager",
-                                         QDBusConnection::systemBus());
-                QDBusReply<QDBusVariant> reply;
-                QDBusMessage msg;
-                QStringList arg = {name + ".timer"};
-                if (!interface.isValid()) {
-                        show_error_dialog("Unable to connect to systemd.");
-                        return -1;
+        QStringList units;
+        for (const auto &job : ready) {
+                if (write_systemd_objects(job) != 0) {
+                        errors[job.name] = "Failed to create systemd objects.";
+                        continue;
                 }
-                msg = interface.call("DisableUnitFiles", arg, false);
-                std::cerr << msg.errorMessage().toStdString() << "\n";
-                interface.call("Reload");
+                units.append(job.name + ".timer");
         }
-        return status;
+        return units;
+}
+
+void Manager::assign_unit_errors(bool enable, const QStringList &units, const QString &error,
+                                 const std::map<QString, QString> &states,
+                                 std::map<QString, QString> &errors)
+{
+        // Unit names are "<job>.timer".
+        for (const auto &unit : units)
+                errors[unit.chopped(6)] = "";
+        if (error.isEmpty())
+                return;
+
+        // systemd answers for the whole batch, so the units' states tell which ones it
+        // left unchanged.
+        QStringList failed;
+        for (const auto &unit : units) {
+                auto found = states.find(unit);
+                QString state = found != states.end() ? found->second : QString();
+                if (enable ? !state.startsWith("enabled") : state != "disabled")
+                        failed.append(unit);
+        }
+        // Every unit was changed, so it was the reload that failed, which concerns them all.
+        if (failed.isEmpty())
+                failed = units;
+        for (const auto &unit : failed)
+                errors[unit.chopped(6)] = error;
 }
 
 int Manager::run_job(const QString &name)
 {
-        if (jobs.count(name.toStdString()) != 0) {
-                QDBusInterface interface("org.freedesktop.systemd1", "/org/freedesktop/systemd1",
-                                         "org.freedesktop.systemd1.Manager",
-                                         QDBusConnection::systemBus());
+        if (resolve(name.toStdString())) {
                 QDBusReply<QDBusObjectPath> reply;
-                if (!interface.isValid()) {
+                if (!systemd->is_valid()) {
                         show_error_dialog("Unable to connect to systemd.");
                         return -1;
                 }
-                reply = interface.call("StartUnit", name + ".service", "replace");
+                reply = systemd->get_interface().call("StartUnit", name + ".service", "replace");
                 if (!reply.isValid()) {
                         std::cerr << reply.error().name().toStdString() << "\n";
                         return -1;
@@ -192,17 +370,219 @@ int Manager::run_job(const QString &name)
         return -1;
 }
 
+void Manager::restore_job_async(const QString &name, const QString &target,
+                                const QStringList &paths,
+                                std::function<void(const QJsonObject &)> done)
+{
+        QProcess *process = new QProcess();
+        process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        QObject::connect(process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+                         [process, done](int, QProcess::ExitStatus) {
+                                 // The JSON result is the last line, after rsync's statistics.
+                                 QList<QByteArray> lines =
+                                         process->readAllStandardOutput().trimmed().split('\n');
+                                 process->deleteLater();
+                                 done(QJsonDocument::fromJson(lines.last()).object());
+                         });
+        QObject::connect(process, &QProcess::errorOccurred,
+                         [process, done](QProcess::ProcessError error) {
+                                 if (error != QProcess::FailedToStart)
+                                         return;
+                                 process->deleteLater();
+                                 done(QJsonObject{{"Ok", false},
+                                                  {"Error", "Unable to start rbackup."}});
+                         });
+        process->start("rbackup", QStringList{"restore", name, target} + paths);
+}
+
+QString Manager::get_history_path(const QString &name) const
+{
+        return configPath + name + ".history";
+}
+
+int Manager::get_expected_duration(const QString &name) const
+{
+        std::vector<RunRecord> records;
+        RunHistory(get_history_path(name).toStdString()).read(records, 10);
+        return (int)RunHistory::trend(records).meanDuration;
+}
+
+std::vector<int> Manager::get_concurrency(const BackupJob &job, int buckets)
+{
+        constexpr int day = 24 * 60 * 60;
+        constexpr int unknownDuration = 10 * 60;
+        std::vector<int> counts(std::max(buckets, 1), 0);
+        QTime set = QTime::fromString(job.time);
+        if (!set.isValid())
+                return counts;
+        int base = set.msecsSinceStartOfDay() / 1000;
+        int expected = get_cached_duration(job.name);
+        int length = std::max(job.flags.staggerWindow * 60, 60)
+                     + (expected > 0 ? expected : unknownDuration);
+        auto every_day = [](const Days &days) {
+                return std::none_of(days.begin(), days.end(), [](bool on) { return on; });
+        };
+
+        auto count = [&](const BackupJob &other) {
+                bool shared = every_day(job.days) || every_day(other.days);
+                for (size_t i = 0; i < job.days.size() && !shared; i++)
+                        shared = job.days[i] && other.days[i];
+                QTime start = QTime::fromString(other.time);
+                if (!shared || !other.flags.recurring || !start.isValid())
+                        return;
+                int duration = get_cached_duration(other.name);
+                if (duration <= 0)
+                        duration = unknownDuration;
+                int from = (start.msecsSinceStartOfDay() / 1000
+                            + other.get_stagger_offset(duration) - base + 2 * day) % day;
+                // Started shortly before the window and still running.
+                if (from > day - duration)
+                        from -= day;
+                for (size_t b = 0; b < counts.size(); b++) {
+                        int first = (int)(b * length / counts.size());
+                        int last = (int)((b + 1) * length / counts.size());
+                        if (from < last && from + duration > first)
+                                counts[b]++;
+                }
+        };
+
+        count(job);
+        // Disabled jobs are skipped, and the others only have their timer fields read.
+        for (const auto &name : get_job_names()) {
+                QString other = QString::fromStdString(name);
+                if (other == job.name || !is_job_enabled(other))
+                        continue;
+                const BackupJob *schedule = get_schedule(name);
+                if (schedule != nullptr)
+                        count(*schedule);
+        }
+        return counts;
+}
+
+void Manager::forget_duration(const QString &name)
+{
+        durations.erase(name.toStdString());
+}
+
+const BackupJob *Manager::get_schedule(const std::string &name)
+{
+        auto job = jobs.find(name);
+        if (job != jobs.end())
+                return &job->second;
+        auto cached = schedules.find(name);
+        if (cached != schedules.end())
+                return &cached->second;
+        auto stored = lazy.find(name);
+        if (stored == lazy.end())
+                return nullptr;
+        QJsonObject json = store->get_catalog()->read(stored->second);
+        BackupJob schedule(QString::fromStdString(name), "", "", "",
+                           days_from_json(json["Days"].toObject()),
+                           jobflags_from_json(json["JobFlags"].toObject()),
+                           json["Time"].toString());
+        return &schedules.emplace(name, schedule).first->second;
+}
+
+int Manager::get_cached_duration(const QString &name)
+{
+        auto found = durations.find(name.toStdString());
+        if (found != durations.end())
+                return found->second;
+        int duration = get_expected_duration(name);
+        durations[name.toStdString()] = duration;
+        return duration;
+}
+
+bool Manager::has_job(const QString &name) const
+{
+        return jobs.count(name.toStdString()) != 0 || lazy.count(name.toStdString()) != 0;
+}
+
+bool Manager::is_job_enabled(const QString &name) const
+{
+        auto it = jobs.find(name.toStdString());
+        if (it != jobs.end())
+                return it->second.enabled;
+        auto stored = lazy.find(name.toStdString());
+        return stored != lazy.end() && store->get_catalog()->is_enabled(stored->second);
+}
+
+QString Manager::get_job_status(const QString &name)
+{
+        if (!has_job(name))
+                return "";
+        if (!systemd->is_valid())
+                return "";
+        QDBusInterface &interface = systemd->get_interface();
+        QDBusReply<QDBusObjectPath> reply = interface.call("LoadUnit", name + ".service");
+        if (!reply.isValid()) {
+                std::cerr << reply.error().name().toStdString() << "\n";
+                return "";
+        }
+        QDBusInterface unit("org.freedesktop.systemd1", reply.value().path(),
+                            "org.freedesktop.systemd1.Unit", QDBusConnection::systemBus());
+        return unit.property("ActiveState").toString();
+}
+
+std::unordered_map<std::string, ServiceState> Manager::get_service_states() const
+{
+        std::unordered_map<std::string, ServiceState> states;
+        if (!systemd->is_valid())
+                return states;
+        QDBusInterface &interface = systemd->get_interface();
+        QDBusMessage reply =
+                interface.call("ListUnitsByPatterns", QStringList(), QStringList{"*.service"});
+        if (reply.type() != QDBusMessage::ReplyMessage) {
+                std::cerr << reply.errorMessage().toStdString() << "\n";
+                return states;
+        }
+
+        // a(ssssssouso): name, description, load, active, sub, following, path, job...
+        const QDBusArgument units = reply.arguments().value(0).value<QDBusArgument>();
+        units.beginArray();
+        while (!units.atEnd()) {
+                QString name, description, load, active, state, following, jobType;
+                QDBusObjectPath path, jobPath;
+                uint jobId;
+                units.beginStructure();
+                units >> name >> description >> load >> active >> state >> following >> path
+                        >> jobId >> jobType >> jobPath;
+                units.endStructure();
+                std::string job = name.chopped(8).toStdString();
+                if (has_job(QString::fromStdString(job)))
+                        states[job] = ServiceState{active, path.path()};
+        }
+        units.endArray();
+        return states;
+}
+
 QJsonObject Manager::job_to_json(const BackupJob &job) const
 {
         QJsonObject json;
         json["Name"] = job.name;
         json["Src"] = job.src;
+        // Jobs with one plain source keep the layout older versions read.
+        if (job.sources.size() > 1
+            || (!job.sources.isEmpty() && !job.sources[0].excludes.isEmpty())) {
+                QJsonArray sources;
+                for (const auto &source : job.sources) {
+                        QJsonObject entry;
+                        entry["Path"] = source.path;
+                        entry["Excludes"] = QJsonArray::fromStringList(source.excludes);
+                        sources.append(entry);
+                }
+                json["Sources"] = sources;
+        }
         json["Dst"] = job.dest;
+        if (job.dests.size() > 1)
+                json["Dsts"] = QJsonArray::fromStringList(job.dests);
         json["Command"] = job.command;
         json["Enabled"] = job.enabled;
         json["Time"] = job.time;
         json["Days"] = days_to_json(job);
         json["JobFlags"] = jobflags_to_json(job);
+        if (!job.snapshots.isEmpty())
+                json["Snapshots"] = QJsonArray::fromStringList(job.snapshots);
         json["Service"] = servicePath + job.name + ".service";
         return json;
 }
@@ -230,6 +610,28 @@ QJsonObject Manager::jobflags_to_json(const BackupJob &job) const
         json["DeleteType"] = job.flags.deleteType;
         json["CompressionType"] = job.flags.compType;
         json["BackupType"] = job.flags.backupType;
+        json["Shards"] = job.flags.shards;
+        json["Workers"] = job.flags.workers;
+        json["Keep"] = job.flags.keep;
+        json["CompressionThreads"] = job.flags.compressionThreads;
+        json["CompressionMemory"] = job.flags.compressionMemory;
+        json["StreamArchive"] = job.flags.streamArchive;
+        json["ArchiveMirror"] = job.flags.archiveMirror;
+        json["SeekableArchive"] = job.flags.seekableArchive;
+        json["ZstdLevel"] = job.flags.zstdLevel;
+        json["ZstdLongWindow"] = job.flags.zstdLongWindow;
+        json["FileIndex"] = job.flags.fileIndex;
+        json["StaggerWindow"] = job.flags.staggerWindow;
+        json["IOWeight"] = job.flags.ioWeight;
+        json["ReadBandwidth"] = job.flags.readBandwidth;
+        json["WriteBandwidth"] = job.flags.writeBandwidth;
+        json["CPUWeight"] = job.flags.cpuWeight;
+        json["CPUQuota"] = job.flags.cpuQuota;
+        json["Nice"] = job.flags.nice;
+        json["IOSchedulingClass"] = job.flags.ioClass;
+        json["BandwidthLimit"] = job.flags.bwLimit;
+        json["PressureTarget"] = job.flags.pressureTarget;
+        json["LatencyTarget"] = job.flags.latencyTarget;
         return json;
 }
 
@@ -254,12 +656,33 @@ BackupJob Manager::job_from_json(const QJsonObject &json) const
         QJsonObject jdays = json["Days"].toObject();
         job.name = json["Name"].toString();
         job.src = json["Src"].toString();
+        for (const auto &value : json["Sources"].toArray()) {
+                QJsonObject entry = value.toObject();
+                QStringList excludes;
+                for (const auto &exclude : entry["Excludes"].toArray())
+                        excludes.append(exclude.toString());
+                BackupJob::add_source(job.sources, entry["Path"].toString(), excludes);
+        }
+        if (job.sources.isEmpty() && job.src != "")
+                job.sources.append({job.src, QStringList()});
+        else if (!job.sources.isEmpty())
+                job.src = job.sources.first().path;
         job.dest = json["Dst"].toString();
+        for (const auto &value : json["Dsts"].toArray()) {
+                if (!job.dests.contains(value.toString()))
+                        job.dests.append(value.toString());
+        }
+        if (job.dests.isEmpty() && job.dest != "")
+                job.dests.append(job.dest);
+        else if (!job.dests.isEmpty())
+                job.dest = job.dests.first();
         job.time = json["Time"].toString();
         job.command = json["Command"].toString();
         job.flags = jobflags_from_json(jflags);
         job.days = days_from_json(jdays);
         job.enabled = json["Enabled"].toBool();
+        for (const auto &snapshot : json["Snapshots"].toArray())
+                job.snapshots.append(snapshot.toString());
         return job;
 }
 
@@ -286,34 +709,43 @@ JobFlags Manager::jobflags_from_json(const QJsonObject &json) const
         flags.backupCompression = json["BackupCompression"].toBool();
         flags.transferCompression = json["TransferCompression"].toBool();
         flags.backupType = (BackupType)json["BackupType"].toInt();
+        flags.shards = json["Shards"].toInt(1);
+        flags.workers = json["Workers"].toInt(1);
+        flags.keep = json["Keep"].toInt();
+        flags.compressionThreads = json["CompressionThreads"].toInt();
+        flags.compressionMemory = json["CompressionMemory"].toInt();
+        flags.streamArchive = json["StreamArchive"].toBool();
+        flags.archiveMirror = json["ArchiveMirror"].toBool();
+        flags.seekableArchive = json["SeekableArchive"].toBool();
+        flags.zstdLevel = json["ZstdLevel"].toInt();
+        flags.zstdLongWindow = json["ZstdLongWindow"].toBool();
+        flags.fileIndex = json["FileIndex"].toBool();
+        flags.staggerWindow = json["StaggerWindow"].toInt();
+        flags.ioWeight = json["IOWeight"].toInt();
+        flags.readBandwidth = json["ReadBandwidth"].toInt();
+        flags.writeBandwidth = json["WriteBandwidth"].toInt();
+        flags.cpuWeight = json["CPUWeight"].toInt();
+        flags.cpuQuota = json["CPUQuota"].toInt();
+        flags.nice = json["Nice"].toInt();
+        flags.ioClass = (IOSchedulingClass)json["IOSchedulingClass"].toInt();
+        flags.bwLimit = json["BandwidthLimit"].toInt();
+        flags.pressureTarget = json["PressureTarget"].toInt();
+        flags.latencyTarget = json["LatencyTarget"].toInt();
         return flags;
 }
 
-QJsonObject Manager::load_json_document(const QString &path)
+int Manager::create_systemd_objects(const QString &name)
 {
-        QJsonDocument doc;
-        QFile file(path);
-        if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-                std::cerr << "File not found or could not be opened.\n";
-        } else {
-                QJsonParseError err;
-                doc = QJsonDocument::fromJson(file.readAll(), &err);
-                if (err.error != QJsonParseError::NoError) {
-                        std::cerr << "Error: " + err.errorString().toStdString() << "\n";
-                } else if (doc.isNull()) {
-                        std::cerr << "Configuration file not found.\n";
-                }
-        }
-        return doc.object();
+        if (!resolve(name.toStdString()))
+                return -1;
+        return write_systemd_objects(jobs[name.toStdString()]);
 }
 
-int Manager::create_systemd_objects(const QString &name)
+int Manager::write_systemd_objects(const BackupJob &job) const
 {
-        QFile timer(servicePath + name + ".timer");
-        QFile service(servicePath + name + ".service");
-        QFile script(configPath + name + ".sh");
-
-        BackupJob *job = &jobs[name.toStdString()];
+        QFile timer(servicePath + job.name + ".timer");
+        QFile service(servicePath + job.name + ".service");
+        QFile script(configPath + job.name + ".sh");
 
         if (!timer.open(QIODevice::WriteOnly | QIODevice::Truncate))
                 return -1;
@@ -321,10 +753,10 @@ int Manager::create_systemd_objects(const QString &name)
                 return -1;
         if (!script.open(QIODevice::WriteOnly | QIODevice::Truncate))
                 return -1;
-        script.write(job->make_shell_script().toUtf8());
-        service.write(job->get_service().toUtf8());
-        if (jobs[name.toStdString()].flags.recurring)
-                timer.write(job->get_timer().toUtf8());
+        script.write(job.make_shell_script().toUtf8());
+        service.write(job.get_service(configPath).toUtf8());
+        if (job.flags.recurring)
+                timer.write(job.get_timer(get_expected_duration(job.name)).toUtf8());
 
         script.setPermissions(QFileDevice::ExeUser | QFileDevice::ExeGroup | QFileDevice::ReadUser
                               | QFileDevice::ReadOther);
@@ -333,7 +765,7 @@ int Manager::create_systemd_objects(const QString &name)
 }
 
 int Manager::delete_job(const QString &name) {
-       if(jobs.count(name.toStdString()) != 0) {
+       if(resolve(name.toStdString())) {
                 QFile timer(servicePath + name + ".timer");
                 QFile service(servicePath + name + ".service");
                 QFile script(configPath + name + ".sh");
@@ -351,7 +783,12 @@ int Manager::delete_job(const QString &name) {
                         std::cerr << "Failed to remove status\r\n";
                         return -1;
                 }
+                QFile::remove(configPath + name + ".idx");
+                QFile::remove(configPath + name + ".journal");
+                QFile::remove(configPath + name + ".journal.pending");
+                QFile::remove(get_history_path(name));
                 jobs.erase(name.toStdString());
+                changed.insert(name.toStdString());
                 save_jobs();
        } 
         return 0;
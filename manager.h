@@ -21,35 +21,79 @@
 #define MANAGER_H
 
 #include "backupjob.h"
+#include "jobstore.h"
+#include "systemdclient.h"
 #include "utility.h"
 #include <QJsonObject>
+#include <QObject>
 #include <QVariant>
 #include <QtDBus/QDBusInterface>
 #include <QtDBus/QDBusReply>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+/*!
+ * \brief State of a job's service as systemd reports it.
+ */
+struct ServiceState {
+        QString activeState;
+        QString path;
+};
 
 class Manager
 {
     public:
         Manager();
-        ~Manager() = default;
+
+        /*!
+         * \param Directory holding backups.json and the job scripts, ending with a slash.
+         * \param Directory the systemd units are written to, ending with a slash.
+         */
+        Manager(const QString &configPath, const QString &servicePath);
+        ~Manager();
         Manager(const Manager &) = delete;
         Manager &operator=(const Manager &) = delete;
-        Manager(Manager &&) = default;
-        Manager &operator=(Manager &&) = default;
+        Manager(Manager &&) = delete;
+        Manager &operator=(Manager &&) = delete;
 
         /*!
-         * \brief Save all jobs to json.
+         * \brief Saves the jobs changed since the last save to the catalog's journal.
          * \return 0 for success, -1 for failure.
          */
         int save_jobs();
 
+        /*!
+         * \brief Writes every job to a new catalog snapshot and empties the journal.
+         * Jobs other processes saved meanwhile are kept and loaded back.
+         * \return 0 for success, -1 for failure.
+         */
+        int compact_jobs();
+
+        /*!
+         * \brief Rewrites the catalog in the given format.
+         * \param True for the binary catalog, false for backups.json.
+         * \return 0 for success, -1 for failure.
+         */
+        int set_catalog_format(bool binary);
+
         /*!
          * \brief Loads the backups into the manager.
          * \return 0 for success, -1 for failure;
          */
         int load_jobs();
 
+        /*!
+         * \brief Loads the backups again if another process saved them since they were loaded.
+         * Does nothing while this manager has unsaved changes.
+         * \return True if the jobs were loaded again.
+         */
+        bool reload_jobs();
+
         /*!
          * \brief Adds the given job to the jobs map.
          * \param Creates a copy of the BackupJob passed to it.
@@ -70,6 +114,36 @@ class Manager
          */
         QString get_job_text(QString name);
 
+        /*!
+         * \brief Gets the path of the file a job's runs are recorded in.
+         * \param Name of the job.
+         * \return Path of the history file.
+         */
+        QString get_history_path(const QString &name) const;
+
+        /*!
+         * \brief Estimates how long a job runs from its last successful runs.
+         * \param Name of the job.
+         * \return Mean length of the recorded runs in seconds, 0 if it has none.
+         */
+        int get_expected_duration(const QString &name) const;
+
+        /*!
+         * \brief Counts how many enabled jobs are expected to run at once while a job
+         * runs, from the staggered start and expected length of every job sharing a day.
+         * \param The job, which may have unsaved changes.
+         * \param Number of equal parts the stagger window and the job's run are split into.
+         * \return Number of jobs running in each part, the job itself included.
+         */
+        std::vector<int> get_concurrency(const BackupJob &job, int buckets);
+
+        /*!
+         * \brief Drops the expected duration get_concurrency() remembers for a job, so the
+         * next call reads the job's history again.
+         * \param Name of the job, typically one that just ran.
+         */
+        void forget_duration(const QString &name);
+
         /*!
          * \brief Update a job in the job's list.
          * \param job
@@ -77,6 +151,14 @@ class Manager
          */
         int update_job(BackupJob job);
 
+        /*!
+         * \brief Records the snapshots a snapshot run left in the job's destination.
+         * \param Name of the job.
+         * \param Snapshot names, oldest first.
+         * \return 0 for success, -1 for not found.
+         */
+        int set_snapshots(const QString &name, const QStringList &snapshots);
+
         /*!
          * \brief Retrieves the given job.
          * \param Name of the job to retrieve.
@@ -98,6 +180,34 @@ class Manager
          */
         int disable_job(const QString &name);
 
+        /*!
+         * \brief Enables the named jobs' timers with one systemd call and one reload.
+         * \param Names of the jobs.
+         * \param Receives an error per job, empty for the jobs that succeeded.
+         * \return 0 if every job was enabled, -1 otherwise.
+         */
+        int enable_jobs(const QStringList &names, std::map<QString, QString> &errors);
+
+        /*!
+         * \brief Disables the named jobs' timers with one systemd call and one reload.
+         * \param Names of the jobs.
+         * \param Receives an error per job, empty for the jobs that succeeded.
+         * \return 0 if every job was disabled, -1 otherwise.
+         */
+        int disable_jobs(const QStringList &names, std::map<QString, QString> &errors);
+
+        /*!
+         * \brief Enables or disables jobs without waiting for systemd.
+         * The units are written on another thread, which the Manager waits for when it is
+         * destroyed; systemd's answers arrive on the event loop, and not at all once the
+         * Manager is gone.
+         * \param True to enable, false to disable.
+         * \param Names of the jobs.
+         * \param Called with an error per job, empty for the jobs that succeeded.
+         */
+        void set_jobs_enabled_async(bool enable, const QStringList &names,
+                                    std::function<void(const std::map<QString, QString> &)> done);
+
         /*!
          * \brief Runs the given job.
          * \param Name of the job to run.
@@ -105,6 +215,17 @@ class Manager
          */
         int run_job(const QString &name);
 
+        /*!
+         * \brief Restores a job's backup with "rbackup restore" without waiting for it.
+         * \param Name of the job.
+         * \param Directory to restore into.
+         * \param Paths to restore, everything when empty.
+         * \param Called with the command's JSON result once it exits.
+         */
+        void restore_job_async(const QString &name, const QString &target,
+                               const QStringList &paths,
+                               std::function<void(const QJsonObject &)> done);
+
         /*!
          * \brief Creates the objects for backups.
          * \param Name of the job to create objects for.
@@ -119,6 +240,47 @@ class Manager
          */ 
         int delete_job(const QString &name);
 
+        /*!
+         * \brief Checks whether a job with the given name exists.
+         * \param Name of the job.
+         * \return True if the job exists.
+         */
+        bool has_job(const QString &name) const;
+
+        /*!
+         * \brief Checks whether a job's timer is enabled without decoding the job.
+         * \param Name of the job.
+         * \return True if the job exists and is enabled.
+         */
+        bool is_job_enabled(const QString &name) const;
+
+        /*!
+         * \brief Asks systemd for the state of the job's service.
+         * \param Name of the job.
+         * \return ActiveState of the service, or an empty string if it could not be found.
+         */
+        QString get_job_status(const QString &name);
+
+        /*!
+         * \brief Asks systemd for the state of every job's service in one call.
+         * \return ActiveState and object path of each loaded service, by job name.
+         */
+        std::unordered_map<std::string, ServiceState> get_service_states() const;
+
+        /*!
+         * \brief Creates a Json object of a job.
+         * \param BackupJob to serialize.
+         * \return Serialized BackupJob.
+         */
+        QJsonObject job_to_json(const BackupJob &job) const;
+
+        /*!
+         * \brief Creates a job from json.
+         * \param QJsonObject containing the job.
+         * \return BackupJob to be saved into the map.
+         */
+        BackupJob job_from_json(const QJsonObject &json) const;
+
     private:
         /*
          * Uses unordered map to easily make sure there are no duplicates.
@@ -134,12 +296,105 @@ class Manager
         // Backup file path
         QString backupPath;
 
+        std::unique_ptr<JobStore> store;
+
+        // Names of jobs added, changed or deleted since the last save.
+        std::set<std::string> changed;
+
+        // Shared connection to systemd.
+        std::unique_ptr<SystemdClient> systemd;
+        std::thread unitWriter;            // writes units for set_jobs_enabled_async
+        std::unique_ptr<QObject> receiver; // context of the calls it posts back
+
+        // Jobs still only in the binary catalog, by position in it.
+        std::unordered_map<std::string, uint64_t> lazy;
+
+        // Timer fields of jobs still in the binary catalog, kept for get_concurrency().
+        std::unordered_map<std::string, BackupJob> schedules;
+
+        // Expected run length of jobs in seconds, read once from their histories.
+        std::unordered_map<std::string, int> durations;
+
         /*!
-         * \brief Creates a Json object of a job.
-         * \param BackupJob to serialize.
-         * \return Serialized BackupJob.
+         * \brief Decodes a job from the binary catalog if it has not been used yet.
+         * \param Name of the job.
+         * \return True if the job exists.
          */
-        QJsonObject job_to_json(const BackupJob &job) const;
+        bool resolve(const std::string &name);
+
+        /*!
+         * \brief Gets the fields of a job that decide when it runs, without resolving it.
+         * \param Name of the job.
+         * \return The job, or one holding only its timer fields; nullptr if not found.
+         */
+        const BackupJob *get_schedule(const std::string &name);
+
+        /*!
+         * \brief Gets a job's expected duration, reading its history only the first time.
+         * \param Name of the job.
+         * \return Mean length of the recorded runs in seconds, 0 if it has none.
+         */
+        int get_cached_duration(const QString &name);
+
+        /*!
+         * \brief Gets the jobs changed since the last save, for the catalog's journal.
+         * \return Changed jobs by name, deleted jobs mapped to empty objects.
+         */
+        std::map<QString, QJsonObject> get_changes() const;
+
+        int set_jobs_enabled(bool enable, const QStringList &names,
+                             std::map<QString, QString> &errors);
+
+        /*!
+         * \brief Marks jobs enabled or disabled.
+         * \param True to enable, false to disable.
+         * \param Names of the jobs.
+         * \param Receives the errors of jobs that were not found.
+         * \return Copies of the jobs that were found, for write_units().
+         */
+        std::vector<BackupJob> mark_enabled(bool enable, const QStringList &names,
+                                            std::map<QString, QString> &errors);
+
+        /*!
+         * \brief Writes the units of jobs. Only reads the manager's paths and the jobs'
+         * histories, so it may run on another thread.
+         * \param Jobs to write the units of.
+         * \param Receives the errors of jobs whose units could not be written.
+         * \return Timer units of the jobs that are ready for systemd.
+         */
+        QStringList write_units(const std::vector<BackupJob> &ready,
+                                std::map<QString, QString> &errors) const;
+
+        /*!
+         * \brief Enables or disables written units, then finds out which jobs failed.
+         * \param True to enable, false to disable.
+         * \param Timer units of the jobs.
+         * \param Errors of the jobs so far, completed before done is called.
+         * \param Called with an error per job.
+         */
+        void set_unit_files_async(bool enable, const QStringList &units,
+                                  std::shared_ptr<std::map<QString, QString>> errors,
+                                  std::function<void(const std::map<QString, QString> &)> done);
+
+        /*!
+         * \brief Turns systemd's answer for a batch of units into an error per job.
+         * \param True if the units were enabled, false if disabled.
+         * \param Timer units of the batch.
+         * \param systemd's error for the batch, empty for success.
+         * \param State of each unit file read after a failure.
+         * \param Receives an error per job, empty for the jobs that succeeded.
+         */
+        static void assign_unit_errors(bool enable, const QStringList &units,
+                                       const QString &error,
+                                       const std::map<QString, QString> &states,
+                                       std::map<QString, QString> &errors);
+
+        /*!
+         * \brief Writes the script, service and timer of a job.
+         * \param The job.
+         * \return 0 for success, -1 for failure.
+         */
+        int write_systemd_objects(const BackupJob &job) const;
 
         /*!
          * \brief Creates an object containing the days to run on.
@@ -161,13 +416,6 @@ class Manager
          */
         QString find_home_directory() const;
 
-        /*!
-         * \brief Creates a job from json.
-         * \param QJsonObject containing the job.
-         * \return BackupJob to be saved into the map.
-         */
-        BackupJob job_from_json(const QJsonObject &json) const;
-
         /*!
          * \brief Create a days array from the json file.
          * \param QJsonObject containing the days data.
@@ -181,13 +429,6 @@ class Manager
          * \return JobFlags set with correct values.
          */
         JobFlags jobflags_from_json(const QJsonObject &json) const;
-
-        /*!
-         * \brief Loads the given json document.
-         * \param Path to the json file.
-         * \return QJsonObject containing the request file, or an empty one if not found.
-         */
-        QJsonObject load_json_document(const QString &path);
 };
 
 #endif // MANAGER_H
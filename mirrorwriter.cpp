@@ -0,0 +1,435 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "mirrorwriter.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+MirrorWriter::MirrorWriter(const std::string &root, size_t maxQueued)
+        : root(root), maxQueued(maxQueued), update(false), queued(0), waited(0),
+          stopping(false), fd(-1), filesWritten(0), filesDeleted(0), errors(0)
+{
+        while (this->root.size() > 1 && this->root.back() == '/')
+                this->root.pop_back();
+        if (mkdir(this->root.c_str(), 0755) != 0 && errno != EEXIST)
+                report(this->root);
+        writer = std::thread(&MirrorWriter::run, this);
+        prefetcher = std::thread(&MirrorWriter::run_prefetch, this);
+}
+
+MirrorWriter::~MirrorWriter()
+{
+        if (writer.joinable())
+                finish();
+}
+
+void MirrorWriter::set_update(bool update)
+{
+        this->update = update;
+}
+
+bool MirrorWriter::is_current(const std::string &relative, const struct stat &st) const
+{
+        struct stat dst;
+        if (lstat((root + "/" + relative).c_str(), &dst) != 0)
+                return false;
+        return (dst.st_mode & S_IFMT) == (st.st_mode & S_IFMT) && dst.st_size == st.st_size
+               && dst.st_mtim.tv_sec == st.st_mtim.tv_sec
+               && dst.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+}
+
+void MirrorWriter::prefetch(const std::string &relative)
+{
+        {
+                std::lock_guard<std::mutex> lock(listMutex);
+                if (!listings.emplace(relative, Listing()).second)
+                        return;
+                requests.push_back(relative);
+        }
+        listRequested.notify_one();
+}
+
+MirrorWriter::Freshness MirrorWriter::check(const std::string &relative, const struct stat &st)
+{
+        size_t slash = relative.find_last_of('/');
+        std::string parent = slash == std::string::npos ? "" : relative.substr(0, slash);
+        std::string name = relative.substr(slash + 1);
+
+        std::lock_guard<std::mutex> lock(listMutex);
+        auto listing = listings.find(parent);
+        if (listing == listings.end() || !listing->second.ready)
+                return UNKNOWN;
+        auto entry = listing->second.entries.find(name);
+        if (entry == listing->second.entries.end())
+                return STALE;
+        return is_kept(entry->second, st) ? CURRENT : STALE;
+}
+
+void MirrorWriter::forget(const std::string &relative)
+{
+        std::lock_guard<std::mutex> lock(listMutex);
+        listings.erase(relative);
+}
+
+std::map<std::string, bool> MirrorWriter::list(const std::string &path) const
+{
+        std::map<std::string, bool> names;
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr)
+                return names;
+        while (struct dirent *entry = readdir(dir)) {
+                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                        continue;
+                bool directory = entry->d_type == DT_DIR;
+                if (entry->d_type == DT_UNKNOWN) {
+                        struct stat st;
+                        directory = lstat((path + "/" + entry->d_name).c_str(), &st) == 0
+                                    && S_ISDIR(st.st_mode);
+                }
+                names[entry->d_name] = directory;
+        }
+        closedir(dir);
+        return names;
+}
+
+void MirrorWriter::directory(const std::string &relative, const struct stat &st)
+{
+        push({DIRECTORY, relative, "", st});
+}
+
+void MirrorWriter::special(const std::string &relative, const std::string &target,
+                           const struct stat &st)
+{
+        push({SPECIAL, relative, target, st});
+}
+
+void MirrorWriter::hard_link(const std::string &relative, const std::string &existing)
+{
+        push({HARD_LINK, relative, existing, {}});
+}
+
+void MirrorWriter::begin_file(const std::string &relative, const struct stat &st)
+{
+        push({BEGIN, relative, "", st});
+}
+
+void MirrorWriter::file_data(const char *data, size_t len)
+{
+        push({DATA, "", std::string(data, len), {}});
+}
+
+void MirrorWriter::end_file(bool complete)
+{
+        push({complete ? END : ABORT, "", "", {}});
+}
+
+void MirrorWriter::prune(const std::string &relative, std::vector<std::string> names,
+                         std::function<bool(const std::string &, bool)> keep)
+{
+        push({PRUNE, relative, "", {}, std::move(names), std::move(keep)});
+}
+
+int MirrorWriter::finish()
+{
+        push({STOP, "", "", {}});
+        writer.join();
+        {
+                std::lock_guard<std::mutex> lock(listMutex);
+                stopping = true;
+        }
+        listRequested.notify_one();
+        prefetcher.join();
+
+        // Deepest first, so setting a parent's times is not undone by its children.
+        for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+                if (set_attributes(it->first, it->second) != 0)
+                        report(it->first);
+        }
+        directories.clear();
+        return errors == 0 ? 0 : -1;
+}
+
+uint64_t MirrorWriter::get_files_written() const
+{
+        return filesWritten;
+}
+
+uint64_t MirrorWriter::get_files_deleted() const
+{
+        return filesDeleted;
+}
+
+uint64_t MirrorWriter::get_errors() const
+{
+        return errors;
+}
+
+double MirrorWriter::get_wait_seconds() const
+{
+        return std::chrono::duration<double>(waited).count();
+}
+
+void MirrorWriter::push(Op op)
+{
+        size_t len = op.data.size();
+        {
+                std::unique_lock<std::mutex> lock(mutex);
+                // A single oversized operation is let through once the queue is empty.
+                auto fits = [&] { return queued == 0 || queued + len <= maxQueued; };
+                if (!fits()) {
+                        auto start = std::chrono::steady_clock::now();
+                        space.wait(lock, fits);
+                        waited += std::chrono::steady_clock::now() - start;
+                }
+                queued += len;
+                ops.push_back(std::move(op));
+        }
+        ready.notify_one();
+}
+
+void MirrorWriter::run()
+{
+        for (;;) {
+                Op op;
+                {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        ready.wait(lock, [this] { return !ops.empty(); });
+                        op = std::move(ops.front());
+                        ops.pop_front();
+                }
+                if (op.type == STOP)
+                        return;
+                size_t len = op.data.size();
+                apply(op);
+                {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        queued -= len;
+                }
+                space.notify_all();
+        }
+}
+
+void MirrorWriter::run_prefetch()
+{
+        for (;;) {
+                std::string relative;
+                {
+                        std::unique_lock<std::mutex> lock(listMutex);
+                        listRequested.wait(lock, [this] { return stopping || !requests.empty(); });
+                        if (stopping)
+                                return;
+                        // Newest first, the order a depth first walk needs them in.
+                        relative = std::move(requests.back());
+                        requests.pop_back();
+                        // Already done with by the caller.
+                        if (listings.find(relative) == listings.end())
+                                continue;
+                }
+
+                // A directory that does not exist yet lists as empty, so all of it is stale.
+                std::map<std::string, struct stat> entries;
+                std::string path = relative.empty() ? root : root + "/" + relative;
+                DIR *dir = opendir(path.c_str());
+                while (struct dirent *entry = dir != nullptr ? readdir(dir) : nullptr) {
+                        struct stat st;
+                        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0
+                            && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                                entries[entry->d_name] = st;
+                }
+                if (dir != nullptr)
+                        closedir(dir);
+
+                std::lock_guard<std::mutex> lock(listMutex);
+                auto listing = listings.find(relative);
+                if (listing != listings.end()) {
+                        listing->second.entries = std::move(entries);
+                        listing->second.ready = true;
+                }
+        }
+}
+
+bool MirrorWriter::is_kept(const struct stat &dst, const struct stat &st) const
+{
+        if ((dst.st_mode & S_IFMT) != (st.st_mode & S_IFMT))
+                return false;
+        if (dst.st_size == st.st_size && dst.st_mtim.tv_sec == st.st_mtim.tv_sec
+            && dst.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+                return true;
+        return update && S_ISREG(dst.st_mode)
+               && (dst.st_mtim.tv_sec > st.st_mtim.tv_sec
+                   || (dst.st_mtim.tv_sec == st.st_mtim.tv_sec
+                       && dst.st_mtim.tv_nsec > st.st_mtim.tv_nsec));
+}
+
+void MirrorWriter::apply(Op &op)
+{
+        std::string path = op.path.empty() ? root : root + "/" + op.path;
+
+        switch (op.type) {
+        case DIRECTORY: {
+                struct stat dst;
+                if (lstat(path.c_str(), &dst) == 0 && !S_ISDIR(dst.st_mode))
+                        unlink(path.c_str());
+                if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+                        report(path);
+                else
+                        directories.emplace_back(path, op.st);
+                break;
+        }
+        case SPECIAL: {
+                struct stat dst;
+                if (lstat(path.c_str(), &dst) == 0 && is_kept(dst, op.st))
+                        break;
+                unlink(path.c_str());
+                int status = S_ISLNK(op.st.st_mode)
+                                     ? symlink(op.data.c_str(), path.c_str())
+                                     : mknod(path.c_str(), op.st.st_mode, op.st.st_rdev);
+                if (status != 0 || set_attributes(path, op.st) != 0)
+                        report(path);
+                break;
+        }
+        case HARD_LINK: {
+                std::string existing = root + "/" + op.data;
+                struct stat dst, linked;
+                if (lstat(path.c_str(), &dst) == 0 && lstat(existing.c_str(), &linked) == 0
+                    && dst.st_dev == linked.st_dev && dst.st_ino == linked.st_ino)
+                        break;
+                unlink(path.c_str());
+                if (link(existing.c_str(), path.c_str()) != 0)
+                        report(path);
+                break;
+        }
+        case BEGIN: {
+                // The data that follows is dropped while fd is closed.
+                struct stat dst;
+                if (lstat(path.c_str(), &dst) == 0 && is_kept(dst, op.st))
+                        break;
+                // Hidden name in the same directory, so the rename can not cross devices.
+                size_t slash = path.find_last_of('/');
+                filePath = path;
+                fileStat = op.st;
+                partPath = path.substr(0, slash + 1) + "." + path.substr(slash + 1) + ".rbackup";
+                fd = open(partPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (fd < 0)
+                        report(filePath);
+                break;
+        }
+        case DATA: {
+                const char *p = op.data.data();
+                size_t left = op.data.size();
+                while (fd >= 0 && left > 0) {
+                        ssize_t n = write(fd, p, left);
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n < 0) {
+                                report(filePath);
+                                close(fd);
+                                unlink(partPath.c_str());
+                                fd = -1;
+                                break;
+                        }
+                        p += n;
+                        left -= n;
+                }
+                break;
+        }
+        case END:
+                if (fd < 0)
+                        break;
+                close(fd);
+                fd = -1;
+                if (set_attributes(partPath, fileStat) != 0
+                    || rename(partPath.c_str(), filePath.c_str()) != 0) {
+                        report(filePath);
+                        unlink(partPath.c_str());
+                } else {
+                        filesWritten++;
+                }
+                break;
+        case ABORT:
+                if (fd >= 0) {
+                        close(fd);
+                        unlink(partPath.c_str());
+                        fd = -1;
+                }
+                break;
+        case PRUNE:
+                // The writer only creates what the source has, so nothing queued after
+                // this can be listed here.
+                for (const auto &entry : list(path)) {
+                        if (!std::binary_search(op.names.begin(), op.names.end(), entry.first)
+                            && !op.keep(entry.first, entry.second))
+                                remove_tree(path + "/" + entry.first);
+                }
+                break;
+        case STOP:
+                break;
+        }
+}
+
+int MirrorWriter::set_attributes(const std::string &path, const struct stat &st)
+{
+        // Ownership can only be kept when running as root, like rsync -a.
+        if (lchown(path.c_str(), st.st_uid, st.st_gid) != 0 && errno != EPERM)
+                return -1;
+        if (!S_ISLNK(st.st_mode) && chmod(path.c_str(), st.st_mode & 07777) != 0)
+                return -1;
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        return utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+}
+
+void MirrorWriter::remove_tree(const std::string &path)
+{
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) {
+                if (errno != ENOENT)
+                        report(path);
+                return;
+        }
+        if (S_ISDIR(st.st_mode)) {
+                DIR *dir = opendir(path.c_str());
+                if (dir == nullptr) {
+                        report(path);
+                        return;
+                }
+                std::vector<std::string> children;
+                while (struct dirent *entry = readdir(dir)) {
+                        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                                children.push_back(path + "/" + entry->d_name);
+                }
+                closedir(dir);
+                for (const auto &child : children)
+                        remove_tree(child);
+        }
+        if ((S_ISDIR(st.st_mode) ? rmdir(path.c_str()) : unlink(path.c_str())) != 0)
+                report(path);
+        else
+                filesDeleted++;
+}
+
+void MirrorWriter::report(const std::string &path)
+{
+        std::cerr << path << ": " << strerror(errno) << "\n";
+        errors++;
+}
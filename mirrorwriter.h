@@ -0,0 +1,292 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIRRORWRITER_H
+#define MIRRORWRITER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*!
+ * \brief The MirrorWriter class
+ * Keeps a plain copy of a tree up to date from data that is already being read,
+ * so an archive and a mirror can be written from a single pass over the source.
+ *
+ * Calls queue operations for a writer thread and only block when more than the
+ * queue limit is waiting. The writer skips files, links and devices the mirror
+ * already has, like rsync's quick check, so callers need not look at the mirror
+ * themselves. Files are written to a temporary name and renamed when complete.
+ * Directory attributes are applied when the mirror is finished, after everything
+ * inside them has been written. Nothing is deleted from the mirror unless prune()
+ * is called.
+ *
+ * A second thread lists directories of the mirror ahead of the writer when asked
+ * to with prefetch(), so a caller can tell which files are worth reading without
+ * waiting for a slow mirror.
+ */
+class MirrorWriter
+{
+    public:
+        /*!
+         * \param Root directory of the mirror, created if missing.
+         * \param Bytes of file data that may be queued before callers wait.
+         */
+        explicit MirrorWriter(const std::string &root, size_t maxQueued = 64 << 20);
+        ~MirrorWriter();
+        MirrorWriter(const MirrorWriter &) = delete;
+        MirrorWriter &operator=(const MirrorWriter &) = delete;
+
+        /*!
+         * \brief What check() knows about a path.
+         */
+        enum Freshness { UNKNOWN, STALE, CURRENT };
+
+        /*!
+         * \brief Keeps files that are newer in the mirror than in the source.
+         * \param True for rsync --update.
+         */
+        void set_update(bool update);
+
+        /*!
+         * \brief Checks whether the mirror already has a file, like rsync's quick check.
+         * \param Path relative to the mirror root.
+         * \param Status of the source file.
+         * \return True if type, size and modification time match.
+         */
+        bool is_current(const std::string &relative, const struct stat &st) const;
+
+        /*!
+         * \brief Starts listing a directory of the mirror on the prefetch thread.
+         * \param Path relative to the mirror root.
+         */
+        void prefetch(const std::string &relative);
+
+        /*!
+         * \brief Checks a path against the prefetched listing of its directory, without
+         * touching the mirror.
+         * \param Path relative to the mirror root.
+         * \param Status of the source.
+         * \return CURRENT if the writer would skip it, STALE if it would write it, and
+         * UNKNOWN while the listing is not ready.
+         */
+        Freshness check(const std::string &relative, const struct stat &st);
+
+        /*!
+         * \brief Drops the prefetched listing of a directory.
+         * \param Path relative to the mirror root.
+         */
+        void forget(const std::string &relative);
+
+        /*!
+         * \brief Creates a directory.
+         * \param Path relative to the mirror root.
+         * \param Status of the source directory.
+         */
+        void directory(const std::string &relative, const struct stat &st);
+
+        /*!
+         * \brief Creates a symbolic link, or a device or fifo when the target is empty.
+         * \param Path relative to the mirror root.
+         * \param Target of the link.
+         * \param Status of the source.
+         */
+        void special(const std::string &relative, const std::string &target,
+                     const struct stat &st);
+
+        /*!
+         * \brief Links a path to a file already in the mirror.
+         * \param Path relative to the mirror root.
+         * \param Existing path relative to the mirror root.
+         */
+        void hard_link(const std::string &relative, const std::string &existing);
+
+        /*!
+         * \brief Starts writing a regular file; its data follows through file_data().
+         * \param Path relative to the mirror root.
+         * \param Status of the source file.
+         */
+        void begin_file(const std::string &relative, const struct stat &st);
+
+        /*!
+         * \brief Appends data to the file being written.
+         * \param Start of the data.
+         * \param Length of the data.
+         */
+        void file_data(const char *data, size_t len);
+
+        /*!
+         * \brief Completes the file being written, or discards it.
+         * \param False to discard the partial file.
+         */
+        void end_file(bool complete);
+
+        /*!
+         * \brief Deletes the entries of a directory that the source does not have.
+         * \param Path of the directory relative to the mirror root.
+         * \param Sorted names of the entries in the source directory.
+         * \param Called with the name of an entry and whether it is a directory; true
+         * keeps the entry. Called on the writer thread.
+         */
+        void prune(const std::string &relative, std::vector<std::string> names,
+                   std::function<bool(const std::string &, bool)> keep);
+
+        /*!
+         * \brief Waits for the queue to empty and applies directory attributes.
+         * \return 0 for success, -1 if anything could not be written.
+         */
+        int finish();
+
+        /*!
+         * \brief Retrieves the number of files written to the mirror.
+         * \return Number of files.
+         */
+        uint64_t get_files_written() const;
+
+        /*!
+         * \brief Retrieves the number of paths deleted from the mirror.
+         * \return Number of paths, counting everything below a deleted directory.
+         */
+        uint64_t get_files_deleted() const;
+
+        /*!
+         * \brief Retrieves the number of paths that could not be written.
+         * \return Number of errors.
+         */
+        uint64_t get_errors() const;
+
+        /*!
+         * \brief Retrieves how long callers waited for room in the queue.
+         * \return Seconds spent waiting, a measure of how far the mirror fell behind.
+         */
+        double get_wait_seconds() const;
+
+    private:
+        enum OpType { DIRECTORY, SPECIAL, HARD_LINK, BEGIN, DATA, END, ABORT, PRUNE, STOP };
+
+        struct Op {
+                OpType type;
+                std::string path;
+                std::string data;
+                struct stat st;
+                std::vector<std::string> names = {};
+                std::function<bool(const std::string &, bool)> keep = nullptr;
+        };
+
+        // Entries of a directory by name; filled in once ready.
+        struct Listing {
+                bool ready = false;
+                std::map<std::string, struct stat> entries;
+        };
+
+        std::string root;
+        size_t maxQueued;
+        bool update;
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable space;
+        std::deque<Op> ops;
+        size_t queued;
+        std::chrono::steady_clock::duration waited;
+        std::thread writer;
+
+        // Prefetched listings, guarded by listMutex.
+        std::mutex listMutex;
+        std::condition_variable listRequested;
+        std::deque<std::string> requests;
+        std::map<std::string, Listing> listings;
+        bool stopping;
+        std::thread prefetcher;
+
+        // Only touched by the writer thread.
+        int fd;
+        std::string partPath;
+        std::string filePath;
+        struct stat fileStat;
+        std::vector<std::pair<std::string, struct stat>> directories;
+        uint64_t filesWritten;
+        uint64_t filesDeleted;
+        uint64_t errors;
+
+        /*!
+         * \brief Queues an operation, waiting while the queue is full.
+         * \param Operation to queue.
+         */
+        void push(Op op);
+
+        /*!
+         * \brief Applies queued operations until stopped.
+         */
+        void run();
+
+        /*!
+         * \brief Lists the directories asked for by prefetch() until stopped.
+         */
+        void run_prefetch();
+
+        /*!
+         * \brief Applies one operation.
+         * \param Operation to apply.
+         */
+        void apply(Op &op);
+
+        /*!
+         * \brief Decides whether the mirror's copy of an entry can be kept.
+         * \param Status of the mirror's copy.
+         * \param Status of the source.
+         * \return True if type, size and modification time match, or with update set
+         * if the mirror's regular file is newer.
+         */
+        bool is_kept(const struct stat &dst, const struct stat &st) const;
+
+        /*!
+         * \brief Lists a directory of the mirror as it is now.
+         * \param Path in the mirror.
+         * \return Names of the entries, mapped to whether they are directories.
+         */
+        std::map<std::string, bool> list(const std::string &path) const;
+
+        /*!
+         * \brief Sets owner, permissions and times of a path.
+         * \param Path in the mirror.
+         * \param Status of the source.
+         * \return 0 for success, -1 for failure.
+         */
+        int set_attributes(const std::string &path, const struct stat &st);
+
+        /*!
+         * \brief Deletes a path, and everything below it for a directory.
+         * \param Path in the mirror.
+         */
+        void remove_tree(const std::string &path);
+
+        void report(const std::string &path);
+};
+
+#endif // MIRRORWRITER_H
@@ -0,0 +1,124 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "changewatcher.h"
+#include "cli.h"
+#include "daemon.h"
+#include "utility.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <iostream>
+
+/*!
+ * \brief Replaces "--json <file>" with the file's contents so the command can be
+ * run by a daemon that does not share our working directory or stdin.
+ * \param Arguments of the command.
+ * \return 0 for success, -1 if the file could not be read.
+ */
+static int inline_json_argument(QStringList &args)
+{
+        int index = args.indexOf("--json");
+        if (index < 0 || index + 1 >= args.size())
+                return 0;
+
+        QFile file(args[index + 1]);
+        bool opened = false;
+        if (args[index + 1] == "-")
+                opened = file.open(stdin, QIODevice::ReadOnly);
+        else
+                opened = file.open(QIODevice::ReadOnly);
+        if (!opened)
+                return -1;
+        args[index] = "--json-text";
+        args[index + 1] = QString::fromUtf8(file.readAll());
+        return 0;
+}
+
+/*!
+ * \brief Makes the file of "export <file>" and "import <file>" absolute so the daemon
+ * opens it in our working directory rather than its own.
+ * \param Arguments of the command.
+ */
+static void absolute_file_argument(QStringList &args)
+{
+        if (args[0] != "export" && args[0] != "import")
+                return;
+        for (int i = 1; i < args.size(); i++) {
+                if (args[i] == "--format")
+                        i++;
+                else if (!args[i].startsWith('-'))
+                        args[i] = QFileInfo(args[i]).absoluteFilePath();
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        QCoreApplication app(argc, argv);
+        QStringList args = app.arguments().mid(1);
+        QTextStream out(stdout);
+
+        if (args.isEmpty() || args[0] == "help" || args[0] == "--help") {
+                std::cerr << Cli::usage().toStdString();
+                return args.isEmpty() ? 2 : 0;
+        }
+
+        if (args[0] == "daemon") {
+                QCommandLineParser parser;
+                parser.addOptions({
+                        {"socket", "Path of the socket.", "path", get_daemon_socket()},
+                        {"watch", "Journal changes to the sources of indexed jobs."},
+                        {"rotational-slots", "Runs at once on a spinning disk.", "count", "1"},
+                        {"slots", "Runs at once on any other device.", "count", "4"},
+                });
+                if (!parser.parse(QStringList{"rbackup daemon"} + args.mid(1))) {
+                        std::cerr << parser.errorText().toStdString() << "\n";
+                        return 2;
+                }
+                Manager manager;
+                Daemon daemon(manager, parser.value("rotational-slots").toInt(),
+                              parser.value("slots").toInt());
+                if (daemon.listen(parser.value("socket")) != 0)
+                        return 1;
+                ChangeWatcher watcher(manager);
+                if (parser.isSet("watch") && watcher.start() == 0)
+                        daemon.set_watcher(&watcher);
+                return app.exec();
+        }
+
+        // Backups run in the caller's process; a daemon busy copying could not answer.
+        static const QStringList jobCommands = {"list",   "status",  "add",     "update",
+                                                "enable", "disable", "run",     "delete",
+                                                "catalog", "export", "import", "queue"};
+        if (jobCommands.contains(args[0])) {
+                if (inline_json_argument(args) != 0) {
+                        std::cerr << "Unable to read the job JSON.\n";
+                        return 1;
+                }
+                absolute_file_argument(args);
+                int status = Daemon::forward(get_daemon_socket(), args, out);
+                if (status >= 0)
+                        return status;
+        }
+
+        Manager manager;
+        Cli cli(manager);
+        return cli.execute(args, out);
+}
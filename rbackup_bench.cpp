@@ -0,0 +1,248 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmarks of job persistence and unit generation at catalog scale.
+ *
+ * Every benchmark runs against a generated catalog in a temporary directory, so
+ * nothing under /etc or /usr/lib/systemd is touched. The catalog is the same for
+ * a given size on every run; results are written as JSON to compare releases.
+ *
+ * Usage: rbackup_bench [--sizes 10,1000,10000,100000] [--repeat N] [--output file]
+ */
+
+#include "manager.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Writing three files per job gets slow on large catalogs; this many are enough for a rate.
+constexpr int MAX_UNIT_WRITES = 10000;
+
+/*!
+ * \brief Builds a job whose settings vary with its number, the same on every run.
+ * \param Number of the job.
+ * \return The job.
+ */
+static BackupJob make_job(int i)
+{
+        QString name = QString("job%1").arg(i, 6, 10, QChar('0'));
+        Days days = Days();
+        for (size_t d = 0; d < days.size(); d++)
+                days[d] = (i >> d) & 1;
+        JobFlags flags = JobFlags();
+        flags.recurring = i % 5 != 0;
+        flags.transferCompression = i % 3 == 0;
+        flags.backupType = (BackupType)(i % (SNAPSHOT + 1));
+        flags.deleteType = (DeleteType)(i % 3);
+        flags.compType = (CompressionType)(i % (ZSTD + 1));
+        flags.backupCompression = flags.compType != NONE;
+        flags.shards = 1 + i % 4;
+        flags.workers = 1 + i % 2;
+        flags.keep = i % 10;
+        flags.fileIndex = i % 7 == 0;
+        QString time = QString("%1:%2:00").arg(i % 24, 2, 10, QChar('0')).arg(i % 60, 2, 10,
+                                                                             QChar('0'));
+        BackupJob job(name, "/mnt/backup/" + name, "/home/user" + QString::number(i % 100), "",
+                      days, flags, time, i % 2 == 0);
+        return BackupJob(name, job.get_dest(), job.get_src(), job.generate_command(), days,
+                         flags, time, job.is_enabled());
+}
+
+class Bench
+{
+    public:
+        Bench(int repeat) : repeat(repeat)
+        {
+        }
+
+        /*!
+         * \brief Times a benchmark and records the result.
+         * \param Name of the benchmark.
+         * \param Catalog size.
+         * \param Number of operations one call of the body performs.
+         * \param Body, run once per repetition.
+         */
+        void run(const QString &name, int jobs, qint64 operations,
+                 const std::function<void()> &body)
+        {
+                std::vector<qint64> times;
+                for (int i = 0; i < repeat; i++) {
+                        QElapsedTimer timer;
+                        timer.start();
+                        body();
+                        times.push_back(timer.nsecsElapsed());
+                }
+                std::sort(times.begin(), times.end());
+                qint64 median = times[times.size() / 2];
+
+                QJsonObject obj;
+                obj["Benchmark"] = name;
+                obj["Jobs"] = jobs;
+                obj["Operations"] = operations;
+                obj["MinNs"] = times.front();
+                obj["MedianNs"] = median;
+                obj["MaxNs"] = times.back();
+                obj["NsPerOp"] = operations > 0 ? (double)median / operations : 0.0;
+                results.append(obj);
+                std::cerr << name.toStdString() << " " << jobs << ": " << median / 1000
+                          << " us\n";
+        }
+
+        QJsonArray get_results() const
+        {
+                return results;
+        }
+
+    private:
+        int repeat;
+        QJsonArray results;
+};
+
+/*!
+ * \brief Runs every benchmark against a catalog of the given size.
+ * \param Benchmark runner.
+ * \param Number of jobs.
+ * \return 0 for success, -1 if the catalog could not be created.
+ */
+static int bench_catalog(Bench &bench, int size)
+{
+        QTemporaryDir dir;
+        if (!dir.isValid())
+                return -1;
+        QString config = dir.path() + "/config/";
+        QString units = dir.path() + "/units/";
+        std::filesystem::create_directories(units.toStdString());
+
+        auto manager = std::make_unique<Manager>(config, units);
+        std::vector<BackupJob> jobs;
+        jobs.reserve(size);
+        for (int i = 0; i < size; i++) {
+                jobs.push_back(make_job(i));
+                manager->add_new_job(jobs.back());
+        }
+
+        bench.run("compact_jobs", size, size, [&]() { manager->compact_jobs(); });
+        int edit = 0;
+        bench.run("save_jobs", size, 1, [&]() {
+                manager->update_job(jobs[edit++ % size]);
+                manager->save_jobs();
+        });
+        bench.run("load_jobs", size, size,
+                  [&]() { manager = std::make_unique<Manager>(config, units); });
+
+        std::vector<QJsonObject> json(size);
+        bench.run("job_to_json", size, size, [&]() {
+                for (int i = 0; i < size; i++)
+                        json[i] = manager->job_to_json(jobs[i]);
+        });
+        bench.run("job_from_json", size, size, [&]() {
+                for (int i = 0; i < size; i++)
+                        jobs[i] = manager->job_from_json(json[i]);
+        });
+
+        qint64 chars = 0;
+        bench.run("get_service", size, size, [&]() {
+                for (const auto &job : jobs)
+                        chars += job.get_service(config).size();
+        });
+        bench.run("get_timer", size, size, [&]() {
+                for (const auto &job : jobs)
+                        chars += job.get_timer().size();
+        });
+        bench.run("make_systemd_calendar", size, size, [&]() {
+                for (const auto &job : jobs)
+                        chars += job.make_systemd_calendar().size();
+        });
+
+        // Looked up in a fixed random order so the cost is not that of a sequential walk.
+        std::vector<std::string> names;
+        for (const auto &job : jobs)
+                names.push_back(job.get_name().toStdString());
+        std::shuffle(names.begin(), names.end(), std::mt19937(size));
+        bench.run("get_job", size, size, [&]() {
+                for (const auto &name : names)
+                        chars += manager->get_job(name).get_name().size();
+        });
+        bench.run("has_job", size, size, [&]() {
+                for (const auto &name : names)
+                        chars += manager->has_job(QString::fromStdString(name));
+        });
+        bench.run("get_job_names", size, size,
+                  [&]() { chars += manager->get_job_names().size(); });
+
+        int writes = std::min(size, MAX_UNIT_WRITES);
+        bench.run("create_systemd_objects", size, writes, [&]() {
+                for (int i = 0; i < writes; i++)
+                        manager->create_systemd_objects(jobs[i].get_name());
+        });
+
+        // Keeps the generated strings from being optimised away.
+        if (chars == 0)
+                std::cerr << "no output\n";
+        return 0;
+}
+
+int main(int argc, char *argv[])
+{
+        QCoreApplication app(argc, argv);
+        QCommandLineParser parser;
+        parser.addHelpOption();
+        parser.addOptions({
+                {"sizes", "Comma separated catalog sizes.", "list", "10,1000,10000,100000"},
+                {"repeat", "Number of times each benchmark is run.", "count", "5"},
+                {"output", "File the JSON results are written to.", "file",
+                 "rbackup_bench.json"},
+        });
+        parser.process(app);
+
+        Bench bench(std::max(parser.value("repeat").toInt(), 1));
+        for (const auto &size : parser.value("sizes").split(',')) {
+                if (bench_catalog(bench, size.toInt()) != 0) {
+                        std::cerr << "Unable to create a temporary catalog.\n";
+                        return 1;
+                }
+        }
+
+        QJsonObject report;
+        report["Date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+        report["Qt"] = qVersion();
+        report["Repeat"] = parser.value("repeat").toInt();
+        report["Results"] = bench.get_results();
+
+        QFile file(parser.value("output"));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                std::cerr << "Unable to write " << parser.value("output").toStdString() << "\n";
+                return 1;
+        }
+        file.write(QJsonDocument(report).toJson());
+        return 0;
+}
@@ -0,0 +1,415 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Round trips of the on-disk formats: the catalog's journal and snapshots, the
+ * binary catalog, run histories and tar archives, plus the vectorized checksum of
+ * the delta copy engine against its plain definition.
+ *
+ * Every test works in its own temporary directory. Run by "ctest", or directly as
+ * rbackup_test, which prints each failed check and exits with 1 if any failed.
+ */
+
+#include "archiveindex.h"
+#include "archivereader.h"
+#include "blockcompressor.h"
+#include "deltacopy.h"
+#include "jobcatalog.h"
+#include "jobstore.h"
+#include "runhistory.h"
+#include "tarwriter.h"
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QTemporaryDir>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                   \
+        do {                                                                               \
+                if (!(condition)) {                                                        \
+                        std::cerr << __FILE__ << ":" << __LINE__ << ": " #condition "\n"; \
+                        failures++;                                                        \
+                }                                                                          \
+        } while (0)
+
+/*!
+ * \brief Builds a job object in the form backups.json stores.
+ * \param Name of the job.
+ * \param Varies the other fields.
+ * \return The job.
+ */
+static QJsonObject make_job(const QString &name, int version)
+{
+        QJsonObject job;
+        job["Name"] = name;
+        job["Source"] = "/home/user/" + name;
+        job["Destination"] = "/mnt/backup/" + name;
+        job["Time"] = QString("%1:00:00").arg(version % 24, 2, 10, QChar('0'));
+        job["Enabled"] = version % 2 == 0;
+        job["Flags"] = QJsonObject{{"Shards", version}, {"Recurring", true}};
+        job["Snapshots"] = QJsonArray{"2020-01-01T00:00:00Z", version};
+        return job;
+}
+
+static std::string read_file(const std::string &path)
+{
+        std::ifstream in(path, std::ios::binary);
+        std::stringstream data;
+        data << in.rdbuf();
+        return data.str();
+}
+
+static void write_file(const std::string &path, const std::string &data)
+{
+        std::ofstream(path, std::ios::binary) << data;
+}
+
+static void test_jobstore_replay(const QString &dir)
+{
+        QString path = dir + "/backups.json";
+        QString catalogPath = dir + "/backups.cat";
+        std::map<QString, QJsonObject> jobs;
+        std::set<QString> deleted;
+
+        JobStore store(path, catalogPath);
+        CHECK(store.load(jobs, deleted) == -1);
+        CHECK(store.append({{"a", make_job("a", 1)}, {"b", make_job("b", 2)}}) == 0);
+
+        JobStore other(path, catalogPath);
+        CHECK(other.load(jobs, deleted) == 0);
+        CHECK(jobs.size() == 2);
+        CHECK(jobs["a"] == make_job("a", 1) && jobs["b"] == make_job("b", 2));
+        CHECK(other.append({{"a", QJsonObject()}, {"b", make_job("b", 3)}}) == 0);
+
+        CHECK(store.is_stale());
+        CHECK(store.load(jobs, deleted) == 0);
+        CHECK(!store.is_stale());
+        CHECK(jobs.size() == 1 && jobs["b"] == make_job("b", 3));
+        CHECK(deleted == std::set<QString>{"a"});
+
+        // A record cut short by a crash is ignored.
+        QFile journal(path + ".journal");
+        CHECK(journal.open(QIODevice::Append));
+        journal.write("{\"Name\":\"c\",\"Job\":{\"Name\":\"c\"");
+        journal.close();
+        CHECK(store.load(jobs, deleted) == 0);
+        CHECK(jobs.size() == 1 && jobs.count("c") == 0);
+}
+
+static void test_jobstore_compaction(const QString &dir)
+{
+        QString path = dir + "/backups.json";
+        QString catalogPath = dir + "/backups.cat";
+        std::map<QString, QJsonObject> jobs;
+        std::set<QString> deleted;
+
+        JobStore first(path, catalogPath);
+        CHECK(first.append({{"a", make_job("a", 1)}, {"gone", make_job("gone", 1)}}) == 0);
+        JobStore second(path, catalogPath);
+        CHECK(second.load(jobs, deleted) == 0);
+        // Appended by another process after the second one loaded.
+        CHECK(first.append({{"c", make_job("c", 4)}}) == 0);
+        CHECK(second.compact({{"b", make_job("b", 2)}, {"gone", QJsonObject()}}) == 0);
+
+        CHECK(QFileInfo(path + ".journal").size() == 0);
+        JobStore json(path, catalogPath);
+        CHECK(json.load(jobs, deleted) == 0);
+        CHECK(json.get_catalog() == nullptr);
+        CHECK(jobs.size() == 3);
+        CHECK(jobs["a"] == make_job("a", 1) && jobs["b"] == make_job("b", 2)
+              && jobs["c"] == make_job("c", 4));
+
+        // Only journaled jobs are decoded from a binary catalog.
+        json.set_binary(true);
+        CHECK(json.compact({}) == 0);
+        CHECK(QFile::exists(catalogPath) && !QFile::exists(path));
+        JobStore binary(path, catalogPath);
+        CHECK(binary.append({{"d", make_job("d", 5)}}) == 0);
+        CHECK(binary.load(jobs, deleted) == 0);
+        CHECK(binary.get_catalog() != nullptr && binary.get_catalog()->size() == 3);
+        CHECK(jobs.size() == 1 && jobs["d"] == make_job("d", 5));
+
+        binary.set_binary(false);
+        CHECK(binary.compact({}) == 0);
+        CHECK(!QFile::exists(catalogPath) && QFile::exists(path));
+        JobStore back(path, catalogPath);
+        CHECK(back.load(jobs, deleted) == 0);
+        CHECK(jobs.size() == 4);
+        CHECK(jobs["c"] == make_job("c", 4) && jobs["d"] == make_job("d", 5));
+}
+
+static void test_catalog_round_trip(const QString &dir)
+{
+        QString path = dir + "/backups.cat";
+        std::map<QString, QJsonObject> jobs;
+        for (int i = 0; i < 100; i++) {
+                QString name = QString("job%1").arg(i * 7919 % 100, 3, 10, QChar('0'));
+                jobs[name] = make_job(name, i);
+        }
+        jobs["Ünïcode job"] = make_job("Ünïcode job", 100);
+        CHECK(JobCatalog::write(path, jobs) == 0);
+
+        JobCatalog catalog(path);
+        CHECK(catalog.is_valid());
+        CHECK(catalog.size() == jobs.size());
+        uint64_t i = 0;
+        for (const auto &job : jobs) {
+                if (i >= catalog.size())
+                        break;
+                CHECK(catalog.name(i) == job.first);
+                CHECK(catalog.is_enabled(i) == job.second["Enabled"].toBool());
+                CHECK(catalog.read(i) == job.second);
+                i++;
+        }
+
+        CHECK(JobCatalog::write(path, {}) == 0);
+        JobCatalog empty(path);
+        CHECK(empty.is_valid() && empty.size() == 0);
+
+        write_file((dir + "/garbage.cat").toStdString(), "RBJCnot a catalog");
+        JobCatalog garbage(dir + "/garbage.cat");
+        CHECK(!garbage.is_valid() && garbage.size() == 0);
+        JobCatalog missing(dir + "/missing.cat");
+        CHECK(!missing.is_valid() && missing.size() == 0);
+}
+
+static void test_history_wraparound(const QString &dir)
+{
+        std::string path = (dir + "/job.history").toStdString();
+        std::vector<RunRecord> records;
+        RunHistory history(path, 4);
+        CHECK(history.read(records) == -1);
+
+        for (int run = 1; run <= 6; run++) {
+                RunRecord record;
+                record.start = run * 1000;
+                record.end = run * 1000 + 500;
+                record.bytesRead = run;
+                CHECK(history.append(record) == 0);
+        }
+        CHECK(history.read(records) == 0);
+        CHECK(records.size() == 4);
+        for (size_t i = 0; i < records.size(); i++) {
+                CHECK(records[i].start == (int64_t)(i + 3) * 1000);
+                CHECK(records[i].bytesRead == (int64_t)i + 3);
+        }
+        CHECK(history.read(records, 2) == 0);
+        CHECK(records.size() == 2 && records[0].start == 5000 && records[1].start == 6000);
+
+        // An existing file keeps its own capacity.
+        RunHistory reopened(path, 16);
+        RunRecord record;
+        record.start = 7000;
+        CHECK(reopened.append(record) == 0);
+        CHECK(reopened.read(records) == 0);
+        CHECK(records.size() == 4);
+        CHECK(records.front().start == 4000 && records.back().start == 7000);
+        // Full, so appending overwrites and the file does not grow.
+        std::uintmax_t size = std::filesystem::file_size(path);
+        for (int run = 0; run < 10; run++)
+                reopened.append(record);
+        CHECK(std::filesystem::file_size(path) == size);
+}
+
+static void test_block_sums(const QString &)
+{
+        std::mt19937 random(42);
+        std::vector<unsigned char> data(8192 + 16);
+        for (auto &byte : data)
+                byte = random();
+        std::vector<unsigned char> ones(8192 + 16, 0xff);
+
+        for (const auto *buffer : {&data, &ones}) {
+                for (size_t len : {0, 1, 15, 16, 17, 31, 32, 33, 100, 700, 4096, 8192}) {
+                        for (size_t offset = 0; offset < 4; offset++) {
+                                const unsigned char *p = buffer->data() + offset;
+                                // The definition: a sums the bytes, b weighs each by the
+                                // number of bytes from it to the end.
+                                uint32_t a = 0, b = 0;
+                                for (size_t i = 0; i < len; i++) {
+                                        a += p[i];
+                                        b += (uint32_t)(len - i) * p[i];
+                                }
+                                uint32_t fastA = 1, fastB = 1;
+                                DeltaCopy::block_sums(p, len, fastA, fastB);
+                                CHECK(fastA == a);
+                                CHECK(fastB == b);
+                        }
+                }
+        }
+}
+
+/*!
+ * \brief Creates a tree with names and a link target longer than ustar allows.
+ * \param Directory to create it in.
+ * \return Map of relative paths to the contents of the regular files.
+ */
+static std::map<std::string, std::string> make_long_tree(const std::string &root)
+{
+        std::map<std::string, std::string> files;
+        std::string deep = std::string(150, 'd');
+        mkdir(root.c_str(), 0755);
+        mkdir((root + "/" + deep).c_str(), 0755);
+        files["short"] = "short file\n";
+        files[deep + "/" + std::string(120, 'f')] = std::string(100000, 'x') + "end";
+        files[deep + "/" + std::string(99, 'g')] = "";
+        for (const auto &file : files)
+                write_file(root + "/" + file.first, file.second);
+        symlink((deep + "/" + std::string(120, 'f')).c_str(), (root + "/link").c_str());
+        return files;
+}
+
+/*!
+ * \brief Reads the members of an uncompressed tar stream, applying pax headers.
+ * \param The stream.
+ * \param Receives the data of regular files by name.
+ * \param Receives the targets of symbolic links by name.
+ * \return True if the stream was well formed up to its end marker.
+ */
+static bool parse_tar(const std::string &tar, std::map<std::string, std::string> &files,
+                      std::map<std::string, std::string> &links)
+{
+        std::map<std::string, std::string> pax;
+        for (size_t at = 0; at + 512 <= tar.size();) {
+                const char *header = tar.data() + at;
+                if (header[0] == '\0')
+                        return true;
+                std::string name(header, strnlen(header, 100));
+                std::string link(header + 157, strnlen(header + 157, 100));
+                uint64_t size = std::stoull(std::string(header + 124, 12), nullptr, 8);
+                char type = header[156];
+                std::string data = tar.substr(at + 512, size);
+                at += 512 + (size + 511) / 512 * 512;
+                if (type == 'x') {
+                        // Records are "<length> <key>=<value>\n".
+                        for (size_t p = 0; p < data.size();) {
+                                size_t space = data.find(' ', p);
+                                size_t length = std::stoul(data.substr(p, space - p));
+                                std::string record =
+                                        data.substr(space + 1, length - (space - p) - 2);
+                                size_t equals = record.find('=');
+                                pax[record.substr(0, equals)] = record.substr(equals + 1);
+                                p += length;
+                        }
+                        continue;
+                }
+                if (pax.count("path"))
+                        name = pax["path"];
+                if (pax.count("linkpath"))
+                        link = pax["linkpath"];
+                pax.clear();
+                if (type == '0')
+                        files[name] = data;
+                else if (type == '2')
+                        links[name] = link;
+        }
+        return false;
+}
+
+static void test_tar_long_names(const QString &dir)
+{
+        std::string root = dir.toStdString() + "/tree";
+        std::map<std::string, std::string> expected = make_long_tree(root);
+        std::string deep = std::string(150, 'd');
+
+        std::string archive = dir.toStdString() + "/plain.tar";
+        int fd = open(archive.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        CHECK(fd >= 0);
+        {
+                BlockCompressor compressor(fd, TARBALL);
+                TarWriter tar(compressor);
+                CHECK(tar.add(root + "/") == 0);
+                CHECK(tar.finish() == 0);
+                CHECK(compressor.finish() == 0);
+                CHECK(tar.get_errors() == 0);
+        }
+        close(fd);
+
+        std::map<std::string, std::string> files;
+        std::map<std::string, std::string> links;
+        CHECK(parse_tar(read_file(archive), files, links));
+        std::string prefix = TarWriter::member_name(root + "/");
+        for (const auto &file : expected)
+                CHECK(files[prefix + file.first] == file.second);
+        CHECK(links[prefix + "link"] == deep + "/" + std::string(120, 'f'));
+
+        // The same tree through a seekable archive and back.
+        std::string seekable = dir.toStdString() + "/seekable.tar.zst";
+        fd = open(seekable.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        CHECK(fd >= 0);
+        {
+                BlockCompressor compressor(fd, ZSTD, 2, 0, 0, false, true);
+                TarWriter tar(compressor);
+                ArchiveIndex index;
+                tar.set_index(&index);
+                CHECK(tar.add(root + "/") == 0);
+                CHECK(tar.finish() == 0);
+                CHECK(compressor.finish() == 0);
+        }
+        close(fd);
+
+        ArchiveReader reader(seekable);
+        CHECK(reader.open() == 0);
+        std::string target = dir.toStdString() + "/restored";
+        std::string longName = prefix + deep + "/" + std::string(120, 'f');
+        CHECK(reader.extract({longName}, target, 2) == 0);
+        CHECK(read_file(target + "/" + longName) == expected[deep + "/" + std::string(120, 'f')]);
+        CHECK(reader.get_stats().errors == 0);
+}
+
+int main(int argc, char *argv[])
+{
+        QCoreApplication app(argc, argv);
+        typedef std::function<void(const QString &)> Test;
+        const std::vector<std::pair<std::string, Test>> tests = {
+                {"jobstore_replay", test_jobstore_replay},
+                {"jobstore_compaction", test_jobstore_compaction},
+                {"catalog_round_trip", test_catalog_round_trip},
+                {"history_wraparound", test_history_wraparound},
+                {"block_sums", test_block_sums},
+                {"tar_long_names", test_tar_long_names},
+        };
+        for (const auto &test : tests) {
+                QTemporaryDir dir;
+                if (!dir.isValid()) {
+                        std::cerr << "Unable to create a temporary directory.\n";
+                        return 1;
+                }
+                int before = failures;
+                test.second(dir.path());
+                std::cerr << test.first << ": " << (failures == before ? "ok" : "FAILED") << "\n";
+        }
+        return failures == 0 ? 0 : 1;
+}
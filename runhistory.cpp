@@ -0,0 +1,162 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "runhistory.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/file.h>
+#include <unistd.h>
+
+constexpr char HISTORY_MAGIC[4] = {'R', 'B', 'R', 'H'};
+constexpr uint32_t HISTORY_VERSION = 1;
+
+namespace
+{
+        struct Header {
+                char magic[4];
+                uint32_t version;
+                uint32_t capacity;
+                uint32_t recordSize;
+                uint64_t appended; // runs ever appended; the next slot is appended % capacity
+                uint64_t reserved;
+        };
+
+        static_assert(sizeof(RunRecord) == 64, "RunRecord is stored as is");
+
+        bool read_header(int fd, Header &header)
+        {
+                return pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                       && memcmp(header.magic, HISTORY_MAGIC, sizeof(header.magic)) == 0
+                       && header.version == HISTORY_VERSION && header.capacity > 0
+                       && header.recordSize == sizeof(RunRecord);
+        }
+
+        off_t slot_offset(const Header &header, uint64_t run)
+        {
+                return sizeof(Header) + (off_t)(run % header.capacity) * sizeof(RunRecord);
+        }
+}
+
+RunHistory::RunHistory(const std::string &path, uint32_t capacity)
+        : path(path), capacity(capacity > 0 ? capacity : DEFAULT_CAPACITY)
+{
+}
+
+int RunHistory::append(const RunRecord &record)
+{
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+                std::cerr << path << ": " << strerror(errno) << "\n";
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+
+        Header header;
+        if (!read_header(fd, header)) {
+                // New, or not something we can append to; history is not worth failing a run.
+                memset(&header, 0, sizeof(header));
+                memcpy(header.magic, HISTORY_MAGIC, sizeof(header.magic));
+                header.version = HISTORY_VERSION;
+                header.capacity = capacity;
+                header.recordSize = sizeof(RunRecord);
+                if (ftruncate(fd, 0) != 0) {
+                        close(fd);
+                        return -1;
+                }
+        }
+
+        // The record goes in before the header counts it, so a crash loses at most this run.
+        bool ok = pwrite(fd, &record, sizeof(record), slot_offset(header, header.appended))
+                  == sizeof(record);
+        header.appended++;
+        ok = ok && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fdatasync(fd) == 0;
+        if (!ok)
+                std::cerr << path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return ok ? 0 : -1;
+}
+
+int RunHistory::read(std::vector<RunRecord> &records, size_t last) const
+{
+        records.clear();
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        flock(fd, LOCK_SH);
+        Header header;
+        if (!read_header(fd, header)) {
+                close(fd);
+                return -1;
+        }
+
+        uint64_t stored = std::min<uint64_t>(header.appended, header.capacity);
+        if (last > 0 && last < stored)
+                stored = last;
+        records.resize(stored);
+        bool ok = true;
+        for (uint64_t i = 0; i < stored && ok; i++) {
+                uint64_t run = header.appended - stored + i;
+                ok = pread(fd, &records[i], sizeof(RunRecord), slot_offset(header, run))
+                     == sizeof(RunRecord);
+        }
+        close(fd);
+        if (!ok) {
+                records.clear();
+                return -1;
+        }
+        return 0;
+}
+
+RunTrend RunHistory::trend(const std::vector<RunRecord> &records)
+{
+        RunTrend trend;
+        std::vector<double> throughputs;
+        double duration = 0;
+        for (const auto &record : records) {
+                trend.runs++;
+                if (record.exitCode != 0) {
+                        trend.failures++;
+                        continue;
+                }
+                double seconds = (record.end - record.start) / 1000.0;
+                duration += seconds;
+                throughputs.push_back(seconds > 0 ? record.bytesRead / seconds : 0);
+        }
+        if (throughputs.empty())
+                return trend;
+
+        auto mean = [](std::vector<double>::const_iterator first,
+                       std::vector<double>::const_iterator last) {
+                double sum = 0;
+                for (auto it = first; it != last; ++it)
+                        sum += *it;
+                return first != last ? sum / (last - first) : 0;
+        };
+        auto middle = throughputs.begin() + throughputs.size() / 2;
+        trend.meanDuration = duration / throughputs.size();
+        trend.meanThroughput = mean(throughputs.begin(), throughputs.end());
+        trend.recentThroughput = mean(middle, throughputs.end());
+        double older = mean(throughputs.begin(), middle);
+        trend.change = older > 0 ? trend.recentThroughput / older - 1 : 0;
+        return trend;
+}
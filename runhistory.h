@@ -0,0 +1,103 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RUNHISTORY_H
+#define RUNHISTORY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief One run of a job, as stored in its history file.
+ * Times are milliseconds since the epoch. Fields a run's tools did not report are 0.
+ */
+struct RunRecord {
+        int64_t start = 0;
+        int64_t end = 0;
+        int32_t exitCode = 0;
+        int32_t queuedSeconds = 0; // spent waiting for the run's disks
+        int64_t filesScanned = 0;
+        int64_t filesTransferred = 0;
+        int64_t bytesRead = 0;    // data read from new and changed files
+        int64_t bytesWritten = 0; // data written to the destination and archive
+        double compressionRatio = 0; // archive input over output, 0 without an archive
+};
+
+/*!
+ * \brief Summary of a job's recent runs.
+ */
+struct RunTrend {
+        size_t runs = 0;
+        size_t failures = 0;
+        double meanDuration = 0;   // seconds
+        double meanThroughput = 0; // bytes read per second, over every run
+        double recentThroughput = 0; // over the newer half of the runs
+        double change = 0; // recent against older throughput, e.g. -0.25 for 25% slower
+};
+
+/*!
+ * \brief The RunHistory class
+ * Ring buffer of a job's last runs in /etc/rbackup/<name>.history.
+ *
+ * The file is a header followed by a fixed number of fixed size records, so
+ * appending a run is one write of a record and one of the header, and the file
+ * never grows past its capacity. Once full, the oldest record is overwritten.
+ * Writers lock the file, so runs that end at the same time do not lose records.
+ */
+class RunHistory
+{
+    public:
+        static constexpr uint32_t DEFAULT_CAPACITY = 512;
+
+        /*!
+         * \param Path of the history file.
+         * \param Number of runs kept by a new file; an existing file keeps its own.
+         */
+        explicit RunHistory(const std::string &path, uint32_t capacity = DEFAULT_CAPACITY);
+        ~RunHistory() = default;
+
+        /*!
+         * \brief Appends a run, overwriting the oldest one when the history is full.
+         * \param The run.
+         * \return 0 for success, -1 for failure.
+         */
+        int append(const RunRecord &record);
+
+        /*!
+         * \brief Reads the stored runs, oldest first.
+         * \param Receives the runs.
+         * \param Number of most recent runs to read, 0 for all.
+         * \return 0 for success, -1 if the file is missing or not a history.
+         */
+        int read(std::vector<RunRecord> &records, size_t last = 0) const;
+
+        /*!
+         * \brief Summarizes runs, comparing the newer half against the older one.
+         * \param Runs, oldest first.
+         * \return The summary; failed runs only count as failures.
+         */
+        static RunTrend trend(const std::vector<RunRecord> &records);
+
+    private:
+        std::string path;
+        uint32_t capacity;
+};
+
+#endif // RUNHISTORY_H
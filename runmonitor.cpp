@@ -0,0 +1,211 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "runmonitor.h"
+#include <QRegularExpression>
+#include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusInterface>
+#include <algorithm>
+
+constexpr char SYSTEMD_SERVICE[] = "org.freedesktop.systemd1";
+constexpr char SYSTEMD_PATH[] = "/org/freedesktop/systemd1";
+constexpr char SYSTEMD_MANAGER[] = "org.freedesktop.systemd1.Manager";
+constexpr char PROPERTIES[] = "org.freedesktop.DBus.Properties";
+
+RunMonitor::RunMonitor(QObject *parent) : QObject(parent)
+{
+        QDBusConnection bus = QDBusConnection::systemBus();
+        // systemd only sends its manager signals to clients that subscribed.
+        QDBusInterface manager(SYSTEMD_SERVICE, SYSTEMD_PATH, SYSTEMD_MANAGER, bus);
+        manager.asyncCall("Subscribe");
+        bus.connect(SYSTEMD_SERVICE, SYSTEMD_PATH, SYSTEMD_MANAGER, "JobRemoved", this,
+                    SLOT(on_job_removed(uint, QDBusObjectPath, QString, QString)));
+}
+
+RunMonitor::~RunMonitor()
+{
+        while (!runs.empty())
+                unwatch(runs.begin()->first);
+}
+
+int RunMonitor::watch(const QString &name)
+{
+        if (is_watching(name))
+                return 0;
+        Run &run = runs[name];
+        run.path = unit_path(name + ".service");
+        bool connected = QDBusConnection::systemBus().connect(
+                SYSTEMD_SERVICE, run.path, PROPERTIES, "PropertiesChanged", this,
+                SLOT(on_properties_changed(QString, QVariantMap, QStringList, QDBusMessage)));
+        if (!connected) {
+                runs.erase(name);
+                return -1;
+        }
+
+        // journalctl follows the journal with inotify; -n 0 skips the earlier runs.
+        run.journal = std::make_unique<QProcess>();
+        connect(run.journal.get(), &QProcess::readyReadStandardOutput, this,
+                [this, name]() { read_journal(name); });
+        run.journal->start("journalctl",
+                           {"-f", "-n", "0", "-o", "cat", "-u", name + ".service"});
+        return 0;
+}
+
+void RunMonitor::unwatch(const QString &name)
+{
+        auto run = runs.find(name);
+        if (run == runs.end())
+                return;
+        QDBusConnection::systemBus().disconnect(
+                SYSTEMD_SERVICE, run->second.path, PROPERTIES, "PropertiesChanged", this,
+                SLOT(on_properties_changed(QString, QVariantMap, QStringList, QDBusMessage)));
+        run->second.journal->disconnect(this);
+        run->second.journal->kill();
+        run->second.journal->waitForFinished(1000);
+        runs.erase(run);
+}
+
+bool RunMonitor::is_watching(const QString &name) const
+{
+        return runs.count(name) != 0;
+}
+
+RunProgress RunMonitor::get_progress(const QString &name) const
+{
+        auto run = runs.find(name);
+        return run != runs.end() ? run->second.progress : RunProgress();
+}
+
+bool RunMonitor::parse_progress(const QString &line, RunProgress &progress)
+{
+        static const QRegularExpression format(
+                "^\\s*([\\d,.]+)([KMGT]?)\\s+(\\d+)%\\s+([\\d.]+)([kKMGT]?)B/s"
+                "\\s+(\\S+)(?:\\s+\\(xfr#(\\d+),.*\\))?\\s*$");
+        static const QString units = "KMGT";
+        QRegularExpressionMatch match = format.match(line);
+        if (!match.hasMatch())
+                return false;
+
+        auto scale = [](const QString &unit) {
+                int power = unit.isEmpty() ? 0 : units.indexOf(unit.toUpper()) + 1;
+                double factor = 1;
+                for (int i = 0; i < power; i++)
+                        factor *= 1024;
+                return factor;
+        };
+        progress.bytes = (qint64)(match.captured(1).remove(',').toDouble()
+                                  * scale(match.captured(2)));
+        progress.percent = match.captured(3).toInt();
+        progress.rate = match.captured(4).toDouble() * scale(match.captured(5));
+
+        // "??:??:??" before rsync has a rate to go by.
+        QStringList eta = match.captured(6).split(':');
+        progress.eta = -1;
+        if (eta.size() == 3) {
+                bool ok[3];
+                qint64 seconds = eta[0].toLongLong(&ok[0]) * 3600 + eta[1].toInt(&ok[1]) * 60
+                                 + eta[2].toInt(&ok[2]);
+                if (ok[0] && ok[1] && ok[2])
+                        progress.eta = seconds;
+        }
+        if (!match.captured(7).isEmpty())
+                progress.files = match.captured(7).toLongLong();
+        return true;
+}
+
+void RunMonitor::on_job_removed(uint id, const QDBusObjectPath &job, const QString &unit,
+                                const QString &result)
+{
+        if (!unit.endsWith(".service"))
+                return;
+        QString name = unit.chopped(8);
+        // A service's start job is done once it runs; anything else means it never did.
+        if (is_watching(name) && result != "done")
+                end(name, result);
+}
+
+void RunMonitor::on_properties_changed(const QString &interface, const QVariantMap &changed,
+                                       const QStringList &invalidated,
+                                       const QDBusMessage &message)
+{
+        auto run = std::find_if(runs.begin(), runs.end(), [&message](const auto &entry) {
+                return entry.second.path == message.path();
+        });
+        if (run == runs.end())
+                return;
+
+        if (interface == "org.freedesktop.systemd1.Service" && changed.contains("Result"))
+                run->second.result = changed.value("Result").toString();
+        if (interface != "org.freedesktop.systemd1.Unit" || !changed.contains("ActiveState"))
+                return;
+        QString state = changed.value("ActiveState").toString();
+        if (state == "failed")
+                end(run->first, run->second.result.isEmpty() || run->second.result == "success"
+                                        ? "failed"
+                                        : run->second.result);
+        else if (state == "inactive")
+                end(run->first, "success");
+}
+
+QString RunMonitor::unit_path(const QString &unit)
+{
+        // sd-bus escapes everything but letters and digits, and a leading digit, as _xx.
+        QByteArray name = unit.toUtf8();
+        QString path = QString(SYSTEMD_PATH) + "/unit/";
+        for (int i = 0; i < name.size(); i++) {
+                char c = name[i];
+                bool plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+                             || (i > 0 && c >= '0' && c <= '9');
+                if (plain)
+                        path += QChar(c);
+                else
+                        path += QString("_%1").arg((uchar)c, 2, 16, QChar('0'));
+        }
+        return path;
+}
+
+void RunMonitor::read_journal(const QString &name)
+{
+        auto run = runs.find(name);
+        if (run == runs.end())
+                return;
+        Run &state = run->second;
+        while (state.journal->canReadLine()) {
+                QString line = QString::fromLocal8Bit(state.journal->readLine());
+                if (!parse_progress(line, state.progress))
+                        continue;
+                // Counted from the first line seen, which is not the start of the run when
+                // the job was already running.
+                if (!state.started.isValid()) {
+                        state.started.start();
+                        state.firstFiles = state.progress.files;
+                }
+                qint64 elapsed = state.started.elapsed();
+                state.progress.filesPerSec =
+                        elapsed > 0 ? (state.progress.files - state.firstFiles) * 1000.0 / elapsed
+                                    : 0;
+                emit progress(name, state.progress);
+        }
+}
+
+void RunMonitor::end(const QString &name, const QString &result)
+{
+        unwatch(name);
+        emit finished(name, result);
+}
@@ -0,0 +1,144 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RUNMONITOR_H
+#define RUNMONITOR_H
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QProcess>
+#include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusObjectPath>
+#include <map>
+#include <memory>
+
+/*!
+ * \brief Progress of a running job, from rsync's --info=progress2 lines.
+ */
+struct RunProgress {
+        qint64 bytes = 0;
+        int percent = 0;
+        double rate = 0;        // bytes per second, as rsync reports it
+        qint64 eta = -1;        // seconds, -1 when unknown
+        qint64 files = 0;       // files transferred so far
+        double filesPerSec = 0;
+};
+
+/*!
+ * \brief The RunMonitor class
+ * Follows running jobs without polling.
+ *
+ * systemd's JobRemoved and the unit's PropertiesChanged signals tell when a run
+ * starts and ends and how it ended. Progress comes from the service's journal,
+ * followed with "journalctl -f", where "rbackup exec" writes rsync's progress
+ * lines once a second.
+ */
+class RunMonitor : public QObject
+{
+        Q_OBJECT
+
+    public:
+        RunMonitor(QObject *parent = nullptr);
+        ~RunMonitor();
+        RunMonitor(const RunMonitor &) = delete;
+        RunMonitor &operator=(const RunMonitor &) = delete;
+
+        /*!
+         * \brief Starts following a job's service.
+         * \param Name of the job.
+         * \return 0 for success, -1 if the unit could not be found.
+         */
+        int watch(const QString &name);
+
+        /*!
+         * \brief Stops following a job.
+         * \param Name of the job.
+         */
+        void unwatch(const QString &name);
+
+        /*!
+         * \brief Checks whether a job is being followed.
+         * \param Name of the job.
+         * \return True while the job runs.
+         */
+        bool is_watching(const QString &name) const;
+
+        /*!
+         * \brief Retrieves the last progress of a running job.
+         * \param Name of the job.
+         * \return The progress, all zero before the first progress line.
+         */
+        RunProgress get_progress(const QString &name) const;
+
+        /*!
+         * \brief Parses one line of rsync --info=progress2 output.
+         * e.g. "  1,234,567  45%   12.34MB/s    0:00:12 (xfr#12, to-chk=100/200)"
+         * \param The line.
+         * \param Receives the values; filesPerSec is left alone.
+         * \return True if the line was a progress line.
+         */
+        static bool parse_progress(const QString &line, RunProgress &progress);
+
+    signals:
+        /*!
+         * \brief Emitted for every progress line of a running job.
+         */
+        void progress(const QString &name, const RunProgress &progress);
+
+        /*!
+         * \brief Emitted once a job's run has ended.
+         * \param Name of the job.
+         * \param systemd's result, e.g. "success", "exit-code" or "signal".
+         */
+        void finished(const QString &name, const QString &result);
+
+    private slots:
+        void on_job_removed(uint id, const QDBusObjectPath &job, const QString &unit,
+                            const QString &result);
+
+        void on_properties_changed(const QString &interface, const QVariantMap &changed,
+                                   const QStringList &invalidated, const QDBusMessage &message);
+
+    private:
+        struct Run {
+                QString path;
+                std::unique_ptr<QProcess> journal;
+                RunProgress progress;
+                QElapsedTimer started; // since the first progress line
+                qint64 firstFiles = 0;
+                QString result; // the service's Result property, once it changes
+        };
+
+        std::map<QString, Run> runs;
+
+        /*!
+         * \brief Builds the object path systemd gives a unit, without asking systemd.
+         * \param Name of the unit.
+         * \return The object path.
+         */
+        static QString unit_path(const QString &unit);
+
+        void read_journal(const QString &name);
+
+        void end(const QString &name, const QString &result);
+};
+
+Q_DECLARE_METATYPE(RunProgress)
+
+#endif // RUNMONITOR_H
@@ -0,0 +1,226 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "runsupervisor.h"
+#include "devicequeue.h"
+#include <QFile>
+#include <QRegularExpression>
+#include <QTextStream>
+#include <algorithm>
+
+constexpr int TICK_MS = 2000;
+constexpr int MAX_LEVEL = 4;
+constexpr qint64 RELAX_MS = 10000;
+constexpr qint64 MAX_FREEZE_MS = 120000;
+constexpr quint64 MIN_BANDWIDTH = 1 << 20;
+constexpr int DEFAULT_IO_WEIGHT = 100;
+
+RunSupervisor::RunSupervisor(QObject *parent) : QObject(parent)
+{
+        timer.setInterval(TICK_MS);
+        connect(&timer, &QTimer::timeout, this, &RunSupervisor::tick);
+}
+
+RunSupervisor::~RunSupervisor()
+{
+        while (!runs.empty())
+                stop(runs.begin()->first);
+}
+
+void RunSupervisor::start(const BackupJob &job)
+{
+        JobFlags flags = job.get_flags();
+        if (flags.pressureTarget <= 0 && flags.latencyTarget <= 0)
+                return;
+        Run &run = runs[job.get_name()];
+        run = Run();
+        run.job = job;
+        std::vector<std::string> dests;
+        for (const auto &dest : job.get_dests())
+                dests.push_back(dest.toStdString());
+        run.disks = DeviceQueue::devices_of(dests);
+        run.changed.start();
+        read_latency(run);
+        measure_rate(run);
+        if (!timer.isActive())
+                timer.start();
+}
+
+void RunSupervisor::stop(const QString &name)
+{
+        auto found = runs.find(name);
+        if (found == runs.end())
+                return;
+        Run &run = found->second;
+        if (run.frozen)
+                systemd.freeze_unit_async(name + ".service", false);
+        if (run.touched)
+                systemd.revert_io_limits_async(name + ".service");
+        runs.erase(found);
+        if (runs.empty())
+                timer.stop();
+}
+
+int RunSupervisor::get_level(const QString &name) const
+{
+        auto found = runs.find(name);
+        return found != runs.end() ? found->second.level : -1;
+}
+
+bool RunSupervisor::is_frozen(const QString &name) const
+{
+        auto found = runs.find(name);
+        return found != runs.end() && found->second.frozen;
+}
+
+double RunSupervisor::read_pressure(const QString &resource)
+{
+        static const QRegularExpression some("^some avg10=([0-9.]+)");
+        QFile file("/proc/pressure/" + resource);
+        if (!file.open(QIODevice::ReadOnly))
+                return 0;
+        QRegularExpressionMatch match = some.match(QString::fromLatin1(file.readLine()));
+        return match.hasMatch() ? match.captured(1).toDouble() : 0;
+}
+
+void RunSupervisor::tick()
+{
+        double pressure = std::max({read_pressure("io"), read_pressure("cpu"),
+                                    read_pressure("memory")});
+        for (auto &entry : runs) {
+                Run &run = entry.second;
+                JobFlags flags = run.job.get_flags();
+                double latency = read_latency(run);
+                if (!run.frozen)
+                        measure_rate(run);
+
+                bool over = (flags.pressureTarget > 0 && pressure > flags.pressureTarget)
+                            || (flags.latencyTarget > 0 && latency > flags.latencyTarget);
+                bool severe = (flags.pressureTarget > 0 && pressure > 2 * flags.pressureTarget)
+                              || (flags.latencyTarget > 0 && latency > 2 * flags.latencyTarget);
+                // Latency is not measured while frozen, so only pressure can end a freeze.
+                bool relaxed = (flags.pressureTarget <= 0 || pressure < flags.pressureTarget / 2.0)
+                               && (run.frozen || flags.latencyTarget <= 0
+                                   || latency < flags.latencyTarget / 2.0);
+
+                if (run.frozen) {
+                        if (relaxed || run.changed.elapsed() > MAX_FREEZE_MS) {
+                                systemd.freeze_unit_async(entry.first + ".service", false);
+                                run.frozen = false;
+                                run.changed.start();
+                                read_latency(run);
+                        }
+                } else if (over && run.level < MAX_LEVEL) {
+                        if (run.level == 0)
+                                run.baseline = run.rate;
+                        run.level++;
+                        apply(run);
+                        run.changed.start();
+                } else if (severe) {
+                        systemd.freeze_unit_async(entry.first + ".service", true);
+                        run.frozen = true;
+                        run.changed.start();
+                } else if (relaxed && run.level > 0 && run.changed.elapsed() > RELAX_MS) {
+                        run.level--;
+                        apply(run);
+                        run.changed.start();
+                }
+        }
+}
+
+void RunSupervisor::apply(Run &run)
+{
+        // Back at level 0 the unit file's settings, whatever they are now, take over.
+        if (run.level == 0) {
+                if (run.touched)
+                        systemd.revert_io_limits_async(run.job.get_name() + ".service");
+                run.touched = false;
+                return;
+        }
+        JobFlags flags = run.job.get_flags();
+        int weight = flags.ioWeight > 0 ? flags.ioWeight : DEFAULT_IO_WEIGHT;
+        quint64 read = (quint64)flags.readBandwidth << 20;
+        quint64 write = (quint64)flags.writeBandwidth << 20;
+        weight = std::max(weight >> (2 * run.level), 1);
+        // Without a measured rate only the weight changes.
+        if (run.baseline > 0) {
+                quint64 cap = std::max((quint64)run.baseline >> run.level, MIN_BANDWIDTH);
+                read = read > 0 ? std::min(read, cap) : cap;
+                write = write > 0 ? std::min(write, cap) : cap;
+        }
+
+        BandwidthLimits reads;
+        BandwidthLimits writes;
+        if (read > 0) {
+                for (const auto &source : run.job.get_sources())
+                        reads.append({source.path, read});
+        }
+        if (write > 0) {
+                for (const auto &dest : run.job.get_dests())
+                        writes.append({dest, write});
+        }
+        systemd.set_io_limits_async(run.job.get_name() + ".service", weight, reads, writes);
+        run.touched = true;
+}
+
+double RunSupervisor::read_latency(Run &run)
+{
+        quint64 ios = 0;
+        quint64 ms = 0;
+        for (const auto &disk : run.disks) {
+                QFile file(QString::fromStdString("/sys/dev/block/" + disk + "/stat"));
+                if (!file.open(QIODevice::ReadOnly))
+                        continue;
+                QStringList fields = QString::fromLatin1(file.readAll()).simplified().split(' ');
+                if (fields.size() < 8)
+                        continue;
+                // Reads and writes completed, and the milliseconds they took.
+                std::pair<quint64, quint64> now(fields[0].toULongLong() + fields[4].toULongLong(),
+                                                fields[3].toULongLong() + fields[7].toULongLong());
+                auto previous = run.diskStats.find(disk);
+                if (previous != run.diskStats.end() && now.first > previous->second.first) {
+                        ios += now.first - previous->second.first;
+                        ms += now.second - previous->second.second;
+                }
+                run.diskStats[disk] = now;
+        }
+        return ios > 0 ? (double)ms / ios : 0;
+}
+
+void RunSupervisor::measure_rate(Run &run)
+{
+        QFile file("/sys/fs/cgroup/system.slice/" + run.job.get_name() + ".service/io.stat");
+        if (!file.open(QIODevice::ReadOnly))
+                return;
+        static const QRegularExpression bytes("[rw]bytes=([0-9]+)");
+        quint64 total = 0;
+        QRegularExpressionMatchIterator it = bytes.globalMatch(QString::fromLatin1(file.readAll()));
+        while (it.hasNext())
+                total += it.next().captured(1).toULongLong();
+
+        qint64 elapsed = run.measured.isValid() ? run.measured.restart() : 0;
+        if (!run.measured.isValid())
+                run.measured.start();
+        // Only unthrottled rates say how fast the run could go.
+        if (elapsed > 0 && total >= run.bytes && run.level == 0) {
+                double rate = (total - run.bytes) * 1000.0 / elapsed;
+                run.rate = run.rate > 0 ? 0.7 * run.rate + 0.3 * rate : rate;
+        }
+        run.bytes = total;
+}
@@ -0,0 +1,136 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RUNSUPERVISOR_H
+#define RUNSUPERVISOR_H
+
+#include "backupjob.h"
+#include "systemdclient.h"
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+#include <map>
+#include <string>
+#include <vector>
+
+/*!
+ * \brief The RunSupervisor class
+ * Slows down running backups while the system is under pressure, and speeds them
+ * back up once it is not.
+ *
+ * Every two seconds, while a supervised run is going, the supervisor reads the
+ * pressure stall information in /proc/pressure and the request latency of the
+ * destination's disks. Above a job's target it takes one step down: each step
+ * divides the service's IOWeight by four and halves its read and write bandwidth,
+ * starting from what the run was moving when throttling began. Past the last step,
+ * at twice the target, the service's cgroup is frozen until pressure falls below
+ * half the target or two minutes pass. Below half the target it steps back up, at
+ * most once every ten seconds, until the job's own settings are back. Throttling is
+ * set as runtime properties of the service; at level 0, and when the run ends, they
+ * are removed again rather than overwritten, so later changes to the unit file apply.
+ */
+class RunSupervisor : public QObject
+{
+        Q_OBJECT
+
+    public:
+        RunSupervisor(QObject *parent = nullptr);
+        ~RunSupervisor();
+        RunSupervisor(const RunSupervisor &) = delete;
+        RunSupervisor &operator=(const RunSupervisor &) = delete;
+
+        /*!
+         * \brief Starts supervising a run if its job has a pressure or latency target.
+         * \param The job.
+         */
+        void start(const BackupJob &job);
+
+        /*!
+         * \brief Stops supervising a run and gives the service its settings back.
+         * \param Name of the job.
+         */
+        void stop(const QString &name);
+
+        /*!
+         * \brief Gets how far a run is throttled.
+         * \param Name of the job.
+         * \return 0 when it runs with its own settings, up to 4, or -1 when it is not
+         * supervised.
+         */
+        int get_level(const QString &name) const;
+
+        /*!
+         * \brief Checks whether a run is frozen.
+         * \param Name of the job.
+         * \return True while the run's processes are frozen.
+         */
+        bool is_frozen(const QString &name) const;
+
+        /*!
+         * \brief Reads how much of the time tasks were stalled on a resource.
+         * \param "io", "cpu" or "memory".
+         * \return The "some" average over the last 10 seconds in percent, 0 without PSI.
+         */
+        static double read_pressure(const QString &resource);
+
+    private slots:
+        void tick();
+
+    private:
+        struct Run {
+                BackupJob job;
+                std::vector<std::string> disks;
+                std::map<std::string, std::pair<quint64, quint64>> diskStats; // ios, ms
+                quint64 bytes = 0;
+                double rate = 0;     // bytes per second, while not throttled
+                double baseline = 0; // rate when throttling began
+                int level = 0;
+                bool frozen = false;
+                bool touched = false;
+                QElapsedTimer changed;
+                QElapsedTimer measured;
+        };
+
+        std::map<QString, Run> runs;
+        QTimer timer;
+        SystemdClient systemd;
+
+        /*!
+         * \brief Sets the service's I/O weight and bandwidth for its throttling level, or
+         * removes what was set at level 0.
+         * \param The run.
+         */
+        void apply(Run &run);
+
+        /*!
+         * \brief Measures the mean time of the requests to the run's destination disks
+         * since the last call.
+         * \param The run.
+         * \return Milliseconds per request, 0 if nothing was requested.
+         */
+        static double read_latency(Run &run);
+
+        /*!
+         * \brief Measures how fast the run's service reads and writes.
+         * \param The run.
+         */
+        static void measure_rate(Run &run);
+};
+
+#endif // RUNSUPERVISOR_H
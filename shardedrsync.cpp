@@ -0,0 +1,386 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "shardedrsync.h"
+#include <QEventLoop>
+#include <QProcess>
+#include <QRegularExpression>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+namespace fs = std::filesystem;
+
+// What one file's metadata round trip costs, in bytes, when balancing the shards.
+constexpr quint64 FILE_WEIGHT = 32 * 1024;
+
+ShardedRsync::ShardedRsync(const QStringList &command, int shards, int workers)
+        : shards(std::max(shards, 1)), workers(std::max(workers, 1))
+{
+        program = command.value(0);
+        options = command.mid(1, command.size() - 3);
+        src = command.value(command.size() - 2);
+        dest = command.value(command.size() - 1);
+}
+
+void ShardedRsync::set_paths(const QStringList &paths)
+{
+        this->paths = paths;
+}
+
+int ShardedRsync::run()
+{
+        std::vector<std::vector<std::string>> lists = plan();
+        std::vector<std::unique_ptr<QTemporaryFile>> files;
+        std::vector<QStringList> args;
+
+        if (lists.empty() && !paths.isEmpty()) {
+                std::cerr << "None of the paths were found.\n";
+                return -1;
+        }
+        // Nothing to split, fall back to a single plain rsync.
+        if (lists.empty()) {
+                args.push_back(options + QStringList{"--stats", src, dest});
+                exitCodes = run_all(program, args, workers, stats);
+                return exitCodes.front();
+        }
+
+        QString base = src.endsWith('/') ? src : QString::fromStdString(
+                                                         fs::path(src.toStdString())
+                                                                 .parent_path()
+                                                                 .string());
+        if (base.isEmpty())
+                base = ".";
+
+        for (const auto &list : lists) {
+                auto file = write_list(list);
+                if (!file)
+                        return -1;
+                args.push_back(options
+                               + QStringList{"-r", "--from0", "--files-from=" + file->fileName(),
+                                             "--stats", base, dest});
+                files.push_back(std::move(file));
+        }
+        exitCodes = run_all(program, args, workers, stats);
+
+        for (int code : exitCodes) {
+                if (code != 0)
+                        return code;
+        }
+
+        // Only the entries directly in a split directory are compared, so this is cheap.
+        if (deletes(options)) {
+                QString from = base.endsWith('/') ? base : base + "/";
+                QString to = dest.endsWith('/') ? dest : dest + "/";
+                args.clear();
+                for (const auto &dir : split) {
+                        QString inside = dir.empty() ? "" : QString::fromStdString(dir) + "/";
+                        args.push_back(options
+                                       + QStringList{"--no-recursive", "--dirs", "--stats",
+                                                     from + inside, to + inside});
+                }
+                RsyncStats pruned;
+                for (int code : run_all(program, args, workers, pruned)) {
+                        if (code != 0)
+                                return code;
+                }
+        }
+
+        // The files are all there, so this only replaces copies with links.
+        if (lists.size() > 1 && !linked.empty() && keeps_hard_links(options)) {
+                auto file = write_list(linked);
+                if (!file)
+                        return -1;
+                RsyncStats relinked;
+                args = {options
+                        + QStringList{"--from0", "--files-from=" + file->fileName(), "--stats",
+                                      base, dest}};
+                return run_all(program, args, 1, relinked).front();
+        }
+        return 0;
+}
+
+RsyncStats ShardedRsync::get_stats() const
+{
+        return stats;
+}
+
+std::vector<int> ShardedRsync::get_exit_codes() const
+{
+        return exitCodes;
+}
+
+void ShardedRsync::parse_stats(const QString &output, RsyncStats &stats)
+{
+        static const QRegularExpression line(
+                "^(Number of files|Number of regular files transferred|Total file size"
+                "|Total transferred file size|Total bytes sent|Total bytes received): ([0-9,]+)",
+                QRegularExpression::MultilineOption);
+
+        QRegularExpressionMatchIterator it = line.globalMatch(output);
+        while (it.hasNext()) {
+                QRegularExpressionMatch match = it.next();
+                qint64 value = match.captured(2).remove(',').toLongLong();
+                QString key = match.captured(1);
+                if (key == "Number of files")
+                        stats.files += value;
+                else if (key == "Number of regular files transferred")
+                        stats.filesTransferred += value;
+                else if (key == "Total file size")
+                        stats.totalSize += value;
+                else if (key == "Total transferred file size")
+                        stats.transferredSize += value;
+                else if (key == "Total bytes sent")
+                        stats.bytesSent += value;
+                else if (key == "Total bytes received")
+                        stats.bytesReceived += value;
+        }
+}
+
+QString ShardedRsync::format_stats(const RsyncStats &stats)
+{
+        QString out = "";
+        out += "Number of files: " + QString::number(stats.files) + "\n";
+        out += "Number of regular files transferred: " + QString::number(stats.filesTransferred)
+               + "\n";
+        out += "Total file size: " + QString::number(stats.totalSize) + " bytes\n";
+        out += "Total transferred file size: " + QString::number(stats.transferredSize)
+               + " bytes\n";
+        out += "Total bytes sent: " + QString::number(stats.bytesSent) + "\n";
+        out += "Total bytes received: " + QString::number(stats.bytesReceived) + "\n";
+        return out;
+}
+
+std::vector<std::vector<std::string>> ShardedRsync::plan()
+{
+        std::error_code ec;
+        fs::path root = fs::path(src.toStdString()).lexically_normal();
+        if (!root.has_filename())
+                root = root.parent_path();
+        if (!fs::is_directory(root, ec) || fs::is_symlink(root, ec))
+                return {};
+
+        // Paths are listed relative to the parent of the source unless the source
+        // ends with a slash, matching how rsync itself names the copied files.
+        fs::path prefix = src.endsWith('/') ? fs::path() : root.filename();
+
+        std::unordered_map<std::string, quint64> weights;
+        std::vector<fs::path> links;
+        std::vector<Unit> pending;
+        quint64 total = 0;
+        split.clear();
+        if (paths.isEmpty()) {
+                total = weigh(root, weights, links);
+                pending = children(root, weights);
+                split.push_back(prefix.string());
+        }
+        for (QString path : paths) {
+                while (path.startsWith('/'))
+                        path.remove(0, 1);
+                fs::path full = (root / path.toStdString()).lexically_normal();
+                if (!full.has_filename())
+                        full = full.parent_path();
+                fs::file_status status = fs::symlink_status(full, ec);
+                if (ec || !fs::exists(status)
+                    || full.lexically_relative(root).string().rfind("..", 0) == 0) {
+                        std::cerr << full.string() << ": not found\n";
+                        ec.clear();
+                        continue;
+                }
+                quint64 weight = FILE_WEIGHT;
+                if (fs::is_directory(status)) {
+                        weight = weigh(full, weights, links);
+                } else if (fs::is_regular_file(status)) {
+                        uintmax_t size = fs::file_size(full, ec);
+                        weight += ec ? 0 : size;
+                        if (fs::hard_link_count(full, ec) > 1)
+                                links.push_back(full);
+                        ec.clear();
+                }
+                total += weight;
+                pending.push_back({full, weight});
+        }
+        quint64 target = total / shards;
+
+        linked.clear();
+        for (const auto &link : links)
+                linked.push_back((prefix / link.lexically_relative(root)).string());
+
+        std::vector<Unit> units;
+        while (!pending.empty()) {
+                Unit unit = pending.back();
+                pending.pop_back();
+                auto found = weights.find(unit.path.string());
+                if (found != weights.end() && unit.weight > target) {
+                        std::vector<Unit> parts = children(unit.path, weights);
+                        if (!parts.empty()) {
+                                // The directory itself is still sent as an implied
+                                // parent of its children.
+                                pending.insert(pending.end(), parts.begin(), parts.end());
+                                split.push_back(
+                                        (prefix / unit.path.lexically_relative(root)).string());
+                                continue;
+                        }
+                }
+                units.push_back(unit);
+        }
+        if (units.empty())
+                return {};
+
+        std::sort(units.begin(), units.end(),
+                  [](const Unit &a, const Unit &b) { return a.weight > b.weight; });
+
+        std::vector<std::vector<std::string>> lists(std::min<size_t>(shards, units.size()));
+        std::vector<quint64> loads(lists.size(), 0);
+        for (const auto &unit : units) {
+                size_t lightest = std::min_element(loads.begin(), loads.end()) - loads.begin();
+                loads[lightest] += unit.weight;
+                lists[lightest].push_back((prefix / unit.path.lexically_relative(root)).string());
+        }
+        return lists;
+}
+
+quint64 ShardedRsync::weigh(const fs::path &dir,
+                            std::unordered_map<std::string, quint64> &weights,
+                            std::vector<fs::path> &links) const
+{
+        quint64 weight = FILE_WEIGHT;
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+                if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                        weight += weigh(it->path(), weights, links);
+                } else {
+                        bool regular = it->is_regular_file(ec) && !it->is_symlink(ec);
+                        uintmax_t size = regular ? it->file_size(ec) : 0;
+                        weight += FILE_WEIGHT + (ec ? 0 : size);
+                        if (regular && it->hard_link_count(ec) > 1)
+                                links.push_back(it->path());
+                        ec.clear();
+                }
+        }
+        weights[dir.string()] = weight;
+        return weight;
+}
+
+std::vector<ShardedRsync::Unit>
+ShardedRsync::children(const fs::path &dir,
+                       const std::unordered_map<std::string, quint64> &weights) const
+{
+        std::vector<Unit> units;
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+                auto found = weights.find(it->path().string());
+                if (found != weights.end()) {
+                        units.push_back({it->path(), found->second});
+                } else {
+                        uintmax_t size = it->is_regular_file(ec) ? it->file_size(ec) : 0;
+                        units.push_back({it->path(), FILE_WEIGHT + (ec ? 0 : size)});
+                        ec.clear();
+                }
+        }
+        return units;
+}
+
+bool ShardedRsync::keeps_hard_links(const QStringList &options)
+{
+        for (const auto &option : options) {
+                if (option == "--hard-links"
+                    || (option.startsWith('-') && !option.startsWith("--") && option.contains('H')))
+                        return true;
+        }
+        return false;
+}
+
+bool ShardedRsync::deletes(const QStringList &options)
+{
+        for (const auto &option : options) {
+                if (option.startsWith("--delete") || option == "--del")
+                        return true;
+        }
+        return false;
+}
+
+std::unique_ptr<QTemporaryFile> ShardedRsync::write_list(const std::vector<std::string> &list)
+{
+        auto file = std::make_unique<QTemporaryFile>();
+        if (!file->open()) {
+                std::cerr << "Unable to create shard list.\n";
+                return nullptr;
+        }
+        for (const auto &path : list) {
+                file->write(path.c_str(), path.size() + 1);
+        }
+        file->flush();
+        return file;
+}
+
+std::vector<int> ShardedRsync::run_all(const QString &program,
+                                      const std::vector<QStringList> &args, int workers,
+                                      RsyncStats &stats)
+{
+        std::vector<std::unique_ptr<QProcess>> processes(args.size());
+        std::vector<int> exitCodes(args.size(), 0);
+        workers = std::max(workers, 1);
+        QEventLoop loop;
+        size_t next = 0;
+        int running = 0;
+
+        std::function<void()> start_next = [&]() {
+                while (running < workers && next < args.size()) {
+                        size_t index = next++;
+                        processes[index] = std::make_unique<QProcess>();
+                        QProcess *process = processes[index].get();
+                        process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+                        QObject::connect(
+                                process,
+                                QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished),
+                                [&, index, process](int code, QProcess::ExitStatus status) {
+                                        exitCodes[index] =
+                                                status == QProcess::NormalExit ? code : -1;
+                                        parse_stats(QString::fromUtf8(process->readAllStandardOutput()),
+                                                    stats);
+                                        running--;
+                                        start_next();
+                                        if (running == 0)
+                                                loop.quit();
+                                });
+                        QObject::connect(process, &QProcess::errorOccurred,
+                                         [&, index](QProcess::ProcessError error) {
+                                                 if (error != QProcess::FailedToStart)
+                                                         return;
+                                                 std::cerr << "Unable to start " +
+                                                                      program.toStdString() +
+                                                                      "\n";
+                                                 exitCodes[index] = 127;
+                                                 running--;
+                                                 start_next();
+                                                 if (running == 0)
+                                                         loop.quit();
+                                         });
+                        running++;
+                        process->start(program, args[index]);
+                }
+        };
+
+        start_next();
+        if (running > 0)
+                loop.exec();
+        return exitCodes;
+}
@@ -0,0 +1,197 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHARDEDRSYNC_H
+#define SHARDEDRSYNC_H
+
+#include <QString>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*!
+ * \brief Transfer statistics as reported by rsync --stats.
+ */
+struct RsyncStats {
+        qint64 files = 0;
+        qint64 filesTransferred = 0;
+        qint64 totalSize = 0;
+        qint64 transferredSize = 0;
+        qint64 bytesSent = 0;
+        qint64 bytesReceived = 0;
+};
+
+/*!
+ * \brief The ShardedRsync class
+ * Splits the source of an rsync command into size balanced shards and runs one
+ * rsync per shard, at most a given number at a time.
+ *
+ * Top level entries of the source are the units of work. Directories heavier than
+ * an even share are split into their children until they fit, then the units are
+ * handed out largest first to the lightest shard. Each shard is passed to rsync as
+ * a --files-from list relative to the source's parent, so the destination layout
+ * is the same as a single "rsync src dest".
+ *
+ * A shard's --delete only reaches inside the directories it recurses into, so when
+ * the options delete, a last non-recursive "rsync --dirs" over the source root and
+ * every split directory removes what was deleted directly from them.
+ *
+ * Hard links between shards can not be seen by either rsync, so when the options
+ * ask for hard links (-H) a last rsync over every file with more than one link
+ * links them together again.
+ */
+class ShardedRsync
+{
+    public:
+        /*!
+         * \param Full rsync command, ending with the source and destination.
+         * \param Number of shards to split the source into.
+         * \param Number of rsync processes to run at once.
+         */
+        ShardedRsync(const QStringList &command, int shards, int workers);
+        ~ShardedRsync() = default;
+        ShardedRsync(const ShardedRsync &) = delete;
+        ShardedRsync &operator=(const ShardedRsync &) = delete;
+
+        /*!
+         * \brief Only copies the given paths below the source instead of all of it.
+         * \param Paths relative to the source, all of it when empty.
+         */
+        void set_paths(const QStringList &paths);
+
+        /*!
+         * \brief Plans the shards and runs the workers. Needs a QCoreApplication.
+         * \return 0 if every shard succeeded, otherwise the first failing rsync exit code.
+         */
+        int run();
+
+        /*!
+         * \brief Retrieves the statistics summed over all shards.
+         * \return Aggregated statistics.
+         */
+        RsyncStats get_stats() const;
+
+        /*!
+         * \brief Retrieves the exit code of each shard's rsync.
+         * \return Exit codes in shard order.
+         */
+        std::vector<int> get_exit_codes() const;
+
+        /*!
+         * \brief Adds the statistics found in rsync --stats output to the given totals.
+         * \param Output of rsync.
+         * \param Statistics to add to.
+         */
+        static void parse_stats(const QString &output, RsyncStats &stats);
+
+        /*!
+         * \brief Formats statistics the way rsync --stats prints them.
+         * \param Statistics to format.
+         * \return Formatted statistics.
+         */
+        static QString format_stats(const RsyncStats &stats);
+
+        /*!
+         * \brief Runs rsync processes, at most a given number at a time. Needs a
+         * QCoreApplication.
+         * \param Program to run.
+         * \param Argument list for each process; each must include --stats.
+         * \param Number of processes to run at once.
+         * \param Statistics the processes' output is added to.
+         * \return Exit code of each process, in the order of the argument lists.
+         */
+        static std::vector<int> run_all(const QString &program,
+                                        const std::vector<QStringList> &args, int workers,
+                                        RsyncStats &stats);
+
+    private:
+        struct Unit {
+                std::filesystem::path path;
+                quint64 weight;
+        };
+
+        QString program;
+        QStringList options;
+        QString src;
+        QString dest;
+        QStringList paths;
+        int shards;
+        int workers;
+
+        RsyncStats stats;
+        std::vector<int> exitCodes;
+        // Files with more than one link, relative to the source's parent.
+        std::vector<std::string> linked;
+        // Directories split into their children by plan(), relative to the source's parent.
+        std::vector<std::string> split;
+
+        /*!
+         * \brief Splits the source into shards, noting the files with more than one link
+         * and the directories that were split.
+         * \return Paths in each shard, relative to the source's parent.
+         */
+        std::vector<std::vector<std::string>> plan();
+
+        /*!
+         * \brief Computes the weight of every directory below the given one.
+         * \param Directory to weigh.
+         * \param Map from directory path to weight that gets filled in.
+         * \param Receives the files with more than one link.
+         * \return Weight of the directory.
+         */
+        quint64 weigh(const std::filesystem::path &dir,
+                      std::unordered_map<std::string, quint64> &weights,
+                      std::vector<std::filesystem::path> &links) const;
+
+        /*!
+         * \brief Checks whether rsync options include -H.
+         * \param rsync options.
+         * \return True if hard links are preserved.
+         */
+        static bool keeps_hard_links(const QStringList &options);
+
+        /*!
+         * \brief Checks whether rsync options include one of the --delete options.
+         * \param rsync options.
+         * \return True if files removed from the source are deleted.
+         */
+        static bool deletes(const QStringList &options);
+
+        /*!
+         * \brief Writes a NUL separated --files-from list.
+         * \param Paths to list.
+         * \return The list, or nullptr if it could not be written.
+         */
+        static std::unique_ptr<QTemporaryFile> write_list(const std::vector<std::string> &list);
+
+        /*!
+         * \brief Lists the direct children of a directory as units of work.
+         * \param Directory to list.
+         * \param Directory weights computed by weigh().
+         * \return Units for the children.
+         */
+        std::vector<Unit> children(const std::filesystem::path &dir,
+                                   const std::unordered_map<std::string, quint64> &weights) const;
+};
+
+#endif // SHARDEDRSYNC_H
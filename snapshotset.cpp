@@ -0,0 +1,143 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "snapshotset.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QRegularExpression>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+constexpr char LATEST[] = "latest";
+constexpr char PARTIAL[] = ".partial";
+
+static const QRegularExpression snapshotName("^\\d{8}T\\d{6}Z$");
+
+SnapshotSet::SnapshotSet(const QString &dest) : dest(dest)
+{
+        QDir().mkpath(dest);
+}
+
+QStringList SnapshotSet::list() const
+{
+        QStringList out;
+        QDir::Filters filters = QDir::Dirs | QDir::NoDotAndDotDot | QDir::NoSymLinks;
+        for (const auto &entry : QDir(dest).entryList(filters, QDir::Name)) {
+                if (snapshotName.match(entry).hasMatch())
+                        out.append(entry);
+        }
+        return out;
+}
+
+QString SnapshotSet::latest() const
+{
+        QFileInfo link(path_of(LATEST));
+        if (link.isSymLink()) {
+                QString target = QFileInfo(link.symLinkTarget()).fileName();
+                if (snapshotName.match(target).hasMatch() && QFileInfo(path_of(target)).isDir())
+                        return target;
+        }
+        // A missing or broken link falls back to the newest snapshot on disk.
+        QStringList snapshots = list();
+        return snapshots.isEmpty() ? QString() : snapshots.last();
+}
+
+QString SnapshotSet::begin()
+{
+        name = QDateTime::currentDateTimeUtc().toString("yyyyMMdd'T'HHmmss'Z'");
+        if (QFileInfo::exists(path_of(name))) {
+                std::cerr << path_of(name).toStdString() << ": snapshot already exists\n";
+                return "";
+        }
+
+        // Continue in what an interrupted run copied; older leftovers are dropped.
+        QString partial = path_of(name + PARTIAL);
+        QStringList leftovers = QDir(dest).entryList({QString("*") + PARTIAL},
+                                                     QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        for (int i = 0; i < leftovers.size(); i++) {
+                if (i + 1 < leftovers.size())
+                        QDir(path_of(leftovers[i])).removeRecursively();
+                else if (rename(path_of(leftovers[i]).toLocal8Bit(), partial.toLocal8Bit()) != 0)
+                        return "";
+        }
+        if (!QDir().mkpath(partial))
+                return "";
+        return partial;
+}
+
+int SnapshotSet::commit()
+{
+        QString partial = path_of(name + PARTIAL);
+        if (rename(partial.toLocal8Bit(), path_of(name).toLocal8Bit()) != 0) {
+                std::cerr << partial.toStdString() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+
+        // The link is relative so the destination can be moved or mounted elsewhere.
+        QString link = path_of(QString(".") + LATEST + ".new");
+        unlink(link.toLocal8Bit());
+        if (symlink(name.toLocal8Bit(), link.toLocal8Bit()) != 0
+            || rename(link.toLocal8Bit(), path_of(LATEST).toLocal8Bit()) != 0) {
+                std::cerr << path_of(LATEST).toStdString() << ": " << strerror(errno) << "\n";
+                return -1;
+        }
+        sync_directory();
+        return 0;
+}
+
+QStringList SnapshotSet::prune(int keep)
+{
+        QStringList removed;
+        if (keep <= 0)
+                return removed;
+        QStringList snapshots = list();
+        QString current = latest();
+        for (int i = 0; i + keep < snapshots.size(); i++) {
+                if (snapshots[i] == current)
+                        continue;
+                if (QDir(path_of(snapshots[i])).removeRecursively())
+                        removed.append(snapshots[i]);
+                else
+                        std::cerr << path_of(snapshots[i]).toStdString() << ": unable to delete\n";
+        }
+        return removed;
+}
+
+QString SnapshotSet::get_name() const
+{
+        return name;
+}
+
+QString SnapshotSet::path_of(const QString &name) const
+{
+        return dest + "/" + name;
+}
+
+void SnapshotSet::sync_directory() const
+{
+        int fd = open(dest.toLocal8Bit(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+                fsync(fd);
+                close(fd);
+        }
+}
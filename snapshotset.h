@@ -0,0 +1,101 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SNAPSHOTSET_H
+#define SNAPSHOTSET_H
+
+#include <QString>
+#include <QStringList>
+
+/*!
+ * \brief The SnapshotSet class
+ * Keeps the dated snapshot directories of a job in its destination.
+ *
+ * Each run is written to "<time>.partial" and renamed to "<time>" once complete,
+ * so a snapshot directory is never half written. "latest" is a symbolic link to
+ * the newest snapshot and is replaced with a rename, so it always points at a
+ * complete one. An interrupted run leaves its partial directory behind; the next
+ * run continues in it instead of copying everything again.
+ *
+ * Layout:
+ *      <dest>/20201012T020000Z         complete snapshot
+ *      <dest>/20201013T020000Z.partial snapshot being written
+ *      <dest>/latest                   -> 20201012T020000Z
+ */
+class SnapshotSet
+{
+    public:
+        /*!
+         * \param Destination directory of the job. It is created if needed.
+         */
+        explicit SnapshotSet(const QString &dest);
+        ~SnapshotSet() = default;
+        SnapshotSet(const SnapshotSet &) = delete;
+        SnapshotSet &operator=(const SnapshotSet &) = delete;
+
+        /*!
+         * \brief Lists the complete snapshots.
+         * \return Snapshot names, oldest first.
+         */
+        QStringList list() const;
+
+        /*!
+         * \brief Finds the snapshot "latest" points to.
+         * \return Snapshot name, or an empty string if there is none.
+         */
+        QString latest() const;
+
+        /*!
+         * \brief Prepares the directory of a new snapshot.
+         * \return Path of the partial directory to copy into, or an empty string on failure.
+         */
+        QString begin();
+
+        /*!
+         * \brief Completes the snapshot started by begin() and points "latest" at it.
+         * \return 0 for success, -1 for failure.
+         */
+        int commit();
+
+        /*!
+         * \brief Deletes the oldest snapshots.
+         * \param Number of snapshots to keep, 0 to keep all.
+         * \return Names of the deleted snapshots.
+         */
+        QStringList prune(int keep);
+
+        /*!
+         * \brief Retrieves the name of the snapshot started by begin().
+         * \return Snapshot name.
+         */
+        QString get_name() const;
+
+    private:
+        QString dest;
+        QString name;
+
+        QString path_of(const QString &name) const;
+
+        /*!
+         * \brief Flushes the destination directory so renames in it survive a crash.
+         */
+        void sync_directory() const;
+};
+
+#endif // SNAPSHOTSET_H
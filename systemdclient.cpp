@@ -0,0 +1,253 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "systemdclient.h"
+#include <QFile>
+#include <QtDBus/QDBusArgument>
+#include <QtDBus/QDBusMetaType>
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <iostream>
+
+constexpr char SYSTEMD_SERVICE[] = "org.freedesktop.systemd1";
+constexpr char SYSTEMD_PATH[] = "/org/freedesktop/systemd1";
+constexpr char SYSTEMD_MANAGER[] = "org.freedesktop.systemd1.Manager";
+constexpr char RUNTIME_DROP_INS[] = "/run/systemd/system.control";
+
+QDBusArgument &operator<<(QDBusArgument &argument, const BandwidthLimit &limit)
+{
+        argument.beginStructure();
+        argument << limit.path << limit.bytes;
+        argument.endStructure();
+        return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, BandwidthLimit &limit)
+{
+        argument.beginStructure();
+        argument >> limit.path >> limit.bytes;
+        argument.endStructure();
+        return argument;
+}
+
+QDBusArgument &operator<<(QDBusArgument &argument, const UnitProperty &property)
+{
+        argument.beginStructure();
+        argument << property.name << property.value;
+        argument.endStructure();
+        return argument;
+}
+
+const QDBusArgument &operator>>(const QDBusArgument &argument, UnitProperty &property)
+{
+        argument.beginStructure();
+        argument >> property.name >> property.value;
+        argument.endStructure();
+        return argument;
+}
+
+SystemdClient::SystemdClient() : watchers(std::make_unique<QObject>())
+{
+        qDBusRegisterMetaType<BandwidthLimit>();
+        qDBusRegisterMetaType<BandwidthLimits>();
+        qDBusRegisterMetaType<UnitProperty>();
+        qDBusRegisterMetaType<QList<UnitProperty>>();
+}
+
+bool SystemdClient::is_valid()
+{
+        return get_interface().isValid();
+}
+
+QDBusInterface &SystemdClient::get_interface()
+{
+        // Retried after a failure, e.g. when systemd was restarting.
+        if (interface == nullptr || !interface->isValid())
+                interface = std::make_unique<QDBusInterface>(SYSTEMD_SERVICE, SYSTEMD_PATH,
+                                                             SYSTEMD_MANAGER,
+                                                             QDBusConnection::systemBus());
+        return *interface;
+}
+
+QString SystemdClient::set_unit_files(bool enable, const QStringList &units,
+                                      QStringList &changed)
+{
+        changed.clear();
+        if (units.isEmpty())
+                return "";
+        if (!is_valid())
+                return "Unable to connect to systemd.";
+        QDBusMessage reply = QDBusConnection::systemBus().call(unit_files_call(enable, units));
+        if (reply.type() != QDBusMessage::ReplyMessage)
+                return reply.errorMessage();
+        changed = read_changes(reply);
+        reply = get_interface().call("Reload");
+        return reply.type() == QDBusMessage::ReplyMessage ? "" : reply.errorMessage();
+}
+
+void SystemdClient::set_unit_files_async(bool enable, const QStringList &units, Callback done)
+{
+        if (units.isEmpty()) {
+                done("", QStringList());
+                return;
+        }
+        if (!is_valid()) {
+                done("Unable to connect to systemd.", QStringList());
+                return;
+        }
+        auto *watcher = new QDBusPendingCallWatcher(
+                QDBusConnection::systemBus().asyncCall(unit_files_call(enable, units)),
+                watchers.get());
+        QObject::connect(watcher, &QDBusPendingCallWatcher::finished, [this, watcher, done]() {
+                watcher->deleteLater();
+                QDBusMessage reply = watcher->reply();
+                if (reply.type() != QDBusMessage::ReplyMessage) {
+                        done(reply.errorMessage(), QStringList());
+                        return;
+                }
+                QStringList changed = read_changes(reply);
+                auto *reload = new QDBusPendingCallWatcher(get_interface().asyncCall("Reload"),
+                                                           watchers.get());
+                QObject::connect(reload, &QDBusPendingCallWatcher::finished,
+                                 [reload, done, changed]() {
+                                         reload->deleteLater();
+                                         QDBusMessage result = reload->reply();
+                                         done(result.type() == QDBusMessage::ReplyMessage
+                                                      ? QString()
+                                                      : result.errorMessage(),
+                                              changed);
+                                 });
+        });
+}
+
+QString SystemdClient::get_unit_file_state(const QString &unit)
+{
+        if (!is_valid())
+                return "";
+        QDBusMessage reply = get_interface().call("GetUnitFileState", unit);
+        if (reply.type() != QDBusMessage::ReplyMessage)
+                return "";
+        return reply.arguments().value(0).toString();
+}
+
+void SystemdClient::get_unit_file_states_async(
+        const QStringList &units, std::function<void(const std::map<QString, QString> &)> done)
+{
+        auto states = std::make_shared<std::map<QString, QString>>();
+        if (units.isEmpty() || !is_valid()) {
+                for (const auto &unit : units)
+                        (*states)[unit] = "";
+                done(*states);
+                return;
+        }
+        auto left = std::make_shared<int>(units.size());
+        for (const auto &unit : units) {
+                auto *watcher = new QDBusPendingCallWatcher(
+                        get_interface().asyncCall("GetUnitFileState", unit), watchers.get());
+                QObject::connect(watcher, &QDBusPendingCallWatcher::finished,
+                                 [watcher, unit, states, left, done]() {
+                                         watcher->deleteLater();
+                                         QDBusMessage reply = watcher->reply();
+                                         (*states)[unit] =
+                                                 reply.type() == QDBusMessage::ReplyMessage
+                                                         ? reply.arguments().value(0).toString()
+                                                         : QString();
+                                         if (--*left == 0)
+                                                 done(*states);
+                                 });
+        }
+}
+
+void SystemdClient::set_io_limits_async(const QString &unit, quint64 weight,
+                                        const BandwidthLimits &read, const BandwidthLimits &write)
+{
+        QList<UnitProperty> properties = {
+                {"IOWeight", QDBusVariant(QVariant::fromValue(weight))},
+                {"IOReadBandwidthMax", QDBusVariant(QVariant::fromValue(read))},
+                {"IOWriteBandwidthMax", QDBusVariant(QVariant::fromValue(write))},
+        };
+        QDBusMessage call = QDBusMessage::createMethodCall(SYSTEMD_SERVICE, SYSTEMD_PATH,
+                                                           SYSTEMD_MANAGER, "SetUnitProperties");
+        call << unit << true << QVariant::fromValue(properties);
+        call_async(call);
+}
+
+void SystemdClient::revert_io_limits_async(const QString &unit)
+{
+        // SetUnitProperties with runtime = true writes one drop-in per property here,
+        // which outranks the unit file until it is removed.
+        QString dropIns = QString(RUNTIME_DROP_INS) + "/" + unit + ".d/";
+        bool removed = false;
+        for (const char *property : {"IOWeight", "IOReadBandwidthMax", "IOWriteBandwidthMax"})
+                removed |= QFile::remove(dropIns + "50-" + property + ".conf");
+        if (removed)
+                call_async(QDBusMessage::createMethodCall(SYSTEMD_SERVICE, SYSTEMD_PATH,
+                                                          SYSTEMD_MANAGER, "Reload"));
+}
+
+void SystemdClient::freeze_unit_async(const QString &unit, bool freeze)
+{
+        call_async(QDBusMessage::createMethodCall(SYSTEMD_SERVICE, SYSTEMD_PATH, SYSTEMD_MANAGER,
+                                                  freeze ? "FreezeUnit" : "ThawUnit")
+                   << unit);
+}
+
+void SystemdClient::call_async(const QDBusMessage &call)
+{
+        auto *watcher =
+                new QDBusPendingCallWatcher(QDBusConnection::systemBus().asyncCall(call));
+        QString method = call.member();
+        QObject::connect(watcher, &QDBusPendingCallWatcher::finished, [watcher, method]() {
+                watcher->deleteLater();
+                if (watcher->isError())
+                        std::cerr << method.toStdString() << ": "
+                                  << watcher->error().message().toStdString() << "\n";
+        });
+}
+
+QDBusMessage SystemdClient::unit_files_call(bool enable, const QStringList &units) const
+{
+        QDBusMessage call = QDBusMessage::createMethodCall(
+                SYSTEMD_SERVICE, SYSTEMD_PATH, SYSTEMD_MANAGER,
+                enable ? "EnableUnitFiles" : "DisableUnitFiles");
+        // runtime = false; EnableUnitFiles also takes force = true.
+        call << units << false;
+        if (enable)
+                call << true;
+        return call;
+}
+
+QStringList SystemdClient::read_changes(const QDBusMessage &reply)
+{
+        // EnableUnitFiles returns (b, a(sss)), DisableUnitFiles only a(sss).
+        QStringList changed;
+        QList<QVariant> args = reply.arguments();
+        if (args.isEmpty())
+                return changed;
+        const QDBusArgument changes = args.last().value<QDBusArgument>();
+        changes.beginArray();
+        while (!changes.atEnd()) {
+                QString type, file, destination;
+                changes.beginStructure();
+                changes >> type >> file >> destination;
+                changes.endStructure();
+                changed.append(file);
+        }
+        changes.endArray();
+        return changed;
+}
@@ -0,0 +1,177 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYSTEMDCLIENT_H
+#define SYSTEMDCLIENT_H
+
+#include <QStringList>
+#include <QtDBus/QDBusArgument>
+#include <QtDBus/QDBusInterface>
+#include <QtDBus/QDBusVariant>
+#include <functional>
+#include <map>
+#include <memory>
+
+/*!
+ * \brief One entry of IOReadBandwidthMax or IOWriteBandwidthMax: a path on the device
+ * and the bytes per second allowed.
+ */
+struct BandwidthLimit {
+        QString path;
+        quint64 bytes;
+};
+
+typedef QList<BandwidthLimit> BandwidthLimits;
+
+/*!
+ * \brief A property passed to SetUnitProperties.
+ */
+struct UnitProperty {
+        QString name;
+        QDBusVariant value;
+};
+
+Q_DECLARE_METATYPE(BandwidthLimit)
+Q_DECLARE_METATYPE(UnitProperty)
+
+QDBusArgument &operator<<(QDBusArgument &argument, const BandwidthLimit &limit);
+const QDBusArgument &operator>>(const QDBusArgument &argument, BandwidthLimit &limit);
+QDBusArgument &operator<<(QDBusArgument &argument, const UnitProperty &property);
+const QDBusArgument &operator>>(const QDBusArgument &argument, UnitProperty &property);
+
+/*!
+ * \brief The SystemdClient class
+ * One connection to systemd's manager object, kept for the life of the Manager so
+ * that every call does not introspect the object again.
+ *
+ * Unit files are enabled and disabled in bulk: one call with every unit, followed
+ * by a single daemon reload. The asynchronous variants return immediately and call
+ * back from the event loop once systemd has answered both calls.
+ */
+class SystemdClient
+{
+    public:
+        /*!
+         * \brief Called when an asynchronous change is done.
+         * \param Error message, empty for success.
+         * \param Unit files systemd linked or removed.
+         */
+        typedef std::function<void(const QString &, const QStringList &)> Callback;
+
+        SystemdClient();
+        ~SystemdClient() = default;
+        SystemdClient(const SystemdClient &) = delete;
+        SystemdClient &operator=(const SystemdClient &) = delete;
+
+        /*!
+         * \brief Checks whether systemd could be reached.
+         * \return True if the connection is usable.
+         */
+        bool is_valid();
+
+        /*!
+         * \brief Retrieves the interface of systemd's manager object.
+         * \return The cached interface.
+         */
+        QDBusInterface &get_interface();
+
+        /*!
+         * \brief Enables or disables unit files and reloads systemd once.
+         * \param True to enable, false to disable.
+         * \param Names of the units.
+         * \param Receives the unit files systemd linked or removed.
+         * \return Error message, empty for success.
+         */
+        QString set_unit_files(bool enable, const QStringList &units, QStringList &changed);
+
+        /*!
+         * \brief Enables or disables unit files without waiting, then reloads systemd once.
+         * \param True to enable, false to disable.
+         * \param Names of the units.
+         * \param Called from the event loop with the result.
+         */
+        void set_unit_files_async(bool enable, const QStringList &units, Callback done);
+
+        /*!
+         * \brief Reads whether a unit file is enabled.
+         * \param Name of the unit.
+         * \return State such as "enabled" or "disabled", empty if it could not be read.
+         */
+        QString get_unit_file_state(const QString &unit);
+
+        /*!
+         * \brief Reads whether unit files are enabled, without waiting.
+         * \param Names of the units.
+         * \param Called from the event loop with the state of each unit, empty for the
+         * units whose state could not be read.
+         */
+        void get_unit_file_states_async(
+                const QStringList &units,
+                std::function<void(const std::map<QString, QString> &)> done);
+
+        /*!
+         * \brief Changes the I/O weight and bandwidth limits of a unit's cgroup, without
+         * waiting. The change is made at runtime, so it lasts until the next boot or the
+         * next change, not only until the unit stops.
+         * \param Name of the unit.
+         * \param IOWeight, 1 to 10000.
+         * \param IOReadBandwidthMax entries; empty removes every read limit.
+         * \param IOWriteBandwidthMax entries; empty removes every write limit.
+         */
+        void set_io_limits_async(const QString &unit, quint64 weight,
+                                 const BandwidthLimits &read, const BandwidthLimits &write);
+
+        /*!
+         * \brief Drops the runtime I/O weight and bandwidth limits set by
+         * set_io_limits_async, without waiting, and reloads systemd so that the unit
+         * file's own settings apply again.
+         * \param Name of the unit.
+         */
+        void revert_io_limits_async(const QString &unit);
+
+        /*!
+         * \brief Freezes or thaws every process of a unit, without waiting.
+         * \param Name of the unit.
+         * \param True to freeze, false to thaw.
+         */
+        void freeze_unit_async(const QString &unit, bool freeze);
+
+    private:
+        std::unique_ptr<QDBusInterface> interface;
+        // Parent of the pending calls whose callbacks use this client, so that they are
+        // dropped with it.
+        std::unique_ptr<QObject> watchers;
+
+        QDBusMessage unit_files_call(bool enable, const QStringList &units) const;
+
+        /*!
+         * \brief Sends a call whose reply only matters when it is an error.
+         * \param The call.
+         */
+        static void call_async(const QDBusMessage &call);
+
+        /*!
+         * \brief Reads the changes listed in a reply to EnableUnitFiles or DisableUnitFiles.
+         * \param The reply.
+         * \return Files that were changed.
+         */
+        static QStringList read_changes(const QDBusMessage &reply);
+};
+
+#endif // SYSTEMDCLIENT_H
@@ -0,0 +1,404 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "tarwriter.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <iostream>
+#include <pwd.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <vector>
+
+constexpr size_t TAR_BLOCK_SIZE = 512;
+constexpr size_t READ_SIZE = 1 << 20;
+
+namespace
+{
+        /*
+         * Writes a zero padded octal number and its terminating NUL.
+         * Returns false when the value needs more digits than the field has.
+         */
+        bool put_octal(char *field, size_t width, uint64_t value)
+        {
+                field[width - 1] = '\0';
+                for (size_t i = width - 1; i-- > 0;) {
+                        field[i] = '0' + (value & 7);
+                        value >>= 3;
+                }
+                return value == 0;
+        }
+
+        void put_string(char *field, size_t width, const std::string &value)
+        {
+                memcpy(field, value.data(), std::min(width, value.size()));
+        }
+
+        /*
+         * Appends a "length key=value\n" record; the length counts itself.
+         */
+        void pax_record(std::string &pax, const std::string &key, const std::string &value)
+        {
+                size_t len = key.size() + value.size() + 3;
+                size_t total = len + std::to_string(len).size();
+                if (std::to_string(total).size() != std::to_string(len).size())
+                        total = len + std::to_string(total).size();
+                pax += std::to_string(total) + " " + key + "=" + value + "\n";
+        }
+}
+
+TarWriter::TarWriter(BlockCompressor &out)
+        : out(out), mirror(nullptr), index(nullptr), mirrorStrip(0), files(0), errors(0)
+{
+}
+
+int TarWriter::add(const std::string &path)
+{
+        size_t slash = path.find_last_of('/');
+        if (path.back() == '/')
+                mirrorStrip = path.size();
+        else
+                mirrorStrip = slash == std::string::npos ? 0 : slash + 1;
+
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) {
+                std::cerr << path << ": " << strerror(errno) << "\n";
+                errors++;
+                return 0;
+        }
+        return add_entry(path, st);
+}
+
+void TarWriter::set_mirror(MirrorWriter *mirror)
+{
+        this->mirror = mirror;
+}
+
+void TarWriter::set_index(ArchiveIndex *index)
+{
+        this->index = index;
+}
+
+int TarWriter::finish()
+{
+        static const char zeros[2 * TAR_BLOCK_SIZE] = {};
+        if (index != nullptr && write_index() != 0)
+                return -1;
+        return out.write(zeros, sizeof(zeros));
+}
+
+uint64_t TarWriter::get_files() const
+{
+        return files;
+}
+
+uint64_t TarWriter::get_errors() const
+{
+        return errors;
+}
+
+std::string TarWriter::member_name(const std::string &path)
+{
+        size_t start = 0;
+        while (start < path.size()) {
+                if (path[start] == '/')
+                        start++;
+                else if (path.compare(start, 2, "./") == 0)
+                        start += 2;
+                else
+                        break;
+        }
+        std::string name = path.substr(start);
+        return name.empty() ? "." : name;
+}
+
+int TarWriter::add_entry(const std::string &path, const struct stat &st)
+{
+        std::string name = member_name(path);
+        std::string relative = path.substr(std::min(mirrorStrip, path.size()));
+        bool mirrored = mirror != nullptr
+                        && (S_ISDIR(st.st_mode) || !mirror->is_current(relative, st));
+
+        if (S_ISDIR(st.st_mode)) {
+                if (name.back() != '/')
+                        name += '/';
+                if (write_header(name, st, '5', "", 0) != 0)
+                        return -1;
+                files++;
+                if (mirrored)
+                        mirror->directory(relative, st);
+
+                DIR *dir = opendir(path.c_str());
+                if (dir == nullptr) {
+                        std::cerr << path << ": " << strerror(errno) << "\n";
+                        errors++;
+                        return 0;
+                }
+                std::vector<std::string> children;
+                while (struct dirent *entry = readdir(dir)) {
+                        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+                                children.push_back(entry->d_name);
+                }
+                closedir(dir);
+                // Sorted so that the same tree always gives the same archive.
+                std::sort(children.begin(), children.end());
+
+                std::string prefix = path.back() == '/' ? path : path + "/";
+                for (const auto &child : children) {
+                        struct stat cst;
+                        std::string childPath = prefix + child;
+                        if (lstat(childPath.c_str(), &cst) != 0) {
+                                std::cerr << childPath << ": " << strerror(errno) << "\n";
+                                errors++;
+                                continue;
+                        }
+                        if (add_entry(childPath, cst) != 0)
+                                return -1;
+                }
+                return 0;
+        }
+
+        if (st.st_nlink > 1) {
+                auto key = std::make_pair(st.st_dev, st.st_ino);
+                auto it = links.find(key);
+                if (it != links.end()) {
+                        files++;
+                        if (mirrored)
+                                mirror->hard_link(relative, it->second.second);
+                        return write_header(name, st, '1', it->second.first, 0);
+                }
+                links[key] = std::make_pair(name, relative);
+        }
+
+        if (S_ISREG(st.st_mode)) {
+                int fd = open(path.c_str(), O_RDONLY | O_NOATIME | O_CLOEXEC);
+                if (fd < 0 && errno == EPERM)
+                        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0) {
+                        std::cerr << path << ": " << strerror(errno) << "\n";
+                        errors++;
+                        return 0;
+                }
+                if (mirrored)
+                        mirror->begin_file(relative, st);
+                int status = write_header(name, st, '0', "", st.st_size);
+                if (status == 0)
+                        status = write_data(fd, path, st.st_size, mirrored);
+                else if (mirrored)
+                        mirror->end_file(false);
+                close(fd);
+                files++;
+                return status;
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+                std::string target(st.st_size > 0 ? st.st_size : PATH_MAX, '\0');
+                ssize_t len = readlink(path.c_str(), &target[0], target.size());
+                if (len < 0) {
+                        std::cerr << path << ": " << strerror(errno) << "\n";
+                        errors++;
+                        return 0;
+                }
+                target.resize(len);
+                files++;
+                if (mirrored)
+                        mirror->special(relative, target, st);
+                return write_header(name, st, '2', target, 0);
+        }
+
+        char type;
+        if (S_ISCHR(st.st_mode))
+                type = '3';
+        else if (S_ISBLK(st.st_mode))
+                type = '4';
+        else if (S_ISFIFO(st.st_mode))
+                type = '6';
+        else
+                return 0; // Sockets can not be archived.
+        files++;
+        if (mirrored)
+                mirror->special(relative, "", st);
+        return write_header(name, st, type, "", 0);
+}
+
+int TarWriter::write_header(const std::string &name, const struct stat &st, char type,
+                            const std::string &link, uint64_t size)
+{
+        char header[TAR_BLOCK_SIZE];
+        std::string pax;
+        uint64_t start = out.get_bytes_in();
+
+        auto fill = [&](const std::string &hname, mode_t mode, uint64_t hsize, char htype,
+                        const std::string &hlink) {
+                memset(header, 0, sizeof(header));
+                put_string(header, 100, hname);
+                put_octal(header + 100, 8, mode & 07777);
+                if (!put_octal(header + 108, 8, st.st_uid))
+                        pax_record(pax, "uid", std::to_string(st.st_uid));
+                if (!put_octal(header + 116, 8, st.st_gid))
+                        pax_record(pax, "gid", std::to_string(st.st_gid));
+                if (!put_octal(header + 124, 12, hsize))
+                        pax_record(pax, "size", std::to_string(hsize));
+                if (st.st_mtime < 0 || !put_octal(header + 136, 12, st.st_mtime)) {
+                        put_octal(header + 136, 12, 0);
+                        pax_record(pax, "mtime", std::to_string(st.st_mtime));
+                }
+                header[156] = htype;
+                put_string(header + 157, 100, hlink);
+                memcpy(header + 257, "ustar", 6);
+                memcpy(header + 263, "00", 2);
+                put_string(header + 265, 32, user_name(st.st_uid));
+                put_string(header + 297, 32, group_name(st.st_gid));
+                if (htype == '3' || htype == '4') {
+                        put_octal(header + 329, 8, major(st.st_rdev));
+                        put_octal(header + 337, 8, minor(st.st_rdev));
+                }
+                memset(header + 148, ' ', 8);
+                unsigned int sum = 0;
+                for (unsigned char c : header)
+                        sum += c;
+                put_octal(header + 148, 7, sum);
+        };
+
+        if (name.size() > 100)
+                pax_record(pax, "path", name);
+        if (link.size() > 100)
+                pax_record(pax, "linkpath", link);
+        fill(name, st.st_mode, size, type, link);
+
+        if (!pax.empty()) {
+                std::string records = pax;
+                std::string base = name.substr(name.find_last_of('/', name.size() - 2) + 1);
+                std::string paxName = ("PaxHeaders/" + base).substr(0, 100);
+                // The numeric fields of the pax header itself always fit.
+                char saved[TAR_BLOCK_SIZE];
+                memcpy(saved, header, sizeof(header));
+                fill(paxName, 0644, records.size(), 'x', "");
+                size_t padded = (records.size() + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+                records.resize(padded, '\0');
+                if (out.write(header, sizeof(header)) != 0
+                    || out.write(records.data(), records.size()) != 0)
+                        return -1;
+                memcpy(header, saved, sizeof(header));
+        }
+        if (out.write(header, sizeof(header)) != 0)
+                return -1;
+        if (index != nullptr)
+                index->add_member({name, start, out.get_bytes_in(), size, type,
+                                   type == '1' ? link : std::string()});
+        return 0;
+}
+
+int TarWriter::write_data(int fd, const std::string &path, uint64_t size, bool mirrored)
+{
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        std::vector<char> buffer(READ_SIZE);
+        uint64_t left = size;
+        bool complete = true;
+        int status = 0;
+        while (left > 0 && status == 0) {
+                ssize_t n = read(fd, buffer.data(), std::min<uint64_t>(left, buffer.size()));
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        // The header already promised the size, so a shrunken file is padded.
+                        std::cerr << path << ": "
+                                  << (n < 0 ? strerror(errno) : "file shrank while reading")
+                                  << "\n";
+                        errors++;
+                        complete = false;
+                        std::fill(buffer.begin(), buffer.end(), 0);
+                        while (left > 0 && status == 0) {
+                                size_t len = std::min<uint64_t>(left, buffer.size());
+                                status = out.write(buffer.data(), len);
+                                left -= len;
+                        }
+                        break;
+                }
+                if (mirrored)
+                        mirror->file_data(buffer.data(), n);
+                status = out.write(buffer.data(), n);
+                left -= n;
+        }
+        if (mirrored)
+                mirror->end_file(complete && status == 0);
+        if (status != 0)
+                return -1;
+
+        static const char zeros[TAR_BLOCK_SIZE] = {};
+        size_t pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        return out.write(zeros, pad);
+}
+
+int TarWriter::write_buffer(const std::string &name, const std::string &data)
+{
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFREG | 0644;
+        st.st_uid = getuid();
+        st.st_gid = getgid();
+        st.st_mtime = time(nullptr);
+        static const char zeros[TAR_BLOCK_SIZE] = {};
+        size_t pad = (TAR_BLOCK_SIZE - data.size() % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+        if (write_header(name, st, '0', "", data.size()) != 0
+            || out.write(data.data(), data.size()) != 0)
+                return -1;
+        return out.write(zeros, pad);
+}
+
+int TarWriter::write_index()
+{
+        ArchiveIndex *finished = index;
+        index = nullptr;
+        // Everything before the index has to be written for its blocks to be known.
+        if (out.flush() != 0)
+                return -1;
+        finished->set_frames(out.get_frames());
+        uint64_t offset = out.get_bytes_out();
+        if (write_buffer(ArchiveIndex::INDEX_NAME, finished->to_text()) != 0
+            || out.flush() != 0)
+                return -1;
+        // The footer and the end of archive marker make up the last block.
+        return write_buffer(ArchiveIndex::FOOTER_NAME, ArchiveIndex::footer(offset));
+}
+
+const std::string &TarWriter::user_name(uid_t uid)
+{
+        auto it = users.find(uid);
+        if (it == users.end()) {
+                struct passwd *pw = getpwuid(uid);
+                it = users.emplace(uid, pw != nullptr ? pw->pw_name : "").first;
+        }
+        return it->second;
+}
+
+const std::string &TarWriter::group_name(gid_t gid)
+{
+        auto it = groups.find(gid);
+        if (it == groups.end()) {
+                struct group *gr = getgrgid(gid);
+                it = groups.emplace(gid, gr != nullptr ? gr->gr_name : "").first;
+        }
+        return it->second;
+}
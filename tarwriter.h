@@ -0,0 +1,168 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TARWRITER_H
+#define TARWRITER_H
+
+#include "archiveindex.h"
+#include "blockcompressor.h"
+#include "mirrorwriter.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+
+/*!
+ * \brief The TarWriter class
+ * Writes a POSIX (pax) tar stream of directory trees.
+ *
+ * Member names are the given paths without a leading slash, as "tar -cf" stores them.
+ * Names and link targets longer than ustar allows, and files of 8 GiB or more, get a
+ * pax extended header. Hard links are stored once, symbolic links are not followed
+ * and sockets are skipped.
+ *
+ * With a mirror set, everything read for the archive also updates a plain copy,
+ * laid out like "rsync -a path mirror": under the path's name, or directly in the
+ * mirror when the path ends with a slash. Files the mirror already has with the
+ * same size and modification time are not written again.
+ *
+ * With an index set, every member is recorded in it, and the index is written at the
+ * end of the archive for readers that seek to single members.
+ */
+class TarWriter
+{
+    public:
+        /*!
+         * \param Stream the archive is written to.
+         */
+        explicit TarWriter(BlockCompressor &out);
+        ~TarWriter() = default;
+        TarWriter(const TarWriter &) = delete;
+        TarWriter &operator=(const TarWriter &) = delete;
+
+        /*!
+         * \brief Adds a file, or a directory and everything below it.
+         * \param Path to add.
+         * \return 0 for success, -1 if the stream failed. Unreadable files are
+         * skipped and counted in get_errors().
+         */
+        int add(const std::string &path);
+
+        /*!
+         * \brief Sets a mirror that is updated from the files being archived.
+         * \param Mirror to update, nullptr for none.
+         */
+        void set_mirror(MirrorWriter *mirror);
+
+        /*!
+         * \brief Sets an index that records the members written from now on.
+         * The stream must be seekable.
+         * \param Index to record in, nullptr for none.
+         */
+        void set_index(ArchiveIndex *index);
+
+        /*!
+         * \brief Writes the index, when one is set, and the end of archive marker.
+         * \return 0 for success, -1 for failure.
+         */
+        int finish();
+
+        /*!
+         * \brief Retrieves the number of members written.
+         * \return Number of members.
+         */
+        uint64_t get_files() const;
+
+        /*!
+         * \brief Retrieves the number of files that could not be read completely.
+         * \return Number of errors.
+         */
+        uint64_t get_errors() const;
+
+        /*!
+         * \brief Gets the member name tar stores for a path.
+         * \param Path on disk.
+         * \return Path with leading slashes and "./" removed.
+         */
+        static std::string member_name(const std::string &path);
+
+    private:
+        BlockCompressor &out;
+        MirrorWriter *mirror;
+        ArchiveIndex *index;
+        // Length of the part of the path that is not repeated in the mirror.
+        size_t mirrorStrip;
+        uint64_t files;
+        uint64_t errors;
+        // Member name and mirror path of the first link to each inode.
+        std::map<std::pair<dev_t, ino_t>, std::pair<std::string, std::string>> links;
+        std::map<uid_t, std::string> users;
+        std::map<gid_t, std::string> groups;
+
+        /*!
+         * \brief Writes one member and, for directories, its children.
+         * \param Path on disk.
+         * \param Status of the path, not following links.
+         * \return 0 for success, -1 if the stream failed.
+         */
+        int add_entry(const std::string &path, const struct stat &st);
+
+        /*!
+         * \brief Writes a header block, preceded by a pax header when needed.
+         * \param Member name.
+         * \param Status of the file.
+         * \param Type flag of the member.
+         * \param Link target, for links.
+         * \param Size of the data that follows.
+         * \return 0 for success, -1 for failure.
+         */
+        int write_header(const std::string &name, const struct stat &st, char type,
+                         const std::string &link, uint64_t size);
+
+        /*!
+         * \brief Streams a regular file's contents, padded to the block size.
+         * \param Open file descriptor of the file.
+         * \param Path on disk, for messages.
+         * \param Size recorded in the header.
+         * \param Whether the data also goes to the mirror's current file.
+         * \return 0 for success, -1 if the stream failed.
+         */
+        int write_data(int fd, const std::string &path, uint64_t size, bool mirrored);
+
+        /*!
+         * \brief Writes a member holding a buffer, owned by the current user.
+         * \param Member name.
+         * \param Contents of the member.
+         * \return 0 for success, -1 if the stream failed.
+         */
+        int write_buffer(const std::string &name, const std::string &data);
+
+        /*!
+         * \brief Writes the index at the start of a block and the footer pointing to it.
+         * \return 0 for success, -1 if the stream failed.
+         */
+        int write_index();
+
+        const std::string &user_name(uid_t uid);
+
+        const std::string &group_name(gid_t gid);
+};
+
+#endif // TARWRITER_H
@@ -0,0 +1,41 @@
+/*
+        Copyright Jonathan Manly 2020
+
+        This file is part of rBackup.
+
+        rBackup is free software: you can redistribute it and/or modify
+        it under the terms of the GNU Lesser General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        rBackup is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU Lesser General Public License for more details.
+
+        You should have received a copy of the GNU Lesser General Public License
+        along with rBackup.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "utility.h"
+#include <iostream>
+
+static std::function<void(const QString &)> errorHandler;
+
+void show_error_dialog(QString text)
+{
+        if (errorHandler)
+                errorHandler(text);
+        else
+                std::cerr << text.toStdString() << "\n";
+}
+
+void set_error_handler(std::function<void(const QString &)> handler)
+{
+        errorHandler = std::move(handler);
+}
+
+QString get_daemon_socket()
+{
+        return qEnvironmentVariable("RBACKUP_SOCKET", DAEMON_SOCKET);
+}
@@ -20,8 +20,8 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
-#include <QMessageBox>
 #include <QString>
+#include <functional>
 
 constexpr char INCREMENTAL_OPTIONS[] = "rsync -auq ";
 
@@ -31,6 +31,10 @@ constexpr char NO_DELTA[] = "-W ";
 
 constexpr char TRANSFER_COMPRESSION[] = "-z ";
 
+constexpr char PROGRESS[] = "--info=progress2 "; // read back from the journal by RunMonitor
+
+constexpr char STATS[] = "--stats "; // recorded in the job's history by rbackup exec
+
 constexpr char DELETE_DURING[] = "--delete-during ";
 
 constexpr char DELETE_AFTER[] = "--delete-after ";
@@ -39,17 +43,46 @@ constexpr char DELETE_BEFORE[] = "--delete-before ";
 
 constexpr char TAR[] = "tar -cf ";
 
-constexpr char TAR_GZ[] = "tar -czf "; // .gz
+constexpr char ARCHIVE[] = "rbackup archive "; // .gz, .bz2 and .xz, compressed on every core
+
+constexpr char SHARDED[] = "rbackup shard ";
+
+constexpr char INDEXED[] = "rbackup indexed ";
+
+constexpr char SOURCES[] = "rbackup sources "; // one rsync per source, several at once
+
+constexpr char FANOUT[] = "rbackup fanout "; // every destination from one read of the sources
+
+constexpr char NATIVE_COPY[] = "rbackup copy ";
+
+constexpr char REPOSITORY_BACKUP[] = "rbackup repo-backup ";
+
+constexpr char SNAPSHOT_BACKUP[] = "rbackup snapshot ";
+
+constexpr char EXEC[] = "rbackup exec ";
+
+constexpr char DAEMON_SOCKET[] = "/run/rbackup.sock";
+
+constexpr char CONFIG_DIRECTORY[] = "/etc/rbackup/";
 
-constexpr char TAR_BZ[] = "tar -cjf "; // .bz2
+/*!
+ * \brief Reports an error to the user.
+ * The GUI installs a handler that shows a message box; without one the text
+ * is written to stderr so the headless tools never need a display.
+ * \param Text of the error.
+ */
+void show_error_dialog(QString text);
 
-constexpr char TAR_XZ[] = "tar -cJf "; //.xz
+/*!
+ * \brief Replaces the handler used by show_error_dialog.
+ * \param Function to call with the error text.
+ */
+void set_error_handler(std::function<void(const QString &)> handler);
 
-inline void show_error_dialog(QString text)
-{
-        QMessageBox box;
-        box.setText(text);
-        box.exec();
-}
+/*!
+ * \brief Retrieves the path of the daemon's socket.
+ * \return $RBACKUP_SOCKET if it is set, otherwise DAEMON_SOCKET.
+ */
+QString get_daemon_socket();
 
 #endif // UTILITY_H